@@ -6,6 +6,7 @@
 #include <cstdlib>
 #include <SDL.h>
 #include <labhelper.h>
+#include <Profiler.h>
 
 #include <imgui.h>
 #include <imgui_impl_sdl_gl3.h>
@@ -244,6 +245,8 @@ void initialize()
 ///////////////////////////////////////////////////////////////////////////////
 void display(void)
 {
+	PROFILE_CPU_ZONE("display");
+	PROFILE_GPU_ZONE("draw");
 	// The viewport determines how many pixels we are rasterizing to
 	int w, h;
 	SDL_GetWindowSize(g_window, &w, &h);
@@ -281,6 +284,7 @@ void display(void)
 ///////////////////////////////////////////////////////////////////////////////
 void gui()
 {
+	PROFILE_CPU_ZONE("gui");
 	// ----------------- Set variables --------------------------
 	ImGui::ColorEdit3("clear color", g_clearColor);
 
@@ -302,6 +306,8 @@ int main(int argc, char* argv[])
 	bool stopRendering = false;
 	while (!stopRendering)
 	{
+		labhelper::profiler::beginFrame();
+
 		// Inform imgui of new frame
 		ImGui_ImplSdlGL3_NewFrame(g_window);
 
@@ -321,6 +327,10 @@ int main(int argc, char* argv[])
 			{
 				labhelper::saveScreenshot();
 			}
+			else if (event.type == SDL_KEYUP && event.key.keysym.sym == SDLK_F9)
+			{
+				labhelper::profiler::toggleCapture();
+			}
 		}
 
 		// First render our geometry.
@@ -6,6 +6,7 @@
 #include <cstdlib>
 
 #include <labhelper.h>
+#include <Profiler.h>
 
 #include <imgui.h>
 #include <imgui_impl_sdl_gl3.h>
@@ -229,6 +230,8 @@ void initialize()
 ///////////////////////////////////////////////////////////////////////////////
 void display(void)
 {
+	PROFILE_CPU_ZONE("display");
+	PROFILE_GPU_ZONE("draw");
 	// The viewport determines how many pixels we are rasterizing to
 	int w, h;
 	SDL_GetWindowSize(g_window, &w, &h);
@@ -288,6 +291,7 @@ void display(void)
 ///////////////////////////////////////////////////////////////////////////////
 void gui()
 {
+	PROFILE_CPU_ZONE("gui");
 	// ----------------- Set variables --------------------------
 	ImGui::PushID("mag");
 	ImGui::Text("Magnification");
@@ -361,6 +365,8 @@ int main(int argc, char* argv[])
 	bool stopRendering = false;
 	while (!stopRendering)
 	{
+		labhelper::profiler::beginFrame();
+
 		// Inform imgui of new frame
 		ImGui_ImplSdlGL3_NewFrame(g_window);
 
@@ -383,6 +389,10 @@ int main(int argc, char* argv[])
 			{
 				labhelper::saveScreenshot();
 			}
+			else if (event.type == SDL_KEYUP && event.key.keysym.sym == SDLK_F9)
+			{
+				labhelper::profiler::toggleCapture();
+			}
 		}
 
 		// render to window
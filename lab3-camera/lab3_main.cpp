@@ -6,6 +6,7 @@
 #include <chrono>
 
 #include <labhelper.h>
+#include <Profiler.h>
 #include <imgui.h>
 #include <imgui_impl_sdl_gl3.h>
 #include <Model.h>
@@ -107,6 +108,8 @@ void drawGround(mat4 mvpMatrix)
 ///////////////////////////////////////////////////////////////////////////////
 void display()
 {
+	PROFILE_CPU_ZONE("display");
+	PROFILE_GPU_ZONE("draw");
 	// Set up
 	int w, h;
 	SDL_GetWindowSize(g_window, &w, &h);
@@ -201,6 +204,7 @@ void display()
 ///////////////////////////////////////////////////////////////////////////////
 bool handleEvents(void)
 {
+	PROFILE_CPU_ZONE("events");
 	// check new events (keyboard among other)
 	SDL_Event event;
 	bool quitEvent = false;
@@ -223,6 +227,10 @@ bool handleEvents(void)
 		{
 			labhelper::saveScreenshot();
 		}
+		else if (event.type == SDL_KEYUP && event.key.keysym.sym == SDLK_F9)
+		{
+			labhelper::profiler::toggleCapture();
+		}
 		else if (event.type == SDL_MOUSEBUTTONDOWN && event.button.button == SDL_BUTTON_LEFT
 			&& !(ImGui::GetIO().WantCaptureMouse))
 		{
@@ -354,6 +362,7 @@ bool handleEvents(void)
 ///////////////////////////////////////////////////////////////////////////////
 void gui()
 {
+	PROFILE_CPU_ZONE("gui");
 	// ----------------- Set variables --------------------------
 	ImGui::SliderFloat("Field Of View", &pp.fov, 1.0f, 180.0f, "%.0f");
 	ImGui::SliderInt("Width", &pp.w, 256, 1920);
@@ -386,6 +395,8 @@ int main(int argc, char* argv[])
 
 	while (!stopRendering)
 	{
+		labhelper::profiler::beginFrame();
+
 		// update currentTime
 		std::chrono::duration<float> timeSinceStart = std::chrono::system_clock::now() - startTime;
 		deltaTime = timeSinceStart.count() - currentTime;
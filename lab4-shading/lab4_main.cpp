@@ -4,6 +4,7 @@
 #include <iostream>
 #include <map>
 #include <labhelper.h>
+#include <Profiler.h>
 #include <imgui.h>
 #include <imgui_impl_sdl_gl3.h>
 #include <glm/glm.hpp>
@@ -332,6 +333,8 @@ void debugDrawLight(const glm::mat4& viewMatrix,
 ///////////////////////////////////////////////////////////////////////////////
 void display(void)
 {
+	PROFILE_CPU_ZONE("display");
+	PROFILE_GPU_ZONE("draw");
 	///////////////////////////////////////////////////////////////////////////
 	// Set up OpenGL stuff
 	///////////////////////////////////////////////////////////////////////////
@@ -420,6 +423,7 @@ void display(void)
 ///////////////////////////////////////////////////////////////////////////////
 bool handleEvents()
 {
+	PROFILE_CPU_ZONE("events");
 	// check events (keyboard among other)
 	SDL_Event event;
 	bool quitEvent = false;
@@ -443,6 +447,10 @@ bool handleEvents()
 		{
 			labhelper::saveScreenshot();
 		}
+		else if (event.type == SDL_KEYUP && event.key.keysym.sym == SDLK_F9)
+		{
+			labhelper::profiler::toggleCapture();
+		}
 		else if (event.type == SDL_MOUSEBUTTONDOWN && (!showUI || !ImGui::GetIO().WantCaptureMouse)
 			&& (event.button.button == SDL_BUTTON_LEFT || event.button.button == SDL_BUTTON_RIGHT)
 			&& !(g_isMouseDragging || g_isMouseRightDragging))
@@ -533,6 +541,7 @@ bool handleEvents()
 ///////////////////////////////////////////////////////////////////////////////
 void gui()
 {
+	PROFILE_CPU_ZONE("gui");
 	if (ImGui::BeginMainMenuBar())
 	{
 		if (ImGui::BeginMenu("Scene"))
@@ -639,6 +648,8 @@ int main(int argc, char* argv[])
 
 	while (!stopRendering)
 	{
+		labhelper::profiler::beginFrame();
+
 		//update currentTime
 		std::chrono::duration<float> timeSinceStart = std::chrono::system_clock::now() - startTime;
 		deltaTime = timeSinceStart.count() - currentTime;
@@ -13,6 +13,8 @@
 using namespace glm;
 
 #include <labhelper.h>
+#include <Profiler.h>
+#include <GpuProfiler.h>
 #include <imgui.h>
 #include <imgui_impl_sdl_gl3.h>
 
@@ -102,6 +104,9 @@ float hueShift = 0.0f;
 // Framebuffers
 ///////////////////////////////////////////////////////////////////////////////
 
+// GPU time of each post processing pass
+labhelper::GpuProfiler* gpuProfiler = nullptr;
+
 struct FboInfo;
 std::vector<FboInfo> fboList;
 
@@ -207,6 +212,8 @@ void initialize()
 {
 	ENSURE_INITIALIZE_ONLY_ONCE();
 
+	gpuProfiler = new labhelper::GpuProfiler();
+
 	// enable Z-buffering
 	glEnable(GL_DEPTH_TEST);
 
@@ -327,6 +334,8 @@ void drawCamera(const mat4& camView, const mat4& view, const mat4& projection)
 ///////////////////////////////////////////////////////////////////////////////
 void display()
 {
+	PROFILE_CPU_ZONE("display");
+	gpuProfiler->beginFrame();
 	///////////////////////////////////////////////////////////////////////////
 	// Check if any framebuffer needs to be resized
 	///////////////////////////////////////////////////////////////////////////
@@ -362,36 +371,44 @@ void display()
 	// draw scene from security camera
 	///////////////////////////////////////////////////////////////////////////
 	// Task 2
-	FboInfo& securityFB = fboList[0];
-	glBindFramebuffer(GL_FRAMEBUFFER, securityFB.framebufferId);
+	{
+		PROFILE_GPU_ZONE("security camera");
+		FboInfo& securityFB = fboList[0];
+		glBindFramebuffer(GL_FRAMEBUFFER, securityFB.framebufferId);
 
-	glViewport(0, 0, securityFB.width, securityFB.height);
-	glClearColor(0.2f, 0.2f, 0.8f, 1.0f);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		glViewport(0, 0, securityFB.width, securityFB.height);
+		glClearColor(0.2f, 0.2f, 0.8f, 1.0f);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-	drawScene(securityCamViewMatrix, securityCamProjectionMatrix); // using both shaderProgram and backgroundProgram
-	labhelper::Material& screen = landingpadModel->m_materials[8];
-	screen.m_emission_texture.gl_id = securityFB.colorTextureTarget;
+		drawScene(securityCamViewMatrix, securityCamProjectionMatrix); // using both shaderProgram and backgroundProgram
+		labhelper::Material& screen = landingpadModel->m_materials[8];
+		screen.m_emission_texture.gl_id = securityFB.colorTextureTarget;
+	}
 
 	///////////////////////////////////////////////////////////////////////////
 	// draw scene from camera
 	///////////////////////////////////////////////////////////////////////////
 	FboInfo& cameraFBO = fboList[1];
-	glBindFramebuffer(GL_FRAMEBUFFER, cameraFBO.framebufferId); // to be replaced with another framebuffer when doing post processing
-	glViewport(0, 0, w, h);
-	glClearColor(0.2f, 0.2f, 0.8f, 1.0f);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	{
+		PROFILE_GPU_ZONE("camera");
+		glBindFramebuffer(GL_FRAMEBUFFER, cameraFBO.framebufferId); // to be replaced with another framebuffer when doing post processing
+		glViewport(0, 0, w, h);
+		glClearColor(0.2f, 0.2f, 0.8f, 1.0f);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-	drawScene(viewMatrix, projectionMatrix); // using both shaderProgram and backgroundProgram
+		drawScene(viewMatrix, projectionMatrix); // using both shaderProgram and backgroundProgram
 
-	// camera (obj-model)
-	drawCamera(securityCamViewMatrix, viewMatrix, projectionMatrix);
+		// camera (obj-model)
+		drawCamera(securityCamViewMatrix, viewMatrix, projectionMatrix);
+	}
 
 	// Task 6 Efficient Blur
 	FboInfo& horizontalBlurFBO = fboList[2];
 	FboInfo& verticalBlurFBO = fboList[3];
 	if (currentEffect == PostProcessingEffect::Separable_blur) {
+		PROFILE_GPU_ZONE("separable blur");
 		// Horizontal Blur
+		gpuProfiler->begin("horizontal_blur");
 		glBindFramebuffer(GL_FRAMEBUFFER, horizontalBlurFBO.framebufferId);
 		glViewport(0, 0, horizontalBlurFBO.width, horizontalBlurFBO.height);
 		glClear(GL_DEPTH_BUFFER_BIT);
@@ -399,8 +416,10 @@ void display()
 		glActiveTexture(GL_TEXTURE0);
 		glBindTexture(GL_TEXTURE_2D, cameraFBO.colorTextureTarget);
 		labhelper::drawFullScreenQuad();
+		gpuProfiler->end();
 
 		// Vertical Blur
+		gpuProfiler->begin("vertical_blur");
 		glBindFramebuffer(GL_FRAMEBUFFER, verticalBlurFBO.framebufferId);
 		glViewport(0, 0, verticalBlurFBO.width, verticalBlurFBO.height);
 		glClear(GL_DEPTH_BUFFER_BIT);
@@ -411,11 +430,14 @@ void display()
 		glActiveTexture(GL_TEXTURE1);
 		glBindTexture(GL_TEXTURE_2D, verticalBlurFBO.colorTextureTarget);
 		labhelper::drawFullScreenQuad();
+		gpuProfiler->end();
 	}
 
 	// Task 7 Bloom
 	if (currentEffect == PostProcessingEffect::Bloom) {
+		PROFILE_GPU_ZONE("bloom");
 		// Cutoff
+		gpuProfiler->begin("cutoff");
 		FboInfo& cutoffFBO = fboList[2];
 		glBindFramebuffer(GL_FRAMEBUFFER, cutoffFBO.framebufferId);
 		glViewport(0, 0, cutoffFBO.width, cutoffFBO.height);
@@ -425,8 +447,10 @@ void display()
 		glActiveTexture(GL_TEXTURE0);
 		glBindTexture(GL_TEXTURE_2D, cameraFBO.colorTextureTarget);
 		labhelper::drawFullScreenQuad();
+		gpuProfiler->end();
 
 		// Horizontal Blur
+		gpuProfiler->begin("bloom_horizontal_blur");
 		glBindFramebuffer(GL_FRAMEBUFFER, horizontalBlurFBO.framebufferId);
 		glViewport(0, 0, horizontalBlurFBO.width, horizontalBlurFBO.height);
 		glClear(GL_DEPTH_BUFFER_BIT);
@@ -434,8 +458,10 @@ void display()
 		glActiveTexture(GL_TEXTURE0);
 		glBindTexture(GL_TEXTURE_2D, cutoffFBO.colorTextureTarget);
 		labhelper::drawFullScreenQuad();
+		gpuProfiler->end();
 
 		// Vertical Blur
+		gpuProfiler->begin("bloom_vertical_blur");
 		glBindFramebuffer(GL_FRAMEBUFFER, verticalBlurFBO.framebufferId);
 		glViewport(0, 0, verticalBlurFBO.width, verticalBlurFBO.height);
 		glClear(GL_DEPTH_BUFFER_BIT);
@@ -443,32 +469,38 @@ void display()
 		glActiveTexture(GL_TEXTURE0);
 		glBindTexture(GL_TEXTURE_2D, horizontalBlurFBO.colorTextureTarget);
 		labhelper::drawFullScreenQuad();
+		gpuProfiler->end();
 	}
 
 	///////////////////////////////////////////////////////////////////////////
 	// Post processing pass(es)
 	///////////////////////////////////////////////////////////////////////////
 	// Task 3:
-	// 1. Bind and clear default framebuffer
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
-	glViewport(0, 0, w, h);
-	glClearColor(0.2f, 0.2f, 0.8f, 1.0f);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	// 2. Set postFxShader as active
-	glUseProgram(postFxShader);
-	// Task 4: Set the required uniforms
-	labhelper::setUniformSlow(postFxShader, "time", currentTime);
-	labhelper::setUniformSlow(postFxShader, "currentEffect", currentEffect);
-	labhelper::setUniformSlow(postFxShader, "filterSize", filterSizes[filterSize - 1]);
-	labhelper::setUniformSlow(postFxShader, "hueShift", hueShift);
-	// 3. Bind the framebuffer to texture unit 0
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, cameraFBO.colorTextureTarget);
-
-	// 4. Draw a quad over the entire viewport
-	labhelper::drawFullScreenQuad();
+	{
+		PROFILE_GPU_ZONE("postFx");
+		gpuProfiler->begin("postFx");
+		// 1. Bind and clear default framebuffer
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glViewport(0, 0, w, h);
+		glClearColor(0.2f, 0.2f, 0.8f, 1.0f);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		// 2. Set postFxShader as active
+		glUseProgram(postFxShader);
+		// Task 4: Set the required uniforms
+		labhelper::setUniformSlow(postFxShader, "time", currentTime);
+		labhelper::setUniformSlow(postFxShader, "currentEffect", currentEffect);
+		labhelper::setUniformSlow(postFxShader, "filterSize", filterSizes[filterSize - 1]);
+		labhelper::setUniformSlow(postFxShader, "hueShift", hueShift);
+		// 3. Bind the framebuffer to texture unit 0
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, cameraFBO.colorTextureTarget);
 
-	glUseProgram(0);
+		// 4. Draw a quad over the entire viewport
+		labhelper::drawFullScreenQuad();
+		gpuProfiler->end();
+
+		glUseProgram(0);
+	}
 
 	CHECK_GL_ERROR();
 }
@@ -478,6 +510,7 @@ void display()
 ///////////////////////////////////////////////////////////////////////////////
 bool handleEvents(void)
 {
+	PROFILE_CPU_ZONE("events");
 	// check events (keyboard among other)
 	SDL_Event event;
 	bool quitEvent = false;
@@ -498,6 +531,10 @@ bool handleEvents(void)
 		{
 			labhelper::saveScreenshot();
 		}
+		else if (event.type == SDL_KEYUP && event.key.keysym.sym == SDLK_F9)
+		{
+			labhelper::profiler::toggleCapture();
+		}
 		else if (event.type == SDL_MOUSEBUTTONDOWN
 			&& (event.button.button == SDL_BUTTON_LEFT || event.button.button == SDL_BUTTON_RIGHT)
 			&& (!showUI || !ImGui::GetIO().WantCaptureMouse))
@@ -580,6 +617,7 @@ bool handleEvents(void)
 ///////////////////////////////////////////////////////////////////////////////
 void gui()
 {
+	PROFILE_CPU_ZONE("gui");
 	// ----------------- Set variables --------------------------
 	ImGui::Text("Post-processing effect");
 	ImGui::RadioButton("None", &currentEffect, PostProcessingEffect::None);
@@ -596,6 +634,10 @@ void gui()
 	ImGui::RadioButton("Church Window", &currentEffect, PostProcessingEffect::ChurchWindow);
 	ImGui::RadioButton("Hue Shift", &currentEffect, PostProcessingEffect::HueShift);
 	ImGui::SliderFloat("Amount##Hue Shift", &hueShift, 0, 1);
+	if (ImGui::CollapsingHeader("GPU passes"))
+	{
+		gpuProfiler->gui();
+	}
 	ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate,
 		ImGui::GetIO().Framerate);
 	// ----------------------------------------------------------
@@ -612,6 +654,8 @@ int main(int argc, char* argv[])
 
 	while (!stopRendering)
 	{
+		labhelper::profiler::beginFrame();
+
 		//update currentTime
 		std::chrono::duration<float> timeSinceStart = std::chrono::system_clock::now() - startTime;
 		deltaTime = timeSinceStart.count() - currentTime;
@@ -646,6 +690,7 @@ int main(int argc, char* argv[])
 	labhelper::freeModel(sphereModel);
 
 	// Shut down everything. This includes the window and all other subsystems.
+	delete gpuProfiler;
 	labhelper::shutDown(g_window);
 	return 0;
 }
\ No newline at end of file
@@ -6,6 +6,8 @@
 #include <map>
 
 #include <labhelper.h>
+#include <Profiler.h>
+#include <GpuProfiler.h>
 #include <imgui.h>
 #include <imgui_impl_sdl_gl3.h>
 
@@ -81,6 +83,65 @@ bool useHardwarePCF = false;
 float polygonOffset_factor = .25f;
 float polygonOffset_units = 1.0f;
 
+// Meshes outside the frustum of each pass are skipped. The shadow map pass
+// culls against the light frustum.
+bool useFrustumCulling = true;
+labhelper::RenderStats shadowPassStats;
+labhelper::RenderStats cameraPassStats;
+// GPU time of the shadow map pass
+labhelper::GpuProfiler* gpuProfiler = nullptr;
+
+///////////////////////////////////////////////////////////////////////////////
+// Uniforms set by drawScene(), one set of handles per program
+///////////////////////////////////////////////////////////////////////////////
+struct SceneUniforms
+{
+	labhelper::Uniform<vec3> point_light_color;
+	labhelper::Uniform<float> point_light_intensity_multiplier;
+	labhelper::Uniform<vec3> viewSpaceLightPosition;
+	labhelper::Uniform<vec3> viewSpaceLightDir;
+	labhelper::Uniform<float> spotOuterAngle;
+	labhelper::Uniform<float> spotInnerAngle;
+	labhelper::Uniform<int> useSpotLight;
+	labhelper::Uniform<int> useSoftFalloff;
+	labhelper::Uniform<mat4> lightMatrix;
+	labhelper::Uniform<float> environment_multiplier;
+	labhelper::Uniform<mat4> viewInverse;
+	labhelper::Uniform<mat4> modelViewProjectionMatrix;
+	labhelper::Uniform<mat4> modelViewMatrix;
+	labhelper::Uniform<mat4> normalMatrix;
+
+	SceneUniforms() = default;
+	explicit SceneUniforms(GLuint program)
+		: point_light_color(program, "point_light_color")
+		, point_light_intensity_multiplier(program, "point_light_intensity_multiplier")
+		, viewSpaceLightPosition(program, "viewSpaceLightPosition")
+		, viewSpaceLightDir(program, "viewSpaceLightDir")
+		, spotOuterAngle(program, "spotOuterAngle")
+		, spotInnerAngle(program, "spotInnerAngle")
+		, useSpotLight(program, "useSpotLight")
+		, useSoftFalloff(program, "useSoftFalloff")
+		, lightMatrix(program, "lightMatrix")
+		, environment_multiplier(program, "environment_multiplier")
+		, viewInverse(program, "viewInverse")
+		, modelViewProjectionMatrix(program, "modelViewProjectionMatrix")
+		, modelViewMatrix(program, "modelViewMatrix")
+		, normalMatrix(program, "normalMatrix")
+	{
+	}
+};
+std::map<GLuint, SceneUniforms> sceneUniforms;
+
+const SceneUniforms& getSceneUniforms(GLuint program)
+{
+	auto it = sceneUniforms.find(program);
+	if (it == sceneUniforms.end())
+	{
+		it = sceneUniforms.insert({ program, SceneUniforms(program) }).first;
+	}
+	return it->second;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Camera parameters.
 ///////////////////////////////////////////////////////////////////////////////
@@ -163,6 +224,8 @@ void initialize()
 {
 	ENSURE_INITIALIZE_ONLY_ONCE();
 
+	gpuProfiler = new labhelper::GpuProfiler();
+
 	///////////////////////////////////////////////////////////////////////
 	// Sanity Check
 	static int _initialized = 0;
@@ -244,6 +307,7 @@ void debugDrawLight(const glm::mat4& viewMatrix,
 
 void drawBackground(const mat4& viewMatrix, const mat4& projectionMatrix)
 {
+	PROFILE_GPU_ZONE("background");
 	glUseProgram(backgroundProgram);
 	labhelper::setUniformSlow(backgroundProgram, "environment_multiplier", environment_multiplier);
 	labhelper::setUniformSlow(backgroundProgram, "inv_PV", inverse(projectionMatrix * viewMatrix));
@@ -261,18 +325,19 @@ void drawScene(GLuint currentShaderProgram,
 	const mat4& lightProjectionMatrix)
 {
 	glUseProgram(currentShaderProgram);
+	const SceneUniforms& u = getSceneUniforms(currentShaderProgram);
 	// Light source
 	vec4 viewSpaceLightPosition = viewMatrix * vec4(lightPosition, 1.0f);
-	labhelper::setUniformSlow(currentShaderProgram, "point_light_color", point_light_color);
-	labhelper::setUniformSlow(currentShaderProgram, "point_light_intensity_multiplier", point_light_intensity_multiplier);
-	labhelper::setUniformSlow(currentShaderProgram, "viewSpaceLightPosition", vec3(viewSpaceLightPosition));
-	labhelper::setUniformSlow(currentShaderProgram, "viewSpaceLightDir", normalize(vec3(viewMatrix * vec4(-lightPosition, 0.0f))));
+	u.point_light_color.set(point_light_color);
+	u.point_light_intensity_multiplier.set(point_light_intensity_multiplier);
+	u.viewSpaceLightPosition.set(vec3(viewSpaceLightPosition));
+	u.viewSpaceLightDir.set(normalize(vec3(viewMatrix * vec4(-lightPosition, 0.0f))));
 	// Task 6
 	// Spot light
-	labhelper::setUniformSlow(currentShaderProgram, "spotOuterAngle", std::cos(radians(outerSpotlightAngle)));
-	labhelper::setUniformSlow(currentShaderProgram, "spotInnerAngle", std::cos(radians(innerSpotlightAngle)));
-	labhelper::setUniformSlow(currentShaderProgram, "useSpotLight", useSpotLight ? 1 : 0);
-	labhelper::setUniformSlow(currentShaderProgram, "useSoftFalloff", useSoftFalloff ? 1 : 0);
+	u.spotOuterAngle.set(std::cos(radians(outerSpotlightAngle)));
+	u.spotInnerAngle.set(std::cos(radians(innerSpotlightAngle)));
+	u.useSpotLight.set(useSpotLight ? 1 : 0);
+	u.useSoftFalloff.set(useSoftFalloff ? 1 : 0);
 
 	// Shadow map
 	// Task 2
@@ -287,33 +352,38 @@ void drawScene(GLuint currentShaderProgram,
 	// The depth value we've stored in our shadow map has the same range between 0 and 1
 	// By doing translate and scale we remap from clip space to texture-coordinates space
 	mat4 lightMatrix = translate(vec3(0.5f)) * scale(vec3(0.5f)) * lightProjectionMatrix * lightViewMatrix * inverse(viewMatrix);
-	labhelper::setUniformSlow(currentShaderProgram, "lightMatrix", lightMatrix);
+	u.lightMatrix.set(lightMatrix);
 
 	// Environment
-	labhelper::setUniformSlow(currentShaderProgram, "environment_multiplier", environment_multiplier);
+	u.environment_multiplier.set(environment_multiplier);
 
 	// camera
-	labhelper::setUniformSlow(currentShaderProgram, "viewInverse", inverse(viewMatrix));
+	u.viewInverse.set(inverse(viewMatrix));
+
+	// The models have no levels of detail here, the view is only for culling
+	labhelper::RenderView view;
+	view.projection_matrix = projectionMatrix;
+	view.viewport_height = 1.0f;
+	view.force_lod = 0;
+	view.frustum_cull = useFrustumCulling;
 
 	// landing pad
 	mat4 modelMatrix(1.0f);
-	labhelper::setUniformSlow(currentShaderProgram, "modelViewProjectionMatrix",
-		projectionMatrix * viewMatrix * modelMatrix);
-	labhelper::setUniformSlow(currentShaderProgram, "modelViewMatrix", viewMatrix * modelMatrix);
-	labhelper::setUniformSlow(currentShaderProgram, "normalMatrix",
-		inverse(transpose(viewMatrix * modelMatrix)));
+	u.modelViewProjectionMatrix.set(projectionMatrix * viewMatrix * modelMatrix);
+	u.modelViewMatrix.set(viewMatrix * modelMatrix);
+	u.normalMatrix.set(inverse(transpose(viewMatrix * modelMatrix)));
 
-	labhelper::render(landingpadModel);
+	view.model_view_matrix = viewMatrix * modelMatrix;
+	labhelper::render(landingpadModel, view);
 
 	// scene objects
 	for (auto& m : scenes[currentScene].models)
 	{
-		labhelper::setUniformSlow(currentShaderProgram, "modelViewProjectionMatrix",
-			projectionMatrix * viewMatrix * m.modelMat);
-		labhelper::setUniformSlow(currentShaderProgram, "modelViewMatrix", viewMatrix * m.modelMat);
-		labhelper::setUniformSlow(currentShaderProgram, "normalMatrix",
-			inverse(transpose(viewMatrix * m.modelMat)));
-		labhelper::render(m.model);
+		u.modelViewProjectionMatrix.set(projectionMatrix * viewMatrix * m.modelMat);
+		u.modelViewMatrix.set(viewMatrix * m.modelMat);
+		u.normalMatrix.set(inverse(transpose(viewMatrix * m.modelMat)));
+		view.model_view_matrix = viewMatrix * m.modelMat;
+		labhelper::render(m.model, view);
 	}
 }
 
@@ -323,6 +393,8 @@ void drawScene(GLuint currentShaderProgram,
 ///////////////////////////////////////////////////////////////////////////////
 void display(void)
 {
+	PROFILE_CPU_ZONE("display");
+	gpuProfiler->beginFrame();
 	int w, h;
 	SDL_GetWindowSize(g_window, &w, &h);
 
@@ -389,19 +461,26 @@ void display(void)
 	// Draw Shadow Map
 	///////////////////////////////////////////////////////////////////////////
 
-	glBindFramebuffer(GL_FRAMEBUFFER, shadowMapFB.framebufferId);
-	glViewport(0, 0, shadowMapFB.height, shadowMapFB.width);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	// Task 3
-	// Polygon offset to avoid self-shadowing (shadow acne)
-	// Setting units or factor too high will cause peter panning, which make it look like the shadow is floating above the surface
-	if (usePolygonOffset) {
-		glEnable(GL_POLYGON_OFFSET_FILL);
-		glPolygonOffset(polygonOffset_factor, polygonOffset_units);
-	}
-	drawScene(simpleShaderProgram, lightViewMatrix, lightProjMatrix, lightViewMatrix, lightProjMatrix);
-	if (usePolygonOffset) {
-		glDisable(GL_POLYGON_OFFSET_FILL);
+	{
+		PROFILE_GPU_ZONE("shadow");
+		gpuProfiler->begin("shadow");
+		glBindFramebuffer(GL_FRAMEBUFFER, shadowMapFB.framebufferId);
+		glViewport(0, 0, shadowMapFB.height, shadowMapFB.width);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		// Task 3
+		// Polygon offset to avoid self-shadowing (shadow acne)
+		// Setting units or factor too high will cause peter panning, which make it look like the shadow is floating above the surface
+		if (usePolygonOffset) {
+			glEnable(GL_POLYGON_OFFSET_FILL);
+			glPolygonOffset(polygonOffset_factor, polygonOffset_units);
+		}
+		labhelper::resetRenderStats();
+		drawScene(simpleShaderProgram, lightViewMatrix, lightProjMatrix, lightViewMatrix, lightProjMatrix);
+		shadowPassStats = labhelper::getRenderStats();
+		if (usePolygonOffset) {
+			glDisable(GL_POLYGON_OFFSET_FILL);
+		}
+		gpuProfiler->end();
 	}
 	labhelper::Material& screen = landingpadModel->m_materials[8];
 	screen.m_emission_texture.gl_id = shadowMapFB.colorTextureTarget;
@@ -415,7 +494,12 @@ void display(void)
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 	drawBackground(viewMatrix, projMatrix);
-	drawScene(shaderProgram, viewMatrix, projMatrix, lightViewMatrix, lightProjMatrix);
+	{
+		PROFILE_GPU_ZONE("main");
+		labhelper::resetRenderStats();
+		drawScene(shaderProgram, viewMatrix, projMatrix, lightViewMatrix, lightProjMatrix);
+		cameraPassStats = labhelper::getRenderStats();
+	}
 	debugDrawLight(viewMatrix, projMatrix, vec3(lightPosition));
 
 	CHECK_GL_ERROR();
@@ -426,6 +510,7 @@ void display(void)
 ///////////////////////////////////////////////////////////////////////////////
 bool handleEvents(void)
 {
+	PROFILE_CPU_ZONE("events");
 	// check events (keyboard among other)
 	SDL_Event event;
 	bool quitEvent = false;
@@ -449,6 +534,10 @@ bool handleEvents(void)
 		{
 			labhelper::saveScreenshot();
 		}
+		else if (event.type == SDL_KEYUP && event.key.keysym.sym == SDLK_F9)
+		{
+			labhelper::profiler::toggleCapture();
+		}
 		else if (event.type == SDL_MOUSEBUTTONDOWN && (!showUI || !ImGui::GetIO().WantCaptureMouse)
 			&& (event.button.button == SDL_BUTTON_LEFT || event.button.button == SDL_BUTTON_RIGHT)
 			&& !(g_isMouseDragging || g_isMouseRightDragging))
@@ -545,6 +634,7 @@ bool handleEvents(void)
 ///////////////////////////////////////////////////////////////////////////////
 void gui()
 {
+	PROFILE_CPU_ZONE("gui");
 	if (ImGui::BeginMainMenuBar())
 	{
 		if (ImGui::BeginMenu("Scene"))
@@ -579,6 +669,12 @@ void gui()
 	ImGui::Checkbox("Animate light", &animateLight);
 	ImGui::SliderFloat("Light Azimuth", &lightAzimuth, 0.0f, 360.0f);
 	ImGui::SliderFloat("Light Zenith", &lightZenith, 0.0f, 90.0f);
+	ImGui::Checkbox("Frustum culling", &useFrustumCulling);
+	ImGui::Text("Shadow pass: %u draw calls, %u meshes culled", shadowPassStats.draw_calls,
+		shadowPassStats.culled_meshes);
+	ImGui::Text("Camera pass: %u draw calls, %u meshes culled", cameraPassStats.draw_calls,
+		cameraPassStats.culled_meshes);
+	gpuProfiler->gui();
 	ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate,
 		ImGui::GetIO().Framerate);
 	// ----------------------------------------------------------
@@ -595,6 +691,8 @@ int main(int argc, char* argv[])
 
 	while (!stopRendering)
 	{
+		labhelper::profiler::beginFrame();
+
 		//update currentTime
 		std::chrono::duration<float> timeSinceStart = std::chrono::system_clock::now() - startTime;
 		deltaTime = timeSinceStart.count() - currentTime;
@@ -626,6 +724,7 @@ int main(int argc, char* argv[])
 	labhelper::freeModel(landingpadModel);
 
 	// Shut down everything. This includes the window and all other subsystems.
+	delete gpuProfiler;
 	labhelper::shutDown(g_window);
 	return 0;
 }
\ No newline at end of file
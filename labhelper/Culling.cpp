@@ -0,0 +1,228 @@
+#include "Culling.h"
+#include "Model.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define LABHELPER_CULLING_SSE
+#endif
+
+namespace labhelper
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Gribb & Hartmann, "Fast Extraction of Viewing Frustum Planes from the
+	// World-View-Projection Matrix"
+	///////////////////////////////////////////////////////////////////////////
+	Frustum extractFrustum(const glm::mat4& m)
+	{
+		const glm::vec4 row0(m[0][0], m[1][0], m[2][0], m[3][0]);
+		const glm::vec4 row1(m[0][1], m[1][1], m[2][1], m[3][1]);
+		const glm::vec4 row2(m[0][2], m[1][2], m[2][2], m[3][2]);
+		const glm::vec4 row3(m[0][3], m[1][3], m[2][3], m[3][3]);
+		Frustum f;
+		f.planes[0] = row3 + row0;
+		f.planes[1] = row3 - row0;
+		f.planes[2] = row3 + row1;
+		f.planes[3] = row3 - row1;
+		f.planes[4] = row3 + row2;
+		f.planes[5] = row3 - row2;
+		for (auto& plane : f.planes)
+		{
+			plane /= glm::length(glm::vec3(plane));
+		}
+		return f;
+	}
+
+	void cullSpheres(const Frustum& frustum, const glm::vec4* spheres, size_t stride, size_t count,
+		uint8_t* visible)
+	{
+		auto sphere = [&](size_t i) {
+			return reinterpret_cast<const float*>(reinterpret_cast<const uint8_t*>(spheres) + i * stride);
+		};
+		size_t i = 0;
+#ifdef LABHELPER_CULLING_SSE
+		for (; i + 4 <= count; i += 4)
+		{
+			// Transpose four spheres into x, y, z and radius vectors
+			__m128 x = _mm_loadu_ps(sphere(i + 0));
+			__m128 y = _mm_loadu_ps(sphere(i + 1));
+			__m128 z = _mm_loadu_ps(sphere(i + 2));
+			__m128 r = _mm_loadu_ps(sphere(i + 3));
+			_MM_TRANSPOSE4_PS(x, y, z, r);
+			const __m128 minus_r = _mm_sub_ps(_mm_setzero_ps(), r);
+			__m128 inside = _mm_cmpeq_ps(minus_r, minus_r);
+			for (const auto& plane : frustum.planes)
+			{
+				__m128 d = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(plane.x)), _mm_set1_ps(plane.w));
+				d = _mm_add_ps(d, _mm_mul_ps(y, _mm_set1_ps(plane.y)));
+				d = _mm_add_ps(d, _mm_mul_ps(z, _mm_set1_ps(plane.z)));
+				inside = _mm_and_ps(inside, _mm_cmpge_ps(d, minus_r));
+			}
+			const int mask = _mm_movemask_ps(inside);
+			visible[i + 0] = (mask >> 0) & 1;
+			visible[i + 1] = (mask >> 1) & 1;
+			visible[i + 2] = (mask >> 2) & 1;
+			visible[i + 3] = (mask >> 3) & 1;
+		}
+#endif
+		for (; i < count; i++)
+		{
+			const float* s = sphere(i);
+			visible[i] = 1;
+			for (const auto& plane : frustum.planes)
+			{
+				if (plane.x * s[0] + plane.y * s[1] + plane.z * s[2] + plane.w < -s[3])
+				{
+					visible[i] = 0;
+					break;
+				}
+			}
+		}
+	}
+
+	void OcclusionBuffer::resize(int width, int height)
+	{
+		m_width = width;
+		m_height = height;
+		m_depth.resize(size_t(width) * size_t(height));
+		clear();
+	}
+
+	void OcclusionBuffer::clear()
+	{
+		std::fill(m_depth.begin(), m_depth.end(), 1.0f);
+		m_triangles_rasterized = 0;
+		m_max_occluder_error = 0.0f;
+	}
+
+	void OcclusionBuffer::addOccluder(const Model* model, const glm::mat4& model_view_projection)
+	{
+		std::vector<glm::vec4> clip(model->m_positions.size());
+		for (const auto& mesh : model->m_meshes)
+		{
+			for (uint32_t i = mesh.m_start_index; i < mesh.m_start_index + mesh.m_number_of_vertices; i++)
+			{
+				clip[i] = model_view_projection * glm::vec4(model->m_positions[i], 1.0f);
+			}
+			const MeshLod& lod = mesh.m_lods.back();
+			m_max_occluder_error = std::max(m_max_occluder_error, lod.m_error);
+			for (uint32_t i = lod.m_first_index; i < lod.m_first_index + lod.m_number_of_indices; i += 3)
+			{
+				addTriangle(clip[model->m_indices[i + 0]], clip[model->m_indices[i + 1]],
+					clip[model->m_indices[i + 2]]);
+			}
+		}
+	}
+
+	void OcclusionBuffer::addTriangle(const glm::vec4& clip0, const glm::vec4& clip1, const glm::vec4& clip2)
+	{
+		// Triangles crossing the near plane are skipped rather than
+		// clipped. Leaving out occluders only makes the test conservative.
+		const glm::vec4* clip[3] = { &clip0, &clip1, &clip2 };
+		glm::vec3 screen[3];
+		for (int k = 0; k < 3; k++)
+		{
+			const glm::vec4& c = *clip[k];
+			if (c.w <= 0.0f || c.z < -c.w)
+			{
+				return;
+			}
+			screen[k] = glm::vec3((c.x / c.w * 0.5f + 0.5f) * m_width, (c.y / c.w * 0.5f + 0.5f) * m_height,
+				c.z / c.w);
+		}
+
+		float area = (screen[1].x - screen[0].x) * (screen[2].y - screen[0].y)
+			- (screen[2].x - screen[0].x) * (screen[1].y - screen[0].y);
+		if (area == 0.0f)
+		{
+			return;
+		}
+		if (area < 0.0f)
+		{
+			std::swap(screen[1], screen[2]);
+			area = -area;
+		}
+
+		const int x0 = std::max(0, int(std::floor(std::min(screen[0].x, std::min(screen[1].x, screen[2].x)))));
+		const int x1 = std::min(m_width - 1, int(std::ceil(std::max(screen[0].x, std::max(screen[1].x, screen[2].x)))));
+		const int y0 = std::max(0, int(std::floor(std::min(screen[0].y, std::min(screen[1].y, screen[2].y)))));
+		const int y1 = std::min(m_height - 1, int(std::ceil(std::max(screen[0].y, std::max(screen[1].y, screen[2].y)))));
+		if (x0 > x1 || y0 > y1)
+		{
+			return;
+		}
+		m_triangles_rasterized++;
+
+		const float inv_area = 1.0f / area;
+		for (int y = y0; y <= y1; y++)
+		{
+			const float py = y + 0.5f;
+			for (int x = x0; x <= x1; x++)
+			{
+				const float px = x + 0.5f;
+				// Edge functions, each the weight of the opposite vertex
+				const float w0 = (screen[2].x - screen[1].x) * (py - screen[1].y)
+					- (screen[2].y - screen[1].y) * (px - screen[1].x);
+				const float w1 = (screen[0].x - screen[2].x) * (py - screen[2].y)
+					- (screen[0].y - screen[2].y) * (px - screen[2].x);
+				const float w2 = (screen[1].x - screen[0].x) * (py - screen[0].y)
+					- (screen[1].y - screen[0].y) * (px - screen[0].x);
+				if (w0 < 0.0f || w1 < 0.0f || w2 < 0.0f)
+				{
+					continue;
+				}
+				const float z = (w0 * screen[0].z + w1 * screen[1].z + w2 * screen[2].z) * inv_area;
+				float& depth = m_depth[y * m_width + x];
+				depth = std::min(depth, z);
+			}
+		}
+	}
+
+	bool OcclusionBuffer::isOccluded(const glm::mat4& model_view_projection, const glm::vec3& aabb_min,
+		const glm::vec3& aabb_max) const
+	{
+		if (m_depth.empty())
+		{
+			return false;
+		}
+		glm::vec2 rect_min(FLT_MAX), rect_max(-FLT_MAX);
+		float nearest = FLT_MAX;
+		for (int corner = 0; corner < 8; corner++)
+		{
+			const glm::vec3 p((corner & 1) ? aabb_max.x : aabb_min.x, (corner & 2) ? aabb_max.y : aabb_min.y,
+				(corner & 4) ? aabb_max.z : aabb_min.z);
+			const glm::vec4 c = model_view_projection * glm::vec4(p, 1.0f);
+			if (c.w <= 0.0f || c.z < -c.w)
+			{
+				// The box reaches the camera
+				return false;
+			}
+			const glm::vec2 screen((c.x / c.w * 0.5f + 0.5f) * m_width, (c.y / c.w * 0.5f + 0.5f) * m_height);
+			rect_min = glm::min(rect_min, screen);
+			rect_max = glm::max(rect_max, screen);
+			nearest = std::min(nearest, c.z / c.w);
+		}
+
+		const int x0 = std::max(0, int(std::floor(rect_min.x)) - 1);
+		const int x1 = std::min(m_width - 1, int(std::ceil(rect_max.x)) + 1);
+		const int y0 = std::max(0, int(std::floor(rect_min.y)) - 1);
+		const int y1 = std::min(m_height - 1, int(std::ceil(rect_max.y)) + 1);
+		if (x0 > x1 || y0 > y1)
+		{
+			// Off screen, left to the frustum test
+			return false;
+		}
+		for (int y = y0; y <= y1; y++)
+		{
+			for (int x = x0; x <= x1; x++)
+			{
+				if (m_depth[y * m_width + x] >= nearest)
+				{
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+} // namespace labhelper
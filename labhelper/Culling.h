@@ -0,0 +1,60 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+
+namespace labhelper
+{
+	class Model;
+
+	///////////////////////////////////////////////////////////////////////////
+	/// The six planes (left, right, bottom, top, near, far) of a view
+	/// frustum, pointing inwards and normalized. Extracted from a
+	/// (model-)view-projection matrix, the planes are in the space that the
+	/// matrix transforms from.
+	///////////////////////////////////////////////////////////////////////////
+	struct Frustum
+	{
+		glm::vec4 planes[6];
+	};
+	Frustum extractFrustum(const glm::mat4& view_projection);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Tests `count` bounding spheres (xyz center, w radius), each
+	/// `stride` bytes after the previous, against the frustum. visible[i] is
+	/// set to 1 if sphere i intersects the frustum, else 0. Four spheres
+	/// are tested at a time with SSE where available.
+	///////////////////////////////////////////////////////////////////////////
+	void cullSpheres(const Frustum& frustum, const glm::vec4* spheres, size_t stride, size_t count,
+		uint8_t* visible);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// A small software depth buffer for occlusion culling. Occluders are
+	/// rasterized at low resolution, and bounding boxes that are behind
+	/// the occluders everywhere they cover are reported as occluded.
+	///
+	/// The depth is approximate: a pixel counts as covered if its center is.
+	/// The test rectangle is grown by a pixel to make up for that.
+	///////////////////////////////////////////////////////////////////////////
+	class OcclusionBuffer
+	{
+	public:
+		void resize(int width, int height);
+		void clear();
+		// Rasterize all meshes of the model, at their coarsest level of detail
+		void addOccluder(const Model* model, const glm::mat4& model_view_projection);
+		void addTriangle(const glm::vec4& clip0, const glm::vec4& clip1, const glm::vec4& clip2);
+		bool isOccluded(const glm::mat4& model_view_projection, const glm::vec3& aabb_min,
+			const glm::vec3& aabb_max) const;
+
+		int m_width = 0;
+		int m_height = 0;
+		// Normalized device z of the nearest occluder, 1 where there is none
+		std::vector<float> m_depth;
+		uint32_t m_triangles_rasterized = 0;
+		// Largest error of the levels of detail rasterized, in the model
+		// space of the occluders
+		float m_max_occluder_error = 0.0f;
+	};
+} // namespace labhelper
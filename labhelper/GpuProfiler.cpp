@@ -0,0 +1,164 @@
+#include "GpuProfiler.h"
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <imgui.h>
+
+namespace labhelper
+{
+	const int GpuProfiler::QUERY_BUFFERS;
+
+	GpuProfiler::GpuProfiler(int history) : m_history(std::max(history, 1)), m_frame(0), m_active(-1)
+	{
+	}
+
+	GpuProfiler::~GpuProfiler()
+	{
+		for (Pass& pass : m_passes)
+		{
+			glDeleteQueries(QUERY_BUFFERS, pass.queries);
+		}
+	}
+
+	void GpuProfiler::beginFrame()
+	{
+		assert(m_active < 0);
+		m_frame++;
+		const int buffer = m_frame % QUERY_BUFFERS;
+		for (Pass& pass : m_passes)
+		{
+			if (!pass.issued[buffer])
+			{
+				continue;
+			}
+			pass.issued[buffer] = false;
+			GLint available = 0;
+			glGetQueryObjectiv(pass.queries[buffer], GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available)
+			{
+				pass.dropped++;
+				continue;
+			}
+			GLuint64 elapsed_ns;
+			glGetQueryObjectui64v(pass.queries[buffer], GL_QUERY_RESULT, &elapsed_ns);
+			pass.samples_ms[pass.next_sample] = float(elapsed_ns / 1e6);
+			pass.sample_frames[pass.next_sample] = m_frame - QUERY_BUFFERS;
+			pass.next_sample = (pass.next_sample + 1) % m_history;
+			pass.sample_count = std::min(pass.sample_count + 1, m_history);
+		}
+	}
+
+	void GpuProfiler::begin(const std::string& name)
+	{
+		assert(m_active < 0);
+		auto it = m_pass_indices.find(name);
+		if (it == m_pass_indices.end())
+		{
+			Pass pass;
+			pass.name = name;
+			glGenQueries(QUERY_BUFFERS, pass.queries);
+			std::fill_n(pass.issued, QUERY_BUFFERS, false);
+			pass.samples_ms.resize(m_history, 0.0f);
+			pass.sample_frames.resize(m_history, 0);
+			pass.next_sample = 0;
+			pass.sample_count = 0;
+			pass.dropped = 0;
+			it = m_pass_indices.insert({ name, int(m_passes.size()) }).first;
+			m_passes.push_back(pass);
+		}
+		m_active = it->second;
+		glBeginQuery(GL_TIME_ELAPSED, m_passes[m_active].queries[m_frame % QUERY_BUFFERS]);
+	}
+
+	void GpuProfiler::end()
+	{
+		assert(m_active >= 0);
+		glEndQuery(GL_TIME_ELAPSED);
+		m_passes[m_active].issued[m_frame % QUERY_BUFFERS] = true;
+		m_active = -1;
+	}
+
+	GpuProfiler::PassStats GpuProfiler::getPassStats(int pass_index) const
+	{
+		const Pass& pass = m_passes[pass_index];
+		PassStats stats = {};
+		stats.samples = pass.sample_count;
+		stats.dropped = pass.dropped;
+		if (pass.sample_count == 0)
+		{
+			return stats;
+		}
+		stats.last_ms = pass.samples_ms[(pass.next_sample + m_history - 1) % m_history];
+		std::vector<float> sorted(pass.samples_ms.begin(), pass.samples_ms.begin() + pass.sample_count);
+		std::sort(sorted.begin(), sorted.end());
+		double sum = 0.0;
+		for (float ms : sorted)
+		{
+			sum += ms;
+		}
+		auto percentile = [&](float p) { return sorted[std::min(int(p * sorted.size()), int(sorted.size()) - 1)]; };
+		stats.average_ms = float(sum / sorted.size());
+		stats.p50_ms = percentile(0.50f);
+		stats.p95_ms = percentile(0.95f);
+		stats.p99_ms = percentile(0.99f);
+		stats.max_ms = sorted.back();
+		return stats;
+	}
+
+	void GpuProfiler::gui()
+	{
+		ImGui::Columns(6, "gpu_passes");
+		const char* headers[] = { "Pass", "Last ms", "Avg ms", "p50 ms", "p95 ms", "p99 ms" };
+		for (const char* header : headers)
+		{
+			ImGui::Text("%s", header);
+			ImGui::NextColumn();
+		}
+		ImGui::Separator();
+		for (int i = 0; i < getPassCount(); i++)
+		{
+			const PassStats stats = getPassStats(i);
+			ImGui::Text("%s", m_passes[i].name.c_str());
+			ImGui::NextColumn();
+			ImGui::Text("%.3f", stats.last_ms);
+			ImGui::NextColumn();
+			ImGui::Text("%.3f", stats.average_ms);
+			ImGui::NextColumn();
+			ImGui::Text("%.3f", stats.p50_ms);
+			ImGui::NextColumn();
+			ImGui::Text("%.3f", stats.p95_ms);
+			ImGui::NextColumn();
+			ImGui::Text("%.3f", stats.p99_ms);
+			ImGui::NextColumn();
+		}
+		ImGui::Columns(1);
+		if (ImGui::Button("Export gpu_passes.csv"))
+		{
+			exportCsv("gpu_passes.csv");
+		}
+	}
+
+	bool GpuProfiler::exportCsv(const std::string& filename) const
+	{
+		FILE* f = fopen(filename.c_str(), "w");
+		if (f == nullptr)
+		{
+			printf("Could not write %s\n", filename.c_str());
+			return false;
+		}
+		fprintf(f, "pass,frame,ms\n");
+		for (const Pass& pass : m_passes)
+		{
+			// Oldest sample first
+			const int first = (pass.next_sample + m_history - pass.sample_count) % m_history;
+			for (int i = 0; i < pass.sample_count; i++)
+			{
+				const int sample = (first + i) % m_history;
+				fprintf(f, "%s,%d,%.4f\n", pass.name.c_str(), pass.sample_frames[sample], pass.samples_ms[sample]);
+			}
+		}
+		fclose(f);
+		printf("Wrote %d passes to %s\n", getPassCount(), filename.c_str());
+		return true;
+	}
+} // namespace labhelper
@@ -0,0 +1,92 @@
+#pragma once
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <GL/glew.h>
+
+namespace labhelper
+{
+	///////////////////////////////////////////////////////////////////////////
+	/// Measures the GPU time of named render passes with GL_TIME_ELAPSED
+	/// queries. Each pass has QUERY_BUFFERS queries used in turn, so a result
+	/// is read back QUERY_BUFFERS frames after it was issued, when the GPU
+	/// has normally finished it, instead of stalling the pipeline. A result
+	/// that is still not available is dropped.
+	///
+	/// Keeps the last `history` samples of each pass, for rolling averages
+	/// and percentiles. The queries are created lazily, so the profiler can
+	/// be constructed before the GL context, but it must be destroyed while
+	/// the context still exists.
+	///////////////////////////////////////////////////////////////////////////
+	class GpuProfiler
+	{
+	public:
+		static const int QUERY_BUFFERS = 2;
+
+		struct PassStats
+		{
+			float last_ms;
+			float average_ms;
+			float p50_ms;
+			float p95_ms;
+			float p99_ms;
+			float max_ms;
+			int samples;
+			int dropped;
+		};
+
+		explicit GpuProfiler(int history = 240);
+		~GpuProfiler();
+
+		GpuProfiler(const GpuProfiler&) = delete;
+		GpuProfiler& operator=(const GpuProfiler&) = delete;
+
+		/// Call once per frame, before any pass: reads back the results of
+		/// the frame QUERY_BUFFERS frames ago.
+		void beginFrame();
+
+		/// Time the GL commands between begin() and end(). Passes can not
+		/// nest (GL_TIME_ELAPSED queries can not), and each pass should be
+		/// timed at most once per frame.
+		void begin(const std::string& name);
+		void end();
+
+		/// Passes in the order they were first timed
+		int getPassCount() const
+		{
+			return int(m_passes.size());
+		}
+		const std::string& getPassName(int pass) const
+		{
+			return m_passes[pass].name;
+		}
+		PassStats getPassStats(int pass) const;
+
+		/// A table of the passes, in the current ImGui window, with a button
+		/// that exports them to gpu_passes.csv
+		void gui();
+
+		/// One line per sample: pass, frame, milliseconds
+		bool exportCsv(const std::string& filename) const;
+
+	private:
+		struct Pass
+		{
+			std::string name;
+			GLuint queries[QUERY_BUFFERS];
+			bool issued[QUERY_BUFFERS];
+			// Ring buffers of the last samples, and the frames they are from
+			std::vector<float> samples_ms;
+			std::vector<int> sample_frames;
+			int next_sample;
+			int sample_count;
+			int dropped;
+		};
+
+		int m_history;
+		int m_frame;
+		int m_active;
+		std::vector<Pass> m_passes;
+		std::unordered_map<std::string, int> m_pass_indices;
+	};
+} // namespace labhelper
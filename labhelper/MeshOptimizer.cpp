@@ -0,0 +1,631 @@
+#include "MeshOptimizer.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <unordered_map>
+
+namespace labhelper
+{
+	float computeACMR(const std::vector<uint32_t>& indices, size_t vertex_count, uint32_t cache_size)
+	{
+		const size_t triangle_count = indices.size() / 3;
+		if (triangle_count == 0)
+		{
+			return 0.0f;
+		}
+		// A vertex is in the FIFO if fewer than cache_size misses have
+		// happened since it was last put in.
+		std::vector<uint32_t> insertion_time(vertex_count, 0);
+		uint32_t time = cache_size + 1;
+		uint32_t misses = 0;
+		for (uint32_t v : indices)
+		{
+			if (time - insertion_time[v] > cache_size)
+			{
+				insertion_time[v] = time++;
+				misses++;
+			}
+		}
+		return float(misses) / float(triangle_count);
+	}
+
+	namespace
+	{
+		///////////////////////////////////////////////////////////////////////
+		// Scoring of Forsyth's algorithm, with the constants of the article
+		///////////////////////////////////////////////////////////////////////
+		const int FORSYTH_CACHE_SIZE = 32;
+		const float CACHE_DECAY_POWER = 1.5f;
+		const float LAST_TRIANGLE_SCORE = 0.75f;
+		const float VALENCE_BOOST_SCALE = 2.0f;
+		const float VALENCE_BOOST_POWER = 0.5f;
+
+		float vertexScore(int cache_position, uint32_t live_triangles)
+		{
+			if (live_triangles == 0)
+			{
+				// No triangles left to draw with this vertex
+				return -1.0f;
+			}
+			float score = 0.0f;
+			if (cache_position >= 0 && cache_position < 3)
+			{
+				// Used by the last triangle. A fixed score, so that the
+				// algorithm does not prefer to reuse the same edges.
+				score = LAST_TRIANGLE_SCORE;
+			}
+			else if (cache_position >= 3)
+			{
+				const float scaler = 1.0f / (FORSYTH_CACHE_SIZE - 3);
+				score = std::pow(1.0f - (cache_position - 3) * scaler, CACHE_DECAY_POWER);
+			}
+			// Boost vertices with few triangles left, so that lone
+			// triangles are not left behind.
+			score += VALENCE_BOOST_SCALE * std::pow(float(live_triangles), -VALENCE_BOOST_POWER);
+			return score;
+		}
+	} // namespace
+
+	void optimizeVertexCache(std::vector<uint32_t>& indices, size_t vertex_count)
+	{
+		const size_t triangle_count = indices.size() / 3;
+		if (triangle_count == 0)
+		{
+			return;
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// Triangles adjacent to each vertex. The first live_triangles[v]
+		// entries of a vertex's range are the triangles not yet emitted.
+		///////////////////////////////////////////////////////////////////////
+		std::vector<uint32_t> live_triangles(vertex_count, 0);
+		for (uint32_t v : indices)
+		{
+			live_triangles[v]++;
+		}
+		std::vector<uint32_t> adjacency_offset(vertex_count + 1, 0);
+		for (size_t v = 0; v < vertex_count; v++)
+		{
+			adjacency_offset[v + 1] = adjacency_offset[v] + live_triangles[v];
+		}
+		std::vector<uint32_t> adjacency(indices.size());
+		std::vector<uint32_t> fill(adjacency_offset.begin(), adjacency_offset.end() - 1);
+		for (size_t i = 0; i < indices.size(); i++)
+		{
+			adjacency[fill[indices[i]]++] = uint32_t(i / 3);
+		}
+
+		std::vector<int> cache_position(vertex_count, -1);
+		std::vector<float> vertex_score(vertex_count);
+		for (size_t v = 0; v < vertex_count; v++)
+		{
+			vertex_score[v] = vertexScore(-1, live_triangles[v]);
+		}
+		std::vector<float> triangle_score(triangle_count);
+		std::vector<bool> emitted(triangle_count, false);
+		int best_triangle = -1;
+		float best_score = -1.0f;
+		for (size_t t = 0; t < triangle_count; t++)
+		{
+			triangle_score[t] = vertex_score[indices[t * 3 + 0]] + vertex_score[indices[t * 3 + 1]]
+				+ vertex_score[indices[t * 3 + 2]];
+			if (triangle_score[t] > best_score)
+			{
+				best_score = triangle_score[t];
+				best_triangle = int(t);
+			}
+		}
+
+		std::vector<uint32_t> output;
+		output.reserve(indices.size());
+		std::vector<uint32_t> cache;
+		std::vector<uint32_t> new_cache;
+		size_t next_unemitted = 0;
+		while (output.size() < indices.size())
+		{
+			if (best_triangle < 0)
+			{
+				// Nothing adjacent to the cache is left, continue anywhere
+				while (emitted[next_unemitted])
+				{
+					next_unemitted++;
+				}
+				best_triangle = int(next_unemitted);
+			}
+
+			///////////////////////////////////////////////////////////////////
+			// Emit the triangle and remove it from its vertices' lists
+			///////////////////////////////////////////////////////////////////
+			const uint32_t* triangle = &indices[best_triangle * 3];
+			emitted[best_triangle] = true;
+			new_cache.clear();
+			for (int k = 0; k < 3; k++)
+			{
+				const uint32_t v = triangle[k];
+				output.push_back(v);
+				new_cache.push_back(v);
+				uint32_t* begin = &adjacency[adjacency_offset[v]];
+				uint32_t* end = begin + live_triangles[v];
+				std::swap(*std::find(begin, end, uint32_t(best_triangle)), *(end - 1));
+				live_triangles[v]--;
+			}
+
+			///////////////////////////////////////////////////////////////////
+			// The triangle's vertices go first in the cache, followed by the
+			// rest of the old cache.
+			///////////////////////////////////////////////////////////////////
+			for (uint32_t v : cache)
+			{
+				if (v != triangle[0] && v != triangle[1] && v != triangle[2])
+				{
+					new_cache.push_back(v);
+				}
+			}
+			for (size_t i = 0; i < new_cache.size(); i++)
+			{
+				const uint32_t v = new_cache[i];
+				cache_position[v] = i < FORSYTH_CACHE_SIZE ? int(i) : -1;
+				vertex_score[v] = vertexScore(cache_position[v], live_triangles[v]);
+			}
+
+			///////////////////////////////////////////////////////////////////
+			// Rescore the triangles of all vertices that changed, and pick the
+			// best one for the next iteration.
+			///////////////////////////////////////////////////////////////////
+			best_triangle = -1;
+			best_score = -1.0f;
+			for (uint32_t v : new_cache)
+			{
+				for (uint32_t i = 0; i < live_triangles[v]; i++)
+				{
+					const uint32_t t = adjacency[adjacency_offset[v] + i];
+					triangle_score[t] = vertex_score[indices[t * 3 + 0]] + vertex_score[indices[t * 3 + 1]]
+						+ vertex_score[indices[t * 3 + 2]];
+					if (triangle_score[t] > best_score)
+					{
+						best_score = triangle_score[t];
+						best_triangle = int(t);
+					}
+				}
+			}
+			if (new_cache.size() > FORSYTH_CACHE_SIZE)
+			{
+				new_cache.resize(FORSYTH_CACHE_SIZE);
+			}
+			std::swap(cache, new_cache);
+		}
+		indices.swap(output);
+	}
+
+	void optimizeOverdraw(std::vector<uint32_t>& indices, const glm::vec3* positions, size_t vertex_count,
+		float threshold)
+	{
+		const size_t triangle_count = indices.size() / 3;
+		if (triangle_count < 2)
+		{
+			return;
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// Split the triangle list into clusters where the cache is flushed,
+		// i.e. at triangles whose three vertices all miss. Reordering whole
+		// clusters keeps most of the cache efficiency.
+		///////////////////////////////////////////////////////////////////////
+		std::vector<uint32_t> cluster_start;
+		std::vector<uint32_t> insertion_time(vertex_count, 0);
+		uint32_t time = ACMR_CACHE_SIZE + 1;
+		for (uint32_t t = 0; t < triangle_count; t++)
+		{
+			int misses = 0;
+			for (int k = 0; k < 3; k++)
+			{
+				const uint32_t v = indices[t * 3 + k];
+				if (time - insertion_time[v] > ACMR_CACHE_SIZE)
+				{
+					insertion_time[v] = time++;
+					misses++;
+				}
+			}
+			if (t == 0 || misses == 3)
+			{
+				cluster_start.push_back(t);
+			}
+		}
+		if (cluster_start.size() < 2)
+		{
+			return;
+		}
+		cluster_start.push_back(uint32_t(triangle_count));
+
+		///////////////////////////////////////////////////////////////////////
+		// Sort the clusters by how much they face away from the center of
+		// the mesh.
+		///////////////////////////////////////////////////////////////////////
+		const size_t cluster_count = cluster_start.size() - 1;
+		std::vector<glm::vec3> cluster_centroid(cluster_count, glm::vec3(0.0f));
+		std::vector<glm::vec3> cluster_normal(cluster_count, glm::vec3(0.0f));
+		glm::vec3 mesh_centroid(0.0f);
+		float mesh_area = 0.0f;
+		for (size_t c = 0; c < cluster_count; c++)
+		{
+			float cluster_area = 0.0f;
+			for (uint32_t t = cluster_start[c]; t < cluster_start[c + 1]; t++)
+			{
+				const glm::vec3& p0 = positions[indices[t * 3 + 0]];
+				const glm::vec3& p1 = positions[indices[t * 3 + 1]];
+				const glm::vec3& p2 = positions[indices[t * 3 + 2]];
+				const glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+				const float area = glm::length(n);
+				cluster_centroid[c] += area * (p0 + p1 + p2) / 3.0f;
+				cluster_normal[c] += n;
+				cluster_area += area;
+			}
+			mesh_centroid += cluster_centroid[c];
+			mesh_area += cluster_area;
+			if (cluster_area > 0.0f)
+			{
+				cluster_centroid[c] /= cluster_area;
+			}
+		}
+		if (mesh_area > 0.0f)
+		{
+			mesh_centroid /= mesh_area;
+		}
+		std::vector<float> cluster_key(cluster_count);
+		std::vector<uint32_t> cluster_order(cluster_count);
+		for (size_t c = 0; c < cluster_count; c++)
+		{
+			const float length = glm::length(cluster_normal[c]);
+			cluster_key[c] =
+				length > 0.0f ? glm::dot(cluster_centroid[c] - mesh_centroid, cluster_normal[c] / length) : 0.0f;
+			cluster_order[c] = uint32_t(c);
+		}
+		std::stable_sort(cluster_order.begin(), cluster_order.end(),
+			[&](uint32_t a, uint32_t b) { return cluster_key[a] > cluster_key[b]; });
+
+		std::vector<uint32_t> reordered;
+		reordered.reserve(indices.size());
+		for (uint32_t c : cluster_order)
+		{
+			reordered.insert(reordered.end(), indices.begin() + cluster_start[c] * 3,
+				indices.begin() + cluster_start[c + 1] * 3);
+		}
+		if (computeACMR(reordered, vertex_count) <= threshold * computeACMR(indices, vertex_count))
+		{
+			indices.swap(reordered);
+		}
+	}
+
+	std::vector<uint32_t> optimizeVertexFetchRemap(const std::vector<uint32_t>& indices, size_t vertex_count)
+	{
+		const uint32_t unused = UINT32_MAX;
+		std::vector<uint32_t> remap(vertex_count, unused);
+		uint32_t next = 0;
+		for (uint32_t v : indices)
+		{
+			if (remap[v] == unused)
+			{
+				remap[v] = next++;
+			}
+		}
+		for (auto& r : remap)
+		{
+			if (r == unused)
+			{
+				r = next++;
+			}
+		}
+		return remap;
+	}
+
+	namespace
+	{
+		///////////////////////////////////////////////////////////////////////
+		// Symmetric 4x4 matrix summing squared distances to planes, and the
+		// total weight (area) of the planes.
+		///////////////////////////////////////////////////////////////////////
+		struct Quadric
+		{
+			double a00 = 0, a01 = 0, a02 = 0, a11 = 0, a12 = 0, a22 = 0;
+			double b0 = 0, b1 = 0, b2 = 0, c = 0;
+			double weight = 0;
+
+			void addPlane(const glm::dvec3& n, double d, double w)
+			{
+				a00 += w * n.x * n.x;
+				a01 += w * n.x * n.y;
+				a02 += w * n.x * n.z;
+				a11 += w * n.y * n.y;
+				a12 += w * n.y * n.z;
+				a22 += w * n.z * n.z;
+				b0 += w * n.x * d;
+				b1 += w * n.y * d;
+				b2 += w * n.z * d;
+				c += w * d * d;
+				weight += w;
+			}
+
+			void add(const Quadric& q)
+			{
+				a00 += q.a00;
+				a01 += q.a01;
+				a02 += q.a02;
+				a11 += q.a11;
+				a12 += q.a12;
+				a22 += q.a22;
+				b0 += q.b0;
+				b1 += q.b1;
+				b2 += q.b2;
+				c += q.c;
+				weight += q.weight;
+			}
+
+			// Mean squared distance from p to the planes
+			double error(const glm::vec3& p) const
+			{
+				const double x = p.x, y = p.y, z = p.z;
+				double e = a00 * x * x + a11 * y * y + a22 * z * z + 2.0 * (a01 * x * y + a02 * x * z + a12 * y * z)
+					+ 2.0 * (b0 * x + b1 * y + b2 * z) + c;
+				return weight > 0.0 ? std::fabs(e) / weight : 0.0;
+			}
+		};
+
+		struct Collapse
+		{
+			uint32_t from;
+			uint32_t to;
+			double error;
+		};
+
+		struct PositionKey
+		{
+			glm::vec3 p;
+			bool operator==(const PositionKey& other) const
+			{
+				return memcmp(&p, &other.p, sizeof(glm::vec3)) == 0;
+			}
+		};
+
+		struct PositionKeyHash
+		{
+			size_t operator()(const PositionKey& key) const
+			{
+				uint32_t h[3];
+				memcpy(h, &key.p, sizeof(h));
+				return size_t(h[0] * 73856093u ^ h[1] * 19349663u ^ h[2] * 83492791u);
+			}
+		};
+
+		glm::vec3 triangleNormal(const glm::vec3& p0, const glm::vec3& p1, const glm::vec3& p2)
+		{
+			return glm::cross(p1 - p0, p2 - p0);
+		}
+	} // namespace
+
+	std::vector<uint32_t> simplifyMesh(const std::vector<uint32_t>& indices, const glm::vec3* positions,
+		size_t vertex_count, size_t target_index_count, float max_error, float* result_error)
+	{
+		std::vector<uint32_t> result = indices;
+		double largest_error = 0.0;
+
+		///////////////////////////////////////////////////////////////////////
+		// Find the vertices that share a position. Seam vertices can not be
+		// moved without tearing the surface open.
+		///////////////////////////////////////////////////////////////////////
+		std::vector<uint32_t> position_id(vertex_count);
+		std::vector<uint32_t> vertices_at_position;
+		{
+			std::unordered_map<PositionKey, uint32_t, PositionKeyHash> ids;
+			for (size_t v = 0; v < vertex_count; v++)
+			{
+				auto it = ids.insert({ { positions[v] }, uint32_t(vertices_at_position.size()) });
+				if (it.second)
+				{
+					vertices_at_position.push_back(0);
+				}
+				position_id[v] = it.first->second;
+				vertices_at_position[it.first->second]++;
+			}
+		}
+		std::vector<bool> locked(vertex_count, false);
+		for (size_t v = 0; v < vertex_count; v++)
+		{
+			locked[v] = vertices_at_position[position_id[v]] > 1;
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// Lock the vertices of border edges, i.e. edges (between positions)
+		// that only one triangle uses.
+		///////////////////////////////////////////////////////////////////////
+		{
+			std::vector<uint64_t> edges;
+			edges.reserve(result.size());
+			for (size_t i = 0; i < result.size(); i += 3)
+			{
+				for (int k = 0; k < 3; k++)
+				{
+					uint32_t a = result[i + k], b = result[i + (k + 1) % 3];
+					uint32_t pa = position_id[a], pb = position_id[b];
+					uint64_t key = pa < pb ? (uint64_t(pa) << 32 | pb) : (uint64_t(pb) << 32 | pa);
+					edges.push_back(key);
+				}
+			}
+			std::sort(edges.begin(), edges.end());
+			std::vector<bool> border(vertices_at_position.size(), false);
+			for (size_t i = 0; i < edges.size();)
+			{
+				size_t j = i;
+				while (j < edges.size() && edges[j] == edges[i])
+				{
+					j++;
+				}
+				if (j - i == 1)
+				{
+					border[uint32_t(edges[i] >> 32)] = true;
+					border[uint32_t(edges[i] & 0xFFFFFFFF)] = true;
+				}
+				i = j;
+			}
+			for (size_t v = 0; v < vertex_count; v++)
+			{
+				locked[v] = locked[v] || border[position_id[v]];
+			}
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// One quadric per position, from the planes of its triangles
+		///////////////////////////////////////////////////////////////////////
+		std::vector<Quadric> quadrics(vertices_at_position.size());
+		for (size_t i = 0; i < result.size(); i += 3)
+		{
+			const glm::vec3& p0 = positions[result[i + 0]];
+			const glm::vec3 n = triangleNormal(p0, positions[result[i + 1]], positions[result[i + 2]]);
+			const double area = 0.5 * glm::length(glm::dvec3(n));
+			if (area == 0.0)
+			{
+				continue;
+			}
+			const glm::dvec3 unit_n = glm::normalize(glm::dvec3(n));
+			const double d = -glm::dot(unit_n, glm::dvec3(p0));
+			for (int k = 0; k < 3; k++)
+			{
+				quadrics[position_id[result[i + k]]].addPlane(unit_n, d, area);
+			}
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// Collapse edges in passes. Each pass sorts all possible collapses
+		// and applies the cheapest ones that do not touch the same
+		// triangles.
+		///////////////////////////////////////////////////////////////////////
+		const double max_squared_error = double(max_error) * double(max_error);
+		std::vector<Collapse> collapses;
+		std::vector<uint32_t> collapse_target(vertex_count);
+		std::vector<bool> touched(vertex_count);
+		std::vector<uint32_t> adjacency_offset(vertex_count + 1);
+		std::vector<uint32_t> adjacency;
+		while (result.size() > target_index_count)
+		{
+			// Triangles around each vertex
+			std::fill(adjacency_offset.begin(), adjacency_offset.end(), 0);
+			for (uint32_t v : result)
+			{
+				adjacency_offset[v + 1]++;
+			}
+			for (size_t v = 0; v < vertex_count; v++)
+			{
+				adjacency_offset[v + 1] += adjacency_offset[v];
+			}
+			adjacency.resize(result.size());
+			std::vector<uint32_t> fill(adjacency_offset.begin(), adjacency_offset.end() - 1);
+			for (size_t i = 0; i < result.size(); i++)
+			{
+				adjacency[fill[result[i]]++] = uint32_t(i / 3);
+			}
+
+			collapses.clear();
+			for (size_t i = 0; i < result.size(); i += 3)
+			{
+				for (int k = 0; k < 3; k++)
+				{
+					uint32_t a = result[i + k], b = result[i + (k + 1) % 3];
+					for (int direction = 0; direction < 2; direction++)
+					{
+						if (!locked[a])
+						{
+							Quadric q = quadrics[position_id[a]];
+							q.add(quadrics[position_id[b]]);
+							collapses.push_back({ a, b, q.error(positions[b]) });
+						}
+						std::swap(a, b);
+					}
+				}
+			}
+			if (collapses.empty())
+			{
+				break;
+			}
+			std::sort(collapses.begin(), collapses.end(),
+				[](const Collapse& a, const Collapse& b) { return a.error < b.error; });
+
+			// Each collapse removes about two triangles
+			const size_t triangles_to_remove = (result.size() - target_index_count) / 3;
+			size_t removed = 0;
+			std::fill(touched.begin(), touched.end(), false);
+			for (size_t v = 0; v < vertex_count; v++)
+			{
+				collapse_target[v] = uint32_t(v);
+			}
+			for (const Collapse& c : collapses)
+			{
+				if (removed >= triangles_to_remove || c.error > max_squared_error)
+				{
+					break;
+				}
+				if (touched[c.from] || touched[c.to])
+				{
+					continue;
+				}
+
+				// Do not let any remaining triangle around `from` flip over
+				bool flips = false;
+				for (uint32_t j = adjacency_offset[c.from]; j < adjacency_offset[c.from + 1] && !flips; j++)
+				{
+					const uint32_t* t = &result[adjacency[j] * 3];
+					if (t[0] == c.to || t[1] == c.to || t[2] == c.to)
+					{
+						continue;
+					}
+					glm::vec3 p[3], q[3];
+					for (int k = 0; k < 3; k++)
+					{
+						p[k] = positions[t[k]];
+						q[k] = t[k] == c.from ? positions[c.to] : p[k];
+					}
+					flips = glm::dot(triangleNormal(p[0], p[1], p[2]), triangleNormal(q[0], q[1], q[2])) <= 0.0f;
+				}
+				if (flips)
+				{
+					continue;
+				}
+
+				collapse_target[c.from] = c.to;
+				quadrics[position_id[c.to]].add(quadrics[position_id[c.from]]);
+				largest_error = std::max(largest_error, c.error);
+				for (uint32_t j = adjacency_offset[c.from]; j < adjacency_offset[c.from + 1]; j++)
+				{
+					const uint32_t* t = &result[adjacency[j] * 3];
+					touched[t[0]] = touched[t[1]] = touched[t[2]] = true;
+				}
+				removed += 2;
+			}
+			if (removed == 0)
+			{
+				break;
+			}
+
+			// Apply the collapses and drop the triangles that degenerated
+			size_t write = 0;
+			for (size_t i = 0; i < result.size(); i += 3)
+			{
+				uint32_t a = collapse_target[result[i + 0]];
+				uint32_t b = collapse_target[result[i + 1]];
+				uint32_t c = collapse_target[result[i + 2]];
+				if (a != b && b != c && c != a)
+				{
+					result[write++] = a;
+					result[write++] = b;
+					result[write++] = c;
+				}
+			}
+			result.resize(write);
+		}
+
+		if (result_error != nullptr)
+		{
+			*result_error = float(std::sqrt(largest_error));
+		}
+		return result;
+	}
+} // namespace labhelper
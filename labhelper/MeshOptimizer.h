@@ -0,0 +1,57 @@
+#pragma once
+#include <vector>
+#include <glm/glm.hpp>
+
+namespace labhelper
+{
+	///////////////////////////////////////////////////////////////////////////
+	/// Index buffer optimizations. All functions work on a triangle list
+	/// whose indices refer to `vertex_count` vertices numbered from zero.
+	///////////////////////////////////////////////////////////////////////////
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Average cache miss ratio (transformed vertices per triangle) of a
+	/// FIFO post-transform cache with `cache_size` entries. 3.0 is the worst
+	/// possible, about 0.5 the best for large regular meshes.
+	///////////////////////////////////////////////////////////////////////////
+	const uint32_t ACMR_CACHE_SIZE = 16;
+	float computeACMR(const std::vector<uint32_t>& indices, size_t vertex_count,
+		uint32_t cache_size = ACMR_CACHE_SIZE);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Reorders the triangles for the post-transform vertex cache, using
+	/// Tom Forsyth's "Linear-Speed Vertex Cache Optimisation".
+	///////////////////////////////////////////////////////////////////////////
+	void optimizeVertexCache(std::vector<uint32_t>& indices, size_t vertex_count);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Reorders clusters of a cache optimized triangle list so that outward
+	/// facing clusters are drawn first, which reduces overdraw from most
+	/// viewpoints (Sander et al. 2007). The new order is only kept if its
+	/// ACMR is at most `threshold` times the ACMR of the input.
+	///////////////////////////////////////////////////////////////////////////
+	void optimizeOverdraw(std::vector<uint32_t>& indices, const glm::vec3* positions, size_t vertex_count,
+		float threshold = 1.05f);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Returns a remap table that numbers the vertices in the order they are
+	/// first used by `indices`, for better locality of vertex fetches.
+	/// Unused vertices are put last.
+	///////////////////////////////////////////////////////////////////////////
+	std::vector<uint32_t> optimizeVertexFetchRemap(const std::vector<uint32_t>& indices, size_t vertex_count);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Simplifies a triangle list with edge collapses ordered by the
+	/// quadric error metric (Garland & Heckbert 1997), until it has at most
+	/// `target_index_count` indices or no collapse is cheaper than
+	/// `max_error`. Vertices are collapsed onto their neighbours, so the
+	/// result uses the same vertex buffer as the input. Vertices on
+	/// attribute seams (several vertices at one position) and on open
+	/// borders are never moved.
+	///
+	/// `result_error` gets the largest distance (in the units of the
+	/// positions) between the simplified surface and a collapsed vertex.
+	///////////////////////////////////////////////////////////////////////////
+	std::vector<uint32_t> simplifyMesh(const std::vector<uint32_t>& indices, const glm::vec3* positions,
+		size_t vertex_count, size_t target_index_count, float max_error, float* result_error);
+} // namespace labhelper
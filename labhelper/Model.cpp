@@ -1,12 +1,20 @@
 #include "Model.h"
 #include "labhelper.h"
+#include "MeshOptimizer.h"
+#include "Culling.h"
 #include <iostream>
 #define TINYOBJLOADER_IMPLEMENTATION // define this in only *one* .cc
 #include <tiny_obj_loader.h>
 //#include <experimental/tinyobj_loader_opt.h>
 #include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
 #include <sstream>
 #include <iomanip>
+#include <map>
+#include <unordered_map>
 #include <GL/glew.h>
 #include <stb_image.h>
 
@@ -116,9 +124,129 @@ namespace labhelper
 		glDeleteBuffers(1, &m_positions_bo);
 		glDeleteBuffers(1, &m_normals_bo);
 		glDeleteBuffers(1, &m_texture_coordinates_bo);
+		glDeleteBuffers(1, &m_vertices_bo);
+		glDeleteBuffers(1, &m_indices_bo);
+		glDeleteVertexArrays(1, &m_vaob);
+		if (m_materials_ubo)
+			glDeleteBuffers(1, &m_materials_ubo);
 	}
 
-	Model* loadModelFromOBJ(std::string path)
+	///////////////////////////////////////////////////////////////////////////
+	// Quantized positions are offset + scale * [0,1]^3 within the mesh AABB.
+	// A flat mesh gets a non-zero scale to avoid dividing by zero.
+	///////////////////////////////////////////////////////////////////////////
+	static glm::vec3 quantizationScale(const Mesh& mesh)
+	{
+		return glm::max(mesh.m_aabb_max - mesh.m_aabb_min, glm::vec3(1e-6f));
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Turn the vertex stream of each mesh into an indexed triangle list by
+	// welding identical vertices, and order the triangles for the vertex
+	// cache and for low overdraw.
+	///////////////////////////////////////////////////////////////////////////
+	namespace
+	{
+		struct WeldKey
+		{
+			glm::vec3 position;
+			glm::vec3 normal;
+			glm::vec2 texture_coordinate;
+			bool operator==(const WeldKey& other) const
+			{
+				return memcmp(this, &other, sizeof(WeldKey)) == 0;
+			}
+		};
+
+		struct WeldKeyHash
+		{
+			size_t operator()(const WeldKey& key) const
+			{
+				// FNV-1a
+				const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&key);
+				uint64_t hash = 14695981039346656037ull;
+				for (size_t i = 0; i < sizeof(WeldKey); i++)
+				{
+					hash = (hash ^ bytes[i]) * 1099511628211ull;
+				}
+				return size_t(hash);
+			}
+		};
+	} // namespace
+
+	static void indexMeshes(Model* model)
+	{
+		std::vector<glm::vec3> positions;
+		std::vector<glm::vec3> normals;
+		std::vector<glm::vec2> texture_coordinates;
+		positions.reserve(model->m_positions.size());
+		normals.reserve(model->m_positions.size());
+		texture_coordinates.reserve(model->m_positions.size());
+		model->m_indices.clear();
+		model->m_indices.reserve(model->m_positions.size());
+
+		float acmr_indexed = 0.0f, acmr_optimized = 0.0f;
+		for (auto& mesh : model->m_meshes)
+		{
+			std::unordered_map<WeldKey, uint32_t, WeldKeyHash> welded;
+			std::vector<WeldKey> vertices;
+			std::vector<uint32_t> indices(mesh.m_number_of_vertices);
+			for (uint32_t i = 0; i < mesh.m_number_of_vertices; i++)
+			{
+				const uint32_t v = mesh.m_start_index + i;
+				WeldKey key = { model->m_positions[v], model->m_normals[v], model->m_texture_coordinates[v] };
+				auto it = welded.insert({ key, uint32_t(vertices.size()) });
+				if (it.second)
+				{
+					vertices.push_back(key);
+				}
+				indices[i] = it.first->second;
+			}
+
+			std::vector<glm::vec3> mesh_positions(vertices.size());
+			for (size_t i = 0; i < vertices.size(); i++)
+			{
+				mesh_positions[i] = vertices[i].position;
+			}
+			const float triangles = float(indices.size() / 3);
+			acmr_indexed += triangles * computeACMR(indices, vertices.size());
+			optimizeVertexCache(indices, vertices.size());
+			optimizeOverdraw(indices, mesh_positions.data(), vertices.size());
+			acmr_optimized += triangles * computeACMR(indices, vertices.size());
+
+			// Store the vertices in the order they are first used
+			const std::vector<uint32_t> remap = optimizeVertexFetchRemap(indices, vertices.size());
+			mesh.m_start_index = uint32_t(positions.size());
+			mesh.m_number_of_vertices = uint32_t(vertices.size());
+			mesh.m_first_index = uint32_t(model->m_indices.size());
+			mesh.m_number_of_indices = uint32_t(indices.size());
+			mesh.m_lods.assign(1, { mesh.m_first_index, mesh.m_number_of_indices, 0.0f });
+			positions.resize(positions.size() + vertices.size());
+			normals.resize(normals.size() + vertices.size());
+			texture_coordinates.resize(texture_coordinates.size() + vertices.size());
+			for (size_t i = 0; i < vertices.size(); i++)
+			{
+				positions[mesh.m_start_index + remap[i]] = vertices[i].position;
+				normals[mesh.m_start_index + remap[i]] = vertices[i].normal;
+				texture_coordinates[mesh.m_start_index + remap[i]] = vertices[i].texture_coordinate;
+			}
+			for (uint32_t index : indices)
+			{
+				model->m_indices.push_back(mesh.m_start_index + remap[index]);
+			}
+		}
+
+		const float total_triangles = float(model->m_indices.size() / 3);
+		std::cout << "welded " << model->m_positions.size() << " vertices into " << positions.size()
+			<< ", ACMR " << std::fixed << std::setprecision(3) << 3.0f << " unindexed, "
+			<< acmr_indexed / total_triangles << " indexed, " << acmr_optimized / total_triangles
+			<< " optimized..." << std::defaultfloat << std::flush;
+		model->m_positions.swap(positions);
+		model->m_normals.swap(normals);
+		model->m_texture_coordinates.swap(texture_coordinates);
+	}
+
+	Model* loadModelFromOBJ(std::string path, VertexFormat format)
 	{
 		std::string filename, extension, directory;
 
@@ -341,37 +469,202 @@ namespace labhelper
 		std::sort(model->m_meshes.begin(), model->m_meshes.end(),
 			[](const Mesh& a, const Mesh& b) { return a.m_name < b.m_name; });
 
+		indexMeshes(model);
+
+		for (auto& mesh : model->m_meshes)
+		{
+			mesh.m_aabb_min = glm::vec3(FLT_MAX);
+			mesh.m_aabb_max = glm::vec3(-FLT_MAX);
+			for (uint32_t i = mesh.m_start_index; i < mesh.m_start_index + mesh.m_number_of_vertices; i++)
+			{
+				mesh.m_aabb_min = glm::min(mesh.m_aabb_min, model->m_positions[i]);
+				mesh.m_aabb_max = glm::max(mesh.m_aabb_max, model->m_positions[i]);
+			}
+			const glm::vec3 center = 0.5f * (mesh.m_aabb_min + mesh.m_aabb_max);
+			float radius_squared = 0.0f;
+			for (uint32_t i = mesh.m_start_index; i < mesh.m_start_index + mesh.m_number_of_vertices; i++)
+			{
+				glm::vec3 d = model->m_positions[i] - center;
+				radius_squared = std::max(radius_squared, glm::dot(d, d));
+			}
+			mesh.m_bounding_sphere = glm::vec4(center, std::sqrt(radius_squared));
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// The meshes are kept sorted by name (for the GUI), but we draw them
+		// grouped by material so that consecutive draws can share state.
+		///////////////////////////////////////////////////////////////////////
+		model->m_draw_order.resize(model->m_meshes.size());
+		for (uint32_t i = 0; i < model->m_meshes.size(); i++)
+		{
+			model->m_draw_order[i] = i;
+		}
+		std::stable_sort(model->m_draw_order.begin(), model->m_draw_order.end(),
+			[model](uint32_t a, uint32_t b) {
+				return model->m_meshes[a].m_material_idx < model->m_meshes[b].m_material_idx;
+			});
+
+		///////////////////////////////////////////////////////////////////////
+		// Pack the vertices, if asked to
+		///////////////////////////////////////////////////////////////////////
+		model->m_vertex_format = format;
+		if (format == VertexFormat::Packed)
+		{
+			model->m_packed_vertices.resize(number_of_vertices);
+			for (size_t i = 0; i < number_of_vertices; i++)
+			{
+				PackedVertex& v = model->m_packed_vertices[i];
+				v.position = model->m_positions[i];
+				v.normal = packNormal(model->m_normals[i]);
+				v.texture_coordinate = glm::packHalf2x16(model->m_texture_coordinates[i]);
+			}
+		}
+		else if (format == VertexFormat::PackedQuantized)
+		{
+			model->m_quantized_vertices.resize(number_of_vertices);
+			for (const auto& mesh : model->m_meshes)
+			{
+				glm::vec3 scale = quantizationScale(mesh);
+				for (uint32_t i = mesh.m_start_index; i < mesh.m_start_index + mesh.m_number_of_vertices; i++)
+				{
+					QuantizedVertex& v = model->m_quantized_vertices[i];
+					glm::vec3 p = glm::round((model->m_positions[i] - mesh.m_aabb_min) / scale * 65535.0f);
+					p = glm::clamp(p, glm::vec3(0.0f), glm::vec3(65535.0f));
+					v.position[0] = uint16_t(p.x);
+					v.position[1] = uint16_t(p.y);
+					v.position[2] = uint16_t(p.z);
+					v.pad = 0;
+					v.normal = packNormal(model->m_normals[i]);
+					v.texture_coordinate = glm::packHalf2x16(model->m_texture_coordinates[i]);
+				}
+			}
+		}
+		if (format != VertexFormat::Float)
+		{
+			std::vector<glm::vec3>().swap(model->m_normals);
+			std::vector<glm::vec2>().swap(model->m_texture_coordinates);
+		}
+
 		///////////////////////////////////////////////////////////////////////
 		// Upload to GPU
 		///////////////////////////////////////////////////////////////////////
 		glGenVertexArrays(1, &model->m_vaob);
 		glBindVertexArray(model->m_vaob);
-		glGenBuffers(1, &model->m_positions_bo);
-		glBindBuffer(GL_ARRAY_BUFFER, model->m_positions_bo);
-		glBufferData(GL_ARRAY_BUFFER, model->m_positions.size() * sizeof(glm::vec3), &model->m_positions[0].x,
+		glGenBuffers(1, &model->m_indices_bo);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, model->m_indices_bo);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, model->m_indices.size() * sizeof(uint32_t), model->m_indices.data(),
 			GL_STATIC_DRAW);
-		glVertexAttribPointer(0, 3, GL_FLOAT, false, 0, 0);
-		glEnableVertexAttribArray(0);
-		glGenBuffers(1, &model->m_normals_bo);
-		glBindBuffer(GL_ARRAY_BUFFER, model->m_normals_bo);
-		glBufferData(GL_ARRAY_BUFFER, model->m_normals.size() * sizeof(glm::vec3), &model->m_normals[0].x,
-			GL_STATIC_DRAW);
-		glVertexAttribPointer(1, 3, GL_FLOAT, false, 0, 0);
-		glEnableVertexAttribArray(1);
-		glGenBuffers(1, &model->m_texture_coordinates_bo);
-		glBindBuffer(GL_ARRAY_BUFFER, model->m_texture_coordinates_bo);
-		glBufferData(GL_ARRAY_BUFFER, model->m_texture_coordinates.size() * sizeof(glm::vec2),
-			&model->m_texture_coordinates[0].x, GL_STATIC_DRAW);
-		glVertexAttribPointer(2, 2, GL_FLOAT, false, 0, 0);
-		glEnableVertexAttribArray(2);
+		if (format == VertexFormat::Float)
+		{
+			glGenBuffers(1, &model->m_positions_bo);
+			glBindBuffer(GL_ARRAY_BUFFER, model->m_positions_bo);
+			glBufferData(GL_ARRAY_BUFFER, model->m_positions.size() * sizeof(glm::vec3),
+				&model->m_positions[0].x, GL_STATIC_DRAW);
+			glVertexAttribPointer(0, 3, GL_FLOAT, false, 0, 0);
+			glEnableVertexAttribArray(0);
+			glGenBuffers(1, &model->m_normals_bo);
+			glBindBuffer(GL_ARRAY_BUFFER, model->m_normals_bo);
+			glBufferData(GL_ARRAY_BUFFER, model->m_normals.size() * sizeof(glm::vec3), &model->m_normals[0].x,
+				GL_STATIC_DRAW);
+			glVertexAttribPointer(1, 3, GL_FLOAT, false, 0, 0);
+			glEnableVertexAttribArray(1);
+			glGenBuffers(1, &model->m_texture_coordinates_bo);
+			glBindBuffer(GL_ARRAY_BUFFER, model->m_texture_coordinates_bo);
+			glBufferData(GL_ARRAY_BUFFER, model->m_texture_coordinates.size() * sizeof(glm::vec2),
+				&model->m_texture_coordinates[0].x, GL_STATIC_DRAW);
+			glVertexAttribPointer(2, 2, GL_FLOAT, false, 0, 0);
+			glEnableVertexAttribArray(2);
+		}
+		else if (format == VertexFormat::Packed)
+		{
+			const GLsizei stride = sizeof(PackedVertex);
+			glGenBuffers(1, &model->m_vertices_bo);
+			glBindBuffer(GL_ARRAY_BUFFER, model->m_vertices_bo);
+			glBufferData(GL_ARRAY_BUFFER, model->m_packed_vertices.size() * stride,
+				model->m_packed_vertices.data(), GL_STATIC_DRAW);
+			glVertexAttribPointer(0, 3, GL_FLOAT, false, stride, (void*)offsetof(PackedVertex, position));
+			glVertexAttribPointer(1, 2, GL_SHORT, true, stride, (void*)offsetof(PackedVertex, normal));
+			glVertexAttribPointer(2, 2, GL_HALF_FLOAT, false, stride,
+				(void*)offsetof(PackedVertex, texture_coordinate));
+			glEnableVertexAttribArray(0);
+			glEnableVertexAttribArray(1);
+			glEnableVertexAttribArray(2);
+		}
+		else
+		{
+			const GLsizei stride = sizeof(QuantizedVertex);
+			glGenBuffers(1, &model->m_vertices_bo);
+			glBindBuffer(GL_ARRAY_BUFFER, model->m_vertices_bo);
+			glBufferData(GL_ARRAY_BUFFER, model->m_quantized_vertices.size() * stride,
+				model->m_quantized_vertices.data(), GL_STATIC_DRAW);
+			glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, true, stride,
+				(void*)offsetof(QuantizedVertex, position));
+			glVertexAttribPointer(1, 2, GL_SHORT, true, stride, (void*)offsetof(QuantizedVertex, normal));
+			glVertexAttribPointer(2, 2, GL_HALF_FLOAT, false, stride,
+				(void*)offsetof(QuantizedVertex, texture_coordinate));
+			glEnableVertexAttribArray(0);
+			glEnableVertexAttribArray(1);
+			glEnableVertexAttribArray(2);
+		}
 
 		glBindVertexArray(0);
 		glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-		std::cout << "done.\n";
+		uploadMaterials(model);
+
+		std::cout << "done. Vertices use " << getCpuVertexMemory(model) / 1024 << " kB on the CPU and "
+			<< getGpuVertexMemory(model) / 1024 << " kB on the GPU.\n";
 		return model;
 	}
 
+	///////////////////////////////////////////////////////////////////////////
+	// Octahedral normal encoding, see "A Survey of Efficient Representations
+	// for Independent Unit Vectors" (Cigolle et al. 2014)
+	///////////////////////////////////////////////////////////////////////////
+	uint32_t packNormal(const glm::vec3& n)
+	{
+		glm::vec2 p = glm::vec2(n) / (abs(n.x) + abs(n.y) + abs(n.z));
+		if (n.z < 0.0f)
+		{
+			p = (1.0f - glm::abs(glm::vec2(p.y, p.x)))
+				* glm::vec2(p.x >= 0.0f ? 1.0f : -1.0f, p.y >= 0.0f ? 1.0f : -1.0f);
+		}
+		return glm::packSnorm2x16(p);
+	}
+
+	glm::vec3 unpackNormal(uint32_t packed)
+	{
+		glm::vec2 p = glm::unpackSnorm2x16(packed);
+		glm::vec3 n = glm::vec3(p, 1.0f - abs(p.x) - abs(p.y));
+		if (n.z < 0.0f)
+		{
+			n.x = (1.0f - abs(p.y)) * (p.x >= 0.0f ? 1.0f : -1.0f);
+			n.y = (1.0f - abs(p.x)) * (p.y >= 0.0f ? 1.0f : -1.0f);
+		}
+		return glm::normalize(n);
+	}
+
+	size_t getCpuVertexMemory(const Model* model)
+	{
+		return model->m_positions.size() * sizeof(glm::vec3) + model->m_normals.size() * sizeof(glm::vec3)
+			+ model->m_texture_coordinates.size() * sizeof(glm::vec2)
+			+ model->m_packed_vertices.size() * sizeof(PackedVertex)
+			+ model->m_quantized_vertices.size() * sizeof(QuantizedVertex);
+	}
+
+	size_t getGpuVertexMemory(const Model* model)
+	{
+		switch (model->m_vertex_format)
+		{
+		case VertexFormat::Packed:
+			return model->m_packed_vertices.size() * sizeof(PackedVertex);
+		case VertexFormat::PackedQuantized:
+			return model->m_quantized_vertices.size() * sizeof(QuantizedVertex);
+		default:
+			return model->m_positions.size() * (2 * sizeof(glm::vec3) + sizeof(glm::vec2));
+		}
+	}
+
 	void saveModelMaterialsToMTL(Model* model, std::string filename)
 	{
 		///////////////////////////////////////////////////////////////////////
@@ -436,7 +729,7 @@ namespace labhelper
 		}
 		obj_file << "# Exported by Chalmers Graphics Group\n";
 		obj_file << "mtllib " << filename << ".mtl\n";
-		int vertex_counter = 1;
+		uint32_t vertex_counter = 1;
 		for (auto mesh : model->m_meshes)
 		{
 			obj_file << "o " << mesh.m_name << "\n";
@@ -449,22 +742,27 @@ namespace labhelper
 			}
 			for (uint32_t i = mesh.m_start_index; i < mesh.m_start_index + mesh.m_number_of_vertices; i++)
 			{
-				obj_file << "vn " << model->m_normals[i].x << " " << model->m_normals[i].y << " "
-					<< model->m_normals[i].z << "\n";
+				glm::vec3 n = getNormal(model, i);
+				obj_file << "vn " << n.x << " " << n.y << " " << n.z << "\n";
 			}
 			for (uint32_t i = mesh.m_start_index; i < mesh.m_start_index + mesh.m_number_of_vertices; i++)
 			{
-				obj_file << "vt " << model->m_texture_coordinates[i].x << " " << model->m_texture_coordinates[i].y
-					<< "\n";
+				glm::vec2 uv = getTextureCoordinate(model, i);
+				obj_file << "vt " << uv.x << " " << uv.y << "\n";
 			}
-			int number_of_faces = mesh.m_number_of_vertices / 3;
-			for (int i = 0; i < number_of_faces; i++)
+			// OBJ indices start at 1, and we write the vertices of all meshes in
+			// the same order as in the model.
+			for (uint32_t i = mesh.m_first_index; i < mesh.m_first_index + mesh.m_number_of_indices; i += 3)
 			{
-				obj_file << "f " << vertex_counter << "/" << vertex_counter << "/" << vertex_counter << " "
-					<< vertex_counter + 1 << "/" << vertex_counter + 1 << "/" << vertex_counter + 1 << " "
-					<< vertex_counter + 2 << "/" << vertex_counter + 2 << "/" << vertex_counter + 2 << "\n";
-				vertex_counter += 3;
+				obj_file << "f";
+				for (int j = 0; j < 3; j++)
+				{
+					const uint32_t v = vertex_counter + model->m_indices[i + j] - mesh.m_start_index;
+					obj_file << " " << v << "/" << v << "/" << v;
+				}
+				obj_file << "\n";
 			}
+			vertex_counter += mesh.m_number_of_vertices;
 		}
 	}
 
@@ -477,74 +775,364 @@ namespace labhelper
 			delete model;
 	}
 
+	MaterialBlock makeMaterialBlock(const Material& material)
+	{
+		MaterialBlock block;
+		block.material_color = material.m_color;
+		block.material_metalness = material.m_metalness;
+		block.material_emission = material.m_emission;
+		block.material_fresnel = material.m_fresnel;
+		block.material_shininess = material.m_shininess;
+		block.has_color_texture = material.m_color_texture.valid ? 1 : 0;
+		block.has_emission_texture = material.m_emission_texture.valid ? 1 : 0;
+		block.pad = 0.0f;
+		return block;
+	}
+
 	///////////////////////////////////////////////////////////////////////
-	// Loop through all Meshes in the Model and render them
+	// Upload the materials to a uniform buffer, one aligned block each
 	///////////////////////////////////////////////////////////////////////
-	void render(const Model* model, const bool submitMaterials)
+	void uploadMaterials(Model* model)
+	{
+		if (model->m_materials.empty())
+		{
+			return;
+		}
+		GLint alignment = 0;
+		glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+		alignment = std::max(alignment, 1);
+		model->m_materials_ubo_stride =
+			((uint32_t(sizeof(MaterialBlock)) + alignment - 1) / alignment) * alignment;
+
+		std::vector<uint8_t> data(model->m_materials.size() * model->m_materials_ubo_stride, 0);
+		for (size_t i = 0; i < model->m_materials.size(); i++)
+		{
+			MaterialBlock block = makeMaterialBlock(model->m_materials[i]);
+			memcpy(&data[i * model->m_materials_ubo_stride], &block, sizeof(block));
+		}
+
+		if (model->m_materials_ubo == 0)
+		{
+			glGenBuffers(1, &model->m_materials_ubo);
+		}
+		glBindBuffer(GL_UNIFORM_BUFFER, model->m_materials_ubo);
+		glBufferData(GL_UNIFORM_BUFFER, data.size(), data.data(), GL_STATIC_DRAW);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	}
+
+	namespace
+	{
+		RenderStats g_render_stats;
+
+		///////////////////////////////////////////////////////////////////////
+		// Locations of the material uniforms in a program, taken from the
+		// reflection cache once per link instead of once per mesh and frame.
+		///////////////////////////////////////////////////////////////////////
+		struct ProgramLocations
+		{
+			uint32_t generation = 0;
+			GLuint material_block;
+			GLint has_color_texture;
+			GLint has_emission_texture;
+			GLint material_color;
+			GLint material_metalness;
+			GLint material_fresnel;
+			GLint material_shininess;
+			GLint material_emission;
+			// Vertex decoding of the packed vertex formats
+			GLint octahedral_normals;
+			GLint position_offset;
+			GLint position_scale;
+		};
+		std::map<GLuint, ProgramLocations> g_program_locations;
+
+		const ProgramLocations& getProgramLocations(GLuint program)
+		{
+			// Program names are reused by GL, so check that the cached
+			// locations are from the same link of the program.
+			const ShaderProgramInfo& info = getShaderProgramInfo(program);
+			ProgramLocations& l = g_program_locations[program];
+			if (l.generation == info.generation)
+			{
+				return l;
+			}
+			l.generation = info.generation;
+			auto block = info.uniform_blocks.find("MaterialBlock");
+			l.material_block = block != info.uniform_blocks.end() ? block->second : GL_INVALID_INDEX;
+			l.has_color_texture = getUniformLocation(program, "has_color_texture");
+			l.has_emission_texture = getUniformLocation(program, "has_emission_texture");
+			l.material_color = getUniformLocation(program, "material_color");
+			l.material_metalness = getUniformLocation(program, "material_metalness");
+			l.material_fresnel = getUniformLocation(program, "material_fresnel");
+			l.material_shininess = getUniformLocation(program, "material_shininess");
+			l.material_emission = getUniformLocation(program, "material_emission");
+			l.octahedral_normals = getUniformLocation(program, "octahedral_normals");
+			l.position_offset = getUniformLocation(program, "position_offset");
+			l.position_scale = getUniformLocation(program, "position_scale");
+			return l;
+		}
+	} // namespace
+
+	const RenderStats& getRenderStats()
+	{
+		return g_render_stats;
+	}
+
+	void resetRenderStats()
+	{
+		g_render_stats = RenderStats();
+	}
+
+	RenderStats& updateRenderStats()
+	{
+		return g_render_stats;
+	}
+
+	void generateLods(Model* model, uint32_t levels)
+	{
+		levels = std::min(levels, MAX_LOD_LEVELS);
+		std::cout << "Generating LODs for " << model->m_name << "..." << std::flush;
+		auto start_time = std::chrono::high_resolution_clock::now();
+		std::vector<uint32_t> lod_triangles(levels, 0);
+		std::vector<float> lod_error(levels, 0.0f);
+		// The levels are appended after the full meshes, drop those of a
+		// previous call
+		size_t full_indices = 0;
+		for (const auto& mesh : model->m_meshes)
+		{
+			const MeshLod& full = mesh.m_lods[0];
+			full_indices = std::max(full_indices, size_t(full.m_first_index) + full.m_number_of_indices);
+		}
+		model->m_indices.resize(full_indices);
+		for (auto& mesh : model->m_meshes)
+		{
+			mesh.m_lods.resize(1);
+			const MeshLod& full = mesh.m_lods[0];
+			std::vector<uint32_t> indices(model->m_indices.begin() + full.m_first_index,
+				model->m_indices.begin() + full.m_first_index + full.m_number_of_indices);
+			for (auto& index : indices)
+			{
+				index -= mesh.m_start_index;
+			}
+			lod_triangles[0] += full.m_number_of_indices / 3;
+
+			// Each level is simplified from the previous one, so errors add up
+			float error = 0.0f;
+			for (uint32_t level = 1; level < levels; level++)
+			{
+				const size_t target = (full.m_number_of_indices >> level) / 3 * 3;
+				float level_error;
+				std::vector<uint32_t> simplified = simplifyMesh(indices, &model->m_positions[mesh.m_start_index],
+					mesh.m_number_of_vertices, target, FLT_MAX, &level_error);
+				// Stop when simplification no longer pays off
+				if (simplified.size() > indices.size() * 9 / 10)
+				{
+					break;
+				}
+				error += level_error;
+				indices.swap(simplified);
+				std::vector<uint32_t> ordered = indices;
+				optimizeVertexCache(ordered, mesh.m_number_of_vertices);
+
+				MeshLod lod = { uint32_t(model->m_indices.size()), uint32_t(ordered.size()), error };
+				for (uint32_t index : ordered)
+				{
+					model->m_indices.push_back(mesh.m_start_index + index);
+				}
+				mesh.m_lods.push_back(lod);
+				lod_triangles[level] += lod.m_number_of_indices / 3;
+				lod_error[level] = std::max(lod_error[level], error);
+			}
+			for (uint32_t level = uint32_t(mesh.m_lods.size()); level < levels; level++)
+			{
+				lod_triangles[level] += mesh.m_lods.back().m_number_of_indices / 3;
+			}
+		}
+
+		// The index buffer is part of the VAO state
+		glBindVertexArray(model->m_vaob);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, model->m_indices.size() * sizeof(uint32_t), model->m_indices.data(),
+			GL_STATIC_DRAW);
+		glBindVertexArray(0);
+
+		std::chrono::duration<float, std::milli> time = std::chrono::high_resolution_clock::now() - start_time;
+		std::cout << "done in " << time.count() << " ms.\n";
+		for (uint32_t level = 0; level < levels; level++)
+		{
+			std::cout << "  LOD " << level << ": " << lod_triangles[level] << " triangles, error "
+				<< lod_error[level] << "\n";
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Pick the level of detail of a mesh from its projected error
+	///////////////////////////////////////////////////////////////////////
+	uint32_t selectLod(const Mesh& mesh, const RenderView& view)
+	{
+		const uint32_t coarsest = uint32_t(mesh.m_lods.size()) - 1;
+		if (view.force_lod >= 0)
+		{
+			return std::min(uint32_t(view.force_lod), coarsest);
+		}
+		// Model space errors are scaled by at most the largest scale of the
+		// model view matrix.
+		const glm::mat4& mv = view.model_view_matrix;
+		const float scale = std::sqrt(std::max(glm::dot(glm::vec3(mv[0]), glm::vec3(mv[0])),
+			std::max(glm::dot(glm::vec3(mv[1]), glm::vec3(mv[1])), glm::dot(glm::vec3(mv[2]), glm::vec3(mv[2])))));
+		const glm::vec3 center = glm::vec3(mesh.m_bounding_sphere);
+		const float radius = mesh.m_bounding_sphere.w * scale;
+		const float view_depth = -(mv * glm::vec4(center, 1.0f)).z;
+		// Distance to the closest point of the bounding sphere
+		const float distance = std::max(view_depth - radius, 1e-3f);
+		const float pixels_per_unit = view.projection_matrix[1][1] * 0.5f * view.viewport_height / distance;
+
+		uint32_t lod = 0;
+		while (lod < coarsest && mesh.m_lods[lod + 1].m_error * scale * pixels_per_unit <= view.max_pixel_error)
+		{
+			lod++;
+		}
+		return lod;
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Loop through all Meshes in the Model and render them, grouped by
+	// material. State that is already set by the previous mesh is not set
+	// again.
+	///////////////////////////////////////////////////////////////////////
+	static void renderMeshes(const Model* model, const RenderView* view, const bool submitMaterials)
 	{
 		GLint current_program = 0;
 		glGetIntegerv(GL_CURRENT_PROGRAM, &current_program);
+		const ProgramLocations* locations = &getProgramLocations(current_program);
+		const bool use_material_block =
+			submitMaterials && locations->material_block != GL_INVALID_INDEX && model->m_materials_ubo != 0;
+
+		// Vertex decoding, which the previous model drawn may have changed
+		const bool quantized = model->m_vertex_format == VertexFormat::PackedQuantized;
+		const bool set_quantization = quantized && locations->position_offset != -1;
+		if (locations->octahedral_normals != -1)
+		{
+			glUniform1i(locations->octahedral_normals, model->m_vertex_format != VertexFormat::Float ? 1 : 0);
+			g_render_stats.uniform_updates++;
+		}
+		if (!quantized && locations->position_offset != -1)
+		{
+			glUniform3f(locations->position_offset, 0.0f, 0.0f, 0.0f);
+			glUniform3f(locations->position_scale, 1.0f, 1.0f, 1.0f);
+			g_render_stats.uniform_updates += 2;
+		}
+
+		// Textures bound to unit 0 (color) and 5 (emission) by this call
+		GLuint bound_color_texture = 0;
+		GLuint bound_emission_texture = 0;
+		uint32_t previous_material = UINT32_MAX;
+
+		///////////////////////////////////////////////////////////////////////
+		// Culling. The frustum is extracted from the model view projection
+		// matrix, so the bounding spheres are tested in model space.
+		///////////////////////////////////////////////////////////////////////
+		std::vector<uint8_t>& visible = model->m_visible;
+		visible.assign(model->m_meshes.size(), 1);
+		glm::mat4 model_view_projection;
+		if (view != nullptr && (view->frustum_cull || view->occlusion != nullptr))
+		{
+			model_view_projection = view->projection_matrix * view->model_view_matrix;
+		}
+		// Occluders are rasterized at their coarsest level, which may stick
+		// out of the full meshes by up to its error.
+		const float occlusion_margin =
+			view != nullptr && view->occlusion != nullptr ? view->occlusion->m_max_occluder_error : 0.0f;
+		if (view != nullptr && view->frustum_cull && !model->m_meshes.empty())
+		{
+			cullSpheres(extractFrustum(model_view_projection), &model->m_meshes[0].m_bounding_sphere, sizeof(Mesh),
+				model->m_meshes.size(), visible.data());
+		}
 
 		glBindVertexArray(model->m_vaob);
-		for (auto& mesh : model->m_meshes)
+		for (uint32_t mesh_idx : model->m_draw_order)
 		{
-			if (submitMaterials)
+			const Mesh& mesh = model->m_meshes[mesh_idx];
+			if (!visible[mesh_idx])
+			{
+				g_render_stats.culled_meshes++;
+				continue;
+			}
+			if (view != nullptr && view->occlusion != nullptr
+				&& view->occlusion->isOccluded(model_view_projection, mesh.m_aabb_min - occlusion_margin,
+					mesh.m_aabb_max + occlusion_margin))
+			{
+				g_render_stats.occluded_meshes++;
+				continue;
+			}
+			if (set_quantization)
+			{
+				glm::vec3 scale = quantizationScale(mesh);
+				glUniform3fv(locations->position_offset, 1, &mesh.m_aabb_min.x);
+				glUniform3fv(locations->position_scale, 1, &scale.x);
+				g_render_stats.uniform_updates += 2;
+			}
+			if (submitMaterials && mesh.m_material_idx != previous_material)
 			{
+				previous_material = mesh.m_material_idx;
+				g_render_stats.material_changes++;
 				const Material& material = model->m_materials[mesh.m_material_idx];
 
 				bool has_color_texture = material.m_color_texture.valid;
-				bool has_metalness_texture = material.m_metalness_texture.valid;
-				bool has_fresnel_texture = material.m_fresnel_texture.valid;
-				bool has_shininess_texture = material.m_shininess_texture.valid;
 				bool has_emission_texture = material.m_emission_texture.valid;
-				if (has_color_texture)
+				// Metalness, fresnel and shininess textures are actually unused in the labs
+				if (has_color_texture && material.m_color_texture.gl_id != bound_color_texture)
 				{
+					bound_color_texture = material.m_color_texture.gl_id;
 					glActiveTexture(GL_TEXTURE0);
-					glBindTexture(GL_TEXTURE_2D, material.m_color_texture.gl_id);
+					glBindTexture(GL_TEXTURE_2D, bound_color_texture);
+					g_render_stats.texture_binds++;
 				}
-				// Actually unused in the labs
-				/*
-				if ( has_metalness_texture )
+				if (has_emission_texture && material.m_emission_texture.gl_id != bound_emission_texture)
 				{
-					glActiveTexture( GL_TEXTURE2 );
-					glBindTexture( GL_TEXTURE_2D, material.m_metalness_texture.gl_id );
-				}
-				if ( has_fresnel_texture )
-				{
-					glActiveTexture( GL_TEXTURE3 );
-					glBindTexture( GL_TEXTURE_2D, material.m_fresnel_texture.gl_id );
+					bound_emission_texture = material.m_emission_texture.gl_id;
+					glActiveTexture(GL_TEXTURE5);
+					glBindTexture(GL_TEXTURE_2D, bound_emission_texture);
+					glActiveTexture(GL_TEXTURE0);
+					g_render_stats.texture_binds++;
 				}
-				if ( has_shininess_texture )
+
+				if (use_material_block)
 				{
-					glActiveTexture( GL_TEXTURE4 );
-					glBindTexture( GL_TEXTURE_2D, material.m_shininess_texture.gl_id );
+					glBindBufferRange(GL_UNIFORM_BUFFER, MATERIAL_BLOCK_BINDING, model->m_materials_ubo,
+						mesh.m_material_idx * model->m_materials_ubo_stride, sizeof(MaterialBlock));
+					g_render_stats.buffer_binds++;
 				}
-				*/
-				if (has_emission_texture)
+				else
 				{
-					glActiveTexture(GL_TEXTURE5);
-					glBindTexture(GL_TEXTURE_2D, material.m_emission_texture.gl_id);
+					glUniform1i(locations->has_color_texture, has_color_texture ? 1 : 0);
+					glUniform1i(locations->has_emission_texture, has_emission_texture ? 1 : 0);
+					glUniform3fv(locations->material_color, 1, &material.m_color.x);
+					glUniform1f(locations->material_metalness, material.m_metalness);
+					glUniform1f(locations->material_fresnel, material.m_fresnel);
+					glUniform1f(locations->material_shininess, material.m_shininess);
+					glUniform3fv(locations->material_emission, 1, &material.m_emission.x);
+					g_render_stats.uniform_updates += 7;
 				}
-				glActiveTexture(GL_TEXTURE0);
-
-				setUniformSlow(current_program, "has_color_texture", has_color_texture);
-				setUniformSlow(current_program, "has_emission_texture", has_emission_texture);
-
-				setUniformSlow(current_program, "material_color", material.m_color);
-				setUniformSlow(current_program, "material_metalness", material.m_metalness);
-				setUniformSlow(current_program, "material_fresnel", material.m_fresnel);
-				setUniformSlow(current_program, "material_shininess", material.m_shininess);
-				setUniformSlow(current_program, "material_emission", material.m_emission);
-
-				// Actually unused in the labs
-				/*
-				setUniformSlow( current_program, "has_metalness_texture", has_metalness_texture );
-				setUniformSlow( current_program, "has_fresnel_texture", has_fresnel_texture );
-				setUniformSlow( current_program, "has_shininess_texture", has_shininess_texture );
-				*/
 			}
-			glDrawArrays(GL_TRIANGLES, mesh.m_start_index, (GLsizei)mesh.m_number_of_vertices);
+			const uint32_t lod = view != nullptr ? selectLod(mesh, *view) : 0;
+			const MeshLod& range = mesh.m_lods[lod];
+			glDrawElements(GL_TRIANGLES, (GLsizei)range.m_number_of_indices, GL_UNSIGNED_INT,
+				(const void*)(range.m_first_index * sizeof(uint32_t)));
+			g_render_stats.draw_calls++;
+			g_render_stats.triangles += range.m_number_of_indices / 3;
+			g_render_stats.lod_meshes[lod]++;
+			g_render_stats.lod_triangles[lod] += range.m_number_of_indices / 3;
 		}
 		glBindVertexArray(0);
 	}
-} // namespace labhelper
\ No newline at end of file
+
+	void render(const Model* model, const bool submitMaterials)
+	{
+		renderMeshes(model, nullptr, submitMaterials);
+	}
+
+	void render(const Model* model, const RenderView& view, const bool submitMaterials)
+	{
+		renderMeshes(model, &view, submitMaterials);
+	}
+} // namespace labhelper
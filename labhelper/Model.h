@@ -2,8 +2,8 @@
 #include <string>
 #include <vector>
 #include <memory>
-#include <memory>
 #include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
 
 namespace labhelper
 {
@@ -47,6 +47,19 @@ namespace labhelper
 		Texture m_emission_texture;
 	};
 
+	///////////////////////////////////////////////////////////////////////////
+	/// A simplified version of a Mesh, drawn with the same vertices
+	///////////////////////////////////////////////////////////////////////////
+	const uint32_t MAX_LOD_LEVELS = 4;
+	struct MeshLod
+	{
+		// Range in Model::m_indices
+		uint32_t m_first_index;
+		uint32_t m_number_of_indices;
+		// Largest distance, in model space, from the full mesh
+		float m_error;
+	};
+
 	struct Mesh
 	{
 		std::string m_name;
@@ -54,8 +67,60 @@ namespace labhelper
 		// Where this Mesh's vertices start
 		uint32_t m_start_index;
 		uint32_t m_number_of_vertices;
+		// Where this Mesh's triangles start in Model::m_indices
+		uint32_t m_first_index;
+		uint32_t m_number_of_indices;
+		// Bounding box in model space
+		glm::vec3 m_aabb_min;
+		glm::vec3 m_aabb_max;
+		// Bounding sphere in model space, xyz center and w radius
+		glm::vec4 m_bounding_sphere;
+		// Level 0 is the full mesh, the following ones coarser
+		std::vector<MeshLod> m_lods;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	/// How the vertices of a Model are stored. The packed formats keep the
+	/// normal and texture coordinate in one interleaved stream:
+	///  - normals octahedral encoded in 2x16 bit snorm
+	///  - texture coordinates as 2x16 bit half floats
+	/// A shader can draw the packed formats if its vertex shader decodes
+	///
+	///   uniform bool octahedral_normals;  // normalIn.xy is the encoded normal
+	///   uniform vec3 position_offset;     // position = offset + scale * in
+	///   uniform vec3 position_scale;
+	///
+	/// which render() sets for each mesh.
+	///////////////////////////////////////////////////////////////////////////
+	enum class VertexFormat
+	{
+		// Separate float streams, 32 bytes per vertex
+		Float,
+		// Interleaved, float position, 20 bytes per vertex
+		Packed,
+		// Interleaved, position quantized to 16 bits per axis within the
+		// mesh bounding box, 16 bytes per vertex
+		PackedQuantized,
+	};
+
+	struct PackedVertex
+	{
+		glm::vec3 position;
+		uint32_t normal;
+		uint32_t texture_coordinate;
+	};
+
+	struct QuantizedVertex
+	{
+		uint16_t position[3];
+		uint16_t pad;
+		uint32_t normal;
+		uint32_t texture_coordinate;
 	};
 
+	uint32_t packNormal(const glm::vec3& n);
+	glm::vec3 unpackNormal(uint32_t packed);
+
 	class Model
 	{
 	public:
@@ -72,17 +137,159 @@ namespace labhelper
 		std::vector<glm::vec3> m_positions;
 		std::vector<glm::vec3> m_normals;
 		std::vector<glm::vec2> m_texture_coordinates;
+		// Triangle list of all meshes. The indices refer to vertices of the
+		// whole model, not of the mesh.
+		std::vector<uint32_t> m_indices;
+		// With a packed vertex format, m_positions is kept for building
+		// acceleration structures on the CPU, but normals and texture
+		// coordinates only live in one of these.
+		VertexFormat m_vertex_format = VertexFormat::Float;
+		std::vector<PackedVertex> m_packed_vertices;
+		std::vector<QuantizedVertex> m_quantized_vertices;
 		// Buffers on GPU
-		uint32_t m_positions_bo;
-		uint32_t m_normals_bo;
-		uint32_t m_texture_coordinates_bo;
+		uint32_t m_positions_bo = 0;
+		uint32_t m_normals_bo = 0;
+		uint32_t m_texture_coordinates_bo = 0;
+		// Interleaved vertices of the packed formats
+		uint32_t m_vertices_bo = 0;
+		uint32_t m_indices_bo = 0;
 		// Vertex Array Object
-		uint32_t m_vaob;
+		uint32_t m_vaob = 0;
+		// Indices into m_meshes, sorted by material so that render() can skip
+		// redundant state changes between consecutive meshes.
+		std::vector<uint32_t> m_draw_order;
+		// Scratch space of render(): which meshes survived frustum culling
+		mutable std::vector<uint8_t> m_visible;
+		// Uniform buffer with one MaterialBlock per material, each starting at
+		// a multiple of m_materials_ubo_stride bytes.
+		uint32_t m_materials_ubo = 0;
+		uint32_t m_materials_ubo_stride = 0;
 	};
 
-	Model* loadModelFromOBJ(std::string filename);
+	///////////////////////////////////////////////////////////////////////////
+	/// Layout (std140) of the per-material uniform block. Shaders that declare
+	///
+	///   layout(std140, binding = 0) uniform MaterialBlock { ... };
+	///
+	/// with these members get their material through the uniform buffer
+	/// instead of through individual glUniform calls.
+	///////////////////////////////////////////////////////////////////////////
+	struct MaterialBlock
+	{
+		glm::vec3 material_color;
+		float material_metalness;
+		glm::vec3 material_emission;
+		float material_fresnel;
+		float material_shininess;
+		int32_t has_color_texture;
+		int32_t has_emission_texture;
+		float pad;
+	};
+	const uint32_t MATERIAL_BLOCK_BINDING = 0;
+	MaterialBlock makeMaterialBlock(const Material& material);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Counters for the work done by render(). They accumulate until
+	/// resetRenderStats() is called, typically once per frame.
+	///////////////////////////////////////////////////////////////////////////
+	struct RenderStats
+	{
+		uint32_t draw_calls = 0;
+		uint32_t material_changes = 0;
+		uint32_t texture_binds = 0;
+		uint32_t uniform_updates = 0;
+		uint32_t buffer_binds = 0;
+		// Meshes drawn through multi-draw-indirect commands
+		uint32_t indirect_draws = 0;
+		uint32_t triangles = 0;
+		// Meshes and triangles drawn at each level of detail
+		uint32_t lod_meshes[MAX_LOD_LEVELS] = {};
+		uint32_t lod_triangles[MAX_LOD_LEVELS] = {};
+		// Meshes skipped by frustum and occlusion culling
+		uint32_t culled_meshes = 0;
+		uint32_t occluded_meshes = 0;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Where a model is seen from, for render functions that select a level
+	/// of detail per mesh. The coarsest level whose error projects to at most
+	/// max_pixel_error pixels is drawn, unless force_lod is set.
+	///
+	/// Meshes whose bounding sphere is outside the view frustum are skipped
+	/// if frustum_cull is set, and meshes whose bounding box is hidden in
+	/// the occlusion buffer are skipped if one is given.
+	///////////////////////////////////////////////////////////////////////////
+	class OcclusionBuffer;
+	struct RenderView
+	{
+		glm::mat4 model_view_matrix;
+		glm::mat4 projection_matrix;
+		float viewport_height;
+		float max_pixel_error = 1.0f;
+		int force_lod = -1;
+		bool frustum_cull = false;
+		const OcclusionBuffer* occlusion = nullptr;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Normal and texture coordinate of a vertex, whatever the vertex format
+	///////////////////////////////////////////////////////////////////////////
+	inline glm::vec3 getNormal(const Model* model, uint32_t vertex)
+	{
+		switch (model->m_vertex_format)
+		{
+		case VertexFormat::Packed:
+			return unpackNormal(model->m_packed_vertices[vertex].normal);
+		case VertexFormat::PackedQuantized:
+			return unpackNormal(model->m_quantized_vertices[vertex].normal);
+		default:
+			return model->m_normals[vertex];
+		}
+	}
+
+	inline glm::vec2 getTextureCoordinate(const Model* model, uint32_t vertex)
+	{
+		switch (model->m_vertex_format)
+		{
+		case VertexFormat::Packed:
+			return glm::unpackHalf2x16(model->m_packed_vertices[vertex].texture_coordinate);
+		case VertexFormat::PackedQuantized:
+			return glm::unpackHalf2x16(model->m_quantized_vertices[vertex].texture_coordinate);
+		default:
+			return model->m_texture_coordinates[vertex];
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Bytes used by the vertices of the model on the CPU and on the GPU
+	///////////////////////////////////////////////////////////////////////////
+	size_t getCpuVertexMemory(const Model* model);
+	size_t getGpuVertexMemory(const Model* model);
+
+	Model* loadModelFromOBJ(std::string filename, VertexFormat format = VertexFormat::Float);
 	void saveModelToOBJ(Model* model, std::string filename);
 	void saveModelMaterialsToMTL(Model* model, std::string filename);
 	void freeModel(Model* model);
 	void render(const Model* model, const bool submitMaterials = true);
+	void render(const Model* model, const RenderView& view, const bool submitMaterials = true);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Generate up to `levels` levels of detail for every mesh of the model,
+	/// each with about half the triangles of the previous, by quadric error
+	/// simplification.
+	///////////////////////////////////////////////////////////////////////////
+	void generateLods(Model* model, uint32_t levels = MAX_LOD_LEVELS);
+	uint32_t selectLod(const Mesh& mesh, const RenderView& view);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Upload the materials of the model to its uniform buffer. Must be called
+	/// after editing m_materials if the model is drawn with a shader that uses
+	/// the MaterialBlock.
+	///////////////////////////////////////////////////////////////////////////
+	void uploadMaterials(Model* model);
+
+	const RenderStats& getRenderStats();
+	void resetRenderStats();
+	// Used by the render functions to count their work
+	RenderStats& updateRenderStats();
 } // namespace labhelper
\ No newline at end of file
@@ -0,0 +1,259 @@
+#include "Profiler.h"
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace labhelper
+{
+	namespace profiler
+	{
+#if LABHELPER_PROFILER
+		std::atomic<bool> g_capturing(false);
+
+		struct CpuEvent
+		{
+			const char* name;
+			int64_t start, end;
+		};
+
+		// The zones recorded by one thread. Each thread appends to its own,
+		// they are only read when the capture is stopped.
+		struct ThreadEvents
+		{
+			int thread_id;
+			std::vector<CpuEvent> events;
+		};
+
+		struct GpuEvent
+		{
+			const char* name;
+			GLuint queries[2];
+			bool ended;
+			int64_t start, end;
+		};
+
+		static std::mutex s_threads_mutex;
+		static std::vector<std::unique_ptr<ThreadEvents>> s_threads;
+		static thread_local ThreadEvents* s_this_thread = nullptr;
+
+		// GPU zones in the order they began. The ones from s_first_pending
+		// on have not been read back yet.
+		static std::vector<GpuEvent> s_gpu_events;
+		static size_t s_first_pending = 0;
+		static std::vector<GLuint> s_free_queries;
+
+		static std::vector<int64_t> s_frames;
+		static std::chrono::steady_clock::time_point s_epoch;
+		// A GPU timestamp and the trace time it was read at
+		static int64_t s_gpu_epoch_ns = 0;
+		static int64_t s_gpu_epoch_us = 0;
+
+		int64_t now()
+		{
+			return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - s_epoch)
+			    .count();
+		}
+
+		static ThreadEvents* thisThread()
+		{
+			if (s_this_thread == nullptr)
+			{
+				std::lock_guard<std::mutex> lock(s_threads_mutex);
+				s_threads.emplace_back(new ThreadEvents());
+				s_threads.back()->thread_id = int(s_threads.size());
+				s_this_thread = s_threads.back().get();
+			}
+			return s_this_thread;
+		}
+
+		void CpuZone::end()
+		{
+			thisThread()->events.push_back({ m_name, m_start, now() });
+		}
+
+		static GLuint allocateQuery()
+		{
+			GLuint query;
+			if (s_free_queries.empty())
+			{
+				glGenQueries(1, &query);
+			}
+			else
+			{
+				query = s_free_queries.back();
+				s_free_queries.pop_back();
+			}
+			return query;
+		}
+
+		void GpuZone::begin(const char* name)
+		{
+			GpuEvent event = { name, { allocateQuery(), allocateQuery() }, false, 0, 0 };
+			glQueryCounter(event.queries[0], GL_TIMESTAMP);
+			m_index = int(s_gpu_events.size());
+			s_gpu_events.push_back(event);
+		}
+
+		void GpuZone::end()
+		{
+			GpuEvent& event = s_gpu_events[m_index];
+			glQueryCounter(event.queries[1], GL_TIMESTAMP);
+			event.ended = true;
+		}
+
+		// Reads back the GPU zones that have finished. Queries finish in
+		// order, so this stops at the first one that has not.
+		static void collectGpuEvents(bool wait)
+		{
+			for (; s_first_pending < s_gpu_events.size(); s_first_pending++)
+			{
+				GpuEvent& event = s_gpu_events[s_first_pending];
+				if (!event.ended)
+				{
+					break;
+				}
+				if (!wait)
+				{
+					GLint available = 0;
+					glGetQueryObjectiv(event.queries[1], GL_QUERY_RESULT_AVAILABLE, &available);
+					if (!available)
+					{
+						break;
+					}
+				}
+				GLint64 timestamps[2];
+				glGetQueryObjecti64v(event.queries[0], GL_QUERY_RESULT, &timestamps[0]);
+				glGetQueryObjecti64v(event.queries[1], GL_QUERY_RESULT, &timestamps[1]);
+				event.start = s_gpu_epoch_us + (timestamps[0] - s_gpu_epoch_ns) / 1000;
+				event.end = s_gpu_epoch_us + (timestamps[1] - s_gpu_epoch_ns) / 1000;
+				s_free_queries.push_back(event.queries[0]);
+				s_free_queries.push_back(event.queries[1]);
+			}
+		}
+#endif
+
+		void startCapture()
+		{
+#if LABHELPER_PROFILER
+			if (g_capturing)
+			{
+				return;
+			}
+			s_epoch = std::chrono::steady_clock::now();
+			{
+				std::lock_guard<std::mutex> lock(s_threads_mutex);
+				for (auto& thread : s_threads)
+				{
+					thread->events.clear();
+				}
+			}
+			// The capturing thread shows up first in the trace
+			thisThread();
+			s_gpu_events.clear();
+			s_first_pending = 0;
+			s_frames.clear();
+			GLint64 gpu_time;
+			glGetInteger64v(GL_TIMESTAMP, &gpu_time);
+			s_gpu_epoch_ns = gpu_time;
+			s_gpu_epoch_us = now();
+			g_capturing = true;
+#endif
+		}
+
+		bool stopCapture(const std::string& filename)
+		{
+#if LABHELPER_PROFILER
+			if (!g_capturing)
+			{
+				return false;
+			}
+			g_capturing = false;
+			collectGpuEvents(true);
+
+			FILE* f = fopen(filename.c_str(), "w");
+			if (f == nullptr)
+			{
+				printf("Could not write %s\n", filename.c_str());
+				return false;
+			}
+			const int gpu_thread_id = 0;
+			size_t zones = 0;
+			fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+			fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"GPU\"}}",
+			        gpu_thread_id);
+			{
+				std::lock_guard<std::mutex> lock(s_threads_mutex);
+				for (auto& thread : s_threads)
+				{
+					fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s %d\"}}",
+					        thread->thread_id, thread->thread_id == 1 ? "main" : "thread", thread->thread_id);
+					for (const CpuEvent& event : thread->events)
+					{
+						fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"cpu\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":1,\"tid\":%d}",
+						        event.name, (long long)event.start, (long long)(event.end - event.start),
+						        thread->thread_id);
+					}
+					zones += thread->events.size();
+				}
+			}
+			for (const GpuEvent& event : s_gpu_events)
+			{
+				fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"gpu\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":1,\"tid\":%d}",
+				        event.name, (long long)event.start, (long long)(event.end - event.start), gpu_thread_id);
+			}
+			zones += s_gpu_events.size();
+			for (size_t frame = 0; frame < s_frames.size(); frame++)
+			{
+				fprintf(f, ",\n{\"name\":\"frame %zu\",\"ph\":\"i\",\"s\":\"g\",\"ts\":%lld,\"pid\":1,\"tid\":1}", frame,
+				        (long long)s_frames[frame]);
+			}
+			fprintf(f, "\n]}\n");
+			fclose(f);
+			printf("Wrote %zu zones over %zu frames to %s\n", zones, s_frames.size(), filename.c_str());
+			return true;
+#else
+			(void)filename;
+			return false;
+#endif
+		}
+
+		void toggleCapture()
+		{
+#if LABHELPER_PROFILER
+			if (g_capturing)
+			{
+				stopCapture("trace.json");
+			}
+			else
+			{
+				startCapture();
+				printf("Capturing a trace, toggle again to write trace.json\n");
+			}
+#else
+			printf("The profiler is compiled out, build with LABHELPER_PROFILER\n");
+#endif
+		}
+
+		bool isCapturing()
+		{
+#if LABHELPER_PROFILER
+			return g_capturing;
+#else
+			return false;
+#endif
+		}
+
+		void beginFrame()
+		{
+#if LABHELPER_PROFILER
+			if (g_capturing)
+			{
+				s_frames.push_back(now());
+				collectGpuEvents(false);
+			}
+#endif
+		}
+	} // namespace profiler
+} // namespace labhelper
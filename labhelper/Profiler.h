@@ -0,0 +1,121 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <GL/glew.h>
+
+///////////////////////////////////////////////////////////////////////////////
+/// Scoped CPU and GPU zones, written as a Chrome trace that can be opened in
+/// chrome://tracing or ui.perfetto.dev. Zones are only recorded between
+/// startCapture() and stopCapture(); otherwise a zone costs one branch.
+/// Build with LABHELPER_PROFILER=0 to compile the zones out entirely.
+///////////////////////////////////////////////////////////////////////////////
+#ifndef LABHELPER_PROFILER
+#define LABHELPER_PROFILER 1
+#endif
+
+namespace labhelper
+{
+	namespace profiler
+	{
+		///////////////////////////////////////////////////////////////////////
+		/// Starts recording zones. GPU zones need the GL context to be
+		/// current on the calling thread.
+		///////////////////////////////////////////////////////////////////////
+		void startCapture();
+
+		///////////////////////////////////////////////////////////////////////
+		/// Stops recording, waits for the GPU zones still in flight, and
+		/// writes everything recorded to `filename`. Must be called between
+		/// frames, when no other thread is inside a zone.
+		///////////////////////////////////////////////////////////////////////
+		bool stopCapture(const std::string& filename = "trace.json");
+
+		///////////////////////////////////////////////////////////////////////
+		/// Starts a capture, or stops it and writes trace.json. Bound to F9
+		/// in the labs.
+		///////////////////////////////////////////////////////////////////////
+		void toggleCapture();
+
+		bool isCapturing();
+
+		///////////////////////////////////////////////////////////////////////
+		/// Call once per frame on the GL thread: marks the frame in the
+		/// trace and collects the GPU zones that have finished, without
+		/// waiting for the others.
+		///////////////////////////////////////////////////////////////////////
+		void beginFrame();
+
+#if LABHELPER_PROFILER
+		extern std::atomic<bool> g_capturing;
+
+		/// Microseconds on the trace's clock
+		int64_t now();
+
+		/// Times its scope on the CPU, on whichever thread it runs.
+		/// `name` must outlive the capture, normally a string literal.
+		class CpuZone
+		{
+		public:
+			explicit CpuZone(const char* name) : m_name(g_capturing.load(std::memory_order_relaxed) ? name : nullptr)
+			{
+				if (m_name != nullptr)
+				{
+					m_start = now();
+				}
+			}
+			~CpuZone()
+			{
+				if (m_name != nullptr)
+				{
+					end();
+				}
+			}
+
+		private:
+			void end();
+			const char* m_name;
+			int64_t m_start;
+		};
+
+		/// Times the GL commands issued in its scope, with GL_TIMESTAMP
+		/// queries, so GPU zones can nest. Only on the GL thread.
+		class GpuZone
+		{
+		public:
+			explicit GpuZone(const char* name) : m_index(-1)
+			{
+				if (g_capturing.load(std::memory_order_relaxed))
+				{
+					begin(name);
+				}
+			}
+			~GpuZone()
+			{
+				if (m_index >= 0)
+				{
+					end();
+				}
+			}
+
+		private:
+			void begin(const char* name);
+			void end();
+			int m_index;
+		};
+#endif
+	} // namespace profiler
+} // namespace labhelper
+
+#if LABHELPER_PROFILER
+#define LABHELPER_PROFILER_CONCAT_(a, b) a##b
+#define LABHELPER_PROFILER_CONCAT(a, b) LABHELPER_PROFILER_CONCAT_(a, b)
+// Times the rest of the enclosing scope
+#define PROFILE_CPU_ZONE(name) \
+	labhelper::profiler::CpuZone LABHELPER_PROFILER_CONCAT(profile_cpu_zone_, __LINE__)(name)
+#define PROFILE_GPU_ZONE(name) \
+	labhelper::profiler::GpuZone LABHELPER_PROFILER_CONCAT(profile_gpu_zone_, __LINE__)(name)
+#else
+#define PROFILE_CPU_ZONE(name)
+#define PROFILE_GPU_ZONE(name)
+#endif
@@ -0,0 +1,224 @@
+#include "SceneBatch.h"
+#include "labhelper.h"
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <iostream>
+#include <GL/glew.h>
+
+namespace labhelper
+{
+	///////////////////////////////////////////////////////////////////////////
+	// Destructor
+	///////////////////////////////////////////////////////////////////////////
+	SceneBatch::~SceneBatch()
+	{
+		glDeleteBuffers(1, &m_vertex_bo);
+		glDeleteBuffers(1, &m_index_bo);
+		glDeleteBuffers(1, &m_draw_id_bo);
+		glDeleteBuffers(1, &m_indirect_bo);
+		glDeleteBuffers(1, &m_draw_data_bo);
+		glDeleteBuffers(1, &m_material_bo);
+		glDeleteVertexArrays(1, &m_vaob);
+	}
+
+	bool isSceneBatchSupported()
+	{
+		return GLEW_ARB_multi_draw_indirect && GLEW_ARB_shader_storage_buffer_object && GLEW_ARB_base_instance;
+	}
+
+	SceneBatch* createSceneBatch(const std::vector<const Model*>& models, const std::vector<glm::mat4>& model_matrices)
+	{
+		assert(models.size() == model_matrices.size());
+		SceneBatch* batch = new SceneBatch;
+		batch->m_models = models;
+
+		///////////////////////////////////////////////////////////////////////
+		// Pack the vertices of all models into one interleaved stream and
+		// the materials of all models into one table.
+		///////////////////////////////////////////////////////////////////////
+		std::vector<BatchVertex> vertices;
+		std::vector<uint32_t> indices;
+		std::vector<MaterialBlock> materials;
+		std::vector<const Material*> draw_materials;
+		for (size_t m = 0; m < models.size(); m++)
+		{
+			const Model* model = models[m];
+			const uint32_t first_vertex = uint32_t(vertices.size());
+			const uint32_t first_index = uint32_t(indices.size());
+			indices.insert(indices.end(), model->m_indices.begin(), model->m_indices.end());
+			const uint32_t first_material = uint32_t(materials.size());
+			for (size_t i = 0; i < model->m_positions.size(); i++)
+			{
+				vertices.push_back({ model->m_positions[i], getNormal(model, uint32_t(i)),
+					getTextureCoordinate(model, uint32_t(i)) });
+			}
+			for (const auto& material : model->m_materials)
+			{
+				materials.push_back(makeMaterialBlock(material));
+			}
+
+			batch->m_model_first_draw.push_back(uint32_t(batch->m_draws.size()));
+			const glm::mat4 normal_matrix = glm::inverse(glm::transpose(model_matrices[m]));
+			for (uint32_t mesh_idx : model->m_draw_order)
+			{
+				const Mesh& mesh = model->m_meshes[mesh_idx];
+				BatchDrawData draw = {};
+				draw.model_matrix = model_matrices[m];
+				draw.normal_matrix = normal_matrix;
+				draw.material_idx = first_material + mesh.m_material_idx;
+				DrawElementsIndirectCommand command;
+				command.count = mesh.m_number_of_indices;
+				command.instanceCount = 1;
+				command.firstIndex = first_index + mesh.m_first_index;
+				command.baseVertex = int32_t(first_vertex);
+				command.baseInstance = uint32_t(batch->m_draws.size());
+				batch->m_draws.push_back(draw);
+				batch->m_commands.push_back(command);
+				draw_materials.push_back(&model->m_materials[mesh.m_material_idx]);
+			}
+		}
+		batch->m_number_of_vertices = uint32_t(vertices.size());
+
+		///////////////////////////////////////////////////////////////////////
+		// Order the commands so that draws with the same textures are
+		// adjacent, and make one group of each such run.
+		///////////////////////////////////////////////////////////////////////
+		auto texture_key = [&](const DrawElementsIndirectCommand& c) {
+			const Material* material = draw_materials[c.baseInstance];
+			uint32_t color = material->m_color_texture.valid ? material->m_color_texture.gl_id : 0;
+			uint32_t emission = material->m_emission_texture.valid ? material->m_emission_texture.gl_id : 0;
+			return (uint64_t(color) << 32) | emission;
+		};
+		std::stable_sort(batch->m_commands.begin(), batch->m_commands.end(),
+			[&](const DrawElementsIndirectCommand& a, const DrawElementsIndirectCommand& b) {
+				return texture_key(a) < texture_key(b);
+			});
+		for (uint32_t i = 0; i < batch->m_commands.size(); i++)
+		{
+			if (i == 0 || texture_key(batch->m_commands[i]) != texture_key(batch->m_commands[i - 1]))
+			{
+				batch->m_groups.push_back({ draw_materials[batch->m_commands[i].baseInstance], i, 0 });
+			}
+			batch->m_groups.back().number_of_commands++;
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// Upload to GPU
+		///////////////////////////////////////////////////////////////////////
+		glGenVertexArrays(1, &batch->m_vaob);
+		glBindVertexArray(batch->m_vaob);
+		glGenBuffers(1, &batch->m_vertex_bo);
+		glBindBuffer(GL_ARRAY_BUFFER, batch->m_vertex_bo);
+		glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(BatchVertex), vertices.data(), GL_STATIC_DRAW);
+		glVertexAttribPointer(0, 3, GL_FLOAT, false, sizeof(BatchVertex), (void*)offsetof(BatchVertex, position));
+		glEnableVertexAttribArray(0);
+		glVertexAttribPointer(1, 3, GL_FLOAT, false, sizeof(BatchVertex), (void*)offsetof(BatchVertex, normal));
+		glEnableVertexAttribArray(1);
+		glVertexAttribPointer(2, 2, GL_FLOAT, false, sizeof(BatchVertex),
+			(void*)offsetof(BatchVertex, texture_coordinate));
+		glEnableVertexAttribArray(2);
+		glGenBuffers(1, &batch->m_index_bo);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, batch->m_index_bo);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(uint32_t), indices.data(), GL_STATIC_DRAW);
+
+		// The draw id is an instanced attribute, so that the baseInstance of
+		// each command selects its own entry.
+		std::vector<uint32_t> draw_ids(batch->m_draws.size());
+		for (uint32_t i = 0; i < draw_ids.size(); i++)
+		{
+			draw_ids[i] = i;
+		}
+		glGenBuffers(1, &batch->m_draw_id_bo);
+		glBindBuffer(GL_ARRAY_BUFFER, batch->m_draw_id_bo);
+		glBufferData(GL_ARRAY_BUFFER, draw_ids.size() * sizeof(uint32_t), draw_ids.data(), GL_STATIC_DRAW);
+		glVertexAttribIPointer(BATCH_DRAW_ID_ATTRIBUTE, 1, GL_UNSIGNED_INT, 0, 0);
+		glVertexAttribDivisor(BATCH_DRAW_ID_ATTRIBUTE, 1);
+		glEnableVertexAttribArray(BATCH_DRAW_ID_ATTRIBUTE);
+		glBindVertexArray(0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+		glGenBuffers(1, &batch->m_indirect_bo);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, batch->m_indirect_bo);
+		glBufferData(GL_DRAW_INDIRECT_BUFFER, batch->m_commands.size() * sizeof(DrawElementsIndirectCommand),
+			batch->m_commands.data(), GL_STATIC_DRAW);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+		glGenBuffers(1, &batch->m_draw_data_bo);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, batch->m_draw_data_bo);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, batch->m_draws.size() * sizeof(BatchDrawData),
+			batch->m_draws.data(), GL_DYNAMIC_DRAW);
+		glGenBuffers(1, &batch->m_material_bo);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, batch->m_material_bo);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, materials.size() * sizeof(MaterialBlock), materials.data(),
+			GL_STATIC_DRAW);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+		CHECK_GL_ERROR();
+
+		std::cout << "Batched " << models.size() << " models into " << batch->m_commands.size() << " draws in "
+			<< batch->m_groups.size() << " groups (" << vertices.size() * sizeof(BatchVertex) / 1024
+			<< " kB of vertices).\n";
+		return batch;
+	}
+
+	void freeSceneBatch(SceneBatch* batch)
+	{
+		if (batch != nullptr)
+			delete batch;
+	}
+
+	void setModelMatrix(SceneBatch* batch, size_t model_idx, const glm::mat4& model_matrix)
+	{
+		const uint32_t first = batch->m_model_first_draw[model_idx];
+		const uint32_t count = uint32_t(batch->m_models[model_idx]->m_meshes.size());
+		const glm::mat4 normal_matrix = glm::inverse(glm::transpose(model_matrix));
+		for (uint32_t i = first; i < first + count; i++)
+		{
+			batch->m_draws[i].model_matrix = model_matrix;
+			batch->m_draws[i].normal_matrix = normal_matrix;
+		}
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, batch->m_draw_data_bo);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, first * sizeof(BatchDrawData), count * sizeof(BatchDrawData),
+			&batch->m_draws[first]);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Render all draws, one multi draw call per group of textures
+	///////////////////////////////////////////////////////////////////////
+	void render(const SceneBatch* batch, const bool submitMaterials)
+	{
+		RenderStats& stats = updateRenderStats();
+		glBindVertexArray(batch->m_vaob);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, batch->m_indirect_bo);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, BATCH_DRAW_BUFFER_BINDING, batch->m_draw_data_bo);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, BATCH_MATERIAL_BUFFER_BINDING, batch->m_material_bo);
+		stats.buffer_binds += 2;
+		for (const BatchDrawGroup& group : batch->m_groups)
+		{
+			if (submitMaterials)
+			{
+				if (group.material->m_color_texture.valid)
+				{
+					glActiveTexture(GL_TEXTURE0);
+					glBindTexture(GL_TEXTURE_2D, group.material->m_color_texture.gl_id);
+					stats.texture_binds++;
+				}
+				if (group.material->m_emission_texture.valid)
+				{
+					glActiveTexture(GL_TEXTURE5);
+					glBindTexture(GL_TEXTURE_2D, group.material->m_emission_texture.gl_id);
+					glActiveTexture(GL_TEXTURE0);
+					stats.texture_binds++;
+				}
+			}
+			glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT,
+				(const void*)(group.first_command * sizeof(DrawElementsIndirectCommand)),
+				GLsizei(group.number_of_commands), 0);
+			stats.draw_calls++;
+			stats.indirect_draws += group.number_of_commands;
+		}
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+		glBindVertexArray(0);
+	}
+} // namespace labhelper
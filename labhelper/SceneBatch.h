@@ -0,0 +1,108 @@
+#pragma once
+#include <vector>
+#include <glm/glm.hpp>
+#include "Model.h"
+
+namespace labhelper
+{
+	///////////////////////////////////////////////////////////////////////////
+	/// Layout of a command in the indirect buffer, as specified by GL.
+	///////////////////////////////////////////////////////////////////////////
+	struct DrawElementsIndirectCommand
+	{
+		uint32_t count;
+		uint32_t instanceCount;
+		uint32_t firstIndex;
+		int32_t baseVertex;
+		uint32_t baseInstance;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	/// One vertex in the interleaved vertex buffer of a SceneBatch.
+	///////////////////////////////////////////////////////////////////////////
+	struct BatchVertex
+	{
+		glm::vec3 position;
+		glm::vec3 normal;
+		glm::vec2 texture_coordinate;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Layout (std430) of the per-draw data read by shaders through
+	///
+	///   layout(std430, binding = 0) readonly buffer DrawBuffer { ... };
+	///
+	/// and indexed by the draw id attribute (location 3).
+	///////////////////////////////////////////////////////////////////////////
+	struct BatchDrawData
+	{
+		glm::mat4 model_matrix;
+		// inverse(transpose(model_matrix))
+		glm::mat4 normal_matrix;
+		uint32_t material_idx;
+		uint32_t pad[3];
+	};
+	const uint32_t BATCH_DRAW_BUFFER_BINDING = 0;
+	// Array of MaterialBlock, indexed by BatchDrawData::material_idx
+	const uint32_t BATCH_MATERIAL_BUFFER_BINDING = 1;
+	const uint32_t BATCH_DRAW_ID_ATTRIBUTE = 3;
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Draws that share the same textures, submitted with one
+	/// glMultiDrawElementsIndirect call.
+	///////////////////////////////////////////////////////////////////////////
+	struct BatchDrawGroup
+	{
+		// The textures of this material are bound for the whole group
+		const Material* material;
+		uint32_t first_command;
+		uint32_t number_of_commands;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	/// All meshes of a set of static models packed into a single interleaved
+	/// vertex buffer and index buffer, with one indirect draw command per
+	/// mesh. The transform
+	/// and material of each draw live in shader storage buffers, so the
+	/// whole scene is drawn with one multi-draw call per set of textures.
+	///////////////////////////////////////////////////////////////////////////
+	class SceneBatch
+	{
+	public:
+		~SceneBatch();
+		// The models in the batch, not owned by the batch
+		std::vector<const Model*> m_models;
+		// Index of the first draw of each model
+		std::vector<uint32_t> m_model_first_draw;
+		std::vector<BatchDrawData> m_draws;
+		std::vector<DrawElementsIndirectCommand> m_commands;
+		std::vector<BatchDrawGroup> m_groups;
+		uint32_t m_number_of_vertices = 0;
+		// Buffers on GPU
+		uint32_t m_vertex_bo = 0;
+		uint32_t m_index_bo = 0;
+		uint32_t m_draw_id_bo = 0;
+		uint32_t m_indirect_bo = 0;
+		uint32_t m_draw_data_bo = 0;
+		uint32_t m_material_bo = 0;
+		// Vertex Array Object
+		uint32_t m_vaob = 0;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Returns true if the GL context has what is needed to draw a
+	/// SceneBatch (multi draw indirect and shader storage buffers).
+	///////////////////////////////////////////////////////////////////////////
+	bool isSceneBatchSupported();
+
+	SceneBatch* createSceneBatch(const std::vector<const Model*>& models,
+		const std::vector<glm::mat4>& model_matrices);
+	void freeSceneBatch(SceneBatch* batch);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Change the transform of all meshes of one of the models in the batch
+	///////////////////////////////////////////////////////////////////////////
+	void setModelMatrix(SceneBatch* batch, size_t model_idx, const glm::mat4& model_matrix);
+
+	void render(const SceneBatch* batch, const bool submitMaterials = true);
+} // namespace labhelper
@@ -0,0 +1,430 @@
+#include "ShaderReloader.h"
+#include "labhelper.h"
+#include <algorithm>
+#include <cstdio>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace labhelper
+{
+	namespace
+	{
+		// Changed files are polled this often when inotify is not available
+		const int POLL_INTERVAL_MS = 250;
+
+		int64_t fileModifiedTime(const std::string& path)
+		{
+			struct stat st;
+			if (stat(path.c_str(), &st) != 0)
+			{
+				return 0;
+			}
+			return int64_t(st.st_mtime);
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// Issues the compile and link of a program, without checking the
+		// results: with parallel compile, these calls return immediately.
+		///////////////////////////////////////////////////////////////////////
+		GLuint compileProgram(const std::string& vs_src, const std::string& fs_src)
+		{
+			GLuint program = glCreateProgram();
+			const GLenum types[] = { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER };
+			const std::string* sources[] = { &vs_src, &fs_src };
+			for (int i = 0; i < 2; i++)
+			{
+				GLuint shader = glCreateShader(types[i]);
+				const char* src = sources[i]->c_str();
+				glShaderSource(shader, 1, &src, nullptr);
+				glCompileShader(shader);
+				glAttachShader(program, shader);
+				// Deleted with the program, or when detached
+				glDeleteShader(shader);
+			}
+			glLinkProgram(program);
+			return program;
+		}
+
+		// The compile logs of the shaders that failed, and the link log
+		std::string programLog(GLuint program)
+		{
+			GLuint shaders[2];
+			GLsizei count = 0;
+			glGetAttachedShaders(program, 2, &count, shaders);
+			std::string log;
+			for (GLsizei i = 0; i < count; i++)
+			{
+				GLint compileOk = 0;
+				glGetShaderiv(shaders[i], GL_COMPILE_STATUS, &compileOk);
+				if (!compileOk)
+				{
+					log += GetShaderInfoLog(shaders[i]);
+				}
+			}
+			return log + GetShaderProgramInfoLog(program);
+		}
+
+		void detachShaders(GLuint program)
+		{
+			GLuint shaders[2];
+			GLsizei count = 0;
+			glGetAttachedShaders(program, 2, &count, shaders);
+			for (GLsizei i = 0; i < count; i++)
+			{
+				glDetachShader(program, shaders[i]);
+			}
+		}
+	} // namespace
+
+	ShaderReloader::ShaderReloader(SDL_Window* window)
+	    : m_parallel_compile(false)
+	    , m_last_reload_ms(0.0f)
+	    , m_inotify_fd(-1)
+	    , m_last_poll(Clock::now())
+	    , m_window(window)
+	    , m_compile_context(nullptr)
+	    , m_quit(false)
+	{
+		if (GLEW_KHR_parallel_shader_compile)
+		{
+			m_parallel_compile = true;
+			glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+		}
+		else if (GLEW_ARB_parallel_shader_compile)
+		{
+			m_parallel_compile = true;
+			glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+		}
+		else
+		{
+			// SDL_GL_CreateContext makes the new context current, so put
+			// back the main one afterwards.
+			SDL_GLContext main_context = SDL_GL_GetCurrentContext();
+			SDL_GL_SetAttribute(SDL_GL_SHARE_WITH_CURRENT_CONTEXT, 1);
+			m_compile_context = SDL_GL_CreateContext(window);
+			SDL_GL_SetAttribute(SDL_GL_SHARE_WITH_CURRENT_CONTEXT, 0);
+			SDL_GL_MakeCurrent(window, main_context);
+			if (m_compile_context != nullptr)
+			{
+				m_compile_thread = std::thread(&ShaderReloader::compileThreadMain, this);
+			}
+			else
+			{
+				printf("Could not create a shared GL context (%s), shaders are reloaded synchronously\n",
+					SDL_GetError());
+			}
+		}
+
+#if defined(__linux__)
+		m_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (m_inotify_fd < 0)
+		{
+			printf("inotify_init1 failed, polling shader files instead\n");
+		}
+#endif
+	}
+
+	ShaderReloader::~ShaderReloader()
+	{
+		if (m_compile_thread.joinable())
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_quit = true;
+			}
+			m_wake.notify_one();
+			m_compile_thread.join();
+		}
+		if (m_compile_context != nullptr)
+		{
+			SDL_GL_DeleteContext(m_compile_context);
+		}
+		for (const CompileResult& result : m_results)
+		{
+			glDeleteProgram(result.program);
+		}
+		for (const WatchedProgram& watched : m_programs)
+		{
+			if (watched.pending != 0)
+			{
+				glDeleteProgram(watched.pending);
+			}
+		}
+#if defined(__linux__)
+		if (m_inotify_fd >= 0)
+		{
+			close(m_inotify_fd);
+		}
+#endif
+	}
+
+	void ShaderReloader::watch(GLuint* program,
+		const std::string& vertexShader,
+		const std::string& fragmentShader,
+		const std::vector<std::string>& defines)
+	{
+		WatchedProgram watched;
+		watched.program = program;
+		watched.vertex_shader = vertexShader;
+		watched.fragment_shader = fragmentShader;
+		watched.defines = defines;
+		watched.dirty = false;
+		watched.compiling = false;
+		watched.pending = 0;
+		m_programs.push_back(watched);
+
+		for (const std::string& path : { vertexShader, fragmentShader })
+		{
+			auto same_path = [&](const WatchedFile& file) { return file.path == path; };
+			if (std::find_if(m_files.begin(), m_files.end(), same_path) != m_files.end())
+			{
+				continue;
+			}
+			m_files.push_back({ path, fileModifiedTime(path) });
+#if defined(__linux__)
+			if (m_inotify_fd < 0)
+			{
+				continue;
+			}
+			// Watch the directory rather than the file, since many editors
+			// save by writing a new file and renaming it over the old one.
+			size_t slash = path.find_last_of("/\\");
+			std::string prefix = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+			auto same_prefix = [&](const std::pair<int, std::string>& dir) { return dir.second == prefix; };
+			if (std::find_if(m_watched_directories.begin(), m_watched_directories.end(), same_prefix)
+				!= m_watched_directories.end())
+			{
+				continue;
+			}
+			int wd = inotify_add_watch(m_inotify_fd, prefix.empty() ? "." : prefix.c_str(),
+				IN_CLOSE_WRITE | IN_MOVED_TO);
+			if (wd < 0)
+			{
+				printf("Could not watch %s for changes\n", prefix.c_str());
+				continue;
+			}
+			m_watched_directories.push_back({ wd, prefix });
+#endif
+		}
+	}
+
+	void ShaderReloader::fileChanged(const std::string& path)
+	{
+		for (WatchedProgram& watched : m_programs)
+		{
+			if (watched.vertex_shader == path || watched.fragment_shader == path)
+			{
+				watched.dirty = true;
+				watched.changed_time = Clock::now();
+			}
+		}
+	}
+
+	void ShaderReloader::pollFiles()
+	{
+		if (Clock::now() - m_last_poll < std::chrono::milliseconds(POLL_INTERVAL_MS))
+		{
+			return;
+		}
+		m_last_poll = Clock::now();
+		for (WatchedFile& file : m_files)
+		{
+			int64_t modified = fileModifiedTime(file.path);
+			if (modified != file.modified)
+			{
+				file.modified = modified;
+				fileChanged(file.path);
+			}
+		}
+	}
+
+	int ShaderReloader::update()
+	{
+#if defined(__linux__)
+		if (m_inotify_fd >= 0)
+		{
+			alignas(inotify_event) char buffer[4096];
+			ssize_t length;
+			while ((length = read(m_inotify_fd, buffer, sizeof(buffer))) > 0)
+			{
+				for (char* p = buffer; p < buffer + length;)
+				{
+					const inotify_event* event = reinterpret_cast<const inotify_event*>(p);
+					p += sizeof(inotify_event) + event->len;
+					if (event->len == 0)
+					{
+						continue;
+					}
+					for (const auto& dir : m_watched_directories)
+					{
+						if (dir.first == event->wd)
+						{
+							fileChanged(dir.second + event->name);
+						}
+					}
+				}
+			}
+		}
+		else
+		{
+			pollFiles();
+		}
+#else
+		pollFiles();
+#endif
+
+		int swapped = 0;
+		if (m_parallel_compile)
+		{
+			for (int i = 0; i < int(m_programs.size()); i++)
+			{
+				WatchedProgram& watched = m_programs[i];
+				if (watched.pending == 0)
+				{
+					continue;
+				}
+				// Does not block, unlike asking for the link status
+				GLint completed = 0;
+				glGetProgramiv(watched.pending, GL_COMPLETION_STATUS_KHR, &completed);
+				if (!completed)
+				{
+					continue;
+				}
+				GLuint program = watched.pending;
+				watched.pending = 0;
+				GLint linkOk = 0;
+				glGetProgramiv(program, GL_LINK_STATUS, &linkOk);
+				swapped += finishCompile(i, program, linkOk != 0, linkOk ? "" : programLog(program));
+			}
+		}
+		else
+		{
+			std::vector<CompileResult> results;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				results.swap(m_results);
+			}
+			for (const CompileResult& result : results)
+			{
+				swapped += finishCompile(result.index, result.program, result.ok, result.log);
+			}
+		}
+
+		for (int i = 0; i < int(m_programs.size()); i++)
+		{
+			if (m_programs[i].dirty && !m_programs[i].compiling)
+			{
+				swapped += startCompile(i);
+			}
+		}
+		return swapped;
+	}
+
+	int ShaderReloader::getPendingCount() const
+	{
+		int count = 0;
+		for (const WatchedProgram& watched : m_programs)
+		{
+			count += watched.compiling ? 1 : 0;
+		}
+		return count;
+	}
+
+	bool ShaderReloader::startCompile(int index)
+	{
+		WatchedProgram& watched = m_programs[index];
+		watched.dirty = false;
+		watched.compiling = true;
+		std::string vs_src = readShaderSource(watched.vertex_shader, watched.defines);
+		std::string fs_src = readShaderSource(watched.fragment_shader, watched.defines);
+
+		if (m_parallel_compile)
+		{
+			watched.pending = compileProgram(vs_src, fs_src);
+			return false;
+		}
+		if (m_compile_context != nullptr)
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_jobs.push_back({ index, std::move(vs_src), std::move(fs_src) });
+			}
+			m_wake.notify_one();
+			return false;
+		}
+		// No way to compile in the background
+		GLuint program = compileProgram(vs_src, fs_src);
+		GLint linkOk = 0;
+		glGetProgramiv(program, GL_LINK_STATUS, &linkOk);
+		return finishCompile(index, program, linkOk != 0, linkOk ? "" : programLog(program));
+	}
+
+	bool ShaderReloader::finishCompile(int index, GLuint program, bool ok, const std::string& log)
+	{
+		WatchedProgram& watched = m_programs[index];
+		watched.compiling = false;
+		if (watched.dirty)
+		{
+			// Changed again while compiling, the next compile replaces it
+			deleteShaderProgram(program);
+			return false;
+		}
+		if (!ok)
+		{
+			non_fatal_error(log, "Shader reload: " + watched.vertex_shader + ", " + watched.fragment_shader);
+			deleteShaderProgram(program);
+			return false;
+		}
+
+		detachShaders(program);
+		if (*watched.program != 0)
+		{
+			deleteShaderProgram(*watched.program);
+		}
+		*watched.program = program;
+		getShaderProgramInfo(program);
+		m_last_reload_ms = std::chrono::duration<float, std::milli>(Clock::now() - watched.changed_time).count();
+		printf("Reloaded %s, %s in %.1f ms\n", watched.vertex_shader.c_str(), watched.fragment_shader.c_str(),
+			m_last_reload_ms);
+		return true;
+	}
+
+	void ShaderReloader::compileThreadMain()
+	{
+		SDL_GL_MakeCurrent(m_window, m_compile_context);
+		for (;;)
+		{
+			CompileJob job;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_wake.wait(lock, [&] { return m_quit || !m_jobs.empty(); });
+				if (m_quit)
+				{
+					break;
+				}
+				job = std::move(m_jobs.front());
+				m_jobs.pop_front();
+			}
+
+			CompileResult result;
+			result.index = job.index;
+			result.program = compileProgram(job.vs_src, job.fs_src);
+			GLint linkOk = 0;
+			glGetProgramiv(result.program, GL_LINK_STATUS, &linkOk);
+			result.ok = linkOk != 0;
+			if (!result.ok)
+			{
+				result.log = programLog(result.program);
+			}
+			// The program must be complete before the main context uses it
+			glFinish();
+
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_results.push_back(std::move(result));
+		}
+		SDL_GL_MakeCurrent(m_window, nullptr);
+	}
+} // namespace labhelper
@@ -0,0 +1,143 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <SDL.h>
+#include <GL/glew.h>
+
+namespace labhelper
+{
+	///////////////////////////////////////////////////////////////////////////
+	/// Hot reloads shader programs in the background. Watches the shader
+	/// files of the programs given to watch() (with inotify on Linux, by
+	/// polling their modification times elsewhere), and recompiles only
+	/// the programs that use a changed file.
+	///
+	/// The compile does not block the frame: with KHR_parallel_shader_compile
+	/// the driver compiles on its own threads and update() polls for
+	/// completion; otherwise the programs are compiled on a thread with a
+	/// GL context shared with the main one. Only if that context can not be
+	/// created are they compiled synchronously in update(). A program is swapped in by
+	/// update(), between frames, once it has linked; if it fails, the log
+	/// is shown and the old program is kept.
+	///////////////////////////////////////////////////////////////////////////
+	class ShaderReloader
+	{
+	public:
+		/// Needs the main GL context to be current on the calling thread
+		explicit ShaderReloader(SDL_Window* window);
+		~ShaderReloader();
+
+		ShaderReloader(const ShaderReloader&) = delete;
+		ShaderReloader& operator=(const ShaderReloader&) = delete;
+
+		///////////////////////////////////////////////////////////////////////
+		/// Reloads `*program` when one of the files changes. The program is
+		/// replaced with deleteShaderProgram(), so `*program` must have been
+		/// loaded with loadShaderProgram() and must outlive the reloader.
+		///////////////////////////////////////////////////////////////////////
+		void watch(GLuint* program,
+			const std::string& vertexShader,
+			const std::string& fragmentShader,
+			const std::vector<std::string>& defines = std::vector<std::string>());
+
+		///////////////////////////////////////////////////////////////////////
+		/// Call once per frame on the main thread: starts compiling the
+		/// programs whose files changed, and swaps in the ones that have
+		/// linked. Returns the number of programs swapped, so that cached
+		/// uniform locations can be dropped.
+		///////////////////////////////////////////////////////////////////////
+		int update();
+
+		/// True if the driver compiles in parallel
+		bool usesParallelCompile() const
+		{
+			return m_parallel_compile;
+		}
+		/// True if the programs are compiled on the shared context thread.
+		/// If neither this nor parallel compile, they are compiled in
+		/// update(), blocking the frame.
+		bool usesCompileThread() const
+		{
+			return m_compile_context != nullptr;
+		}
+		/// Programs being compiled
+		int getPendingCount() const;
+		/// From the file change to the swap, for the last program swapped
+		float getLastReloadMs() const
+		{
+			return m_last_reload_ms;
+		}
+
+	private:
+		typedef std::chrono::steady_clock Clock;
+
+		struct WatchedProgram
+		{
+			GLuint* program;
+			std::string vertex_shader;
+			std::string fragment_shader;
+			std::vector<std::string> defines;
+			// Set when a file changes, cleared when a compile starts. A
+			// program that changes while it compiles is compiled again.
+			bool dirty;
+			bool compiling;
+			// The program the driver is compiling in parallel
+			GLuint pending;
+			Clock::time_point changed_time;
+		};
+
+		struct WatchedFile
+		{
+			std::string path;
+			int64_t modified;
+		};
+
+		struct CompileJob
+		{
+			int index;
+			std::string vs_src;
+			std::string fs_src;
+		};
+
+		// A program compiled by the compile thread
+		struct CompileResult
+		{
+			int index;
+			GLuint program;
+			bool ok;
+			std::string log;
+		};
+
+		void fileChanged(const std::string& path);
+		void pollFiles();
+		bool startCompile(int index);
+		bool finishCompile(int index, GLuint program, bool ok, const std::string& log);
+		void compileThreadMain();
+
+		std::vector<WatchedProgram> m_programs;
+		std::vector<WatchedFile> m_files;
+		bool m_parallel_compile;
+		float m_last_reload_ms;
+
+		// File watching
+		int m_inotify_fd;
+		std::vector<std::pair<int, std::string>> m_watched_directories;
+		Clock::time_point m_last_poll;
+
+		// Compile thread, when there is no parallel compile
+		SDL_Window* m_window;
+		SDL_GLContext m_compile_context;
+		std::thread m_compile_thread;
+		std::mutex m_mutex;
+		std::condition_variable m_wake;
+		std::deque<CompileJob> m_jobs;
+		std::vector<CompileResult> m_results;
+		bool m_quit;
+	};
+} // namespace labhelper
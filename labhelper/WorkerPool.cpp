@@ -0,0 +1,112 @@
+#include "WorkerPool.h"
+#include "Profiler.h"
+#include <algorithm>
+
+namespace labhelper
+{
+	WorkerPool::WorkerPool(int threads)
+	    : m_function(nullptr)
+	    , m_jobs(0)
+	    , m_static_schedule(false)
+	    , m_next_job(0)
+	    , m_busy_workers(0)
+	    , m_generation(0)
+	    , m_quit(false)
+	{
+		if (threads <= 0)
+		{
+			threads = std::max(1, int(std::thread::hardware_concurrency()));
+		}
+		m_size = threads;
+		for (int thread = 1; thread < m_size; thread++)
+		{
+			m_threads.emplace_back(&WorkerPool::workerMain, this, thread);
+		}
+	}
+
+	WorkerPool::~WorkerPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_quit = true;
+		}
+		m_wake.notify_all();
+		for (auto& thread : m_threads)
+		{
+			thread.join();
+		}
+	}
+
+	void WorkerPool::parallelFor(int jobs, const std::function<void(int, int)>& job_function, bool static_schedule)
+	{
+		if (m_size == 1 || jobs <= 1)
+		{
+			for (int job = 0; job < jobs; job++)
+			{
+				job_function(job, 0);
+			}
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_function = &job_function;
+			m_jobs = jobs;
+			m_static_schedule = static_schedule;
+			m_next_job = 0;
+			m_busy_workers = m_size - 1;
+			m_generation++;
+		}
+		m_wake.notify_all();
+		runJobs(0);
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_done.wait(lock, [this] { return m_busy_workers == 0; });
+		m_function = nullptr;
+	}
+
+	void WorkerPool::workerMain(int thread)
+	{
+		uint64_t seen_generation = 0;
+		std::unique_lock<std::mutex> lock(m_mutex);
+		for (;;)
+		{
+			m_wake.wait(lock, [&] { return m_quit || m_generation != seen_generation; });
+			if (m_quit)
+			{
+				return;
+			}
+			seen_generation = m_generation;
+			lock.unlock();
+			runJobs(thread);
+			lock.lock();
+			if (--m_busy_workers == 0)
+			{
+				m_done.notify_one();
+			}
+		}
+	}
+
+	void WorkerPool::runJobs(int thread)
+	{
+		const std::function<void(int, int)>& job_function = *m_function;
+		if (m_static_schedule)
+		{
+			const int first = int(int64_t(thread) * m_jobs / m_size);
+			const int last = int(int64_t(thread + 1) * m_jobs / m_size);
+			for (int job = first; job < last; job++)
+			{
+				PROFILE_CPU_ZONE("job");
+				job_function(job, thread);
+			}
+		}
+		else
+		{
+			for (int job = m_next_job++; job < m_jobs; job = m_next_job++)
+			{
+				PROFILE_CPU_ZONE("job");
+				job_function(job, thread);
+			}
+		}
+	}
+} // namespace labhelper
@@ -0,0 +1,62 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace labhelper
+{
+	///////////////////////////////////////////////////////////////////////////
+	/// A fixed set of threads that run the jobs of a parallel loop. The
+	/// thread that calls parallelFor() works on the jobs too, as thread 0,
+	/// so a pool of size 1 has no worker threads and runs everything inline.
+	///////////////////////////////////////////////////////////////////////////
+	class WorkerPool
+	{
+	public:
+		/// `threads` <= 0 uses one thread per hardware thread
+		explicit WorkerPool(int threads = 0);
+		~WorkerPool();
+
+		int size() const
+		{
+			return m_size;
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		/// Calls job_function(job, thread) for every job in [0, jobs), and
+		/// returns when all have finished. `thread` is in [0, size()) and
+		/// is the same for all jobs that run on one thread, so it can index
+		/// per-thread scratch data.
+		///
+		/// By default jobs are handed out to whichever thread is free. With
+		/// `static_schedule`, thread t runs the jobs in
+		/// [t * jobs / size(), (t + 1) * jobs / size()) in order, so
+		/// concatenating per-thread results in thread order gives the same
+		/// result as running the jobs in order on one thread.
+		///////////////////////////////////////////////////////////////////////
+		void parallelFor(int jobs, const std::function<void(int job, int thread)>& job_function,
+			bool static_schedule = false);
+
+	private:
+		void workerMain(int thread);
+		void runJobs(int thread);
+
+		int m_size;
+		std::vector<std::thread> m_threads;
+
+		std::mutex m_mutex;
+		std::condition_variable m_wake;
+		std::condition_variable m_done;
+		const std::function<void(int, int)>* m_function;
+		int m_jobs;
+		bool m_static_schedule;
+		std::atomic<int> m_next_job;
+		int m_busy_workers;
+		uint64_t m_generation;
+		bool m_quit;
+	};
+} // namespace labhelper
@@ -3,10 +3,12 @@
 #define VC_EXTRALEAN
 #define NOMINMAX //          - Macros min(a,b) and max(a,b)
 #include <windows.h>
+#include <direct.h>
 #undef near
 #undef far
 #else
 #include <signal.h>
+#include <sys/stat.h>
 #endif // WIN32
 
 #include <GL/glew.h>
@@ -30,6 +32,7 @@
 #include <sstream>
 #include <iostream>
 #include <algorithm>
+#include <unordered_set>
 
 #include <string>
 #include <fstream>
@@ -503,16 +506,272 @@ namespace labhelper
 		return log;
 	}
 
-	GLuint loadShaderProgram(const std::string& vertexShader, const std::string& fragmentShader, bool allow_errors)
+	///////////////////////////////////////////////////////////////////////////
+	// Insert "#define X" lines after the #version line of a shader source
+	///////////////////////////////////////////////////////////////////////////
+	static std::string insertDefines(const std::string& src, const std::vector<std::string>& defines)
 	{
-		GLuint vShader = glCreateShader(GL_VERTEX_SHADER);
-		GLuint fShader = glCreateShader(GL_FRAGMENT_SHADER);
+		if (defines.empty())
+		{
+			return src;
+		}
+		std::string define_lines;
+		for (const auto& define : defines)
+		{
+			define_lines += "#define " + define + "\n";
+		}
+		size_t version = src.find("#version");
+		if (version == std::string::npos)
+		{
+			return define_lines + src;
+		}
+		size_t end_of_line = src.find('\n', version);
+		if (end_of_line == std::string::npos)
+		{
+			return src + "\n" + define_lines;
+		}
+		return src.substr(0, end_of_line + 1) + define_lines + src.substr(end_of_line + 1);
+	}
+
+	std::string readShaderSource(const std::string& file, const std::vector<std::string>& defines)
+	{
+		std::ifstream in(file);
+		std::string src((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		return insertDefines(src, defines);
+	}
+
+	namespace
+	{
+		void reflectShaderProgram(GLuint shaderProgram);
+
+		///////////////////////////////////////////////////////////////////////
+		// Program binary cache. Each file is a header followed by the binary
+		// returned by glGetProgramBinary. `key` hashes the sources and the
+		// driver strings, so a file made by other sources or another driver
+		// is stale and gets overwritten.
+		///////////////////////////////////////////////////////////////////////
+		const char* SHADER_CACHE_DIRECTORY = "shader_cache";
+		const uint32_t SHADER_CACHE_MAGIC = 0x4250484c; // "LHPB"
+		const uint32_t SHADER_CACHE_VERSION = 1;
+
+		struct ShaderCacheHeader
+		{
+			uint32_t magic;
+			uint32_t version;
+			uint64_t key;
+			uint32_t format;
+			uint32_t length;
+		};
+
+		bool g_shader_cache_enabled = true;
+		bool g_shader_cache_initialized = false;
+		std::string g_shader_cache_driver;
+		std::vector<GLint> g_program_binary_formats;
+		std::unordered_set<std::string> g_shader_cache_files;
+		ShaderCacheStats g_shader_cache_stats;
+
+		// 64 bit FNV-1a, continuing from `hash`
+		uint64_t hashString(const std::string& str, uint64_t hash = 14695981039346656037ull)
+		{
+			for (unsigned char c : str)
+			{
+				hash = (hash ^ c) * 1099511628211ull;
+			}
+			// Terminate, so that "ab" + "c" and "a" + "bc" differ
+			return (hash ^ 0xff) * 1099511628211ull;
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// Queries the driver the first time. Returns false if the cache is
+		// disabled, or the driver can not save program binaries.
+		///////////////////////////////////////////////////////////////////////
+		bool useShaderCache()
+		{
+			if (!g_shader_cache_enabled)
+			{
+				return false;
+			}
+			if (!g_shader_cache_initialized)
+			{
+				g_shader_cache_initialized = true;
+				GLint num_formats = 0;
+				glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+				if (num_formats <= 0)
+				{
+					printf("No program binary formats, the shader cache is disabled\n");
+					return false;
+				}
+				g_program_binary_formats.resize(num_formats);
+				glGetIntegerv(GL_PROGRAM_BINARY_FORMATS, g_program_binary_formats.data());
+				for (GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION })
+				{
+					const GLubyte* str = glGetString(name);
+					g_shader_cache_driver += str != nullptr ? reinterpret_cast<const char*>(str) : "";
+					g_shader_cache_driver += "\n";
+				}
+#if defined(_WIN32)
+				_mkdir(SHADER_CACHE_DIRECTORY);
+#else
+				mkdir(SHADER_CACHE_DIRECTORY, 0755);
+#endif
+			}
+			return !g_program_binary_formats.empty();
+		}
+
+		std::string shaderCacheFile(const std::string& vertexShader,
+			const std::string& fragmentShader,
+			const std::vector<std::string>& defines)
+		{
+			uint64_t hash = hashString(fragmentShader, hashString(vertexShader));
+			for (const auto& define : defines)
+			{
+				hash = hashString(define, hash);
+			}
+			char file[64];
+			snprintf(file, sizeof(file), "%s/%016llx.bin", SHADER_CACHE_DIRECTORY, (unsigned long long)hash);
+			return file;
+		}
+
+		uint64_t shaderCacheKey(const std::string& vs_src, const std::string& fs_src)
+		{
+			return hashString(g_shader_cache_driver, hashString(fs_src, hashString(vs_src)));
+		}
+
+		///////////////////////////////////////////////////////////////////////
+		// Returns the linked program in `file`, or 0 if there is no file, or
+		// its binary is stale or rejected by the driver.
+		///////////////////////////////////////////////////////////////////////
+		GLuint loadProgramBinary(const std::string& file, uint64_t key)
+		{
+			std::ifstream in(file, std::ios::binary);
+			if (!in)
+			{
+				return 0;
+			}
+			g_shader_cache_files.insert(file);
+			ShaderCacheHeader header = {};
+			std::vector<char> binary;
+			if (in.read(reinterpret_cast<char*>(&header), sizeof(header)) && header.magic == SHADER_CACHE_MAGIC
+				&& header.version == SHADER_CACHE_VERSION && header.key == key)
+			{
+				binary.resize(header.length);
+				in.read(binary.data(), binary.size());
+			}
+			if (binary.empty() || !in
+				|| std::find(g_program_binary_formats.begin(), g_program_binary_formats.end(), GLint(header.format))
+					== g_program_binary_formats.end())
+			{
+				g_shader_cache_stats.stale++;
+				return 0;
+			}
+
+			GLuint program = glCreateProgram();
+			glProgramBinary(program, header.format, binary.data(), GLsizei(binary.size()));
+			GLint linkOk = 0;
+			glGetProgramiv(program, GL_LINK_STATUS, &linkOk);
+			if (!linkOk)
+			{
+				// Drivers may reject binaries for reasons not in the key,
+				// e.g. an update that kept the version string.
+				g_shader_cache_stats.rejected++;
+				glDeleteProgram(program);
+				return 0;
+			}
+			return program;
+		}
+
+		void saveProgramBinary(const std::string& file, uint64_t key, GLuint program)
+		{
+			GLint length = 0;
+			glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+			if (length <= 0)
+			{
+				return;
+			}
+			std::vector<char> binary(length);
+			GLsizei written = 0;
+			GLenum format = 0;
+			glGetProgramBinary(program, length, &written, &format, binary.data());
+			if (written <= 0)
+			{
+				return;
+			}
 
-		std::ifstream vs_file(vertexShader);
-		std::string vs_src((std::istreambuf_iterator<char>(vs_file)), std::istreambuf_iterator<char>());
+			ShaderCacheHeader header = { SHADER_CACHE_MAGIC, SHADER_CACHE_VERSION, key, format, uint32_t(written) };
+			std::ofstream out(file, std::ios::binary | std::ios::trunc);
+			out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+			out.write(binary.data(), written);
+			if (!out)
+			{
+				printf("Could not write %s\n", file.c_str());
+				return;
+			}
+			g_shader_cache_files.insert(file);
+		}
 
-		std::ifstream fs_file(fragmentShader);
-		std::string fs_src((std::istreambuf_iterator<char>(fs_file)), std::istreambuf_iterator<char>());
+		double millisecondsSince(std::chrono::steady_clock::time_point start)
+		{
+			return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		}
+	} // namespace
+
+	void setShaderCacheEnabled(bool enabled)
+	{
+		g_shader_cache_enabled = enabled;
+	}
+
+	bool isShaderCacheEnabled()
+	{
+		return g_shader_cache_enabled;
+	}
+
+	void clearShaderCache()
+	{
+		for (const std::string& file : g_shader_cache_files)
+		{
+			std::remove(file.c_str());
+		}
+		g_shader_cache_files.clear();
+	}
+
+	const ShaderCacheStats& getShaderCacheStats()
+	{
+		return g_shader_cache_stats;
+	}
+
+	void resetShaderCacheStats()
+	{
+		g_shader_cache_stats = ShaderCacheStats();
+	}
+
+	GLuint loadShaderProgram(const std::string& vertexShader,
+		const std::string& fragmentShader,
+		bool allow_errors,
+		const std::vector<std::string>& defines)
+	{
+		std::string vs_src = readShaderSource(vertexShader, defines);
+		std::string fs_src = readShaderSource(fragmentShader, defines);
+
+		const auto start_time = std::chrono::steady_clock::now();
+		const bool use_cache = useShaderCache();
+		std::string cache_file;
+		uint64_t cache_key = 0;
+		if (use_cache)
+		{
+			cache_file = shaderCacheFile(vertexShader, fragmentShader, defines);
+			cache_key = shaderCacheKey(vs_src, fs_src);
+			GLuint cachedProgram = loadProgramBinary(cache_file, cache_key);
+			if (cachedProgram != 0)
+			{
+				reflectShaderProgram(cachedProgram);
+				g_shader_cache_stats.cache_hits++;
+				g_shader_cache_stats.cache_ms += millisecondsSince(start_time);
+				return cachedProgram;
+			}
+		}
+
+		GLuint vShader = glCreateShader(GL_VERTEX_SHADER);
+		GLuint fShader = glCreateShader(GL_FRAGMENT_SHADER);
 
 		const char* vs = vs_src.c_str();
 		const char* fs = fs_src.c_str();
@@ -559,15 +818,79 @@ namespace labhelper
 		glDeleteShader(fShader);
 		glAttachShader(shaderProgram, vShader);
 		glDeleteShader(vShader);
+		if (use_cache)
+		{
+			glProgramParameteri(shaderProgram, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+		}
 		if (!allow_errors)
 			CHECK_GL_ERROR();
 
 		if (!linkShaderProgram(shaderProgram, allow_errors))
 			return 0;
 
+		if (use_cache)
+		{
+			saveProgramBinary(cache_file, cache_key, shaderProgram);
+		}
+		g_shader_cache_stats.compiled++;
+		g_shader_cache_stats.compile_ms += millisecondsSince(start_time);
 		return shaderProgram;
 	}
 
+	namespace
+	{
+		std::unordered_map<GLuint, ShaderProgramInfo> g_program_infos;
+		uint32_t g_program_generation = 0;
+
+		///////////////////////////////////////////////////////////////////////
+		// Query all active uniforms and uniform blocks of a linked program
+		///////////////////////////////////////////////////////////////////////
+		void reflectShaderProgram(GLuint shaderProgram)
+		{
+			ShaderProgramInfo& info = g_program_infos[shaderProgram];
+			info = ShaderProgramInfo();
+			info.generation = ++g_program_generation;
+
+			GLint num_uniforms = 0, max_name_length = 0;
+			glGetProgramiv(shaderProgram, GL_ACTIVE_UNIFORMS, &num_uniforms);
+			glGetProgramiv(shaderProgram, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_name_length);
+			std::vector<char> name(std::max(max_name_length, 1));
+			for (GLint i = 0; i < num_uniforms; i++)
+			{
+				GLsizei length = 0;
+				GLint size = 0;
+				GLenum type = 0;
+				glGetActiveUniform(shaderProgram, GLuint(i), GLsizei(name.size()), &length, &size, &type,
+					name.data());
+				GLint location = glGetUniformLocation(shaderProgram, name.data());
+				if (location == -1)
+				{
+					continue; // Member of a uniform block
+				}
+				std::string uniform_name(name.data(), length);
+				info.uniform_locations[uniform_name] = location;
+				// Arrays are reported as "name[0]", but are usually set by "name"
+				size_t bracket = uniform_name.find("[0]");
+				if (bracket != std::string::npos)
+				{
+					info.uniform_locations[uniform_name.substr(0, bracket)] = location;
+				}
+			}
+
+			GLint num_blocks = 0;
+			glGetProgramiv(shaderProgram, GL_ACTIVE_UNIFORM_BLOCKS, &num_blocks);
+			for (GLint i = 0; i < num_blocks; i++)
+			{
+				GLint length = 0;
+				glGetActiveUniformBlockiv(shaderProgram, GLuint(i), GL_UNIFORM_BLOCK_NAME_LENGTH, &length);
+				std::vector<char> block_name(std::max(length, 1));
+				glGetActiveUniformBlockName(shaderProgram, GLuint(i), GLsizei(block_name.size()), nullptr,
+					block_name.data());
+				info.uniform_blocks[block_name.data()] = GLuint(i);
+			}
+		}
+	} // namespace
+
 	bool linkShaderProgram(GLuint shaderProgram, bool allow_errors)
 	{
 		glLinkProgram(shaderProgram);
@@ -575,6 +898,7 @@ namespace labhelper
 		glGetProgramiv(shaderProgram, GL_LINK_STATUS, &linkOk);
 		if (!linkOk)
 		{
+			g_program_infos.erase(shaderProgram);
 			std::string err = GetShaderProgramInfoLog(shaderProgram);
 			if (allow_errors)
 			{
@@ -586,9 +910,35 @@ namespace labhelper
 			}
 			return false;
 		}
+		reflectShaderProgram(shaderProgram);
 		return true;
 	}
 
+	void deleteShaderProgram(GLuint shaderProgram)
+	{
+		g_program_infos.erase(shaderProgram);
+		glDeleteProgram(shaderProgram);
+	}
+
+	const ShaderProgramInfo& getShaderProgramInfo(GLuint shaderProgram)
+	{
+		auto it = g_program_infos.find(shaderProgram);
+		if (it == g_program_infos.end())
+		{
+			// Linked without linkShaderProgram(), reflect it now.
+			reflectShaderProgram(shaderProgram);
+			it = g_program_infos.find(shaderProgram);
+		}
+		return it->second;
+	}
+
+	GLint getUniformLocation(GLuint shaderProgram, const char* name)
+	{
+		const ShaderProgramInfo& info = getShaderProgramInfo(shaderProgram);
+		auto it = info.uniform_locations.find(name);
+		return it != info.uniform_locations.end() ? it->second : -1;
+	}
+
 	GLuint createAddAttribBuffer(GLuint vertexArrayObject,
 		const void* data,
 		const size_t dataSize,
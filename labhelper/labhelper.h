@@ -6,7 +6,9 @@
 #include <glm/glm.hpp>
 
 #include <string>
+#include <vector>
 #include <cassert>
+#include <unordered_map>
 
 #include <SDL.h>
 #undef main
@@ -110,22 +112,93 @@ namespace labhelper
 	/// Helper function used to get log info (such as errors) about a shader object or shader program
 	///////////////////////////////////////////////////////////////////////////
 	std::string GetShaderInfoLog(GLuint obj);
+	std::string GetShaderProgramInfoLog(GLuint obj);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Reads a shader source file, and inserts "#define <string>" after the
+	/// #version line for each string in `defines`, as loadShaderProgram()
+	/// does.
+	///////////////////////////////////////////////////////////////////////////
+	std::string readShaderSource(const std::string& file, const std::vector<std::string>& defines);
 
 	///////////////////////////////////////////////////////////////////////////
 	/// Loads and compiles a fragment and vertex shader. Then creates a shader program
 	/// and attaches the shaders. Does NOT link the program, this is done with  linkShaderProgram()
 	/// The reason for this is that before linking we need to bind attribute locations, using
 	/// glBindAttribLocation and fragment data lications, using glBindFragDataLocation.
+	/// Each string in `defines` is inserted as "#define <string>" after the
+	/// #version line of both shaders, to compile variants of the same source.
 	///////////////////////////////////////////////////////////////////////////
 	GLuint loadShaderProgram(const std::string& vertexShader,
 		const std::string& fragmentShader,
-		bool allow_errors = false);
+		bool allow_errors = false,
+		const std::vector<std::string>& defines = std::vector<std::string>());
 
 	///////////////////////////////////////////////////////////////////////////
 	/// Call to link a shader program prevoiusly loaded using loadShaderProgram.
+	/// (Re)builds the uniform reflection cache of the program on success.
 	///////////////////////////////////////////////////////////////////////////
 	bool linkShaderProgram(GLuint shaderProgram, bool allow_errors = false);
 
+	///////////////////////////////////////////////////////////////////////////
+	/// Deletes a shader program and drops its uniform reflection cache. Use
+	/// this instead of glDeleteProgram when replacing a hot reloaded program.
+	///////////////////////////////////////////////////////////////////////////
+	void deleteShaderProgram(GLuint shaderProgram);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// The active uniforms and uniform blocks of a linked program, queried
+	/// once when it is linked. `generation` is unique for every link, so code
+	/// that caches locations can tell when a program has been relinked.
+	///////////////////////////////////////////////////////////////////////////
+	struct ShaderProgramInfo
+	{
+		uint32_t generation = 0;
+		std::unordered_map<std::string, GLint> uniform_locations;
+		std::unordered_map<std::string, GLuint> uniform_blocks;
+	};
+	const ShaderProgramInfo& getShaderProgramInfo(GLuint shaderProgram);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Location of a uniform from the reflection cache, -1 if not active.
+	///////////////////////////////////////////////////////////////////////////
+	GLint getUniformLocation(GLuint shaderProgram, const char* name);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Program binary cache. loadShaderProgram() stores every program it
+	/// links with glGetProgramBinary in the shader_cache directory, one file
+	/// per shader pair and defines, and loads it back with glProgramBinary
+	/// the next time. A binary is only used if it was made from the same
+	/// sources by the same driver (vendor, renderer and version strings);
+	/// otherwise, or if the driver rejects it, the program is compiled and
+	/// the file is replaced. Enabled by default.
+	///////////////////////////////////////////////////////////////////////////
+	void setShaderCacheEnabled(bool enabled);
+	bool isShaderCacheEnabled();
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Removes the cache files of the programs loaded so far, so that the
+	/// next load of each is cold.
+	///////////////////////////////////////////////////////////////////////////
+	void clearShaderCache();
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Programs loaded by loadShaderProgram() since the last reset: the ones
+	/// loaded from the cache, the ones compiled (including those whose
+	/// binary was stale or rejected), and the time spent on each.
+	///////////////////////////////////////////////////////////////////////////
+	struct ShaderCacheStats
+	{
+		uint32_t cache_hits = 0;
+		uint32_t compiled = 0;
+		uint32_t stale = 0;
+		uint32_t rejected = 0;
+		double cache_ms = 0.0;
+		double compile_ms = 0.0;
+	};
+	const ShaderCacheStats& getShaderCacheStats();
+	void resetShaderCacheStats();
+
 	///////////////////////////////////////////////////////////////////////////
 	/// Creates a GL buffer, uploads the given data to it, and attaches it to the VAO.
 	/// returns the handle of the GL buffer.
@@ -162,6 +235,71 @@ namespace labhelper
 	void setUniformSlow(GLuint shaderProgram, const char* name, const glm::vec3& value);
 	void setUniformSlow(GLuint shaderProgram, const char* name, const uint32_t nof_values, const glm::vec3* values);
 
+	///////////////////////////////////////////////////////////////////////////
+	/// Set a uniform by location in a program that does not have to be bound.
+	///////////////////////////////////////////////////////////////////////////
+	inline void setProgramUniform(GLuint program, GLint location, const glm::mat4& value)
+	{
+		glProgramUniformMatrix4fv(program, location, 1, false, &value[0].x);
+	}
+	inline void setProgramUniform(GLuint program, GLint location, const glm::mat3& value)
+	{
+		glProgramUniformMatrix3fv(program, location, 1, false, &value[0].x);
+	}
+	inline void setProgramUniform(GLuint program, GLint location, const float value)
+	{
+		glProgramUniform1f(program, location, value);
+	}
+	inline void setProgramUniform(GLuint program, GLint location, const GLint value)
+	{
+		glProgramUniform1i(program, location, value);
+	}
+	inline void setProgramUniform(GLuint program, GLint location, const GLuint value)
+	{
+		glProgramUniform1ui(program, location, value);
+	}
+	inline void setProgramUniform(GLuint program, GLint location, const bool value)
+	{
+		glProgramUniform1i(program, location, value ? 1 : 0);
+	}
+	inline void setProgramUniform(GLuint program, GLint location, const glm::vec2& value)
+	{
+		glProgramUniform2fv(program, location, 1, &value.x);
+	}
+	inline void setProgramUniform(GLuint program, GLint location, const glm::vec3& value)
+	{
+		glProgramUniform3fv(program, location, 1, &value.x);
+	}
+	inline void setProgramUniform(GLuint program, GLint location, const glm::vec4& value)
+	{
+		glProgramUniform4fv(program, location, 1, &value.x);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Typed handle to a uniform in a program. The location is found once
+	/// when the handle is created; set() is a single glProgramUniform call.
+	/// Handles must be recreated when the program is reloaded.
+	///
+	/// Example:
+	///   labhelper::Uniform<glm::mat4> mvp(program, "modelViewProjectionMatrix");
+	///   mvp.set(projectionMatrix * viewMatrix * modelMatrix);
+	///////////////////////////////////////////////////////////////////////////
+	template<typename T>
+	struct Uniform
+	{
+		GLuint program = 0;
+		GLint location = -1;
+
+		Uniform() = default;
+		Uniform(GLuint _program, const char* name) : program(_program), location(getUniformLocation(_program, name))
+		{
+		}
+		void set(const T& value) const
+		{
+			setProgramUniform(program, location, value);
+		}
+	};
+
 	///////////////////////////////////////////////////////////////////////////
 	/// Draws a single quad (two triangles) that cover the entire screen
 	///////////////////////////////////////////////////////////////////////////
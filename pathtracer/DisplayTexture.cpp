@@ -0,0 +1,244 @@
+#include "DisplayTexture.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <glm/gtc/packing.hpp>
+#include "RenderThread.h"
+#if defined(__F16C__)
+#include <immintrin.h>
+#define DISPLAY_F16C 1
+#else
+#define DISPLAY_F16C 0
+#endif
+
+namespace pathtracer
+{
+	size_t getBytesPerPixel(DisplayFormat format)
+	{
+		return format == DisplayFormat::RGBA16F ? 8 : 16;
+	}
+
+	// FNV-1a, a word at a time
+	static inline uint64_t hashWord(uint64_t hash, uint64_t word)
+	{
+		return (hash ^ word) * 1099511628211ull;
+	}
+
+	uint64_t convertDisplayTile(const Image& image, int tile_x, int tile_y, DisplayFormat format, uint8_t* pixels)
+	{
+		const int x0 = tile_x * DISPLAY_TILE_SIZE, y0 = tile_y * DISPLAY_TILE_SIZE;
+		const int x1 = std::min(x0 + DISPLAY_TILE_SIZE, image.width);
+		const int y1 = std::min(y0 + DISPLAY_TILE_SIZE, image.height);
+		uint64_t hash = 14695981039346656037ull;
+		for (int y = y0; y < y1; y++)
+		{
+			const size_t row = size_t(y) * image.width;
+			const vec3* source = &image.data[row];
+			if (format == DisplayFormat::RGBA16F)
+			{
+				uint64_t* destination = reinterpret_cast<uint64_t*>(pixels) + row;
+				for (int x = x0; x < x1; x++)
+				{
+					const vec3& c = source[x];
+#if DISPLAY_F16C
+					const uint64_t half = uint64_t(_mm_cvtsi128_si64(_mm_cvtps_ph(_mm_set_ps(1.0f, c.b, c.g, c.r), 0)));
+#else
+					const uint64_t half = glm::packHalf4x16(vec4(c, 1.0f));
+#endif
+					destination[x] = half;
+					hash = hashWord(hash, half);
+				}
+			}
+			else
+			{
+				vec4* destination = reinterpret_cast<vec4*>(pixels) + row;
+				for (int x = x0; x < x1; x++)
+				{
+					destination[x] = vec4(source[x], 1.0f);
+					uint64_t rg;
+					uint32_t b;
+					memcpy(&rg, &source[x].r, sizeof(rg));
+					memcpy(&b, &source[x].b, sizeof(b));
+					hash = hashWord(hashWord(hash, rg), b);
+				}
+			}
+		}
+		return hash;
+	}
+
+	DisplayTexture::DisplayTexture()
+	    : m_texture(0)
+	    , m_width(0)
+	    , m_height(0)
+	    , m_format(DisplayFormat::RGBA16F)
+	    , m_uploaded_frame(0)
+	    , m_persistent(GLEW_ARB_buffer_storage != 0)
+	    , m_last_upload_ms(0.0f)
+	    , m_last_upload_tiles(0)
+	{
+		for (Staging& staging : m_staging)
+		{
+			staging = Staging{ 0, 0, nullptr };
+		}
+		if (!m_persistent)
+		{
+			printf("No ARB_buffer_storage, the pathtraced image is uploaded from client memory\n");
+		}
+	}
+
+	DisplayTexture::~DisplayTexture()
+	{
+		for (Staging& staging : m_staging)
+		{
+			if (staging.fence != 0)
+			{
+				glDeleteSync(staging.fence);
+			}
+			// Deleting a mapped buffer unmaps it
+			glDeleteBuffers(1, &staging.buffer);
+		}
+		glDeleteTextures(1, &m_texture);
+	}
+
+	int DisplayTexture::getTileCount() const
+	{
+		return ((m_width + DISPLAY_TILE_SIZE - 1) / DISPLAY_TILE_SIZE)
+		       * ((m_height + DISPLAY_TILE_SIZE - 1) / DISPLAY_TILE_SIZE);
+	}
+
+	void DisplayTexture::createTexture(int width, int height, DisplayFormat format)
+	{
+		glDeleteTextures(1, &m_texture);
+		glGenTextures(1, &m_texture);
+		glBindTexture(GL_TEXTURE_2D, m_texture);
+		const GLenum internal_format = format == DisplayFormat::RGBA16F ? GL_RGBA16F : GL_RGBA32F;
+		if (GLEW_ARB_texture_storage)
+		{
+			glTexStorage2D(GL_TEXTURE_2D, 1, internal_format, width, height);
+		}
+		else
+		{
+			glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, GL_RGBA, GL_FLOAT, nullptr);
+		}
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		m_width = width;
+		m_height = height;
+		m_format = format;
+		m_uploaded_frame = 0;
+	}
+
+	void DisplayTexture::createStaging(Frame& frame)
+	{
+		Staging& staging = m_staging[frame.slot];
+		if (staging.fence != 0)
+		{
+			glDeleteSync(staging.fence);
+			staging.fence = 0;
+		}
+		// The GPU keeps the old buffer until it has read it
+		glDeleteBuffers(1, &staging.buffer);
+		const size_t size = size_t(frame.width) * frame.height * getBytesPerPixel(frame.format);
+		const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glGenBuffers(1, &staging.buffer);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging.buffer);
+		glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, nullptr, flags);
+		frame.staging = static_cast<uint8_t*>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags));
+		frame.staging_size = frame.staging != nullptr ? size : 0;
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		staging.frame = &frame;
+	}
+
+	void DisplayTexture::upload(Frame& frame)
+	{
+		if (frame.id == 0 || frame.id == m_uploaded_frame)
+		{
+			return;
+		}
+		auto upload_start = std::chrono::high_resolution_clock::now();
+		glBindTexture(GL_TEXTURE_2D, m_texture);
+		if (frame.width != m_width || frame.height != m_height || frame.format != m_format)
+		{
+			createTexture(frame.width, frame.height, frame.format);
+		}
+
+		if (frame.in_staging)
+		{
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_staging[frame.slot].buffer);
+		}
+		const size_t bytes_per_pixel = getBytesPerPixel(frame.format);
+		const GLenum type = frame.format == DisplayFormat::RGBA16F ? GL_HALF_FLOAT : GL_FLOAT;
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, frame.width);
+
+		// One copy per run of changed tiles in a row of tiles
+		const int tiles_x = (frame.width + DISPLAY_TILE_SIZE - 1) / DISPLAY_TILE_SIZE;
+		const int tiles_y = (frame.height + DISPLAY_TILE_SIZE - 1) / DISPLAY_TILE_SIZE;
+		int tiles = 0;
+		for (int tile_y = 0; tile_y < tiles_y; tile_y++)
+		{
+			const uint64_t* changed = &frame.tile_changed[tile_y * tiles_x];
+			for (int first = 0; first < tiles_x;)
+			{
+				if (changed[first] <= m_uploaded_frame)
+				{
+					first++;
+					continue;
+				}
+				int last = first;
+				while (last + 1 < tiles_x && changed[last + 1] > m_uploaded_frame)
+				{
+					last++;
+				}
+				const int x = first * DISPLAY_TILE_SIZE, y = tile_y * DISPLAY_TILE_SIZE;
+				const int width = std::min((last + 1) * DISPLAY_TILE_SIZE, frame.width) - x;
+				const int height = std::min(DISPLAY_TILE_SIZE, frame.height - y);
+				// An offset into the bound buffer, or a pointer
+				const size_t offset = (size_t(y) * frame.width + x) * bytes_per_pixel;
+				glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, width, height, GL_RGBA, type,
+				                frame.in_staging ? reinterpret_cast<const void*>(offset) : &frame.pixels[offset]);
+				tiles += last - first + 1;
+				first = last + 1;
+			}
+		}
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+		m_uploaded_frame = frame.id;
+		m_last_upload_tiles = tiles;
+
+		if (frame.in_staging)
+		{
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			Staging& staging = m_staging[frame.slot];
+			staging.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			frame.busy = true;
+		}
+		else if (m_persistent)
+		{
+			// The render thread converts this frame's next image straight
+			// into a buffer the size of this one
+			createStaging(frame);
+		}
+		std::chrono::duration<float, std::milli> upload_time = std::chrono::high_resolution_clock::now() - upload_start;
+		m_last_upload_ms = upload_time.count();
+	}
+
+	void DisplayTexture::update()
+	{
+		for (Staging& staging : m_staging)
+		{
+			if (staging.fence == 0)
+			{
+				continue;
+			}
+			const GLenum status = glClientWaitSync(staging.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+			if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED)
+			{
+				glDeleteSync(staging.fence);
+				staging.fence = 0;
+				staging.frame->busy = false;
+			}
+		}
+	}
+} // namespace pathtracer
@@ -0,0 +1,96 @@
+#pragma once
+#include <cstdint>
+#include <GL/glew.h>
+#include "Pathtracer.h"
+
+namespace pathtracer
+{
+	struct Frame;
+
+	///////////////////////////////////////////////////////////////////////////
+	// Pixel format of the displayed image, RGBA so that rows are aligned
+	///////////////////////////////////////////////////////////////////////////
+	enum class DisplayFormat
+	{
+		RGBA16F,
+		RGBA32F
+	};
+	size_t getBytesPerPixel(DisplayFormat format);
+
+	// The displayed image is compared and uploaded in tiles of this size
+	const int DISPLAY_TILE_SIZE = 64;
+
+	///////////////////////////////////////////////////////////////////////////
+	// Converts tile (tile_x, tile_y) of `image` to `format`, into `pixels`,
+	// which are laid out row by row like the whole image. Returns a hash of
+	// the converted pixels, to tell whether the tile has changed.
+	///////////////////////////////////////////////////////////////////////////
+	uint64_t convertDisplayTile(const Image& image, int tile_x, int tile_y, DisplayFormat format, uint8_t* pixels);
+
+	///////////////////////////////////////////////////////////////////////////
+	// The texture the pathtraced image is displayed from, with immutable
+	// storage. Each Frame gets a persistently mapped pixel buffer (with
+	// ARB_buffer_storage) that the render thread converts the image into,
+	// so that an upload is a copy on the GPU of the tiles that changed.
+	// Frames without one, before their first upload at a size, are
+	// uploaded from client memory. GL thread only.
+	///////////////////////////////////////////////////////////////////////////
+	class DisplayTexture
+	{
+	public:
+		DisplayTexture();
+		~DisplayTexture();
+
+		DisplayTexture(const DisplayTexture&) = delete;
+		DisplayTexture& operator=(const DisplayTexture&) = delete;
+
+		///////////////////////////////////////////////////////////////////////
+		/// Uploads the tiles of `frame` that changed since the frame in the
+		/// texture. Call with the frame acquired. The frame's pixel buffer
+		/// is busy until the GPU has read it, see update().
+		///////////////////////////////////////////////////////////////////////
+		void upload(Frame& frame);
+
+		/// Call once per frame: hands the pixel buffers the GPU has read
+		/// back to the render thread
+		void update();
+
+		GLuint getTexture() const
+		{
+			return m_texture;
+		}
+		/// Time spent in the last upload() on the CPU, and the tiles it copied
+		float getLastUploadMs() const
+		{
+			return m_last_upload_ms;
+		}
+		int getLastUploadTiles() const
+		{
+			return m_last_upload_tiles;
+		}
+		int getTileCount() const;
+
+	private:
+		void createTexture(int width, int height, DisplayFormat format);
+		void createStaging(Frame& frame);
+
+		GLuint m_texture;
+		int m_width, m_height;
+		DisplayFormat m_format;
+		// Id of the frame in the texture
+		uint64_t m_uploaded_frame;
+
+		struct Staging
+		{
+			GLuint buffer;
+			GLsync fence;
+			// The frame the buffer is mapped for, busy while fence is set
+			Frame* frame;
+		};
+		Staging m_staging[2];
+		bool m_persistent;
+
+		float m_last_upload_ms;
+		int m_last_upload_tiles;
+	};
+} // namespace pathtracer
@@ -0,0 +1,300 @@
+#include "HeightFieldGeometry.h"
+#include <stb_image.h>
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <iostream>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+	vec3 HeightFieldGeometry::sampleNormal(int i, int j) const
+	{
+		const int i0 = std::max(i - 1, 0), i1 = std::min(i + 1, width - 1);
+		const int j0 = std::max(j - 1, 0), j1 = std::min(j + 1, height - 1);
+		const float dhdx = (sample(i1, j) - sample(i0, j)) * size.y / ((i1 - i0) * spacing.x);
+		const float dhdz = (sample(i, j1) - sample(i, j0)) * size.y / ((j1 - j0) * spacing.z);
+		return normalize(vec3(-dhdx, 1.0f, -dhdz));
+	}
+
+	size_t HeightFieldGeometry::getMemoryBytes() const
+	{
+		size_t bytes = heights.size() * sizeof(float);
+		for (const auto& level : levels)
+		{
+			bytes += level.minMax.size() * sizeof(vec2);
+		}
+		return bytes;
+	}
+
+	HeightFieldGeometry* loadHeightFieldGeometry(const string& path, const vec3& origin, const vec3& size)
+	{
+		int width, height, components;
+		// Unflipped, so that the first image row is at origin.z (the far
+		// edge when looking down -z, as in the rasterized terrain)
+		stbi_set_flip_vertically_on_load(false);
+		float* data = stbi_loadf(path.c_str(), &width, &height, &components, 1);
+		if (data == nullptr || width < 2 || height < 2)
+		{
+			std::cout << "Failed to load height field: " << path << ".\n";
+			if (data != nullptr)
+			{
+				stbi_image_free(data);
+			}
+			return nullptr;
+		}
+
+		auto start = chrono::high_resolution_clock::now();
+		HeightFieldGeometry* hf = new HeightFieldGeometry;
+		hf->width = width;
+		hf->height = height;
+		hf->heights.assign(data, data + size_t(width) * size_t(height));
+		stbi_image_free(data);
+		hf->origin = origin;
+		hf->size = size;
+		hf->spacing = vec3(size.x / (width - 1), size.y, size.z / (height - 1));
+
+		hf->material.m_name = "Terrain";
+		hf->material.m_color = vec3(0.45f, 0.42f, 0.35f);
+		hf->material.m_shininess = 0.0f;
+		hf->material.m_metalness = 0.0f;
+		hf->material.m_fresnel = 0.04f;
+		hf->material.m_emission = vec3(0.0f);
+		hf->material.m_transparency = 0.0f;
+		hf->material.m_ior = 1.0f;
+
+		///////////////////////////////////////////////////////////////////////
+		// Min/max pyramid. The first level is built from the samples of 2x2
+		// cell blocks, the others from the 2x2 blocks of the level below,
+		// until a single block covers everything. Blocks on the far edges
+		// may be partial.
+		///////////////////////////////////////////////////////////////////////
+		int cells_x = width - 1, cells_y = height - 1;
+		while (cells_x > 1 || cells_y > 1)
+		{
+			HeightFieldGeometry::MinMaxLevel level;
+			level.width = (cells_x + 1) / 2;
+			level.height = (cells_y + 1) / 2;
+			level.minMax.resize(size_t(level.width) * size_t(level.height));
+			const bool from_samples = hf->levels.empty();
+			for (int y = 0; y < level.height; y++)
+			{
+				for (int x = 0; x < level.width; x++)
+				{
+					vec2 range(FLT_MAX, -FLT_MAX);
+					if (from_samples)
+					{
+						for (int j = 2 * y; j <= std::min(2 * y + 2, height - 1); j++)
+						{
+							for (int i = 2 * x; i <= std::min(2 * x + 2, width - 1); i++)
+							{
+								range.x = std::min(range.x, hf->sample(i, j));
+								range.y = std::max(range.y, hf->sample(i, j));
+							}
+						}
+					}
+					else
+					{
+						const auto& below = hf->levels.back();
+						for (int j = 2 * y; j <= std::min(2 * y + 1, below.height - 1); j++)
+						{
+							for (int i = 2 * x; i <= std::min(2 * x + 1, below.width - 1); i++)
+							{
+								range.x = std::min(range.x, below.minMax[j * below.width + i].x);
+								range.y = std::max(range.y, below.minMax[j * below.width + i].y);
+							}
+						}
+					}
+					level.minMax[y * level.width + x] = range;
+				}
+			}
+			cells_x = level.width;
+			cells_y = level.height;
+			hf->levels.push_back(std::move(level));
+		}
+		if (hf->levels.empty())
+		{
+			// A single cell
+			hf->heightRange = vec2(*std::min_element(hf->heights.begin(), hf->heights.end()),
+				*std::max_element(hf->heights.begin(), hf->heights.end()));
+		}
+		else
+		{
+			hf->heightRange = hf->levels.back().minMax[0];
+		}
+		auto end = chrono::high_resolution_clock::now();
+		hf->buildMs = chrono::duration<float, milli>(end - start).count();
+
+		// A triangle mesh of the same surface would need a BVH over these
+		size_t triangles = 2 * size_t(width - 1) * size_t(height - 1);
+		std::cout << "Height field " << path << ": " << width << "x" << height << ", "
+		          << hf->getMemoryBytes() / 1024 << " kB, min/max pyramid built in " << hf->buildMs
+		          << " ms (" << triangles << " triangles when tessellated).\n";
+		return hf;
+	}
+
+	void freeHeightFieldGeometry(HeightFieldGeometry* heightfield)
+	{
+		delete heightfield;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Moller-Trumbore ray/triangle test. u and v are the barycentric
+	// coordinates of v1 and v2.
+	///////////////////////////////////////////////////////////////////////////
+	static bool intersectTriangle(const vec3& o, const vec3& d, const vec3& v0, const vec3& v1, const vec3& v2,
+		float tnear, float tfar, float& t, float& u, float& v)
+	{
+		const vec3 e1 = v1 - v0;
+		const vec3 e2 = v2 - v0;
+		const vec3 p = cross(d, e2);
+		const float det = dot(e1, p);
+		if (det == 0.0f)
+		{
+			return false;
+		}
+		const float inv_det = 1.0f / det;
+		const vec3 s = o - v0;
+		u = dot(s, p) * inv_det;
+		if (u < 0.0f || u > 1.0f)
+		{
+			return false;
+		}
+		const vec3 q = cross(s, e1);
+		v = dot(d, q) * inv_det;
+		if (v < 0.0f || u + v > 1.0f)
+		{
+			return false;
+		}
+		t = dot(e2, q) * inv_det;
+		return t > tnear && t < tfar;
+	}
+
+	bool intersectHeightField(const HeightFieldGeometry* hf, const vec3& ray_origin, const vec3& ray_direction,
+		float tnear, float& tfar, bool any_hit, vec3& normal, uint32_t& prim, float& u, float& v)
+	{
+		///////////////////////////////////////////////////////////////////////
+		// Trace in grid space, where cell (i, j) spans [i, i + 1] x [j, j + 1]
+		// and y is the raw sample value. The mapping is affine, so ray
+		// distances are the same as in world space.
+		///////////////////////////////////////////////////////////////////////
+		const vec3 o = (ray_origin - hf->origin) / hf->spacing;
+		const vec3 d = ray_direction / hf->spacing;
+		const vec3 inv_d = 1.0f / d;
+		const int cells_x = hf->width - 1, cells_y = hf->height - 1;
+		// Blocks are padded a little so rays through shared edges can not
+		// slip between two cells
+		const float pad = 1e-3f;
+
+		///////////////////////////////////////////////////////////////////////
+		// Depth first walk of the pyramid. A node at level l is a block of
+		// 2^l x 2^l cells; level 0 is a single cell, whose height range is
+		// taken from its corners. Children are visited nearest first, and
+		// once a hit is found, blocks beyond it are skipped by the box test.
+		///////////////////////////////////////////////////////////////////////
+		struct Node
+		{
+			int level, x, y;
+		};
+		Node stack[4 * 32];
+		int top = 0;
+		stack[top++] = { int(hf->levels.size()), 0, 0 };
+		const int near_x = d.x < 0.0f ? 1 : 0;
+		const int near_z = d.z < 0.0f ? 1 : 0;
+		bool hit = false;
+
+		while (top > 0)
+		{
+			const Node node = stack[--top];
+			const int block = 1 << node.level;
+			const int x0 = node.x * block, x1 = std::min(x0 + block, cells_x);
+			const int z0 = node.y * block, z1 = std::min(z0 + block, cells_y);
+			float h00 = 0.0f, h10 = 0.0f, h01 = 0.0f, h11 = 0.0f;
+			vec2 range;
+			if (node.level == 0)
+			{
+				h00 = hf->sample(x0, z0);
+				h10 = hf->sample(x1, z0);
+				h01 = hf->sample(x0, z1);
+				h11 = hf->sample(x1, z1);
+				range = vec2(std::min(std::min(h00, h10), std::min(h01, h11)),
+					std::max(std::max(h00, h10), std::max(h01, h11)));
+			}
+			else
+			{
+				const auto& level = hf->levels[node.level - 1];
+				range = level.minMax[node.y * level.width + node.x];
+			}
+
+			// Slab test. The argument order makes NaNs from axis aligned
+			// rays leave the interval unchanged.
+			const vec3 box_min(x0 - pad, range.x - pad, z0 - pad);
+			const vec3 box_max(x1 + pad, range.y + pad, z1 + pad);
+			const vec3 t0 = (box_min - o) * inv_d;
+			const vec3 t1 = (box_max - o) * inv_d;
+			float tmin = tnear, tmax = tfar;
+			for (int k = 0; k < 3; k++)
+			{
+				tmin = std::max(tmin, std::min(t0[k], t1[k]));
+				tmax = std::min(tmax, std::max(t0[k], t1[k]));
+			}
+			if (tmin > tmax)
+			{
+				continue;
+			}
+
+			if (node.level == 0)
+			{
+				// The two triangles of the cell
+				const vec3 p00(x0, h00, z0), p10(x1, h10, z0), p01(x0, h01, z1), p11(x1, h11, z1);
+				float t, tu, tv;
+				if (intersectTriangle(o, d, p00, p10, p01, tnear, tfar, t, tu, tv))
+				{
+					tfar = t;
+					normal = cross(p01 - p00, p10 - p00);
+					prim = 2 * uint32_t(z0 * cells_x + x0);
+					u = tu;
+					v = tv;
+					hit = true;
+				}
+				if (intersectTriangle(o, d, p11, p01, p10, tnear, tfar, t, tu, tv))
+				{
+					tfar = t;
+					normal = cross(p10 - p11, p01 - p11);
+					prim = 2 * uint32_t(z0 * cells_x + x0) + 1;
+					u = tu;
+					v = tv;
+					hit = true;
+				}
+				if (hit && any_hit)
+				{
+					break;
+				}
+				continue;
+			}
+
+			// Push the children farthest first
+			const int child_level = node.level - 1;
+			const int child_w = child_level == 0 ? cells_x : hf->levels[child_level - 1].width;
+			const int child_h = child_level == 0 ? cells_y : hf->levels[child_level - 1].height;
+			for (int k = 3; k >= 0; k--)
+			{
+				const int cx = 2 * node.x + ((k & 1) ? 1 - near_x : near_x);
+				const int cy = 2 * node.y + ((k & 2) ? 1 - near_z : near_z);
+				if (cx < child_w && cy < child_h)
+				{
+					stack[top++] = { child_level, cx, cy };
+				}
+			}
+		}
+
+		if (hit)
+		{
+			// Normals are covectors, so they scale inversely to positions
+			normal = normal / hf->spacing;
+		}
+		return hit;
+	}
+} // namespace pathtracer
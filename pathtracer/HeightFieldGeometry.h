@@ -0,0 +1,71 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <string>
+#include <vector>
+#include <Model.h>
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// A height field that is ray traced directly, instead of being
+	// tessellated into triangles. Sample (i, j) of the height map is at
+	//
+	//   origin + (i * spacing.x, height(i, j) * size.y, j * spacing.z)
+	//
+	// and every grid cell is split into two triangles along the diagonal
+	// from (i + 1, j) to (i, j + 1). Rays are traced through a min/max
+	// pyramid over the cells, so that only the few cells near the ray are
+	// tested against their triangles.
+	///////////////////////////////////////////////////////////////////////////
+	struct HeightFieldGeometry
+	{
+		int width, height;
+		// width * height samples, row by row, in [0, 1]
+		std::vector<float> heights;
+		// Height range of blocks of 2^(l + 1) x 2^(l + 1) cells in level l
+		struct MinMaxLevel
+		{
+			int width, height;
+			std::vector<glm::vec2> minMax;
+		};
+		std::vector<MinMaxLevel> levels;
+		// Range of all samples
+		glm::vec2 heightRange;
+
+		glm::vec3 origin;
+		glm::vec3 size;
+		glm::vec3 spacing;
+		labhelper::Material material;
+
+		float buildMs;
+
+		float sample(int i, int j) const
+		{
+			return heights[j * width + i];
+		}
+		// Smooth normal at a sample, from central differences
+		glm::vec3 sampleNormal(int i, int j) const;
+		// Bytes used by the samples and the pyramid
+		size_t getMemoryBytes() const;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// Load a height map image and build its min/max pyramid. The height
+	// field covers the box from `origin` to `origin + size`, with the first
+	// image row at origin.z. Returns nullptr if the image can not be loaded.
+	///////////////////////////////////////////////////////////////////////////
+	HeightFieldGeometry* loadHeightFieldGeometry(const std::string& path, const glm::vec3& origin,
+		const glm::vec3& size);
+	void freeHeightFieldGeometry(HeightFieldGeometry* heightfield);
+
+	///////////////////////////////////////////////////////////////////////////
+	// Closest hit along the ray between tnear and tfar. On a hit, tfar is
+	// set to the hit distance, `normal` to the (unnormalized, upward facing)
+	// world space normal of the hit triangle, `prim` to the triangle index
+	// and u, v to its barycentric coordinates. With `any_hit`, the search
+	// stops at the first hit found.
+	///////////////////////////////////////////////////////////////////////////
+	bool intersectHeightField(const HeightFieldGeometry* heightfield, const glm::vec3& ray_origin,
+		const glm::vec3& ray_direction, float tnear, float& tfar, bool any_hit, glm::vec3& normal,
+		uint32_t& prim, float& u, float& v);
+} // namespace pathtracer
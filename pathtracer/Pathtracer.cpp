@@ -7,6 +7,8 @@
 #include "embree.h"
 #include "sampling.h"
 #include "labhelper.h"
+#include "Profiler.h"
+#include "stats.h"
 
 using namespace std;
 using namespace glm;
@@ -20,9 +22,68 @@ namespace pathtracer
 	Settings settings;
 	Environment environment;
 	Image rendered_image;
+	FeatureImage feature_image;
 	PointLight point_light;
 	std::vector<DiscLight> disc_lights;
 
+	// One set of ray counts per thread, each on its own cache line, so
+	// counting does not need atomics
+	struct alignas(64) ThreadRayCounts
+	{
+		RayCounts counts;
+	};
+	ThreadRayCounts thread_ray_counts[24]; // Assuming no more than 24 cores, like randf()
+
+	inline RayCounts& rayCounts()
+	{
+		return thread_ray_counts[omp_get_thread_num()].counts;
+	}
+
+	RayCounts getRayCounts()
+	{
+		RayCounts total = {};
+		for (const ThreadRayCounts& thread : thread_ray_counts)
+		{
+			total.primary += thread.counts.primary;
+			total.secondary += thread.counts.secondary;
+			total.shadow += thread.counts.shadow;
+		}
+		return total;
+	}
+
+	void resetRayCounts()
+	{
+		for (ThreadRayCounts& thread : thread_ray_counts)
+		{
+			thread.counts = RayCounts();
+		}
+	}
+
+	// Reprojection: set by cameraMoved(), the view the last samples were
+	// traced from, and the buffers they are moved to when the camera moves
+	bool camera_moved = false;
+	mat4 last_view_projection;
+	vec3 last_camera_pos;
+	struct History
+	{
+		std::vector<vec3> color;
+		std::vector<float> depth;
+		std::vector<float> luminance_squared;
+		std::vector<float> samples;
+	};
+	History history;
+	// The samples of the first frame after a move, and where their first
+	// hits were in the last view: pixel x and y, and the expected distance
+	// from the last camera (0 for the environment). x < -1 if not visible.
+	std::vector<vec3> new_samples;
+	std::vector<vec3> history_coords;
+	// Samples in the albedo, normal and depth of each pixel. These start
+	// over after a move, while the color keeps its reprojected samples.
+	std::vector<float> feature_samples;
+	// Relative depth difference above which a reprojected pixel is taken
+	// to be another surface, that was occluded in the last view
+	const float REPROJECTION_DEPTH_TOLERANCE = 0.03f;
+
 	///////////////////////////////////////////////////////////////////////////
 	// Restart rendering of image
 	///////////////////////////////////////////////////////////////////////////
@@ -30,6 +91,20 @@ namespace pathtracer
 	{
 		// No need to clear image,
 		rendered_image.number_of_samples = 0;
+		camera_moved = false;
+		stats::resetStats();
+	}
+
+	void cameraMoved()
+	{
+		if (settings.reproject)
+		{
+			camera_moved = true;
+		}
+		else
+		{
+			restart();
+		}
 	}
 
 	int getSampleCount()
@@ -46,6 +121,14 @@ namespace pathtracer
 		rendered_image.width = w / settings.subsampling;
 		rendered_image.height = h / settings.subsampling;
 		rendered_image.data.resize(rendered_image.width * rendered_image.height);
+		feature_image.width = rendered_image.width;
+		feature_image.height = rendered_image.height;
+		feature_image.albedo.resize(rendered_image.data.size());
+		feature_image.normal.resize(rendered_image.data.size());
+		feature_image.depth.resize(rendered_image.data.size());
+		feature_image.luminance_squared.resize(rendered_image.data.size());
+		feature_image.samples.resize(rendered_image.data.size());
+		feature_samples.resize(rendered_image.data.size());
 		restart();
 	}
 
@@ -55,6 +138,7 @@ namespace pathtracer
 	///////////////////////////////////////////////////////////////////////////
 	vec3 Lenvironment(const vec3& wi)
 	{
+		PATHTRACER_ZONE(Lenvironment);
 		const float theta = acos(std::max(-1.0f, std::min(1.0f, wi.y)));
 		float phi = atan(wi.z, wi.x);
 		if (phi < 0.0f)
@@ -65,9 +149,10 @@ namespace pathtracer
 
 	///////////////////////////////////////////////////////////////////////////
 	/// Calculate the radiance going from one point (r.hitPosition()) in one
-	/// direction (-r.d), through path tracing.
+	/// direction (-r.d), through path tracing. The first intersection is
+	/// returned in `first_hit`, for the denoiser's features.
 	///////////////////////////////////////////////////////////////////////////
-	vec3 Li(Ray& primary_ray)
+	vec3 Li(Ray& primary_ray, Intersection& first_hit)
 	{
 		vec3 L = vec3(0.0f);
 		vec3 path_throughput = vec3(1.0);
@@ -123,6 +208,10 @@ namespace pathtracer
 		for (int bounces = 0; bounces < settings.max_bounces; bounces++) {
 			// Get the intersection information from the ray
 			Intersection hit = getIntersection(current_ray);
+			if (bounces == 0)
+			{
+				first_hit = hit;
+			}
 
 			// Create a material tree
 			Diffuse diffuse(hit.material->m_color);
@@ -144,6 +233,7 @@ namespace pathtracer
 				shadowRay.o = hit.position + hit.geometry_normal * EPSILON;
 				shadowRay.d = normalize(point_light.position - hit.position);
 
+				rayCounts().shadow++;
 				if (!occluded(shadowRay))
 				{
 					L += path_throughput * mat.f(wi, hit.wo, hit.shading_normal) * Li * std::max(0.0f, dot(wi, hit.shading_normal));
@@ -174,6 +264,7 @@ namespace pathtracer
 				shadowRay.o = hit.position + hit.geometry_normal * EPSILON;
 				shadowRay.d = wi;
 
+				rayCounts().shadow++;
 				if (!occluded(shadowRay))
 				{
 					float cos_theta = std::max(0.0f, dot(wi, hit.shading_normal));
@@ -187,7 +278,11 @@ namespace pathtracer
 			L += path_throughput * hit.material->m_emission;
 
 			// Sample an incoming direction (and the brdf and pdf for that direction)
-			WiSample sample = mat.sample_wi(hit.wo, hit.shading_normal);
+			WiSample sample;
+			{
+				PATHTRACER_ZONE(SampleWi);
+				sample = mat.sample_wi(hit.wo, hit.shading_normal);
+			}
 			vec3 wi = sample.wi;
 			vec3 f = sample.f;
 			float pdf = sample.pdf;
@@ -195,6 +290,7 @@ namespace pathtracer
 			// If the pdf is too close to zero, it means that the current path is extremely
 			// unlikely to exist, so we break to avoid numerical instability
 			if (pdf < EPSILON) {
+				PATHTRACER_END_PATH(bounces + 1, LowPdf);
 				return L;
 			}
 
@@ -204,6 +300,7 @@ namespace pathtracer
 
 			// If pathThroughput is zero there is no need to continue, as no more light comes from this path
 			if (path_throughput == vec3(0.0f)) {
+				PATHTRACER_END_PATH(bounces + 1, ZeroThroughput);
 				return L;
 			}
 
@@ -215,7 +312,9 @@ namespace pathtracer
 
 			// Intersect the new ray and if there is no intersection just
 			// add environment contribution and finish
+			rayCounts().secondary++;
 			if (!intersect(next_ray)) {
+				PATHTRACER_END_PATH(bounces + 1, EnvironmentMiss);
 				return L + path_throughput * Lenvironment(next_ray.d);
 			}
 			// Otherwise, reiterate for the new intersection
@@ -223,6 +322,7 @@ namespace pathtracer
 		}
 
 		// Return the final outgoing radiance for the primary ray
+		PATHTRACER_END_PATH(settings.max_bounces, MaxBounces);
 		return L;
 	}
 
@@ -234,16 +334,127 @@ namespace pathtracer
 		return glm::vec3(p * (1.f / p.w));
 	}
 
+	///////////////////////////////////////////////////////////////////////////
+	/// Blends the new samples with the samples of the last view: bilinearly
+	/// from the pixels around where each first hit was, that saw the same
+	/// surface, and clamped to the neighbourhood of the new samples, which
+	/// rejects what the depth test misses, like moving shadows.
+	///////////////////////////////////////////////////////////////////////////
+	static void resolveReprojection()
+	{
+		PROFILE_CPU_ZONE("reprojection");
+		const int width = rendered_image.width, height = rendered_image.height;
+#pragma omp parallel for
+		for (int y = 0; y < height; y++)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				const int pixel = y * width + x;
+				const vec3 sample = new_samples[pixel];
+				const float luminance = dot(sample, vec3(0.2126f, 0.7152f, 0.0722f));
+				vec3 color = sample;
+				float luminance_squared = luminance * luminance;
+				float samples = 1.0f;
+
+				const vec3 coords = history_coords[pixel];
+				const int x0 = int(std::floor(coords.x)), y0 = int(std::floor(coords.y));
+				const float fx = coords.x - x0, fy = coords.y - y0;
+				vec3 history_color(0.0f);
+				float history_luminance_squared = 0.0f, history_samples = 0.0f, history_weight = 0.0f;
+				for (int tap = 0; tap < 4; tap++)
+				{
+					const int hx = x0 + (tap & 1), hy = y0 + (tap >> 1);
+					if (hx < 0 || hx >= width || hy < 0 || hy >= height)
+					{
+						continue;
+					}
+					const int q = hy * width + hx;
+					const float depth = history.depth[q];
+					const bool same_surface = coords.z > 0.0f
+						? std::abs(depth - coords.z) < REPROJECTION_DEPTH_TOLERANCE * coords.z
+						: depth == 0.0f;
+					if (!same_surface)
+					{
+						continue;
+					}
+					const float weight = ((tap & 1) ? fx : 1.0f - fx) * ((tap >> 1) ? fy : 1.0f - fy);
+					history_color += weight * history.color[q];
+					history_luminance_squared += weight * history.luminance_squared[q];
+					history_samples += weight * history.samples[q];
+					history_weight += weight;
+				}
+
+				// Disoccluded pixels start over
+				if (history_weight > 0.01f)
+				{
+					history_color /= history_weight;
+					history_luminance_squared /= history_weight;
+					history_samples /= history_weight;
+
+					vec3 mean(0.0f), mean_squared(0.0f);
+					int count = 0;
+					for (int qy = std::max(y - 1, 0); qy <= std::min(y + 1, height - 1); qy++)
+					{
+						for (int qx = std::max(x - 1, 0); qx <= std::min(x + 1, width - 1); qx++)
+						{
+							const vec3 neighbour = new_samples[qy * width + qx];
+							mean += neighbour;
+							mean_squared += neighbour * neighbour;
+							count++;
+						}
+					}
+					mean /= float(count);
+					const vec3 deviation = sqrt(max(mean_squared / float(count) - mean * mean, vec3(0.0f)));
+					history_color = clamp(history_color, mean - settings.history_clamp * deviation,
+						mean + settings.history_clamp * deviation);
+
+					const float n = std::min(history_samples, float(settings.max_history));
+					color = (history_color * n + sample) / (n + 1.0f);
+					luminance_squared = (history_luminance_squared * n + luminance * luminance) / (n + 1.0f);
+					samples = n + 1.0f;
+				}
+				rendered_image.data[pixel] = color;
+				feature_image.luminance_squared[pixel] = luminance_squared;
+				feature_image.samples[pixel] = samples;
+			}
+		}
+	}
+
 	///////////////////////////////////////////////////////////////////////////
 	/// Trace one path per pixel and accumulate the result in an image
 	///////////////////////////////////////////////////////////////////////////
-	void tracePaths(const glm::mat4& V, const glm::mat4& P)
+	bool tracePaths(const glm::mat4& V, const glm::mat4& P)
 	{
+		PROFILE_CPU_ZONE("tracePaths");
+		// After a camera move, keep the samples so far to reproject them
+		bool reprojecting = false;
+		if (camera_moved)
+		{
+			camera_moved = false;
+			if (rendered_image.number_of_samples > 0)
+			{
+				reprojecting = true;
+				history.color.swap(rendered_image.data);
+				history.depth.swap(feature_image.depth);
+				history.luminance_squared.swap(feature_image.luminance_squared);
+				history.samples.swap(feature_image.samples);
+				for (auto buffer : { &rendered_image.data, &new_samples, &history_coords })
+				{
+					buffer->resize(history.color.size());
+				}
+				for (auto buffer : { &feature_image.depth, &feature_image.luminance_squared, &feature_image.samples })
+				{
+					buffer->resize(history.color.size());
+				}
+				// The pixels' sample counts are used from here on
+				rendered_image.number_of_samples = 0;
+			}
+		}
 		// Stop here if we have as many samples as we want
 		if ((int(rendered_image.number_of_samples) > settings.max_paths_per_pixel)
 			&& (settings.max_paths_per_pixel != 0))
 		{
-			return;
+			return false;
 		}
 		vec3 camera_pos = vec3(glm::inverse(V) * vec4(0.0f, 0.0f, 0.0f, 1.0f));
 		// Trace one path per pixel (the omp parallel stuf magically distributes the
@@ -254,9 +465,12 @@ namespace pathtracer
 #pragma omp parallel for
 		for (int y = 0; y < rendered_image.height; y++)
 		{
+			PROFILE_CPU_ZONE("row");
 			for (int x = 0; x < rendered_image.width; x++)
 			{
 				vec3 color;
+				vec3 albedo(0.0f), normal(0.0f);
+				float depth = 0.0f;
 				Ray primaryRay;
 				primaryRay.o = camera_pos;
 				// Create a ray that starts in the camera position and points toward
@@ -274,23 +488,77 @@ namespace pathtracer
 				primaryRay.d = normalize(p - camera_pos);
 
 				// Intersect ray with scene
+				rayCounts().primary++;
 				if (intersect(primaryRay))
 				{
 					// If it hit something, evaluate the radiance from that point
-					color = Li(primaryRay);
+					PATHTRACER_ZONE(Li);
+					Intersection hit = {};
+					color = Li(primaryRay, hit);
+					// No hit is recorded with max_bounces = 0
+					if (hit.material != nullptr)
+					{
+						albedo = hit.material->m_color;
+						normal = hit.shading_normal;
+						depth = length(hit.position - camera_pos);
+					}
 				}
 				else
 				{
+					PATHTRACER_END_PATH(0, PrimaryMiss);
 					// Otherwise evaluate environment
 					color = Lenvironment(primaryRay.d);
+					// The background is not lit, it is its own albedo
+					albedo = color;
+				}
+				const int pixel = y * rendered_image.width + x;
+				if (reprojecting)
+				{
+					// Where the first hit, or the environment in the ray's
+					// direction, was in the last view
+					const vec4 last_clip = last_view_projection
+						* (depth > 0.0f ? vec4(camera_pos + primaryRay.d * depth, 1.0f) : vec4(primaryRay.d, 0.0f));
+					vec3 coords(-2.0f);
+					if (last_clip.w > 0.0f)
+					{
+						const vec2 ndc = vec2(last_clip) / last_clip.w;
+						coords = vec3((ndc * 0.5f + 0.5f) * vec2(rendered_image.width, rendered_image.height) - 0.5f,
+							depth > 0.0f ? length(camera_pos + primaryRay.d * depth - last_camera_pos) : 0.0f);
+					}
+					history_coords[pixel] = coords;
+					new_samples[pixel] = color;
+					// The features are view dependent, start them over
+					feature_image.albedo[pixel] = albedo;
+					feature_image.normal[pixel] = normal;
+					feature_image.depth[pixel] = depth;
+					feature_samples[pixel] = 1.0f;
+					continue;
 				}
-				// Accumulate the obtained radiance to the pixels color
-				float n = float(rendered_image.number_of_samples);
-				rendered_image.data[y * rendered_image.width + x] =
-					rendered_image.data[y * rendered_image.width + x] * (n / (n + 1.0f))
-					+ (1.0f / (n + 1.0f)) * color;
+
+				// Accumulate the obtained radiance to the pixels color, with
+				// the pixel's samples so far
+				float n = rendered_image.number_of_samples > 0 ? feature_image.samples[pixel] : 0.0f;
+				feature_image.samples[pixel] = n + 1.0f;
+				rendered_image.data[pixel] = rendered_image.data[pixel] * (n / (n + 1.0f)) + (1.0f / (n + 1.0f)) * color;
+
+				// And the features, the view dependent ones with their own count
+				const float m = rendered_image.number_of_samples > 0 ? feature_samples[pixel] : 0.0f;
+				feature_samples[pixel] = m + 1.0f;
+				feature_image.albedo[pixel] = feature_image.albedo[pixel] * (m / (m + 1.0f)) + (1.0f / (m + 1.0f)) * albedo;
+				feature_image.normal[pixel] = feature_image.normal[pixel] * (m / (m + 1.0f)) + (1.0f / (m + 1.0f)) * normal;
+				feature_image.depth[pixel] = feature_image.depth[pixel] * (m / (m + 1.0f)) + (1.0f / (m + 1.0f)) * depth;
+				const float luminance = dot(color, vec3(0.2126f, 0.7152f, 0.0722f));
+				feature_image.luminance_squared[pixel] = feature_image.luminance_squared[pixel] * (n / (n + 1.0f))
+					+ (1.0f / (n + 1.0f)) * luminance * luminance;
 			}
 		}
+		if (reprojecting)
+		{
+			resolveReprojection();
+		}
+		last_view_projection = P * V;
+		last_camera_pos = camera_pos;
 		rendered_image.number_of_samples += 1;
+		return true;
 	}
 }; // namespace pathtracer
\ No newline at end of file
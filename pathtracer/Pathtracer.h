@@ -18,18 +18,26 @@ namespace pathtracer
 	///////////////////////////////////////////////////////////////////////////////
 	// Path Tracer settings
 	///////////////////////////////////////////////////////////////////////////////
-	extern struct Settings
+	struct Settings
 	{
 		int subsampling;
 		int max_bounces;
 		int max_paths_per_pixel;
+		// Keep the samples when the camera moves, see cameraMoved()
+		bool reproject;
+		// Samples a reprojected pixel keeps at most, so that it can follow
+		// view dependent lighting
+		int max_history;
+		// Reprojected colors are clamped to the mean of their 3x3
+		// neighbourhood in the new sample, +- this many standard deviations
+		float history_clamp;
 	};
 	extern Settings settings;
 
 	///////////////////////////////////////////////////////////////////////////////
 	// Environment
 	///////////////////////////////////////////////////////////////////////////////
-	extern struct Environment
+	struct Environment
 	{
 		float multiplier;
 		HDRImage map;
@@ -39,7 +47,7 @@ namespace pathtracer
 	///////////////////////////////////////////////////////////////////////////
 	// The rendered image
 	///////////////////////////////////////////////////////////////////////////
-	extern struct Image
+	struct Image
 	{
 		int width, height, number_of_samples = 0;
 		std::vector<glm::vec3> data;
@@ -50,6 +58,26 @@ namespace pathtracer
 	};
 	extern Image rendered_image;
 
+	///////////////////////////////////////////////////////////////////////////
+	// Features of the first hit of each camera path, averaged over the
+	// samples like rendered_image, to guide the denoiser: the albedo, the
+	// shading normal, the distance from the camera (0 where the rays miss),
+	// and the mean squared luminance, for the variance of each pixel. Also
+	// the number of samples in each pixel, which differ after reprojection.
+	// The albedo, normal and distance are only averaged over the samples
+	// since the last camera move, as they depend on the view.
+	///////////////////////////////////////////////////////////////////////////
+	struct FeatureImage
+	{
+		int width, height;
+		std::vector<glm::vec3> albedo;
+		std::vector<glm::vec3> normal;
+		std::vector<float> depth;
+		std::vector<float> luminance_squared;
+		std::vector<float> samples;
+	};
+	extern FeatureImage feature_image;
+
 	///////////////////////////////////////////////////////////////////////////////
 	// The light sources
 	///////////////////////////////////////////////////////////////////////////////
@@ -76,6 +104,15 @@ namespace pathtracer
 	///////////////////////////////////////////////////////////////////////////
 	void restart();
 
+	///////////////////////////////////////////////////////////////////////////
+	/// Call instead of restart() when only the camera has moved. With
+	/// settings.reproject, the next tracePaths() reprojects the samples so
+	/// far into the new view through the first hit depth of each pixel,
+	/// and keeps them where the same surface is still visible. Otherwise,
+	/// the same as restart().
+	///////////////////////////////////////////////////////////////////////////
+	void cameraMoved();
+
 	///////////////////////////////////////////////////////////////////////////
 	/// Get the amount of samples taken in the current image
 	///////////////////////////////////////////////////////////////////////////
@@ -88,7 +125,21 @@ namespace pathtracer
 	void resize(int w, int h);
 
 	///////////////////////////////////////////////////////////////////////////
-	/// Trace one path per pixel
+	/// Trace one path per pixel. Returns false, without tracing, once there
+	/// are settings.max_paths_per_pixel samples.
+	///////////////////////////////////////////////////////////////////////////
+	bool tracePaths(const mat4& V, const mat4& P);
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Number of rays traced since the last resetRayCounts(): camera rays,
+	/// bounce rays and shadow rays
 	///////////////////////////////////////////////////////////////////////////
-	void tracePaths(const mat4& V, const mat4& P);
+	struct RayCounts
+	{
+		uint64_t primary;
+		uint64_t secondary;
+		uint64_t shadow;
+	};
+	RayCounts getRayCounts();
+	void resetRayCounts();
 }; // namespace pathtracer
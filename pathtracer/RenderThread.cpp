@@ -0,0 +1,316 @@
+#include "RenderThread.h"
+#include <chrono>
+#include <Profiler.h>
+
+namespace pathtracer
+{
+	MaterialParameters getMaterialParameters(const labhelper::Material& material)
+	{
+		MaterialParameters parameters;
+		parameters.color = material.m_color;
+		parameters.metalness = material.m_metalness;
+		parameters.fresnel = material.m_fresnel;
+		parameters.shininess = material.m_shininess;
+		parameters.emission = material.m_emission;
+		parameters.transparency = material.m_transparency;
+		return parameters;
+	}
+
+	RenderThread::RenderThread()
+	    : m_pushed(0)
+	    , m_applied(0)
+	    , m_has_camera(false)
+	    , m_window_width(0)
+	    , m_window_height(0)
+	    , m_publish_pending(false)
+	    , m_trace_ms(0.0f)
+	    , m_display_format(DisplayFormat::RGBA16F)
+	    , m_tiles_width(0)
+	    , m_tiles_height(0)
+	    , m_tiles_format(DisplayFormat::RGBA16F)
+	    , m_front(0)
+	    , m_pause_depth(0)
+	    , m_pause_requested(false)
+	    , m_paused(false)
+	    , m_quit(false)
+	{
+		m_frames[0].slot = 0;
+		m_frames[1].slot = 1;
+		m_thread = std::thread(&RenderThread::threadMain, this);
+	}
+
+	RenderThread::~RenderThread()
+	{
+		m_quit = true;
+		{
+			std::lock_guard<std::mutex> lock(m_pause_mutex);
+			m_pause_requested = false;
+			m_pause_changed.notify_all();
+		}
+		m_thread.join();
+	}
+
+	void RenderThread::send(const Command& command)
+	{
+		if (!m_unsent.empty() || !m_queue.push(command))
+		{
+			m_unsent.push_back(command);
+		}
+		else
+		{
+			m_pushed++;
+		}
+	}
+
+	void RenderThread::flush()
+	{
+		size_t sent = 0;
+		while (sent < m_unsent.size() && m_queue.push(m_unsent[sent]))
+		{
+			sent++;
+		}
+		m_pushed += sent;
+		m_unsent.erase(m_unsent.begin(), m_unsent.begin() + sent);
+	}
+
+	void RenderThread::pause()
+	{
+		if (m_pause_depth++ > 0)
+		{
+			return;
+		}
+		std::unique_lock<std::mutex> lock(m_pause_mutex);
+		m_pause_requested = true;
+		// The commands that did not fit are applied too, as the queue
+		// empties while the render thread applies them
+		while (!m_paused || !m_unsent.empty() || m_applied.load() != m_pushed)
+		{
+			flush();
+			m_pause_changed.wait_for(lock, std::chrono::milliseconds(1));
+		}
+	}
+
+	void RenderThread::resume()
+	{
+		if (--m_pause_depth > 0)
+		{
+			return;
+		}
+		std::lock_guard<std::mutex> lock(m_pause_mutex);
+		m_pause_requested = false;
+		m_pause_changed.notify_all();
+	}
+
+	Frame& RenderThread::acquireFrame()
+	{
+		m_frame_mutex.lock();
+		return m_frames[m_front];
+	}
+
+	void RenderThread::releaseFrame()
+	{
+		m_frame_mutex.unlock();
+	}
+
+	void RenderThread::threadMain()
+	{
+		while (!m_quit)
+		{
+			applyCommands();
+			{
+				std::unique_lock<std::mutex> lock(m_pause_mutex);
+				if (m_pause_requested)
+				{
+					m_paused = true;
+					m_pause_changed.notify_all();
+					while (m_pause_requested)
+					{
+						// Keeps applying commands, that pause() waits for
+						lock.unlock();
+						applyCommands();
+						lock.lock();
+						m_pause_changed.wait_for(lock, std::chrono::milliseconds(1));
+					}
+					m_paused = false;
+					continue;
+				}
+			}
+			if (!m_has_camera || m_window_width == 0)
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				continue;
+			}
+
+			auto trace_start = std::chrono::high_resolution_clock::now();
+			const bool traced = tracePaths(m_view, m_projection);
+			std::chrono::duration<float, std::milli> trace_time = std::chrono::high_resolution_clock::now() - trace_start;
+			if (traced)
+			{
+				m_trace_ms = trace_time.count();
+			}
+			if (traced || m_publish_pending)
+			{
+				publish();
+			}
+			else
+			{
+				// All samples are taken, wait for a change
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}
+	}
+
+	void RenderThread::applyCommands()
+	{
+		Command command;
+		while (m_queue.pop(command))
+		{
+			apply(command);
+			m_applied++;
+		}
+	}
+
+	void RenderThread::apply(const Command& command)
+	{
+		switch (command.type)
+		{
+		case Command::SetCamera:
+			m_view = command.view;
+			m_projection = command.projection;
+			if (m_has_camera)
+			{
+				cameraMoved();
+			}
+			m_has_camera = true;
+			break;
+		case Command::Restart:
+			restart();
+			break;
+		case Command::Resize:
+			m_window_width = command.width;
+			m_window_height = command.height;
+			resize(m_window_width, m_window_height);
+			break;
+		case Command::SetSettings:
+		{
+			const bool resized = command.settings.subsampling != settings.subsampling;
+			settings = command.settings;
+			if (resized && m_window_width > 0)
+			{
+				resize(m_window_width, m_window_height);
+			}
+			break;
+		}
+		case Command::SetDenoiser:
+			denoiser::settings = command.denoiser_settings;
+			m_publish_pending = true;
+			break;
+		case Command::SetPointLight:
+			point_light = command.point_light;
+			break;
+		case Command::SetDiscLight:
+			disc_lights[command.index] = command.disc_light;
+			break;
+		case Command::SetEnvironment:
+			environment.multiplier = command.environment_multiplier;
+			break;
+		case Command::SetMaterial:
+		{
+			labhelper::Material& material = *command.material;
+			const MaterialParameters& parameters = command.material_parameters;
+			material.m_color = parameters.color;
+			material.m_metalness = parameters.metalness;
+			material.m_fresnel = parameters.fresnel;
+			material.m_shininess = parameters.shininess;
+			material.m_emission = parameters.emission;
+			material.m_transparency = parameters.transparency;
+			break;
+		}
+		case Command::SetDisplayFormat:
+			m_display_format = command.display_format;
+			m_publish_pending = true;
+			break;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	/// Fills the back frame, then swaps it to the front
+	///////////////////////////////////////////////////////////////////////////
+	void RenderThread::publish()
+	{
+		PROFILE_CPU_ZONE("publish");
+		Frame& back = m_frames[1 - m_front];
+		// Until the GPU has read the back frame's pixel buffer. The UI may
+		// be waiting in pause(), and then stops checking, so give way.
+		while (back.busy.load(std::memory_order_acquire))
+		{
+			if (m_pause_requested || m_quit)
+			{
+				m_publish_pending = true;
+				return;
+			}
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		}
+		m_publish_pending = false;
+
+		back.denoise_ms = 0.0f;
+		const Image* image = &rendered_image;
+		if (denoiser::settings.enabled)
+		{
+			auto denoise_start = std::chrono::high_resolution_clock::now();
+			denoiser::denoise(rendered_image, feature_image, m_denoised);
+			std::chrono::duration<float, std::milli> denoise_time =
+			    std::chrono::high_resolution_clock::now() - denoise_start;
+			back.denoise_ms = denoise_time.count();
+			image = &m_denoised;
+		}
+
+		// Convert the image into the frame tile by tile, and keep which
+		// tiles changed, so that only those are uploaded
+		const uint64_t id = m_frames[m_front].id + 1;
+		const int tiles_x = (image->width + DISPLAY_TILE_SIZE - 1) / DISPLAY_TILE_SIZE;
+		const int tiles_y = (image->height + DISPLAY_TILE_SIZE - 1) / DISPLAY_TILE_SIZE;
+		const bool all_changed = image->width != m_tiles_width || image->height != m_tiles_height
+		                         || m_display_format != m_tiles_format;
+		if (all_changed)
+		{
+			m_tile_hashes.assign(tiles_x * tiles_y, 0);
+			m_tile_changed.assign(tiles_x * tiles_y, 0);
+			m_tiles_width = image->width;
+			m_tiles_height = image->height;
+			m_tiles_format = m_display_format;
+		}
+		const size_t size = size_t(image->width) * image->height * getBytesPerPixel(m_display_format);
+		back.width = image->width;
+		back.height = image->height;
+		back.format = m_display_format;
+		back.in_staging = back.staging != nullptr && back.staging_size == size;
+		if (!back.in_staging)
+		{
+			back.pixels.resize(size);
+		}
+		uint8_t* pixels = back.in_staging ? back.staging : back.pixels.data();
+		{
+			PROFILE_CPU_ZONE("convert");
+#pragma omp parallel for schedule(dynamic)
+			for (int tile = 0; tile < tiles_x * tiles_y; tile++)
+			{
+				const uint64_t hash =
+				    convertDisplayTile(*image, tile % tiles_x, tile / tiles_x, m_display_format, pixels);
+				if (all_changed || hash != m_tile_hashes[tile])
+				{
+					m_tile_hashes[tile] = hash;
+					m_tile_changed[tile] = id;
+				}
+			}
+		}
+		back.tile_changed = m_tile_changed;
+		back.samples = getSampleCount();
+		back.trace_ms = m_trace_ms;
+		back.stats = stats::getStats();
+
+		std::lock_guard<std::mutex> lock(m_frame_mutex);
+		back.id = id;
+		m_front = 1 - m_front;
+	}
+} // namespace pathtracer
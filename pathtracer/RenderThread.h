@@ -0,0 +1,223 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Pathtracer.h"
+#include "DisplayTexture.h"
+#include "denoiser.h"
+#include "stats.h"
+
+namespace pathtracer
+{
+	///////////////////////////////////////////////////////////////////////////
+	// A single producer, single consumer queue that never locks: one thread
+	// pushes, another pops. CAPACITY must be a power of two.
+	///////////////////////////////////////////////////////////////////////////
+	template <typename T, uint32_t CAPACITY>
+	class CommandQueue
+	{
+		static_assert((CAPACITY & (CAPACITY - 1)) == 0, "CAPACITY must be a power of two");
+
+	public:
+		CommandQueue() : m_head(0), m_tail(0)
+		{
+		}
+
+		/// Producer only. False if the queue is full.
+		bool push(const T& value)
+		{
+			const uint32_t tail = m_tail.load(std::memory_order_relaxed);
+			if (tail - m_head.load(std::memory_order_acquire) == CAPACITY)
+			{
+				return false;
+			}
+			m_slots[tail & (CAPACITY - 1)] = value;
+			m_tail.store(tail + 1, std::memory_order_release);
+			return true;
+		}
+
+		/// Consumer only. False if the queue is empty.
+		bool pop(T& value)
+		{
+			const uint32_t head = m_head.load(std::memory_order_relaxed);
+			if (head == m_tail.load(std::memory_order_acquire))
+			{
+				return false;
+			}
+			value = m_slots[head & (CAPACITY - 1)];
+			m_head.store(head + 1, std::memory_order_release);
+			return true;
+		}
+
+	private:
+		T m_slots[CAPACITY];
+		std::atomic<uint32_t> m_head;
+		// On separate cache lines, as each is written by its own thread
+		char m_padding[64];
+		std::atomic<uint32_t> m_tail;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// The parameters of a material that can be edited while rendering
+	///////////////////////////////////////////////////////////////////////////
+	struct MaterialParameters
+	{
+		vec3 color;
+		float metalness;
+		float fresnel;
+		float shininess;
+		vec3 emission;
+		float transparency;
+	};
+	MaterialParameters getMaterialParameters(const labhelper::Material& material);
+
+	///////////////////////////////////////////////////////////////////////////
+	// A change to the render state, applied by the render thread between
+	// passes. Only the fields of the command's type are used.
+	///////////////////////////////////////////////////////////////////////////
+	struct Command
+	{
+		enum Type
+		{
+			SetCamera,        // view, projection
+			Restart,
+			Resize,           // width, height: of the window
+			SetSettings,      // settings
+			SetDenoiser,      // denoiser_settings
+			SetPointLight,    // point_light
+			SetDiscLight,     // index, disc_light
+			SetEnvironment,   // environment_multiplier
+			SetMaterial,      // material, material_parameters
+			SetDisplayFormat, // display_format
+		};
+		Type type;
+		mat4 view, projection;
+		int width, height;
+		Settings settings;
+		denoiser::Settings denoiser_settings;
+		PointLight point_light;
+		int index;
+		DiscLight disc_light;
+		float environment_multiplier;
+		labhelper::Material* material;
+		MaterialParameters material_parameters;
+		DisplayFormat display_format;
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// A published pass: the image to display, denoised if enabled, and what
+	// the UI shows about it
+	///////////////////////////////////////////////////////////////////////////
+	struct Frame
+	{
+		// Which of the two frames this is
+		int slot = 0;
+		// Counts the published frames, 0 before the first
+		uint64_t id = 0;
+		// The image, converted to `format`. Into `staging`, a persistently
+		// mapped pixel buffer given by the DisplayTexture, if it has the
+		// size of the image, otherwise into `pixels`.
+		int width = 0, height = 0;
+		DisplayFormat format = DisplayFormat::RGBA16F;
+		uint8_t* staging = nullptr;
+		size_t staging_size = 0;
+		bool in_staging = false;
+		std::vector<uint8_t> pixels;
+		// For each tile, row by row, the id of the last frame it changed in
+		std::vector<uint64_t> tile_changed;
+		// Set while the GPU reads `staging`, that is not written until then
+		std::atomic<bool> busy{ false };
+		int samples = 0;
+		float trace_ms = 0.0f;
+		float denoise_ms = 0.0f;
+		stats::Stats stats = {};
+	};
+
+	///////////////////////////////////////////////////////////////////////////
+	// Traces paths on a thread of its own, so that the UI runs at display
+	// rate however long a pass takes. The passes are run by tracePaths() on
+	// the OpenMP thread pool, started from the render thread.
+	//
+	// The render thread owns the pathtracer's state: the UI thread changes
+	// it only through send(), whose commands are applied between passes,
+	// or while the thread is paused. Each pass is published to the back of
+	// a double-buffered Frame, which is then swapped with the front under
+	// a lock that is only held for the swap and while the UI reads the
+	// front, never for a pass.
+	///////////////////////////////////////////////////////////////////////////
+	class RenderThread
+	{
+	public:
+		RenderThread();
+		~RenderThread();
+
+		RenderThread(const RenderThread&) = delete;
+		RenderThread& operator=(const RenderThread&) = delete;
+
+		///////////////////////////////////////////////////////////////////////
+		/// UI thread only. Never blocks: if the queue is full, the command
+		/// is kept and sent, in order, by the next send() or flush().
+		///////////////////////////////////////////////////////////////////////
+		void send(const Command& command);
+		/// Sends the commands kept by send(), call once per frame
+		void flush();
+
+		///////////////////////////////////////////////////////////////////////
+		/// Waits for the pass in progress, and applies the commands sent so
+		/// far. Until resume(), the UI thread may change the scene and the
+		/// pathtracer directly. Nests: only the outermost calls count.
+		///////////////////////////////////////////////////////////////////////
+		void pause();
+		void resume();
+
+		///////////////////////////////////////////////////////////////////////
+		/// The last published frame, that is not swapped until
+		/// releaseFrame(). Waits at most for a swap, not for a pass.
+		///////////////////////////////////////////////////////////////////////
+		Frame& acquireFrame();
+		void releaseFrame();
+
+	private:
+		void threadMain();
+		void applyCommands();
+		void apply(const Command& command);
+		void publish();
+
+		CommandQueue<Command, 256> m_queue;
+		std::vector<Command> m_unsent;
+		// Commands pushed to the queue, and applied from it
+		uint64_t m_pushed;
+		std::atomic<uint64_t> m_applied;
+
+		// Render state, only used on the render thread
+		mat4 m_view, m_projection;
+		bool m_has_camera;
+		int m_window_width, m_window_height;
+		// Publish even without a new pass, after a change of the denoiser or
+		// the format, or when the last publish gave way to pause()
+		bool m_publish_pending;
+		float m_trace_ms;
+		Image m_denoised;
+		DisplayFormat m_display_format;
+		// Of the tiles of the last published image
+		int m_tiles_width, m_tiles_height;
+		DisplayFormat m_tiles_format;
+		std::vector<uint64_t> m_tile_hashes;
+		std::vector<uint64_t> m_tile_changed;
+
+		Frame m_frames[2];
+		int m_front;
+		std::mutex m_frame_mutex;
+
+		std::thread m_thread;
+		int m_pause_depth;
+		std::mutex m_pause_mutex;
+		std::condition_variable m_pause_changed;
+		std::atomic<bool> m_pause_requested;
+		bool m_paused;
+		std::atomic<bool> m_quit;
+	};
+} // namespace pathtracer
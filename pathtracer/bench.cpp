@@ -0,0 +1,418 @@
+///////////////////////////////////////////////////////////////////////////////
+// pathtracer-bench: renders fixed scenes with a fixed camera, seed and
+// number of samples per pixel, and reports the performance as JSON, to
+// stdout or to the --out file, so that runs on the same machine can be
+// compared across commits. The hot path counters slow the rendering down,
+// "stats" tells whether they were built in (PATHTRACER_STATS).
+//
+// Usage: pathtracer-bench [--spp N] [--width W] [--height H] [--seed S]
+//                         [--bounces B] [--out file.json]
+//                         [--denoise] [--reference-spp N]
+//
+// With --denoise, each scene is also rendered at 1, 4 and 16 spp and
+// denoised, and both images are compared to a reference rendered with
+// --reference-spp samples (256 by default).
+///////////////////////////////////////////////////////////////////////////////
+#include <GL/glew.h>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <labhelper.h>
+#include <glm/glm.hpp>
+#include <glm/gtx/transform.hpp>
+#include <Model.h>
+#include "Pathtracer.h"
+#include "embree.h"
+#include "sampling.h"
+#include "stats.h"
+#include "denoiser.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "psapi.lib")
+#endif
+#else
+#include <sys/resource.h>
+#endif
+
+using namespace glm;
+
+///////////////////////////////////////////////////////////////////////////////
+// The scenes, with the same models and cameras as in the pathtracer
+///////////////////////////////////////////////////////////////////////////////
+struct BenchScene
+{
+	std::string name;
+	std::vector<std::pair<std::string, mat4>> models;
+	vec3 cameraPosition;
+	vec3 cameraDirection;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Error of the noisy and denoised images at one sample count, against the
+// reference, on display values (clamped to [0, 1])
+///////////////////////////////////////////////////////////////////////////////
+struct DenoiseResult
+{
+	int spp;
+	float renderMs;
+	float denoiseMs;
+	double noisyRmse;
+	double denoisedRmse;
+};
+
+const int DENOISE_SPPS[] = { 1, 4, 16 };
+
+struct BenchResult
+{
+	std::string name;
+	size_t triangles;
+	float loadMs;
+	float bvhBuildMs;
+	float renderMs;
+	pathtracer::RayCounts rays;
+	pathtracer::stats::Stats stats;
+	float meanRadiance;
+	std::vector<DenoiseResult> denoise;
+	double peakRssMB;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Peak resident set size of the process so far, in MB
+///////////////////////////////////////////////////////////////////////////////
+double getPeakRssMB()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+	{
+		return double(counters.PeakWorkingSetSize) / (1024.0 * 1024.0);
+	}
+	return 0.0;
+#else
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+	return double(usage.ru_maxrss) / (1024.0 * 1024.0); // bytes
+#else
+	return double(usage.ru_maxrss) / 1024.0; // kilobytes
+#endif
+#endif
+}
+
+float msSince(std::chrono::high_resolution_clock::time_point start)
+{
+	return std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+double rmse(const std::vector<vec3>& image, const std::vector<vec3>& reference)
+{
+	double sum = 0.0;
+	for (size_t i = 0; i < image.size(); i++)
+	{
+		const vec3 d = clamp(image[i], vec3(0.0f), vec3(1.0f)) - clamp(reference[i], vec3(0.0f), vec3(1.0f));
+		sum += dot(d, d) / 3.0;
+	}
+	return std::sqrt(sum / image.size());
+}
+
+double psnr(double rmse)
+{
+	return rmse > 0.0 ? 20.0 * std::log10(1.0 / rmse) : 99.0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Renders the reference, then each of DENOISE_SPPS with another seed, and
+// denoises them
+///////////////////////////////////////////////////////////////////////////////
+std::vector<DenoiseResult> runDenoise(const mat4& viewMatrix, const mat4& projMatrix, int referenceSpp, uint32_t seed)
+{
+	pathtracer::restart();
+	pathtracer::seedRandom(seed + 1);
+	for (int sample = 0; sample < referenceSpp; sample++)
+	{
+		pathtracer::tracePaths(viewMatrix, projMatrix);
+	}
+	const std::vector<vec3> reference = pathtracer::rendered_image.data;
+
+	std::vector<DenoiseResult> results;
+	pathtracer::Image denoised;
+	for (int spp : DENOISE_SPPS)
+	{
+		DenoiseResult result = {};
+		result.spp = spp;
+		pathtracer::restart();
+		pathtracer::seedRandom(seed);
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int sample = 0; sample < spp; sample++)
+		{
+			pathtracer::tracePaths(viewMatrix, projMatrix);
+		}
+		result.renderMs = msSince(start);
+		start = std::chrono::high_resolution_clock::now();
+		pathtracer::denoiser::denoise(pathtracer::rendered_image, pathtracer::feature_image, denoised);
+		result.denoiseMs = msSince(start);
+		result.noisyRmse = rmse(pathtracer::rendered_image.data, reference);
+		result.denoisedRmse = rmse(denoised.data, reference);
+		results.push_back(result);
+	}
+	return results;
+}
+
+BenchResult runScene(const BenchScene& scene, int width, int height, int spp, uint32_t seed, int referenceSpp)
+{
+	BenchResult result = {};
+	result.name = scene.name;
+
+	auto start = std::chrono::high_resolution_clock::now();
+	std::vector<labhelper::Model*> models;
+	for (auto& m : scene.models)
+	{
+		models.push_back(labhelper::loadModelFromOBJ(m.first));
+	}
+	if (scene.name == "Ship")
+	{
+		// Same landingpad screen color as in the pathtracer
+		models[1]->m_materials[8].m_color = vec3(0.380392, 0.588235, 0.266667);
+	}
+	result.loadMs = msSince(start);
+
+	pathtracer::reinitScene();
+	for (size_t i = 0; i < models.size(); i++)
+	{
+		pathtracer::addModel(models[i], scene.models[i].second);
+		result.triangles += models[i]->m_indices.size() / 3;
+	}
+	start = std::chrono::high_resolution_clock::now();
+	pathtracer::buildBVH();
+	result.bvhBuildMs = msSince(start);
+
+	pathtracer::resize(width, height);
+	pathtracer::seedRandom(seed);
+	pathtracer::resetRayCounts();
+	pathtracer::stats::resetStats();
+	mat4 viewMatrix = lookAt(scene.cameraPosition, scene.cameraPosition + scene.cameraDirection, vec3(0, 1, 0));
+	mat4 projMatrix = perspective(radians(45.0f), float(width) / float(height), 0.1f, 100.0f);
+	start = std::chrono::high_resolution_clock::now();
+	for (int sample = 0; sample < spp; sample++)
+	{
+		pathtracer::tracePaths(viewMatrix, projMatrix);
+	}
+	result.renderMs = msSince(start);
+	result.rays = pathtracer::getRayCounts();
+	result.stats = pathtracer::stats::getStats();
+
+	// A cheap checksum of the image, to notice when a change alters the result
+	double sum = 0.0;
+	for (const vec3& c : pathtracer::rendered_image.data)
+	{
+		sum += (c.r + c.g + c.b) / 3.0;
+	}
+	result.meanRadiance = float(sum / pathtracer::rendered_image.data.size());
+	if (referenceSpp > 0)
+	{
+		result.denoise = runDenoise(viewMatrix, projMatrix, referenceSpp, seed);
+	}
+	result.peakRssMB = getPeakRssMB();
+
+	for (auto model : models)
+	{
+		labhelper::freeModel(model);
+	}
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The hot path counters: calls and time per zone, path lengths and why the
+// paths ended
+///////////////////////////////////////////////////////////////////////////////
+void writeStatsJson(FILE* f, const pathtracer::stats::Stats& stats)
+{
+	using namespace pathtracer::stats;
+	const double nsPerCycle = 1e9 / cyclesPerSecond();
+	fprintf(f, "      \"hot_path\": {\n        \"zones\": {\n");
+	for (int zone = 0; zone < NUM_ZONES; zone++)
+	{
+		const uint64_t calls = stats.calls[zone];
+		fprintf(f, "          \"%s\": { \"calls\": %llu, \"cycles\": %llu, \"ns_per_call\": %.1f }%s\n",
+			zone_names[zone], (unsigned long long)calls, (unsigned long long)stats.cycles[zone],
+			calls > 0 ? stats.cycles[zone] * nsPerCycle / calls : 0.0, zone + 1 < NUM_ZONES ? "," : "");
+	}
+	fprintf(f, "        },\n        \"path_lengths\": [");
+	for (int i = 0; i < PATH_LENGTH_BUCKETS; i++)
+	{
+		fprintf(f, "%llu%s", (unsigned long long)stats.path_lengths[i], i + 1 < PATH_LENGTH_BUCKETS ? ", " : "");
+	}
+	fprintf(f, "],\n        \"terminations\": {");
+	for (int reason = 0; reason < NUM_TERMINATIONS; reason++)
+	{
+		fprintf(f, " \"%s\": %llu%s", termination_names[reason], (unsigned long long)stats.terminations[reason],
+			reason + 1 < NUM_TERMINATIONS ? "," : " ");
+	}
+	fprintf(f, "}\n      },\n");
+}
+
+void writeJson(FILE* f, const std::vector<BenchResult>& results, int width, int height, int spp, uint32_t seed)
+{
+	fprintf(f, "{\n");
+	fprintf(f, "  \"width\": %d,\n  \"height\": %d,\n  \"spp\": %d,\n  \"seed\": %u,\n", width, height, spp, seed);
+	fprintf(f, "  \"max_bounces\": %d,\n  \"threads\": %d,\n", pathtracer::settings.max_bounces, omp_get_max_threads());
+	// The counters cost time in the hot path, compare runs built alike
+	fprintf(f, "  \"stats\": %s,\n", pathtracer::stats::enabled() ? "true" : "false");
+	fprintf(f, "  \"scenes\": [\n");
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const BenchResult& r = results[i];
+		const double seconds = r.renderMs / 1000.0;
+		const double samples = double(width) * height * spp;
+		fprintf(f, "    {\n");
+		fprintf(f, "      \"name\": \"%s\",\n", r.name.c_str());
+		fprintf(f, "      \"triangles\": %zu,\n", r.triangles);
+		fprintf(f, "      \"load_ms\": %.3f,\n", r.loadMs);
+		fprintf(f, "      \"bvh_build_ms\": %.3f,\n", r.bvhBuildMs);
+		fprintf(f, "      \"render_ms\": %.3f,\n", r.renderMs);
+		fprintf(f, "      \"ns_per_sample\": %.1f,\n", r.renderMs * 1e6 / samples);
+		fprintf(f, "      \"primary_rays\": %llu,\n", (unsigned long long)r.rays.primary);
+		fprintf(f, "      \"secondary_rays\": %llu,\n", (unsigned long long)r.rays.secondary);
+		fprintf(f, "      \"shadow_rays\": %llu,\n", (unsigned long long)r.rays.shadow);
+		fprintf(f, "      \"primary_rays_per_sec\": %.0f,\n", r.rays.primary / seconds);
+		fprintf(f, "      \"secondary_rays_per_sec\": %.0f,\n", r.rays.secondary / seconds);
+		fprintf(f, "      \"shadow_rays_per_sec\": %.0f,\n", r.rays.shadow / seconds);
+		fprintf(f, "      \"rays_per_sec\": %.0f,\n", (r.rays.primary + r.rays.secondary + r.rays.shadow) / seconds);
+		fprintf(f, "      \"mean_radiance\": %.6f,\n", r.meanRadiance);
+		if (pathtracer::stats::enabled())
+		{
+			writeStatsJson(f, r.stats);
+		}
+		if (!r.denoise.empty())
+		{
+			fprintf(f, "      \"denoise\": [\n");
+			for (size_t j = 0; j < r.denoise.size(); j++)
+			{
+				const DenoiseResult& d = r.denoise[j];
+				fprintf(f,
+					"        { \"spp\": %d, \"render_ms\": %.3f, \"denoise_ms\": %.3f, \"noisy_rmse\": %.6f, "
+					"\"denoised_rmse\": %.6f, \"noisy_psnr\": %.2f, \"denoised_psnr\": %.2f }%s\n",
+					d.spp, d.renderMs, d.denoiseMs, d.noisyRmse, d.denoisedRmse, psnr(d.noisyRmse),
+					psnr(d.denoisedRmse), j + 1 < r.denoise.size() ? "," : "");
+			}
+			fprintf(f, "      ],\n");
+		}
+		fprintf(f, "      \"peak_rss_mb\": %.1f\n", r.peakRssMB);
+		fprintf(f, "    }%s\n", i + 1 < results.size() ? "," : "");
+	}
+	fprintf(f, "  ],\n");
+	fprintf(f, "  \"peak_rss_mb\": %.1f\n", getPeakRssMB());
+	fprintf(f, "}\n");
+}
+
+int main(int argc, char* argv[])
+{
+	int width = 640, height = 360, spp = 16, bounces = 8, referenceSpp = 256;
+	bool denoise = false;
+	uint32_t seed = 1;
+	const char* outputPath = nullptr;
+	for (int i = 1; i < argc; i++)
+	{
+		const bool hasValue = i + 1 < argc;
+		if (strcmp(argv[i], "--spp") == 0 && hasValue)
+			spp = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--width") == 0 && hasValue)
+			width = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--height") == 0 && hasValue)
+			height = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--seed") == 0 && hasValue)
+			seed = uint32_t(strtoul(argv[++i], nullptr, 10));
+		else if (strcmp(argv[i], "--bounces") == 0 && hasValue)
+			bounces = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--out") == 0 && hasValue)
+			outputPath = argv[++i];
+		else if (strcmp(argv[i], "--denoise") == 0)
+			denoise = true;
+		else if (strcmp(argv[i], "--reference-spp") == 0 && hasValue)
+			referenceSpp = atoi(argv[++i]);
+		else
+		{
+			fprintf(stderr,
+				"Usage: %s [--spp N] [--width W] [--height H] [--seed S] [--bounces B] [--out file.json] "
+				"[--denoise] [--reference-spp N]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	// The models upload their meshes and textures when loaded, so they need
+	// a GL context even though nothing is drawn
+	SDL_Window* window = labhelper::init_window_SDL("pathtracer-bench", 64, 64);
+	if (window == nullptr)
+	{
+		return 1;
+	}
+	SDL_HideWindow(window);
+
+	pathtracer::settings.subsampling = 1;
+	pathtracer::settings.max_bounces = bounces;
+	pathtracer::settings.max_paths_per_pixel = 0;
+
+	// Same lights and environment as in the pathtracer
+	pathtracer::point_light.intensity_multiplier = 2500.0f;
+	pathtracer::point_light.color = vec3(1.f, 1.f, 1.f);
+	pathtracer::point_light.position = vec3(10.0f, 25.0f, 20.0f);
+	pathtracer::disc_lights.push_back(pathtracer::DiscLight{ 1000, { 1, 0.8, 0 }, { -8, 10, 8 },
+		normalize(vec3(10, -2, 10)), 8.0 });
+	pathtracer::disc_lights.push_back(pathtracer::DiscLight{ 1000, { 0.1, 0.3, 1 }, { -10, 20, -5 },
+		normalize(-vec3(-10, 20, -5)), 10.0 });
+	pathtracer::environment.map.load("../scenes/envmaps/001.hdr");
+	pathtracer::environment.multiplier = 1.0f;
+
+	const std::vector<BenchScene> scenes = {
+		{ "Sphere", { { "../scenes/sphere.obj", mat4(1.f) } }, vec3(-15, 0, 15), normalize(-vec3(-15, 0, 15)) },
+		{ "Ship",
+		  { { "../scenes/space-ship.obj", translate(vec3(0.f, 8.f, 0.f)) }, { "../scenes/landingpad.obj", mat4(1.f) } },
+		  vec3(-30, 15, 30),
+		  normalize(-vec3(-30, 8, 30)) },
+		{ "Refractions", { { "../scenes/refractions.obj", mat4(1.f) } }, vec3(7.3, 3.2, 7.2),
+		  normalize(vec3(-0.43, -0.27, -0.85)) },
+	};
+
+	std::vector<BenchResult> results;
+	for (const BenchScene& scene : scenes)
+	{
+		results.push_back(runScene(scene, width, height, spp, seed, denoise ? referenceSpp : 0));
+		const BenchResult& r = results.back();
+		const uint64_t rays = r.rays.primary + r.rays.secondary + r.rays.shadow;
+		fprintf(stderr, "%-12s %8.1f ms, %.2f Mrays/s, %.1f ns per sample, BVH built in %.1f ms\n", r.name.c_str(),
+			r.renderMs, rays / (r.renderMs * 1000.0), r.renderMs * 1e6 / (double(width) * height * spp),
+			r.bvhBuildMs);
+		for (const DenoiseResult& d : r.denoise)
+		{
+			fprintf(stderr, "%12s %2d spp: PSNR %.2f dB noisy, %.2f dB denoised in %.1f ms\n", "", d.spp,
+				psnr(d.noisyRmse), psnr(d.denoisedRmse), d.denoiseMs);
+		}
+	}
+
+	FILE* f = stdout;
+	if (outputPath != nullptr)
+	{
+		f = fopen(outputPath, "w");
+		if (f == nullptr)
+		{
+			fprintf(stderr, "Could not write %s\n", outputPath);
+			return 1;
+		}
+	}
+	writeJson(f, results, width, height, spp, seed);
+	if (f != stdout)
+	{
+		fclose(f);
+	}
+
+	labhelper::shutDown(window);
+	return 0;
+}
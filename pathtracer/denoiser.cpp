@@ -0,0 +1,401 @@
+#include "denoiser.h"
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include "Profiler.h"
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define DENOISER_SIMD 1
+#else
+#define DENOISER_SIMD 0
+#endif
+
+namespace pathtracer
+{
+	namespace denoiser
+	{
+		Settings settings;
+
+		namespace
+		{
+			// The B3 spline kernel of the à-trous transform
+			const float KERNEL[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+			// Depth difference that halves the weight of a tap, relative to
+			// the depth of the center pixel and per pixel of distance
+			const float DEPTH_SCALE = 0.01f;
+			// Below this albedo the lighting is not demodulated
+			const float MIN_ALBEDO = 0.01f;
+			// Fewer samples than this give a poor variance estimate, so the
+			// variance of the 3x3 neighbourhood is used instead
+			const int MIN_TEMPORAL_SAMPLES = 4;
+			const float EPS = 1e-4f;
+
+			// One image per channel, so that 4 neighbouring pixels are one load
+			struct Planes
+			{
+				std::vector<float> r, g, b, variance;
+
+				void resize(size_t size)
+				{
+					r.resize(size);
+					g.resize(size);
+					b.resize(size);
+					variance.resize(size);
+				}
+			};
+
+			// Scratch space, reused from frame to frame
+			Planes ping_pong[2];
+			std::vector<float> albedo_r, albedo_g, albedo_b;
+			std::vector<float> depth, normal_x, normal_y, normal_z;
+			std::vector<float> luminance;
+
+			inline float luminanceOf(float r, float g, float b)
+			{
+				return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+			}
+
+			const int TAPS = 25;
+
+			struct Pass
+			{
+				const Planes* in;
+				Planes* out;
+				int width, height;
+				int step;
+				int normal_squarings;
+				float inv_sigma_luminance;
+				float inv_sigma_depth;
+				// Per tap: offset in pixels, kernel weight, and 1 / distance to
+				// the center in pixels (1 for the center)
+				int tap_x[TAPS], tap_y[TAPS];
+				float tap_weight[TAPS];
+				float tap_inv_distance[TAPS];
+			};
+
+#if DENOISER_SIMD
+			///////////////////////////////////////////////////////////////////
+			// exp(x) for x <= 0, to about 1e-5 relative error: 2^(x log2(e))
+			// split into 2^integer, put in the exponent bits, and 2^fraction
+			// from a polynomial.
+			///////////////////////////////////////////////////////////////////
+			inline __m128 expNegative(__m128 x)
+			{
+				const __m128 t = _mm_mul_ps(_mm_max_ps(x, _mm_set1_ps(-87.0f)), _mm_set1_ps(1.44269504f));
+				__m128i i = _mm_cvttps_epi32(t);
+				__m128 fi = _mm_cvtepi32_ps(i);
+				// Truncation rounds the negative values up, floor them
+				const __m128 rounded_up = _mm_cmpgt_ps(fi, t);
+				fi = _mm_sub_ps(fi, _mm_and_ps(rounded_up, _mm_set1_ps(1.0f)));
+				i = _mm_add_epi32(i, _mm_castps_si128(rounded_up)); // -1 where rounded up
+				const __m128 f = _mm_sub_ps(t, fi);
+				__m128 poly = _mm_set1_ps(0.0096181f);
+				poly = _mm_add_ps(_mm_mul_ps(poly, f), _mm_set1_ps(0.0555041f));
+				poly = _mm_add_ps(_mm_mul_ps(poly, f), _mm_set1_ps(0.2402265f));
+				poly = _mm_add_ps(_mm_mul_ps(poly, f), _mm_set1_ps(0.6931472f));
+				poly = _mm_add_ps(_mm_mul_ps(poly, f), _mm_set1_ps(1.0f));
+				const __m128 exponent = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(i, _mm_set1_epi32(127)), 23));
+				return _mm_mul_ps(poly, exponent);
+			}
+
+			// The same approximation for single values, so that the pixels
+			// filterPixel() does at the borders match the others
+			inline float expNegative(float x)
+			{
+				return _mm_cvtss_f32(expNegative(_mm_set_ss(x)));
+			}
+
+			inline __m128 absolute(__m128 x)
+			{
+				return _mm_andnot_ps(_mm_set1_ps(-0.0f), x);
+			}
+
+			inline __m128 luminanceOf(__m128 r, __m128 g, __m128 b)
+			{
+				return _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(0.2126f)), _mm_mul_ps(g, _mm_set1_ps(0.7152f))),
+					_mm_mul_ps(b, _mm_set1_ps(0.0722f)));
+			}
+
+			///////////////////////////////////////////////////////////////////
+			// Pixels x to x + 3, when all their taps are inside the image
+			///////////////////////////////////////////////////////////////////
+			void filterPixels4(const Pass& pass, int x, int y)
+			{
+				const float* r = pass.in->r.data();
+				const float* g = pass.in->g.data();
+				const float* b = pass.in->b.data();
+				const float* variance = pass.in->variance.data();
+				const float* z = depth.data();
+				const float* nx = normal_x.data();
+				const float* ny = normal_y.data();
+				const float* nz = normal_z.data();
+				const int p = y * pass.width + x;
+
+				const __m128 zero = _mm_setzero_ps();
+				const __m128 luminance_p = luminanceOf(_mm_loadu_ps(r + p), _mm_loadu_ps(g + p), _mm_loadu_ps(b + p));
+				const __m128 luminance_scale = _mm_div_ps(_mm_set1_ps(pass.inv_sigma_luminance),
+					_mm_add_ps(_mm_sqrt_ps(_mm_max_ps(_mm_loadu_ps(variance + p), zero)), _mm_set1_ps(EPS)));
+				const __m128 depth_p = _mm_loadu_ps(z + p);
+				const __m128 depth_scale = _mm_div_ps(_mm_set1_ps(pass.inv_sigma_depth),
+					_mm_add_ps(_mm_mul_ps(depth_p, _mm_set1_ps(float(pass.step))), _mm_set1_ps(EPS)));
+				const __m128 nx_p = _mm_loadu_ps(nx + p);
+				const __m128 ny_p = _mm_loadu_ps(ny + p);
+				const __m128 nz_p = _mm_loadu_ps(nz + p);
+
+				__m128 sum_weight = zero, sum_r = zero, sum_g = zero, sum_b = zero, sum_variance = zero;
+				for (int tap = 0; tap < TAPS; tap++)
+				{
+					const int q = p + (pass.tap_y[tap] * pass.width + pass.tap_x[tap]) * pass.step;
+					__m128 weight_normal = _mm_max_ps(zero,
+						_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx_p, _mm_loadu_ps(nx + q)), _mm_mul_ps(ny_p, _mm_loadu_ps(ny + q))),
+							_mm_mul_ps(nz_p, _mm_loadu_ps(nz + q))));
+					for (int i = 0; i < pass.normal_squarings; i++)
+					{
+						weight_normal = _mm_mul_ps(weight_normal, weight_normal);
+					}
+					const __m128 r_q = _mm_loadu_ps(r + q);
+					const __m128 g_q = _mm_loadu_ps(g + q);
+					const __m128 b_q = _mm_loadu_ps(b + q);
+					const __m128 luminance_distance =
+						_mm_mul_ps(absolute(_mm_sub_ps(luminance_p, luminanceOf(r_q, g_q, b_q))), luminance_scale);
+					const __m128 depth_distance = _mm_mul_ps(_mm_mul_ps(absolute(_mm_sub_ps(depth_p, _mm_loadu_ps(z + q))),
+						depth_scale), _mm_set1_ps(pass.tap_inv_distance[tap]));
+					const __m128 weight = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(pass.tap_weight[tap]), weight_normal),
+						expNegative(_mm_sub_ps(zero, _mm_add_ps(luminance_distance, depth_distance))));
+					sum_weight = _mm_add_ps(sum_weight, weight);
+					sum_r = _mm_add_ps(sum_r, _mm_mul_ps(weight, r_q));
+					sum_g = _mm_add_ps(sum_g, _mm_mul_ps(weight, g_q));
+					sum_b = _mm_add_ps(sum_b, _mm_mul_ps(weight, b_q));
+					sum_variance = _mm_add_ps(sum_variance, _mm_mul_ps(_mm_mul_ps(weight, weight), _mm_loadu_ps(variance + q)));
+				}
+
+				// Keep the input where no tap has a weight, as filterPixel()
+				const __m128 valid = _mm_cmpgt_ps(sum_weight, zero);
+				const __m128 inv_weight = _mm_div_ps(_mm_set1_ps(1.0f),
+					_mm_or_ps(_mm_and_ps(valid, sum_weight), _mm_andnot_ps(valid, _mm_set1_ps(1.0f))));
+				auto select = [&](__m128 filtered, const float* input) {
+					return _mm_or_ps(_mm_and_ps(valid, filtered), _mm_andnot_ps(valid, _mm_loadu_ps(input + p)));
+				};
+				_mm_storeu_ps(&pass.out->r[p], select(_mm_mul_ps(sum_r, inv_weight), r));
+				_mm_storeu_ps(&pass.out->g[p], select(_mm_mul_ps(sum_g, inv_weight), g));
+				_mm_storeu_ps(&pass.out->b[p], select(_mm_mul_ps(sum_b, inv_weight), b));
+				_mm_storeu_ps(&pass.out->variance[p],
+					select(_mm_mul_ps(sum_variance, _mm_mul_ps(inv_weight, inv_weight)), variance));
+			}
+#else
+			inline float expNegative(float x)
+			{
+				return std::exp(x);
+			}
+#endif
+
+			///////////////////////////////////////////////////////////////////
+			// One pixel, skipping the taps outside the image
+			///////////////////////////////////////////////////////////////////
+			void filterPixel(const Pass& pass, int x, int y)
+			{
+				const Planes& in = *pass.in;
+				const int p = y * pass.width + x;
+				const float luminance_p = luminanceOf(in.r[p], in.g[p], in.b[p]);
+				const float luminance_scale =
+					pass.inv_sigma_luminance / (std::sqrt(std::max(in.variance[p], 0.0f)) + EPS);
+				const float depth_scale = pass.inv_sigma_depth / (depth[p] * pass.step + EPS);
+
+				float sum_weight = 0.0f, sum_r = 0.0f, sum_g = 0.0f, sum_b = 0.0f, sum_variance = 0.0f;
+				for (int tap = 0; tap < TAPS; tap++)
+				{
+					const int qx = x + pass.tap_x[tap] * pass.step;
+					const int qy = y + pass.tap_y[tap] * pass.step;
+					if (qx < 0 || qx >= pass.width || qy < 0 || qy >= pass.height)
+					{
+						continue;
+					}
+					const int q = qy * pass.width + qx;
+					float weight_normal = std::max(0.0f,
+						normal_x[p] * normal_x[q] + normal_y[p] * normal_y[q] + normal_z[p] * normal_z[q]);
+					for (int i = 0; i < pass.normal_squarings; i++)
+					{
+						weight_normal *= weight_normal;
+					}
+					const float luminance_distance =
+						std::abs(luminance_p - luminanceOf(in.r[q], in.g[q], in.b[q])) * luminance_scale;
+					const float depth_distance =
+						std::abs(depth[p] - depth[q]) * depth_scale * pass.tap_inv_distance[tap];
+					const float weight =
+						pass.tap_weight[tap] * weight_normal * expNegative(-(luminance_distance + depth_distance));
+					sum_weight += weight;
+					sum_r += weight * in.r[q];
+					sum_g += weight * in.g[q];
+					sum_b += weight * in.b[q];
+					sum_variance += weight * weight * in.variance[q];
+				}
+				// The center tap always has a weight, unless its normal is 0
+				if (sum_weight <= 0.0f)
+				{
+					pass.out->r[p] = in.r[p];
+					pass.out->g[p] = in.g[p];
+					pass.out->b[p] = in.b[p];
+					pass.out->variance[p] = in.variance[p];
+					return;
+				}
+				pass.out->r[p] = sum_r / sum_weight;
+				pass.out->g[p] = sum_g / sum_weight;
+				pass.out->b[p] = sum_b / sum_weight;
+				pass.out->variance[p] = sum_variance / (sum_weight * sum_weight);
+			}
+
+			///////////////////////////////////////////////////////////////////
+			// Divides the lighting by the albedo, and estimates its variance
+			///////////////////////////////////////////////////////////////////
+			void prepare(const Image& input, const FeatureImage& features)
+			{
+				const int width = input.width, height = input.height;
+#pragma omp parallel for
+				for (int y = 0; y < height; y++)
+				{
+					for (int x = 0; x < width; x++)
+					{
+						const int p = y * width + x;
+						const vec3& color = input.data[p];
+						luminance[p] = luminanceOf(color.r, color.g, color.b);
+						const vec3 albedo = max(features.albedo[p], vec3(MIN_ALBEDO));
+						albedo_r[p] = albedo.r;
+						albedo_g[p] = albedo.g;
+						albedo_b[p] = albedo.b;
+						ping_pong[0].r[p] = color.r / albedo.r;
+						ping_pong[0].g[p] = color.g / albedo.g;
+						ping_pong[0].b[p] = color.b / albedo.b;
+						depth[p] = features.depth[p];
+						normal_x[p] = features.normal[p].x;
+						normal_y[p] = features.normal[p].y;
+						normal_z[p] = features.normal[p].z;
+					}
+				}
+
+#pragma omp parallel for
+				for (int y = 0; y < height; y++)
+				{
+					for (int x = 0; x < width; x++)
+					{
+						const int p = y * width + x;
+						// Per pixel, as reprojection keeps different numbers
+						const float samples = std::max(features.samples[p], 1.0f);
+						float variance;
+						if (samples >= MIN_TEMPORAL_SAMPLES)
+						{
+							variance = features.luminance_squared[p] - luminance[p] * luminance[p];
+						}
+						else
+						{
+							float sum = 0.0f, sum_squared = 0.0f;
+							int count = 0;
+							for (int qy = std::max(y - 1, 0); qy <= std::min(y + 1, height - 1); qy++)
+							{
+								for (int qx = std::max(x - 1, 0); qx <= std::min(x + 1, width - 1); qx++)
+								{
+									const float l = luminance[qy * width + qx];
+									sum += l;
+									sum_squared += l * l;
+									count++;
+								}
+							}
+							variance = sum_squared / count - (sum / count) * (sum / count);
+						}
+						// Variance of the mean of the samples, of the lighting
+						const float albedo_luminance = luminanceOf(albedo_r[p], albedo_g[p], albedo_b[p]);
+						ping_pong[0].variance[p] =
+							std::max(variance, 0.0f) / (samples * albedo_luminance * albedo_luminance);
+					}
+				}
+			}
+		} // namespace
+
+		void denoise(const Image& input, const FeatureImage& features, Image& output)
+		{
+			PROFILE_CPU_ZONE("denoise");
+			const int width = input.width, height = input.height;
+			const size_t size = size_t(width) * height;
+			output.width = width;
+			output.height = height;
+			output.number_of_samples = input.number_of_samples;
+			output.data.resize(size);
+			if (size == 0)
+			{
+				return;
+			}
+			ping_pong[0].resize(size);
+			ping_pong[1].resize(size);
+			for (auto plane : { &albedo_r, &albedo_g, &albedo_b, &depth, &normal_x, &normal_y, &normal_z, &luminance })
+			{
+				plane->resize(size);
+			}
+			prepare(input, features);
+
+			Pass pass;
+			pass.width = width;
+			pass.height = height;
+			pass.normal_squarings = 0;
+			while ((2 << pass.normal_squarings) <= int(settings.sigma_normal))
+			{
+				pass.normal_squarings++;
+			}
+			pass.inv_sigma_luminance = 1.0f / std::max(settings.sigma_luminance, EPS);
+			pass.inv_sigma_depth = 1.0f / std::max(settings.sigma_depth * DEPTH_SCALE, EPS);
+			for (int tap = 0; tap < TAPS; tap++)
+			{
+				const int dx = tap % 5 - 2, dy = tap / 5 - 2;
+				pass.tap_x[tap] = dx;
+				pass.tap_y[tap] = dy;
+				pass.tap_weight[tap] = KERNEL[dx + 2] * KERNEL[dy + 2];
+				// The center tap has no depth difference
+				pass.tap_inv_distance[tap] = 1.0f / std::max(std::sqrt(float(dx * dx + dy * dy)), 1.0f);
+			}
+
+			int current = 0;
+			for (int iteration = 0; iteration < settings.iterations; iteration++)
+			{
+				pass.in = &ping_pong[current];
+				pass.out = &ping_pong[1 - current];
+				pass.step = 1 << iteration;
+				const int border = 2 * pass.step;
+#pragma omp parallel for
+				for (int y = 0; y < height; y++)
+				{
+					int x = 0;
+#if DENOISER_SIMD
+					// Only rows with an interior, narrower images are filtered
+					// one pixel at a time
+					if (y >= border && y < height - border && width > 2 * border)
+					{
+						for (; x < border; x++)
+						{
+							filterPixel(pass, x, y);
+						}
+						for (; x + 4 <= width - border; x += 4)
+						{
+							filterPixels4(pass, x, y);
+						}
+					}
+#endif
+					for (; x < width; x++)
+					{
+						filterPixel(pass, x, y);
+					}
+				}
+				current = 1 - current;
+			}
+
+			// Put the albedo back
+			const Planes& result = ping_pong[current];
+#pragma omp parallel for
+			for (int y = 0; y < height; y++)
+			{
+				for (int x = 0; x < width; x++)
+				{
+					const int p = y * width + x;
+					output.data[p] = vec3(result.r[p] * albedo_r[p], result.g[p] * albedo_g[p], result.b[p] * albedo_b[p]);
+				}
+			}
+		}
+	} // namespace denoiser
+} // namespace pathtracer
@@ -0,0 +1,33 @@
+#pragma once
+#include "Pathtracer.h"
+
+namespace pathtracer
+{
+	namespace denoiser
+	{
+		///////////////////////////////////////////////////////////////////////
+		/// An edge-avoiding à-trous wavelet filter, as in SVGF (Schied et
+		/// al. 2017) without the temporal part. The lighting is divided by
+		/// the albedo, so that textures are not blurred, and filtered by
+		/// `iterations` passes of a 5x5 kernel with holes of 1, 2, 4, ...
+		/// pixels. Each tap is weighted by how similar its normal, depth
+		/// and luminance are to the center pixel's; the luminance weight is
+		/// scaled by the pixel's variance, so noisy pixels are blurred more.
+		///////////////////////////////////////////////////////////////////////
+		struct Settings
+		{
+			bool enabled = true;
+			int iterations = 5;
+			float sigma_luminance = 4.0f;
+			float sigma_normal = 128.0f; // Rounded down to a power of two
+			float sigma_depth = 1.0f;
+		};
+		extern Settings settings;
+
+		///////////////////////////////////////////////////////////////////////
+		/// Filters `input` with the first hit features, into `output`. Runs
+		/// on all cores, 4 pixels at a time with SSE.
+		///////////////////////////////////////////////////////////////////////
+		void denoise(const Image& input, const FeatureImage& features, Image& output);
+	} // namespace denoiser
+} // namespace pathtracer
@@ -1,6 +1,8 @@
 #include "embree.h"
 #include <iostream>
+#include <list>
 #include <map>
+#include "stats.h"
 
 using namespace std;
 using namespace glm;
@@ -38,6 +40,16 @@ namespace pathtracer
 	map<uint32_t, const labhelper::Model*> map_geom_ID_to_model;
 	map<uint32_t, const labhelper::Mesh*> map_geom_ID_to_mesh;
 
+	// User data of the height field geometries. The callbacks need the
+	// geometry ID to report hits; a list keeps the pointers stable.
+	struct HeightFieldUserData
+	{
+		const HeightFieldGeometry* heightfield;
+		uint32_t geom_ID;
+	};
+	list<HeightFieldUserData> heightfield_user_data;
+	map<uint32_t, const HeightFieldGeometry*> map_geom_ID_to_heightfield;
+
 	void initEmbree()
 	{
 		///////////////////////////////////////////////////////////////////////
@@ -62,6 +74,8 @@ namespace pathtracer
 		{
 			rtcDeleteScene(embree_scene);
 		}
+		heightfield_user_data.clear();
+		map_geom_ID_to_heightfield.clear();
 
 		embree_scene = rtcDeviceNewScene(embree_device, RTC_SCENE_STATIC, RTC_INTERSECT1);
 	}
@@ -88,7 +102,7 @@ namespace pathtracer
 		for (auto& mesh : model->m_meshes)
 		{
 			uint32_t geom_ID = rtcNewTriangleMesh(embree_scene, RTC_GEOMETRY_STATIC,
-				mesh.m_number_of_vertices / 3, mesh.m_number_of_vertices);
+				mesh.m_number_of_indices / 3, mesh.m_number_of_vertices);
 			map_geom_ID_to_mesh[geom_ID] = &mesh;
 			map_geom_ID_to_model[geom_ID] = model;
 			// Transform and commit vertices
@@ -98,38 +112,135 @@ namespace pathtracer
 				embree_vertices[i] = model_matrix * vec4(model->m_positions[mesh.m_start_index + i], 1.0f);
 			}
 			rtcUnmapBuffer(embree_scene, geom_ID, RTC_VERTEX_BUFFER);
-			// Commit triangle indices
+			// Commit triangle indices, relative to the first vertex of the mesh
 			int* embree_tri_idxs = (int*)rtcMapBuffer(embree_scene, geom_ID, RTC_INDEX_BUFFER);
-			for (uint32_t i = 0; i < mesh.m_number_of_vertices; i++)
+			for (uint32_t i = 0; i < mesh.m_number_of_indices; i++)
 			{
-				embree_tri_idxs[i] = i;
+				embree_tri_idxs[i] = model->m_indices[mesh.m_first_index + i] - mesh.m_start_index;
 			}
 			rtcUnmapBuffer(embree_scene, geom_ID, RTC_INDEX_BUFFER);
 		}
 		cout << "done.\n";
 	}
 
+	///////////////////////////////////////////////////////////////////////////
+	// Embree callbacks for height fields. The Ray struct has the same layout
+	// as RTCRay.
+	///////////////////////////////////////////////////////////////////////////
+	void heightFieldBounds(void* ptr, size_t /*item*/, RTCBounds& bounds)
+	{
+		const HeightFieldGeometry* hf = static_cast<HeightFieldUserData*>(ptr)->heightfield;
+		bounds.lower_x = hf->origin.x;
+		bounds.lower_y = hf->origin.y + hf->heightRange.x * hf->size.y;
+		bounds.lower_z = hf->origin.z;
+		bounds.upper_x = hf->origin.x + hf->size.x;
+		bounds.upper_y = hf->origin.y + hf->heightRange.y * hf->size.y;
+		bounds.upper_z = hf->origin.z + hf->size.z;
+	}
+
+	void heightFieldIntersect(void* ptr, RTCRay& rtc_ray, size_t /*item*/)
+	{
+		const HeightFieldUserData* data = static_cast<HeightFieldUserData*>(ptr);
+		Ray& r = *((Ray*)&rtc_ray);
+		vec3 normal;
+		uint32_t prim;
+		float u, v;
+		if (intersectHeightField(data->heightfield, r.o, r.d, r.tnear, r.tfar, false, normal, prim, u, v))
+		{
+			r.n = normal;
+			r.u = u;
+			r.v = v;
+			r.geomID = data->geom_ID;
+			r.primID = prim;
+		}
+	}
+
+	void heightFieldOccluded(void* ptr, RTCRay& rtc_ray, size_t /*item*/)
+	{
+		const HeightFieldUserData* data = static_cast<HeightFieldUserData*>(ptr);
+		Ray& r = *((Ray*)&rtc_ray);
+		vec3 normal;
+		uint32_t prim;
+		float u, v;
+		float tfar = r.tfar;
+		if (intersectHeightField(data->heightfield, r.o, r.d, r.tnear, tfar, true, normal, prim, u, v))
+		{
+			// Embree's convention for a blocked shadow ray
+			r.geomID = 0;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Add a height field to the embree scene
+	///////////////////////////////////////////////////////////////////////////
+	void addHeightField(const HeightFieldGeometry* heightfield)
+	{
+		if (!embree_scene)
+		{
+			reinitScene();
+		}
+		uint32_t geom_ID = rtcNewUserGeometry(embree_scene, 1);
+		heightfield_user_data.push_back({ heightfield, geom_ID });
+		map_geom_ID_to_heightfield[geom_ID] = heightfield;
+		rtcSetUserData(embree_scene, geom_ID, &heightfield_user_data.back());
+		rtcSetBoundsFunction(embree_scene, geom_ID, heightFieldBounds);
+		rtcSetIntersectFunction(embree_scene, geom_ID, heightFieldIntersect);
+		rtcSetOccludedFunction(embree_scene, geom_ID, heightFieldOccluded);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Intersection with a height field. The shading normal is interpolated
+	// between the sample normals at the corners of the hit cell.
+	///////////////////////////////////////////////////////////////////////////
+	Intersection getHeightFieldIntersection(const HeightFieldGeometry* hf, const Ray& r)
+	{
+		Intersection i;
+		i.material = &hf->material;
+		i.position = r.o + r.tfar * r.d;
+		i.geometry_normal = normalize(r.n);
+		i.wo = normalize(-r.d);
+
+		const int cells_x = hf->width - 1;
+		const int cell = int(r.primID / 2);
+		const int x = cell % cells_x, z = cell / cells_x;
+		const vec3 grid = (i.position - hf->origin) / hf->spacing;
+		const float fx = clamp(grid.x - x, 0.0f, 1.0f);
+		const float fz = clamp(grid.z - z, 0.0f, 1.0f);
+		const vec3 n0 = mix(hf->sampleNormal(x, z), hf->sampleNormal(x + 1, z), fx);
+		const vec3 n1 = mix(hf->sampleNormal(x, z + 1), hf->sampleNormal(x + 1, z + 1), fx);
+		i.shading_normal = normalize(mix(n0, n1, fz));
+		i.uv = vec2((x + fx) / cells_x, (z + fz) / (hf->height - 1));
+		return i;
+	}
+
 	///////////////////////////////////////////////////////////////////////////
 	// Extract an intersection from an embree ray.
 	///////////////////////////////////////////////////////////////////////////
 	Intersection getIntersection(const Ray& r)
 	{
+		PATHTRACER_ZONE(GetIntersection);
+		auto heightfield = map_geom_ID_to_heightfield.find(r.geomID);
+		if (heightfield != map_geom_ID_to_heightfield.end())
+		{
+			return getHeightFieldIntersection(heightfield->second, r);
+		}
 		const labhelper::Model* model = map_geom_ID_to_model[r.geomID];
 		const labhelper::Mesh* mesh = map_geom_ID_to_mesh[r.geomID];
 		Intersection i;
 		i.material = &(model->m_materials[mesh->m_material_idx]);
-		vec3 n0 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 0];
-		vec3 n1 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 1];
-		vec3 n2 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 2];
+		const uint32_t* triangle = &model->m_indices[mesh->m_first_index + r.primID * 3];
+		vec3 n0 = labhelper::getNormal(model, triangle[0]);
+		vec3 n1 = labhelper::getNormal(model, triangle[1]);
+		vec3 n2 = labhelper::getNormal(model, triangle[2]);
 		float w = 1.0f - (r.u + r.v);
 		i.shading_normal = normalize(w * n0 + r.u * n1 + r.v * n2);
 		i.geometry_normal = -normalize(r.n);
 		i.position = r.o + r.tfar * r.d;
 		i.wo = normalize(-r.d);
 
-		vec2 uv0 = model->m_texture_coordinates[((mesh->m_start_index / 3) + r.primID) * 3 + 0];
-		vec2 uv1 = model->m_texture_coordinates[((mesh->m_start_index / 3) + r.primID) * 3 + 1];
-		vec2 uv2 = model->m_texture_coordinates[((mesh->m_start_index / 3) + r.primID) * 3 + 2];
+		vec2 uv0 = labhelper::getTextureCoordinate(model, triangle[0]);
+		vec2 uv1 = labhelper::getTextureCoordinate(model, triangle[1]);
+		vec2 uv2 = labhelper::getTextureCoordinate(model, triangle[2]);
 		i.uv = w * uv0 + r.u * uv1 + r.v * uv2;
 		return i;
 	}
@@ -139,6 +250,7 @@ namespace pathtracer
 	///////////////////////////////////////////////////////////////////////////
 	bool intersect(Ray& r)
 	{
+		PATHTRACER_ZONE(Intersect);
 		rtcIntersect(embree_scene, *((RTCRay*)&r));
 		return r.geomID != RTC_INVALID_GEOMETRY_ID;
 	}
@@ -149,6 +261,7 @@ namespace pathtracer
 	///////////////////////////////////////////////////////////////////////////
 	bool occluded(Ray& r)
 	{
+		PATHTRACER_ZONE(Occluded);
 		rtcOccluded(embree_scene, *((RTCRay*)&r));
 		return r.geomID != RTC_INVALID_GEOMETRY_ID;
 	}
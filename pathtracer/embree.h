@@ -2,6 +2,7 @@
 #include <embree2/rtcore.h>
 #include <embree2/rtcore_ray.h>
 #include "Model.h"
+#include "HeightFieldGeometry.h"
 #include <glm/glm.hpp>
 #include <map>
 
@@ -88,6 +89,10 @@ namespace pathtracer
 	// Add a model to the embree scene
 	void addModel(const labhelper::Model* model, const glm::mat4& model_matrix);
 
+	// Add a height field to the embree scene, as a user geometry that is
+	// intersected by walking its min/max pyramid
+	void addHeightField(const HeightFieldGeometry* heightfield);
+
 	// Build an acceleration structure for the scene
 	void buildBVH();
 
@@ -3,6 +3,7 @@
 #include <chrono>
 #include <iostream>
 #include <labhelper.h>
+#include <Profiler.h>
 #include <imgui.h>
 #include <imgui_impl_sdl_gl3.h>
 #include <glm/glm.hpp>
@@ -12,6 +13,9 @@
 #include "Pathtracer.h"
 #include "embree.h"
 #include "sampling.h"
+#include "stats.h"
+#include "denoiser.h"
+#include "RenderThread.h"
 
 
 using namespace glm;
@@ -43,7 +47,9 @@ GLuint simpleShaderProgram;
 ///////////////////////////////////////////////////////////////////////////////
 // GL texture to put pathtracing result into
 ///////////////////////////////////////////////////////////////////////////////
-uint32_t pathtracer_result_txt_id;
+pathtracer::DisplayTexture* displayTexture = nullptr;
+pathtracer::DisplayFormat displayFormat = pathtracer::DisplayFormat::RGBA16F;
+std::string uploadBenchmarkResults;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Scene
@@ -66,6 +72,17 @@ struct scene_t
 	std::vector<scene_object_t> models;
 
 	camera_t camera;
+
+	// Optional terrain, traced without tessellating it. It is large, so it
+	// is loaded from heightfieldPath when the scene is first selected.
+	std::string heightfieldPath;
+	vec3 heightfieldOrigin, heightfieldSize;
+	pathtracer::HeightFieldGeometry* heightfield = nullptr;
+
+	scene_t(const std::vector<scene_object_t>& models = {}, const camera_t& camera = {})
+	    : models(models), camera(camera)
+	{
+	}
 };
 
 std::map<std::string, scene_t> scenes;
@@ -76,12 +93,41 @@ int selected_model_index = 0;
 int selected_mesh_index = 0;
 int selected_material_index = 0;
 
+// Vertex format the scenes are loaded with
+labhelper::VertexFormat vertexFormat = labhelper::VertexFormat::Float;
+
+///////////////////////////////////////////////////////////////////////////////
+// Paths are traced on the render thread, that owns the pathtracer's state.
+// The UI edits copies of the settings, lights and materials, and sends the
+// changes to it.
+///////////////////////////////////////////////////////////////////////////////
+pathtracer::RenderThread* renderThread = nullptr;
+pathtracer::Settings pathtracerSettings;
+pathtracer::denoiser::Settings denoiserSettings;
+pathtracer::PointLight pointLight;
+std::vector<pathtracer::DiscLight> discLights;
+float environmentMultiplier;
+std::map<labhelper::Material*, pathtracer::MaterialParameters> editedMaterials;
+
+// What the frame in the texture says about its pass
+int displayedSamples = 0;
+float tracePathsMs = 0.0f;
+float denoiseMs = 0.0f;
+pathtracer::stats::Stats displayedStats = {};
+
+pathtracer::Command makeCommand(pathtracer::Command::Type type)
+{
+	pathtracer::Command command = {};
+	command.type = type;
+	return command;
+}
+
 
 void loadScenes()
 {
 	scenes["Sphere"] = { {
 		                     // Models
-		                     { labhelper::loadModelFromOBJ("../scenes/sphere.obj"), mat4(1.f) },
+		                     { labhelper::loadModelFromOBJ("../scenes/sphere.obj", vertexFormat), mat4(1.f) },
 		                 },
 		                 {
 		                     // Camera
@@ -90,9 +136,9 @@ void loadScenes()
 		                 } };
 	scenes["Ship"] = { {
 		                   // Models
-		                   { labhelper::loadModelFromOBJ("../scenes/space-ship.obj"),
+		                   { labhelper::loadModelFromOBJ("../scenes/space-ship.obj", vertexFormat),
 		                     translate(vec3(0.f, 8.f, 0.f)) },
-		                   { labhelper::loadModelFromOBJ("../scenes/landingpad.obj"), mat4(1.f) },
+		                   { labhelper::loadModelFromOBJ("../scenes/landingpad.obj", vertexFormat), mat4(1.f) },
 		               },
 		               {
 		                   // Camera
@@ -104,35 +150,73 @@ void loadScenes()
 
 	scenes["Refractions"] = { {
 		                          // Models
-		                          { labhelper::loadModelFromOBJ("../scenes/refractions.obj"), mat4(1.f) },
+		                          { labhelper::loadModelFromOBJ("../scenes/refractions.obj", vertexFormat),
+		                            mat4(1.f) },
 		                      },
 		                      {
 		                          // Camera
 		                          vec3(7.3, 3.2, 7.2),
 		                          normalize(vec3(-0.43, -0.27, -0.85)),
 		                      } };
+
+	scenes["Terrain"] = { {
+		                      // Models
+		                      { labhelper::loadModelFromOBJ("../scenes/space-ship.obj", vertexFormat),
+		                        translate(vec3(0.f, 60.f, 0.f)) },
+		                  },
+		                  {
+		                      // Camera
+		                      vec3(-120, 90, 120),
+		                      normalize(vec3(120, -50, -120)),
+		                  } };
+	scenes["Terrain"].heightfieldPath = "../scenes/nlsFinland/L3123F.png";
+	scenes["Terrain"].heightfieldOrigin = vec3(-250.f, -10.f, -250.f);
+	scenes["Terrain"].heightfieldSize = vec3(500.f, 60.f, 500.f);
 }
 
+void sendCamera(mat4& viewMatrix, mat4& projMatrix);
+
 void changeScene(std::string sceneName)
 {
+	if(renderThread != nullptr)
+	{
+		renderThread->pause();
+	}
 	currentScene = sceneName;
-	camera = scenes[currentScene].camera;
+	scene_t& scene = scenes[currentScene];
+	camera = scene.camera;
+	if(scene.heightfield == nullptr && !scene.heightfieldPath.empty())
+	{
+		scene.heightfield = pathtracer::loadHeightFieldGeometry(scene.heightfieldPath, scene.heightfieldOrigin,
+		                                                        scene.heightfieldSize);
+	}
 
 	selected_model_index = 0;
 	selected_mesh_index = 0;
-	selected_material_index = scenes[currentScene].models[0].model->m_meshes[0].m_material_idx;
+	selected_material_index = scene.models[0].model->m_meshes[0].m_material_idx;
 
 
 	pathtracer::reinitScene();
 
 	// Add models to pathtracer scene
-	for(auto& o : scenes[currentScene].models)
+	for(auto& o : scene.models)
 	{
 		pathtracer::addModel(o.model, o.modelMat);
 	}
+	if(scene.heightfield != nullptr)
+	{
+		pathtracer::addHeightField(scene.heightfield);
+	}
 	pathtracer::buildBVH();
 
 	pathtracer::restart();
+	if(renderThread != nullptr)
+	{
+		// So that no pass is traced with the last scene's camera
+		mat4 viewMatrix, projMatrix;
+		sendCamera(viewMatrix, projMatrix);
+		renderThread->resume();
+	}
 }
 
 void cleanupScenes()
@@ -143,6 +227,7 @@ void cleanupScenes()
 		{
 			labhelper::freeModel(m.model);
 		}
+		pathtracer::freeHeightFieldGeometry(it.second.heightfield);
 	}
 }
 
@@ -163,19 +248,16 @@ void initialize()
 	///////////////////////////////////////////////////////////////////////////
 	// Generate result texture
 	///////////////////////////////////////////////////////////////////////////
-	glGenTextures(1, &pathtracer_result_txt_id);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, pathtracer_result_txt_id);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	displayTexture = new pathtracer::DisplayTexture();
 
 	///////////////////////////////////////////////////////////////////////////
 	// Initial path-tracer settings
 	///////////////////////////////////////////////////////////////////////////
 	pathtracer::settings.max_bounces = 8;
 	pathtracer::settings.max_paths_per_pixel = 0; // 0 = Infinite
+	pathtracer::settings.reproject = true;
+	pathtracer::settings.max_history = 32;
+	pathtracer::settings.history_clamp = 3.0f;
 #ifdef _DEBUG
 	pathtracer::settings.subsampling = 16;
 #else
@@ -223,6 +305,15 @@ void initialize()
 	//changeScene("Sphere");
 	//changeScene("Refractions");
 
+	///////////////////////////////////////////////////////////////////////////
+	// Start tracing in the background, with the state above
+	///////////////////////////////////////////////////////////////////////////
+	pathtracerSettings = pathtracer::settings;
+	denoiserSettings = pathtracer::denoiser::settings;
+	pointLight = pathtracer::point_light;
+	discLights = pathtracer::disc_lights;
+	environmentMultiplier = pathtracer::environment.multiplier;
+	renderThread = new pathtracer::RenderThread();
 
 	///////////////////////////////////////////////////////////////////////////
 	// This is INCORRECT! But an easy way to get us a brighter image that
@@ -231,41 +322,70 @@ void initialize()
 	//glEnable(GL_FRAMEBUFFER_SRGB);
 }
 
-void display(void)
+///////////////////////////////////////////////////////////////////////////////
+// Send the camera to the render thread, when it has moved
+///////////////////////////////////////////////////////////////////////////////
+void sendCamera(mat4& viewMatrix, mat4& projMatrix)
 {
-	{ ///////////////////////////////////////////////////////////////////////
-		// If first frame, or window resized, or subsampling changes,
-		// inform the pathtracer
-		///////////////////////////////////////////////////////////////////////
-		int w, h;
-		SDL_GetWindowSize(g_window, &w, &h);
-		static int old_subsampling;
-		if(windowWidth != w || windowHeight != h || old_subsampling != pathtracer::settings.subsampling)
-		{
-			pathtracer::resize(w, h);
-			windowWidth = w;
-			windowWidth = h;
-			old_subsampling = pathtracer::settings.subsampling;
-		}
+	int w, h;
+	SDL_GetWindowSize(g_window, &w, &h);
+	viewMatrix = lookAt(camera.position, camera.position + camera.direction, worldUp);
+	projMatrix = perspective(radians(45.0f), float(w) / float(h), 0.1f, 100.0f);
+	static mat4 sentViewMatrix, sentProjMatrix;
+	static bool cameraSent = false;
+	if(!cameraSent || viewMatrix != sentViewMatrix || projMatrix != sentProjMatrix)
+	{
+		pathtracer::Command command = makeCommand(pathtracer::Command::SetCamera);
+		command.view = viewMatrix;
+		command.projection = projMatrix;
+		renderThread->send(command);
+		sentViewMatrix = viewMatrix;
+		sentProjMatrix = projMatrix;
+		cameraSent = true;
 	}
+}
 
+void display(void)
+{
+	PROFILE_CPU_ZONE("display");
+	PROFILE_GPU_ZONE("display");
 	///////////////////////////////////////////////////////////////////////////
-	// Trace one path per pixel
+	// If first frame, or window resized, inform the pathtracer
 	///////////////////////////////////////////////////////////////////////////
-	mat4 viewMatrix = lookAt(camera.position, camera.position + camera.direction, worldUp);
-	mat4 projMatrix = perspective(radians(45.0f),
-	                              float(pathtracer::rendered_image.width)
-	                                  / float(pathtracer::rendered_image.height),
-	                              0.1f, 100.0f);
-	pathtracer::tracePaths(viewMatrix, projMatrix);
+	int w, h;
+	SDL_GetWindowSize(g_window, &w, &h);
+	static int sentWidth = 0, sentHeight = 0;
+	if(sentWidth != w || sentHeight != h)
+	{
+		pathtracer::Command command = makeCommand(pathtracer::Command::Resize);
+		command.width = w;
+		command.height = h;
+		renderThread->send(command);
+		sentWidth = w;
+		sentHeight = h;
+	}
+
+	mat4 viewMatrix, projMatrix;
+	sendCamera(viewMatrix, projMatrix);
+	renderThread->flush();
 
 	///////////////////////////////////////////////////////////////////////////
-	// Copy pathtraced image to texture for display
+	// Copy the last pass the render thread published to texture for display
 	///////////////////////////////////////////////////////////////////////////
 	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, pathtracer_result_txt_id);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, pathtracer::rendered_image.width,
-	             pathtracer::rendered_image.height, 0, GL_RGB, GL_FLOAT, pathtracer::rendered_image.getPtr());
+	displayTexture->update();
+	pathtracer::Frame& frame = renderThread->acquireFrame();
+	if(frame.id != 0)
+	{
+		PROFILE_CPU_ZONE("upload");
+		displayTexture->upload(frame);
+		displayedSamples = frame.samples;
+		tracePathsMs = frame.trace_ms;
+		denoiseMs = frame.denoise_ms;
+		displayedStats = frame.stats;
+	}
+	renderThread->releaseFrame();
+	glBindTexture(GL_TEXTURE_2D, displayTexture->getTexture());
 
 	///////////////////////////////////////////////////////////////////////////
 	// Render a fullscreen quad, textured with our pathtraced image.
@@ -283,36 +403,123 @@ void display(void)
 	{
 		glUseProgram(simpleShaderProgram);
 
-		mat4 modelMatrix = glm::translate(pathtracer::point_light.position);
+		mat4 modelMatrix = glm::translate(pointLight.position);
 		glUseProgram(simpleShaderProgram);
 		labhelper::setUniformSlow(simpleShaderProgram, "modelViewProjectionMatrix",
 		                          projMatrix * viewMatrix * modelMatrix);
-		labhelper::setUniformSlow(simpleShaderProgram, "material_color", pathtracer::point_light.color);
+		labhelper::setUniformSlow(simpleShaderProgram, "material_color", pointLight.color);
 
 		labhelper::debugDrawSphere();
 
-		for(int i = 0; i < pathtracer::disc_lights.size(); ++i)
+		for(int i = 0; i < discLights.size(); ++i)
 		{
-			mat3 tbn = labhelper::tangentSpace(pathtracer::disc_lights[i].direction);
+			mat3 tbn = labhelper::tangentSpace(discLights[i].direction);
 			tbn = mat3(tbn[0], tbn[2], tbn[1]);
-			mat4 modelMatrix = glm::translate(pathtracer::disc_lights[i].position) * mat4(tbn)
-			                   * glm::scale(vec3(pathtracer::disc_lights[i].radius));
+			mat4 modelMatrix = glm::translate(discLights[i].position) * mat4(tbn)
+			                   * glm::scale(vec3(discLights[i].radius));
 			glUseProgram(simpleShaderProgram);
 			labhelper::setUniformSlow(simpleShaderProgram, "modelViewProjectionMatrix",
 			                          projMatrix * viewMatrix * modelMatrix);
-			labhelper::setUniformSlow(simpleShaderProgram, "material_color", pathtracer::disc_lights[i].color);
+			labhelper::setUniformSlow(simpleShaderProgram, "material_color", discLights[i].color);
 
 			labhelper::debugDrawDisc();
 
-			labhelper::debugDrawArrow(viewMatrix, projMatrix, pathtracer::disc_lights[i].position,
-			                          pathtracer::disc_lights[i].position
-			                              + 2.f * pathtracer::disc_lights[i].direction);
+			labhelper::debugDrawArrow(viewMatrix, projMatrix, discLights[i].position,
+			                          discLights[i].position + 2.f * discLights[i].direction);
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Times uploading an image at 1080p and 4K: the way it was, where
+// glTexImage2D reallocates the texture and converts float RGB to RGB8 on
+// the CPU, against the DisplayTexture. All tiles change, the worst case.
+///////////////////////////////////////////////////////////////////////////////
+void benchmarkUpload()
+{
+	renderThread->pause();
+	typedef std::chrono::high_resolution_clock Clock;
+	typedef std::chrono::duration<double, std::milli> Milliseconds;
+	const int RUNS = 10;
+	const ivec2 sizes[] = { ivec2(1920, 1080), ivec2(3840, 2160) };
+	uploadBenchmarkResults.clear();
+	for(const ivec2& size : sizes)
+	{
+		pathtracer::Image image;
+		image.width = size.x;
+		image.height = size.y;
+		image.data.resize(size_t(size.x) * size.y);
+		for(size_t i = 0; i < image.data.size(); i++)
+		{
+			image.data[i] = vec3(float(i % 1021), float(i % 509), float(i % 251)) / 256.0f;
+		}
+
+		// Before, the first run allocates
+		GLuint texture;
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		double texImageMs = 0.0;
+		for(int run = 0; run <= RUNS; run++)
+		{
+			auto start = Clock::now();
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, image.width, image.height, 0, GL_RGB, GL_FLOAT, image.getPtr());
+			glFinish();
+			texImageMs += run > 0 ? Milliseconds(Clock::now() - start).count() : 0.0;
+		}
+		glDeleteTextures(1, &texture);
+		char line[256];
+		snprintf(line, sizeof(line), "%dx%d: glTexImage2D RGB8 %.2f ms\n", size.x, size.y, texImageMs / RUNS);
+		uploadBenchmarkResults += line;
+
+		// After, the first run uploads from client memory and creates the
+		// pixel buffer, the second maps it
+		for(pathtracer::DisplayFormat format : { pathtracer::DisplayFormat::RGBA16F, pathtracer::DisplayFormat::RGBA32F })
+		{
+			pathtracer::DisplayTexture display;
+			pathtracer::Frame frame;
+			frame.width = image.width;
+			frame.height = image.height;
+			frame.format = format;
+			const size_t bytes = size_t(image.width) * image.height * pathtracer::getBytesPerPixel(format);
+			const int tilesX = (image.width + pathtracer::DISPLAY_TILE_SIZE - 1) / pathtracer::DISPLAY_TILE_SIZE;
+			const int tilesY = (image.height + pathtracer::DISPLAY_TILE_SIZE - 1) / pathtracer::DISPLAY_TILE_SIZE;
+			double convertMs = 0.0, uploadMs = 0.0;
+			for(int run = 0; run <= RUNS + 1; run++)
+			{
+				frame.id = run + 1;
+				frame.in_staging = frame.staging != nullptr && frame.staging_size == bytes;
+				frame.pixels.resize(frame.in_staging ? 0 : bytes);
+				uint8_t* pixels = frame.in_staging ? frame.staging : frame.pixels.data();
+				auto start = Clock::now();
+#pragma omp parallel for schedule(dynamic)
+				for(int tile = 0; tile < tilesX * tilesY; tile++)
+				{
+					pathtracer::convertDisplayTile(image, tile % tilesX, tile / tilesX, format, pixels);
+				}
+				frame.tile_changed.assign(tilesX * tilesY, frame.id);
+				auto converted = Clock::now();
+				display.upload(frame);
+				glFinish();
+				display.update();
+				if(run > 1)
+				{
+					convertMs += Milliseconds(converted - start).count();
+					uploadMs += Milliseconds(Clock::now() - converted).count();
+				}
+			}
+			snprintf(line, sizeof(line), "%dx%d: %s %.2f ms upload (%.2f ms converting on the render thread)\n",
+			         size.x, size.y, format == pathtracer::DisplayFormat::RGBA16F ? "RGBA16F" : "RGBA32F",
+			         uploadMs / RUNS, convertMs / RUNS);
+			uploadBenchmarkResults += line;
 		}
 	}
+	printf("%s", uploadBenchmarkResults.c_str());
+	renderThread->resume();
 }
 
 bool handleEvents(void)
 {
+	PROFILE_CPU_ZONE("events");
 	// check events (keyboard among other)
 	SDL_Event event;
 	bool quitEvent = false;
@@ -336,6 +543,13 @@ bool handleEvents(void)
 		{
 			labhelper::saveScreenshot();
 		}
+		else if(event.type == SDL_KEYUP && event.key.keysym.sym == SDLK_F9)
+		{
+			// Not while the render thread is in a zone
+			renderThread->pause();
+			labhelper::profiler::toggleCapture();
+			renderThread->resume();
+		}
 		else if(event.type == SDL_MOUSEBUTTONDOWN && event.button.button == SDL_BUTTON_LEFT
 		        && !io.WantCaptureMouse)
 		{
@@ -364,7 +578,6 @@ bool handleEvents(void)
 			camera.direction = vec3(pitch * yaw * vec4(camera.direction, 0.0f));
 			g_prevMouseCoords.x = event.motion.x;
 			g_prevMouseCoords.y = event.motion.y;
-			pathtracer::restart();
 		}
 	}
 
@@ -377,32 +590,26 @@ bool handleEvents(void)
 		if(state[SDL_SCANCODE_W])
 		{
 			camera.position += deltaTime * speed * camera.direction;
-			pathtracer::restart();
 		}
 		if(state[SDL_SCANCODE_S])
 		{
 			camera.position -= deltaTime * speed * camera.direction;
-			pathtracer::restart();
 		}
 		if(state[SDL_SCANCODE_A])
 		{
 			camera.position -= deltaTime * speed * cameraRight;
-			pathtracer::restart();
 		}
 		if(state[SDL_SCANCODE_D])
 		{
 			camera.position += deltaTime * speed * cameraRight;
-			pathtracer::restart();
 		}
 		if(state[SDL_SCANCODE_Q])
 		{
 			camera.position -= deltaTime * speed * worldUp;
-			pathtracer::restart();
 		}
 		if(state[SDL_SCANCODE_E])
 		{
 			camera.position += deltaTime * speed * worldUp;
-			pathtracer::restart();
 		}
 	}
 
@@ -411,6 +618,7 @@ bool handleEvents(void)
 
 void gui()
 {
+	PROFILE_CPU_ZONE("gui");
 	if(ImGui::BeginMainMenuBar())
 	{
 		if(ImGui::BeginMenu("Scene"))
@@ -472,14 +680,148 @@ void gui()
 	///////////////////////////////////////////////////////////////////////////
 	if(ImGui::CollapsingHeader("Pathtracer", "pathtracer_ch", true, true))
 	{
-		ImGui::SliderInt("Subsampling", &pathtracer::settings.subsampling, 1, 16);
-		ImGui::SliderInt("Max Bounces", &pathtracer::settings.max_bounces, 0, 16);
-		ImGui::SliderInt("Max Paths Per Pixel", &pathtracer::settings.max_paths_per_pixel, 0, 1024);
+		pathtracer::Settings& settings = pathtracerSettings;
+		bool settingsChanged = false;
+		settingsChanged |= ImGui::SliderInt("Subsampling", &settings.subsampling, 1, 16);
+		settingsChanged |= ImGui::SliderInt("Max Bounces", &settings.max_bounces, 0, 16);
+		settingsChanged |= ImGui::SliderInt("Max Paths Per Pixel", &settings.max_paths_per_pixel, 0, 1024);
+		settingsChanged |= ImGui::Checkbox("Reproject on camera motion", &settings.reproject);
+		if(settings.reproject)
+		{
+			settingsChanged |= ImGui::SliderInt("Max history", &settings.max_history, 1, 256);
+			settingsChanged |= ImGui::SliderFloat("History clamp", &settings.history_clamp, 0.5f, 8.0f);
+		}
+		if(settingsChanged)
+		{
+			pathtracer::Command command = makeCommand(pathtracer::Command::SetSettings);
+			command.settings = settings;
+			renderThread->send(command);
+		}
 		if(ImGui::Button("Restart Pathtracing"))
 		{
-			pathtracer::restart();
+			renderThread->send(makeCommand(pathtracer::Command::Restart));
+		}
+		ImGui::Text("Num. samples: %d", displayedSamples);
+		ImGui::Text("Last frame: %.1f ms", tracePathsMs);
+		ImGui::Text("Upload: %.2f ms, %d/%d tiles", displayTexture->getLastUploadMs(),
+		            displayTexture->getLastUploadTiles(), displayTexture->getTileCount());
+		int displayFormatIndex = int(displayFormat);
+		if(ImGui::Combo("Display format", &displayFormatIndex, "RGBA16F\0RGBA32F\0"))
+		{
+			displayFormat = pathtracer::DisplayFormat(displayFormatIndex);
+			pathtracer::Command command = makeCommand(pathtracer::Command::SetDisplayFormat);
+			command.display_format = displayFormat;
+			renderThread->send(command);
+		}
+		if(ImGui::Button("Benchmark upload"))
+		{
+			benchmarkUpload();
+		}
+		if(!uploadBenchmarkResults.empty())
+		{
+			ImGui::TextUnformatted(uploadBenchmarkResults.c_str());
+		}
+
+		// Filter the image with the first hit albedo, normal and depth
+		pathtracer::denoiser::Settings& denoise = denoiserSettings;
+		bool denoiseSettingsChanged = ImGui::Checkbox("Denoise", &denoise.enabled);
+		if(denoise.enabled)
+		{
+			denoiseSettingsChanged |= ImGui::SliderInt("Denoise iterations", &denoise.iterations, 1, 8);
+			denoiseSettingsChanged |= ImGui::SliderFloat("Sigma luminance", &denoise.sigma_luminance, 0.1f, 16.0f);
+			denoiseSettingsChanged |= ImGui::SliderFloat("Sigma normal", &denoise.sigma_normal, 1.0f, 256.0f);
+			denoiseSettingsChanged |= ImGui::SliderFloat("Sigma depth", &denoise.sigma_depth, 0.1f, 16.0f);
+			ImGui::Text("Denoise: %.1f ms", denoiseMs);
+		}
+		if(denoiseSettingsChanged)
+		{
+			pathtracer::Command command = makeCommand(pathtracer::Command::SetDenoiser);
+			command.denoiser_settings = denoise;
+			renderThread->send(command);
+		}
+
+		// Reload all scenes with another vertex format, to compare memory
+		// use and tracing time.
+		int format = int(vertexFormat);
+		if(ImGui::Combo("Vertex format", &format, "Float\0Packed\0Packed, quantized positions\0"))
+		{
+			vertexFormat = labhelper::VertexFormat(format);
+			renderThread->pause();
+			cleanupScenes();
+			scenes.clear();
+			editedMaterials.clear();
+			loadScenes();
+			changeScene(currentScene);
+			renderThread->resume();
+		}
+		size_t cpuMemory = 0;
+		for(auto& o : scenes[currentScene].models)
+		{
+			cpuMemory += labhelper::getCpuVertexMemory(o.model);
+		}
+		ImGui::Text("Vertex memory: %zu kB", cpuMemory / 1024);
+		const pathtracer::HeightFieldGeometry* heightfield = scenes[currentScene].heightfield;
+		if(heightfield != nullptr)
+		{
+			ImGui::Text("Height field: %dx%d, %zu kB, pyramid built in %.1f ms", heightfield->width,
+			            heightfield->height, heightfield->getMemoryBytes() / 1024, heightfield->buildMs);
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Where the time goes in the hot path, since the last restart
+	///////////////////////////////////////////////////////////////////////////
+	if(ImGui::CollapsingHeader("Hot path", "hotpath_ch", true, false))
+	{
+		if(!pathtracer::stats::enabled())
+		{
+			ImGui::Text("Compiled out, build with PATHTRACER_STATS");
+		}
+		else
+		{
+			using namespace pathtracer::stats;
+			const Stats& stats = displayedStats;
+			const double nsPerCycle = 1e9 / cyclesPerSecond();
+			const double liCycles = double(std::max<uint64_t>(stats.cycles[Li], 1));
+			ImGui::Columns(4, "hotpath_zones");
+			ImGui::Text("Zone");
+			ImGui::NextColumn();
+			ImGui::Text("Calls");
+			ImGui::NextColumn();
+			ImGui::Text("ns/call");
+			ImGui::NextColumn();
+			ImGui::Text("%% of Li");
+			ImGui::NextColumn();
+			ImGui::Separator();
+			for(int zone = 0; zone < NUM_ZONES; zone++)
+			{
+				const uint64_t calls = stats.calls[zone];
+				ImGui::Text("%s", zone_names[zone]);
+				ImGui::NextColumn();
+				ImGui::Text("%llu", (unsigned long long)calls);
+				ImGui::NextColumn();
+				ImGui::Text("%.1f", calls > 0 ? stats.cycles[zone] * nsPerCycle / calls : 0.0);
+				ImGui::NextColumn();
+				ImGui::Text("%.1f", 100.0 * stats.cycles[zone] / liCycles);
+				ImGui::NextColumn();
+			}
+			ImGui::Columns(1);
+
+			float pathLengths[PATH_LENGTH_BUCKETS];
+			uint64_t paths = 0;
+			for(int i = 0; i < PATH_LENGTH_BUCKETS; i++)
+			{
+				pathLengths[i] = float(stats.path_lengths[i]);
+				paths += stats.path_lengths[i];
+			}
+			ImGui::PlotHistogram("Path lengths", pathLengths, PATH_LENGTH_BUCKETS, 0, nullptr, 0.0f, FLT_MAX,
+			                     ImVec2(0, 60));
+			for(int reason = 0; reason < NUM_TERMINATIONS; reason++)
+			{
+				ImGui::Text("%-16s %5.1f%%", termination_names[reason],
+				            paths > 0 ? 100.0 * stats.terminations[reason] / paths : 0.0);
+			}
 		}
-		ImGui::Text("Num. samples: %d", pathtracer::getSampleCount());
 	}
 
 	///////////////////////////////////////////////////////////////////////////
@@ -521,21 +863,40 @@ void gui()
 		{
 			labhelper::Material& material = selected_model->m_materials[selected_material_index];
 			ImGui::LabelText("Material Name", "%s", material.m_name.c_str());
-			ImGui::ColorEdit3("Color", &material.m_color.x);
-			ImGui::SliderFloat("Metalness", &material.m_metalness, 0.0f, 1.0f);
-			ImGui::SliderFloat("Fresnel", &material.m_fresnel, 0.0f, 1.0f);
-			ImGui::SliderFloat("Shininess", &material.m_shininess, 0.0f, 5000.0f, "%.3f", 2);
-			ImGui::ColorEdit3("Emission", &material.m_emission.x);
-			ImGui::SliderFloat("Transparency", &material.m_transparency, 0.0f, 1.0f);
+			// The render thread writes the material, the UI edits a copy.
+			// Materials that have not been edited are never written, so
+			// they can be read here.
+			auto edited = editedMaterials.find(&material);
+			if(edited == editedMaterials.end())
+			{
+				edited = editedMaterials.insert({ &material, pathtracer::getMaterialParameters(material) }).first;
+			}
+			pathtracer::MaterialParameters& parameters = edited->second;
+			bool materialChanged = false;
+			materialChanged |= ImGui::ColorEdit3("Color", &parameters.color.x);
+			materialChanged |= ImGui::SliderFloat("Metalness", &parameters.metalness, 0.0f, 1.0f);
+			materialChanged |= ImGui::SliderFloat("Fresnel", &parameters.fresnel, 0.0f, 1.0f);
+			materialChanged |= ImGui::SliderFloat("Shininess", &parameters.shininess, 0.0f, 5000.0f, "%.3f", 2);
+			materialChanged |= ImGui::ColorEdit3("Emission", &parameters.emission.x);
+			materialChanged |= ImGui::SliderFloat("Transparency", &parameters.transparency, 0.0f, 1.0f);
 			//ImGui::SliderFloat("IoR", &material.m_ior, 0.1f, 3.0f);
+			if(materialChanged)
+			{
+				pathtracer::Command command = makeCommand(pathtracer::Command::SetMaterial);
+				command.material = &material;
+				command.material_parameters = parameters;
+				renderThread->send(command);
+			}
 		}
 
 #if ALLOW_SAVE_MATERIALS
 		if(ImGui::Button("Save Materials"))
 		{
+			renderThread->pause();
 			labhelper::saveModelMaterialsToMTL(selected_model,
 			                                   labhelper::file::change_extension(selected_model->m_filename,
 			                                                                     ".mtl"));
+			renderThread->resume();
 		}
 #endif
 	}
@@ -546,32 +907,55 @@ void gui()
 	if(ImGui::CollapsingHeader("Light sources", "lights_ch", true, true))
 	{
 		ImGui::Checkbox("Show Light Overlays", &showLightSources);
-		ImGui::SliderFloat("Environment multiplier", &pathtracer::environment.multiplier, 0.0f, 10.0f);
+		if(ImGui::SliderFloat("Environment multiplier", &environmentMultiplier, 0.0f, 10.0f))
+		{
+			pathtracer::Command command = makeCommand(pathtracer::Command::SetEnvironment);
+			command.environment_multiplier = environmentMultiplier;
+			renderThread->send(command);
+		}
 		ImGui::Separator();
 		ImGui::Text("Point Light");
-		ImGui::ColorEdit3("Point light color", &pathtracer::point_light.color.x);
-		ImGui::SliderFloat("Point light intensity multiplier", &pathtracer::point_light.intensity_multiplier,
-		                   0.0f, 10000.0f);
-		ImGui::DragFloat3("Position", &pathtracer::point_light.position.x, 0.1);
+		bool pointLightChanged = false;
+		pointLightChanged |= ImGui::ColorEdit3("Point light color", &pointLight.color.x);
+		pointLightChanged |= ImGui::SliderFloat("Point light intensity multiplier", &pointLight.intensity_multiplier,
+		                                        0.0f, 10000.0f);
+		pointLightChanged |= ImGui::DragFloat3("Position", &pointLight.position.x, 0.1);
+		if(pointLightChanged)
+		{
+			pathtracer::Command command = makeCommand(pathtracer::Command::SetPointLight);
+			command.point_light = pointLight;
+			renderThread->send(command);
+		}
 
-		for(int i = 0; i < pathtracer::disc_lights.size(); ++i)
+		for(int i = 0; i < discLights.size(); ++i)
 		{
 			ImGui::PushID(i);
 			ImGui::Separator();
-			auto& l = pathtracer::disc_lights[i];
+			auto& l = discLights[i];
+			bool discLightChanged = false;
 			ImGui::Text("Disc Light %d", i);
-			ImGui::ColorEdit3("Color", &l.color.x);
-			ImGui::SliderFloat("Intensity", &l.intensity_multiplier, 0.0f, 10000.0f, "%.3f", 3);
-			ImGui::DragFloat3("Position", &l.position.x, 0.1);
+			discLightChanged |= ImGui::ColorEdit3("Color", &l.color.x);
+			discLightChanged |= ImGui::SliderFloat("Intensity", &l.intensity_multiplier, 0.0f, 10000.0f, "%.3f", 3);
+			discLightChanged |= ImGui::DragFloat3("Position", &l.position.x, 0.1);
 
 			glm::vec2 dir(atan2(l.direction.z, l.direction.x) / (2 * M_PI) + 0.5, acos(l.direction.y) / M_PI);
-			ImGui::DragFloat2("Direction", &dir.x, 0.01, 0, 1);
-			dir.x -= 0.5;
-			dir.x *= 2 * M_PI;
-			dir.y *= M_PI;
-			l.direction = vec3(cos(dir.x) * sin(dir.y), cos(dir.y), sin(dir.x) * sin(dir.y));
+			if(ImGui::DragFloat2("Direction", &dir.x, 0.01, 0, 1))
+			{
+				dir.x -= 0.5;
+				dir.x *= 2 * M_PI;
+				dir.y *= M_PI;
+				l.direction = vec3(cos(dir.x) * sin(dir.y), cos(dir.y), sin(dir.x) * sin(dir.y));
+				discLightChanged = true;
+			}
 
-			ImGui::DragFloat("Radius", &l.radius, 1, 0, 100);
+			discLightChanged |= ImGui::DragFloat("Radius", &l.radius, 1, 0, 100);
+			if(discLightChanged)
+			{
+				pathtracer::Command command = makeCommand(pathtracer::Command::SetDiscLight);
+				command.index = i;
+				command.disc_light = l;
+				renderThread->send(command);
+			}
 			ImGui::PopID();
 		}
 	}
@@ -590,6 +974,8 @@ int main(int argc, char* argv[])
 
 	while(!stopRendering)
 	{
+		labhelper::profiler::beginFrame();
+
 		//update currentTime
 		std::chrono::duration<float> timeSinceStart = std::chrono::system_clock::now() - startTime;
 		deltaTime = timeSinceStart.count() - currentTime;
@@ -617,6 +1003,10 @@ int main(int argc, char* argv[])
 		SDL_GL_SwapWindow(g_window);
 	}
 
+	// Stop tracing before the scenes and the pixel buffers go away
+	delete renderThread;
+	delete displayTexture;
+
 	// Delete Models
 	cleanupScenes();
 
@@ -1,6 +1,7 @@
 #include "material.h"
 #include "sampling.h"
 #include "labhelper.h"
+#include "stats.h"
 
 using namespace labhelper;
 
@@ -31,6 +32,7 @@ namespace pathtracer
 
 	WiSample Diffuse::sample_wi(const vec3& wo, const vec3& n) const
 	{
+		PATHTRACER_ZONE(SampleWiDiffuse);
 		WiSample r = sampleHemisphereCosine(wo, n);
 		r.f = f(r.wi, wo, n);
 		return r;
@@ -56,6 +58,7 @@ namespace pathtracer
 
 	WiSample MicrofacetBRDF::sample_wi(const vec3& wo, const vec3& n) const
 	{
+		PATHTRACER_ZONE(SampleWiMicrofacet);
 		//WiSample r = sampleHemisphereCosine(wo, n);
 		//r.f = f(r.wi, wo, n);
 
@@ -96,6 +99,7 @@ namespace pathtracer
 
 	WiSample DielectricBSDF::sample_wi(const vec3& wo, const vec3& n) const
 	{
+		PATHTRACER_ZONE(SampleWiDielectric);
 		WiSample r;
 
 		//r = sampleHemisphereCosine(wo, n); // Before task 7
@@ -129,6 +133,7 @@ namespace pathtracer
 
 	WiSample MetalBSDF::sample_wi(const vec3& wo, const vec3& n) const
 	{
+		PATHTRACER_ZONE(SampleWiMetal);
 		// Task 8
 		WiSample r;
 		//r = sampleHemisphereCosine(wo, n); // Before task 8
@@ -145,6 +150,7 @@ namespace pathtracer
 
 	WiSample BSDFLinearBlend::sample_wi(const vec3& wo, const vec3& n) const
 	{
+		PATHTRACER_ZONE(SampleWiBlend);
 		// Task 8
 		WiSample r;
 
@@ -175,6 +181,7 @@ namespace pathtracer
 
 	WiSample GlassBTDF::sample_wi(const vec3& wo, const vec3& n) const
 	{
+		PATHTRACER_ZONE(SampleWiGlass);
 		WiSample r;
 
 		float eta;
@@ -226,6 +233,7 @@ namespace pathtracer
 
 	WiSample BTDFLinearBlend::sample_wi(const vec3& wo, const vec3& n) const
 	{
+		PATHTRACER_ZONE(SampleWiBlend);
 		if (randf() < w)
 		{
 			WiSample r = btdf0->sample_wi(wo, n);
@@ -19,6 +19,14 @@ namespace pathtracer
 		return float(generators[omp_get_thread_num()]() / double(generators[omp_get_thread_num()].max()));
 	}
 
+	void seedRandom(uint32_t seed)
+	{
+		for (uint32_t i = 0; i < sizeof(generators) / sizeof(generators[0]); i++)
+		{
+			generators[i].seed(seed + i);
+		}
+	}
+
 	///////////////////////////////////////////////////////////////////////////
 	// Generate uniform points on a disc
 	///////////////////////////////////////////////////////////////////////////
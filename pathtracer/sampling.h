@@ -1,4 +1,5 @@
 #pragma once
+#include <cstdint>
 #include <glm/glm.hpp>
 
 namespace pathtracer
@@ -8,6 +9,11 @@ namespace pathtracer
 	///////////////////////////////////////////////////////////////////////////
 	float randf();
 
+	///////////////////////////////////////////////////////////////////////////
+	// Reseed the generator of every thread, for reproducible images
+	///////////////////////////////////////////////////////////////////////////
+	void seedRandom(uint32_t seed);
+
 	///////////////////////////////////////////////////////////////////////////
 	// Generate uniform points on a disc
 	///////////////////////////////////////////////////////////////////////////
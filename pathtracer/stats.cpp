@@ -0,0 +1,88 @@
+#include "stats.h"
+#include <algorithm>
+#include <chrono>
+
+namespace pathtracer
+{
+	namespace stats
+	{
+		const char* zone_names[NUM_ZONES] = { "Li",
+			                                  "intersect",
+			                                  "occluded",
+			                                  "getIntersection",
+			                                  "sample_wi",
+			                                  "Diffuse::sample_wi",
+			                                  "MicrofacetBRDF::sample_wi",
+			                                  "DielectricBSDF::sample_wi",
+			                                  "MetalBSDF::sample_wi",
+			                                  "LinearBlend::sample_wi",
+			                                  "GlassBTDF::sample_wi",
+			                                  "Lenvironment" };
+
+		const char* termination_names[NUM_TERMINATIONS] = { "primary_miss", "environment", "low_pdf",
+			                                                 "zero_throughput", "max_bounces" };
+
+#if PATHTRACER_STATS
+		std::vector<ThreadStats> thread_stats(omp_get_max_threads());
+#endif
+
+		Stats getStats()
+		{
+			Stats total = {};
+#if PATHTRACER_STATS
+			for (const ThreadStats& thread : thread_stats)
+			{
+				const Stats& s = thread.stats;
+				for (int i = 0; i < NUM_ZONES; i++)
+				{
+					total.calls[i] += s.calls[i];
+					total.cycles[i] += s.cycles[i];
+				}
+				for (int i = 0; i < PATH_LENGTH_BUCKETS; i++)
+				{
+					total.path_lengths[i] += s.path_lengths[i];
+				}
+				for (int i = 0; i < NUM_TERMINATIONS; i++)
+				{
+					total.terminations[i] += s.terminations[i];
+				}
+			}
+#endif
+			return total;
+		}
+
+		void resetStats()
+		{
+#if PATHTRACER_STATS
+			// Outside of parallel regions, so room can be made for the
+			// threads of the next ones
+			thread_stats.resize(std::max(thread_stats.size(), size_t(omp_get_max_threads())));
+			for (ThreadStats& thread : thread_stats)
+			{
+				thread.stats = Stats();
+			}
+#endif
+		}
+
+		double cyclesPerSecond()
+		{
+#if PATHTRACER_STATS && PATHTRACER_RDTSC
+			static double rate = 0.0;
+			if (rate == 0.0)
+			{
+				auto start = std::chrono::steady_clock::now();
+				uint64_t startCycles = readCycles();
+				while (std::chrono::steady_clock::now() - start < std::chrono::milliseconds(20))
+				{
+				}
+				std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+				rate = double(readCycles() - startCycles) / elapsed.count();
+			}
+			return rate;
+#else
+			// Without a cycle counter the timers count nanoseconds
+			return 1e9;
+#endif
+		}
+	} // namespace stats
+} // namespace pathtracer
@@ -0,0 +1,152 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include <omp.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Counters and cycle timers for the hot path of the pathtracer. Each thread
+// adds to its own copy, so nothing is shared while tracing; getStats() sums
+// them. They cost time in the hot path, so they are only compiled in when
+// building with PATHTRACER_STATS=1.
+///////////////////////////////////////////////////////////////////////////////
+#ifndef PATHTRACER_STATS
+#define PATHTRACER_STATS 0
+#endif
+
+#if PATHTRACER_STATS
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define PATHTRACER_RDTSC 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PATHTRACER_RDTSC 1
+#else
+#include <chrono>
+#define PATHTRACER_RDTSC 0
+#endif
+#endif
+
+namespace pathtracer
+{
+	namespace stats
+	{
+		///////////////////////////////////////////////////////////////////////
+		// The timed functions. The times are inclusive: SampleWi is the
+		// whole material tree, which is also counted per BSDF.
+		///////////////////////////////////////////////////////////////////////
+		enum Zone
+		{
+			Li,
+			Intersect,
+			Occluded,
+			GetIntersection,
+			SampleWi,
+			SampleWiDiffuse,
+			SampleWiMicrofacet,
+			SampleWiDielectric,
+			SampleWiMetal,
+			SampleWiBlend,
+			SampleWiGlass,
+			Lenvironment,
+			NUM_ZONES
+		};
+
+		// Why a path ended
+		enum Termination
+		{
+			PrimaryMiss,
+			EnvironmentMiss,
+			LowPdf,
+			ZeroThroughput,
+			MaxBounces,
+			NUM_TERMINATIONS
+		};
+
+		// Path lengths, in surface hits, longer paths go in the last bucket
+		const int PATH_LENGTH_BUCKETS = 17;
+
+		struct Stats
+		{
+			uint64_t calls[NUM_ZONES];
+			uint64_t cycles[NUM_ZONES];
+			uint64_t path_lengths[PATH_LENGTH_BUCKETS];
+			uint64_t terminations[NUM_TERMINATIONS];
+		};
+
+		extern const char* zone_names[NUM_ZONES];
+		extern const char* termination_names[NUM_TERMINATIONS];
+
+		inline bool enabled()
+		{
+			return PATHTRACER_STATS != 0;
+		}
+
+		// The sum over all threads since the last resetStats(). All zeros
+		// when the stats are compiled out.
+		Stats getStats();
+		void resetStats();
+
+		// Rate of the cycle counter, measured once on first use
+		double cyclesPerSecond();
+
+#if PATHTRACER_STATS
+		struct alignas(64) ThreadStats
+		{
+			Stats stats;
+		};
+		// One per OpenMP thread, as many as omp_get_max_threads() when the
+		// stats were last reset
+		extern std::vector<ThreadStats> thread_stats;
+
+		inline Stats& threadStats()
+		{
+			return thread_stats[omp_get_thread_num()].stats;
+		}
+
+		inline uint64_t readCycles()
+		{
+#if PATHTRACER_RDTSC
+			return __rdtsc();
+#else
+			return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			                    std::chrono::steady_clock::now().time_since_epoch())
+			                    .count());
+#endif
+		}
+
+		class ScopedZone
+		{
+		public:
+			explicit ScopedZone(Zone zone) : m_zone(zone), m_start(readCycles())
+			{
+			}
+			~ScopedZone()
+			{
+				Stats& s = threadStats();
+				s.calls[m_zone]++;
+				s.cycles[m_zone] += readCycles() - m_start;
+			}
+
+		private:
+			Zone m_zone;
+			uint64_t m_start;
+		};
+
+		inline void endPath(int length, Termination reason)
+		{
+			Stats& s = threadStats();
+			s.path_lengths[length < PATH_LENGTH_BUCKETS ? length : PATH_LENGTH_BUCKETS - 1]++;
+			s.terminations[reason]++;
+		}
+#endif
+	} // namespace stats
+} // namespace pathtracer
+
+#if PATHTRACER_STATS
+// Times the rest of the enclosing scope
+#define PATHTRACER_ZONE(zone) pathtracer::stats::ScopedZone pathtracer_zone(pathtracer::stats::zone)
+#define PATHTRACER_END_PATH(length, reason) pathtracer::stats::endPath(length, pathtracer::stats::reason)
+#else
+#define PATHTRACER_ZONE(zone)
+#define PATHTRACER_END_PATH(length, reason)
+#endif
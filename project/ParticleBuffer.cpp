@@ -0,0 +1,100 @@
+#include "ParticleBuffer.h"
+#include <chrono>
+
+const int ParticleBuffer::FRAMES_IN_FLIGHT;
+
+ParticleBuffer::ParticleBuffer(int capacity) : capacity(capacity)
+{
+}
+
+ParticleBuffer::~ParticleBuffer()
+{
+	for (auto& fence : fences)
+	{
+		if (fence != nullptr)
+		{
+			glDeleteSync(fence);
+		}
+	}
+	if (gl_buffer != 0)
+	{
+		if (mapped != nullptr)
+		{
+			glBindBuffer(GL_ARRAY_BUFFER, gl_buffer);
+			glUnmapBuffer(GL_ARRAY_BUFFER);
+		}
+		glDeleteBuffers(1, &gl_buffer);
+		glDeleteVertexArrays(1, &gl_vao);
+	}
+}
+
+void ParticleBuffer::init_gpu_data()
+{
+	glGenVertexArrays(1, &gl_vao);
+	glBindVertexArray(gl_vao);
+	glGenBuffers(1, &gl_buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, gl_buffer);
+	if (GLEW_ARB_buffer_storage)
+	{
+		const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		const GLsizeiptr size = GLsizeiptr(FRAMES_IN_FLIGHT) * capacity * sizeof(glm::vec4);
+		glBufferStorage(GL_ARRAY_BUFFER, size, nullptr, flags);
+		mapped = static_cast<glm::vec4*>(glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags));
+	}
+	else
+	{
+		glBufferData(GL_ARRAY_BUFFER, capacity * sizeof(glm::vec4), nullptr, GL_STREAM_DRAW);
+		gl_data_temp_buffer.resize(capacity);
+	}
+	glVertexAttribPointer(0, 4, GL_FLOAT, false, 0, 0);
+	glEnableVertexAttribArray(0);
+	glBindVertexArray(0);
+}
+
+glm::vec4* ParticleBuffer::map_frame()
+{
+	if (mapped == nullptr)
+	{
+		return gl_data_temp_buffer.data();
+	}
+	// Wait until the GPU has drawn from this region, FRAMES_IN_FLIGHT
+	// frames ago. Normally it has, and this returns right away.
+	auto startTime = std::chrono::high_resolution_clock::now();
+	GLsync& fence = fences[region];
+	if (fence != nullptr)
+	{
+		GLenum result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+		while (result != GL_ALREADY_SIGNALED && result != GL_CONDITION_SATISFIED && result != GL_WAIT_FAILED)
+		{
+			result = glClientWaitSync(fence, 0, 1000000);
+		}
+		glDeleteSync(fence);
+		fence = nullptr;
+	}
+	wait_ms = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count();
+	return mapped + region * capacity;
+}
+
+void ParticleBuffer::draw(int count)
+{
+	glBindVertexArray(gl_vao);
+	if (mapped == nullptr)
+	{
+		if (count > 0)
+		{
+			glBindBuffer(GL_ARRAY_BUFFER, gl_buffer);
+			glBufferSubData(GL_ARRAY_BUFFER, 0, count * sizeof(glm::vec4), gl_data_temp_buffer.data());
+			glDrawArrays(GL_POINTS, 0, count);
+		}
+	}
+	else
+	{
+		if (count > 0)
+		{
+			glDrawArrays(GL_POINTS, region * capacity, count);
+		}
+		fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		region = (region + 1) % FRAMES_IN_FLIGHT;
+	}
+	glBindVertexArray(0);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <vector>
+#include <glm/vec4.hpp>
+
+/// The vertex buffer the particles are drawn from: one vec4 per particle,
+/// with the view space position in xyz and the normalized age in w.
+///
+/// With ARB_buffer_storage the buffer holds FRAMES_IN_FLIGHT regions that
+/// stay persistently mapped. Each frame writes the next region directly,
+/// after waiting for the fence of the draw that last read it, so the CPU
+/// never waits for the GPU to finish the previous frame. Without it, the
+/// vertices are written to a CPU buffer and copied with glBufferSubData.
+class ParticleBuffer
+{
+public:
+	static const int FRAMES_IN_FLIGHT = 3;
+
+	/// Room for `capacity` particles per frame. The gpu buffer is created by
+	/// init_gpu_data().
+	explicit ParticleBuffer(int capacity);
+
+	/// Unmaps and deletes the gpu buffer, so it must be destroyed while the
+	/// GL context exists
+	~ParticleBuffer();
+
+	ParticleBuffer(const ParticleBuffer&) = delete;
+	ParticleBuffer& operator=(const ParticleBuffer&) = delete;
+
+	void init_gpu_data();
+
+	/// Where to write the vertices of this frame, `capacity` of them
+	glm::vec4* map_frame();
+
+	/// Draws the first `count` vertices written since map_frame() as points,
+	/// and moves on to the next region
+	void draw(int count);
+
+	bool is_persistent() const
+	{
+		return mapped != nullptr;
+	}
+
+	/// Time map_frame() spent waiting for the GPU, in the last frame
+	float wait_ms = 0.0f;
+
+private:
+	int capacity;
+	int region = 0;
+	GLuint gl_vao = 0;
+	GLuint gl_buffer = 0;
+	glm::vec4* mapped = nullptr;
+	GLsync fences[FRAMES_IN_FLIGHT] = {};
+	// Used when the buffer can not be persistently mapped
+	std::vector<glm::vec4> gl_data_temp_buffer;
+};
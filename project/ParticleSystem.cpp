@@ -1,25 +1,398 @@
 #include "ParticleSystem.h"
-ParticleSystem::ParticleSystem(int capacity) : max_size(capacity)
+#include <WorkerPool.h>
+#include <algorithm>
+#include <cfloat>
+#include <cstring>
+#if defined(__AVX__)
+#include <immintrin.h>
+#define PARTICLES_SIMD_WIDTH 8
+#elif defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define PARTICLES_SIMD_WIDTH 4
+#else
+#define PARTICLES_SIMD_WIDTH 1
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// Integrates PARTICLES_SIMD_WIDTH particles starting at `i` in place, and
+// returns a mask with bit k set if particle i + k is still alive.
+///////////////////////////////////////////////////////////////////////////////
+static inline int integrate(float* px, float* py, float* pz, const float* vx, const float* vy, const float* vz,
+	float* lifetime, const float* life_length, int i, float dt)
 {
-	gl_data_temp_buffer.resize(max_size);
+#if PARTICLES_SIMD_WIDTH == 8
+	const __m256 t = _mm256_set1_ps(dt);
+	_mm256_storeu_ps(px + i, _mm256_add_ps(_mm256_loadu_ps(px + i), _mm256_mul_ps(_mm256_loadu_ps(vx + i), t)));
+	_mm256_storeu_ps(py + i, _mm256_add_ps(_mm256_loadu_ps(py + i), _mm256_mul_ps(_mm256_loadu_ps(vy + i), t)));
+	_mm256_storeu_ps(pz + i, _mm256_add_ps(_mm256_loadu_ps(pz + i), _mm256_mul_ps(_mm256_loadu_ps(vz + i), t)));
+	const __m256 age = _mm256_add_ps(_mm256_loadu_ps(lifetime + i), t);
+	_mm256_storeu_ps(lifetime + i, age);
+	return _mm256_movemask_ps(_mm256_cmp_ps(age, _mm256_loadu_ps(life_length + i), _CMP_LT_OQ));
+#elif PARTICLES_SIMD_WIDTH == 4
+	const __m128 t = _mm_set1_ps(dt);
+	_mm_storeu_ps(px + i, _mm_add_ps(_mm_loadu_ps(px + i), _mm_mul_ps(_mm_loadu_ps(vx + i), t)));
+	_mm_storeu_ps(py + i, _mm_add_ps(_mm_loadu_ps(py + i), _mm_mul_ps(_mm_loadu_ps(vy + i), t)));
+	_mm_storeu_ps(pz + i, _mm_add_ps(_mm_loadu_ps(pz + i), _mm_mul_ps(_mm_loadu_ps(vz + i), t)));
+	const __m128 age = _mm_add_ps(_mm_loadu_ps(lifetime + i), t);
+	_mm_storeu_ps(lifetime + i, age);
+	return _mm_movemask_ps(_mm_cmplt_ps(age, _mm_loadu_ps(life_length + i)));
+#else
+	px[i] += vx[i] * dt;
+	py[i] += vy[i] * dt;
+	pz[i] += vz[i] * dt;
+	lifetime[i] += dt;
+	return lifetime[i] < life_length[i] ? 1 : 0;
+#endif
 }
 
-ParticleSystem::~ParticleSystem()
+///////////////////////////////////////////////////////////////////////////////
+// Copies PARTICLES_SIMD_WIDTH values from `from` down to `to` <= `from`.
+// Each vector is loaded before it is stored, so the ranges may overlap.
+///////////////////////////////////////////////////////////////////////////////
+static inline void moveBlock(float* stream, int from, int to)
+{
+#if PARTICLES_SIMD_WIDTH == 8
+	_mm256_storeu_ps(stream + to, _mm256_loadu_ps(stream + from));
+#elif PARTICLES_SIMD_WIDTH == 4
+	_mm_storeu_ps(stream + to, _mm_loadu_ps(stream + from));
+#else
+	stream[to] = stream[from];
+#endif
+}
+
+const int ParticleSystem::PARTICLE_CHUNK_SIZE;
+const int ParticleSystem::SORT_KEY_BITS;
+const int ParticleSystem::SORT_RADIX_BITS;
+
+ParticleSystem::ParticleSystem(int capacity, labhelper::WorkerPool* pool) : max_size(capacity), pool(pool)
 {
+	for (auto& stream : streams)
+	{
+		stream.resize(max_size);
+	}
+	emission_buffers.resize(pool != nullptr ? pool->size() : 1);
 }
 
-void ParticleSystem::init_gpu_data()
+int ParticleSystem::integrate_and_compact(int first, int last, float dt)
 {
+	float* px = streams[POS_X].data();
+	float* py = streams[POS_Y].data();
+	float* pz = streams[POS_Z].data();
+	const float* vx = streams[VEL_X].data();
+	const float* vy = streams[VEL_Y].data();
+	const float* vz = streams[VEL_Z].data();
+	float* age = streams[LIFETIME].data();
+	const float* length = streams[LIFE_LENGTH].data();
+
+	///////////////////////////////////////////////////////////////////////////
+	// Integrate and compact in one pass. Survivors are written to the front
+	// of the range in order. Blocks where everything survived are moved
+	// as vectors (or not at all, if nothing died before them), the rest one
+	// particle at a time.
+	///////////////////////////////////////////////////////////////////////////
+	const int width = force_scalar ? 1 : PARTICLES_SIMD_WIDTH;
+	const int all_alive = (1 << PARTICLES_SIMD_WIDTH) - 1;
+	int write = first;
+	int i = first;
+	if (width == PARTICLES_SIMD_WIDTH)
+	{
+		for (; i + PARTICLES_SIMD_WIDTH <= last; i += PARTICLES_SIMD_WIDTH)
+		{
+			const int alive = integrate(px, py, pz, vx, vy, vz, age, length, i, dt);
+			if (alive == all_alive)
+			{
+				if (write != i)
+				{
+					for (auto& stream : streams)
+					{
+						moveBlock(stream.data(), i, write);
+					}
+				}
+				write += PARTICLES_SIMD_WIDTH;
+				continue;
+			}
+			for (int lane = 0; lane < PARTICLES_SIMD_WIDTH; lane++)
+			{
+				if (alive & (1 << lane))
+				{
+					move(i + lane, write++);
+				}
+			}
+		}
+	}
+	for (; i < last; i++)
+	{
+		px[i] += vx[i] * dt;
+		py[i] += vy[i] * dt;
+		pz[i] += vz[i] * dt;
+		age[i] += dt;
+		if (age[i] < length[i])
+		{
+			if (write != i)
+			{
+				move(i, write);
+			}
+			write++;
+		}
+	}
+	return write - first;
 }
 
 void ParticleSystem::process_particles(float dt)
 {
+	spawn_emitted();
+	sorted = false;
+
+	const int chunks = (count + PARTICLE_CHUNK_SIZE - 1) / PARTICLE_CHUNK_SIZE;
+	if (pool == nullptr || pool->size() == 1 || chunks <= 1)
+	{
+		count = integrate_and_compact(0, count, dt);
+		return;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Parallel stream compaction, as a blocked prefix sum: the chunks are
+	// integrated and compacted in place in parallel, an exclusive scan of
+	// their survivor counts gives each chunk its place in the output, and
+	// the chunks are gathered there in parallel. Chunks would overwrite
+	// each other if moved in place, so they are gathered into a second set
+	// of arrays that is then swapped in.
+	///////////////////////////////////////////////////////////////////////////
+	chunk_survivors.resize(chunks);
+	chunk_offsets.resize(chunks);
+	pool->parallelFor(chunks,
+		[&](int chunk, int) {
+			const int first = chunk * PARTICLE_CHUNK_SIZE;
+			const int last = std::min(first + PARTICLE_CHUNK_SIZE, count);
+			chunk_survivors[chunk] = integrate_and_compact(first, last, dt);
+		},
+		deterministic);
+
+	int survivors = 0;
+	for (int chunk = 0; chunk < chunks; chunk++)
+	{
+		chunk_offsets[chunk] = survivors;
+		survivors += chunk_survivors[chunk];
+	}
+
+	for (auto& stream : gathered_streams)
+	{
+		stream.resize(max_size);
+	}
+	pool->parallelFor(chunks,
+		[&](int chunk, int) {
+			const int first = chunk * PARTICLE_CHUNK_SIZE;
+			for (int s = 0; s < NUM_STREAMS; s++)
+			{
+				memcpy(gathered_streams[s].data() + chunk_offsets[chunk], streams[s].data() + first,
+					chunk_survivors[chunk] * sizeof(float));
+			}
+		},
+		deterministic);
+	for (int s = 0; s < NUM_STREAMS; s++)
+	{
+		streams[s].swap(gathered_streams[s]);
+	}
+	count = survivors;
 }
 
-void ParticleSystem::submit_to_gpu(const glm::mat4& viewMat)
+void ParticleSystem::sort_by_depth(const glm::mat4& viewMat)
 {
+	const int chunks = (count + PARTICLE_CHUNK_SIZE - 1) / PARTICLE_CHUNK_SIZE;
+	for (int copy = 0; copy < 2; copy++)
+	{
+		sort_keys[copy].resize(count);
+		sort_indices[copy].resize(count);
+	}
+	sort_depths.resize(count);
+	chunk_depth_ranges.resize(chunks);
+
+	///////////////////////////////////////////////////////////////////////////
+	// View space z of every particle, and its range
+	///////////////////////////////////////////////////////////////////////////
+	float* depths = sort_depths.data();
+	for_each_chunk([&](int chunk) {
+		const float* px = streams[POS_X].data();
+		const float* py = streams[POS_Y].data();
+		const float* pz = streams[POS_Z].data();
+		glm::vec2 range(FLT_MAX, -FLT_MAX);
+		const int last = std::min(count, (chunk + 1) * PARTICLE_CHUNK_SIZE);
+		for (int i = chunk * PARTICLE_CHUNK_SIZE; i < last; i++)
+		{
+			const float z = viewMat[0][2] * px[i] + viewMat[1][2] * py[i] + viewMat[2][2] * pz[i] + viewMat[3][2];
+			depths[i] = z;
+			range.x = std::min(range.x, z);
+			range.y = std::max(range.y, z);
+		}
+		chunk_depth_ranges[chunk] = range;
+	});
+	glm::vec2 range(FLT_MAX, -FLT_MAX);
+	for (const auto& chunk_range : chunk_depth_ranges)
+	{
+		range.x = std::min(range.x, chunk_range.x);
+		range.y = std::max(range.y, chunk_range.y);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Quantize. The camera looks down -z, so increasing z is back to front.
+	///////////////////////////////////////////////////////////////////////////
+	const float max_key = float((1 << SORT_KEY_BITS) - 1);
+	const float scale = range.y > range.x ? max_key / (range.y - range.x) : 0.0f;
+	for_each_chunk([&](int chunk) {
+		const int last = std::min(count, (chunk + 1) * PARTICLE_CHUNK_SIZE);
+		for (int i = chunk * PARTICLE_CHUNK_SIZE; i < last; i++)
+		{
+			sort_keys[0][i] = uint16_t(std::min(max_key, (depths[i] - range.x) * scale));
+			sort_indices[0][i] = uint32_t(i);
+		}
+	});
+
+	///////////////////////////////////////////////////////////////////////////
+	// LSD radix sort, SORT_RADIX_BITS at a time. Each pass counts the
+	// digits of every chunk in parallel, scans the counts in (digit, chunk)
+	// order so every chunk gets its own range within every bucket, and then
+	// scatters the chunks in parallel. Chunks keep their order within a
+	// bucket, so the sort is stable and the result does not depend on the
+	// number of threads.
+	///////////////////////////////////////////////////////////////////////////
+	const int buckets = 1 << SORT_RADIX_BITS;
+	sort_histograms.resize(size_t(chunks) * buckets);
+	int in = 0;
+	for (int shift = 0; shift < SORT_KEY_BITS; shift += SORT_RADIX_BITS)
+	{
+		const uint16_t* keys_in = sort_keys[in].data();
+		for_each_chunk([&](int chunk) {
+			uint32_t* histogram = &sort_histograms[size_t(chunk) * buckets];
+			std::fill(histogram, histogram + buckets, 0);
+			const int last = std::min(count, (chunk + 1) * PARTICLE_CHUNK_SIZE);
+			for (int i = chunk * PARTICLE_CHUNK_SIZE; i < last; i++)
+			{
+				histogram[(keys_in[i] >> shift) & (buckets - 1)]++;
+			}
+		});
+
+		uint32_t offset = 0;
+		for (int digit = 0; digit < buckets; digit++)
+		{
+			for (int chunk = 0; chunk < chunks; chunk++)
+			{
+				uint32_t& bucket = sort_histograms[size_t(chunk) * buckets + digit];
+				const uint32_t size = bucket;
+				bucket = offset;
+				offset += size;
+			}
+		}
+
+		const uint32_t* indices_in = sort_indices[in].data();
+		uint16_t* keys_out = sort_keys[1 - in].data();
+		uint32_t* indices_out = sort_indices[1 - in].data();
+		for_each_chunk([&](int chunk) {
+			uint32_t* offsets = &sort_histograms[size_t(chunk) * buckets];
+			const int last = std::min(count, (chunk + 1) * PARTICLE_CHUNK_SIZE);
+			for (int i = chunk * PARTICLE_CHUNK_SIZE; i < last; i++)
+			{
+				const uint32_t destination = offsets[(keys_in[i] >> shift) & (buckets - 1)]++;
+				keys_out[destination] = keys_in[i];
+				indices_out[destination] = indices_in[i];
+			}
+		});
+		in = 1 - in;
+	}
+	sorted_copy = in;
+	sorted = true;
 }
 
-void ParticleSystem::spawn(Particle particle) {};
+void ParticleSystem::write_vertices(const glm::mat4& viewMat, glm::vec4* vertices) const
+{
+	const uint32_t* order = sorted ? sort_indices[sorted_copy].data() : nullptr;
+	for_each_chunk([&](int chunk) {
+		const float* px = streams[POS_X].data();
+		const float* py = streams[POS_Y].data();
+		const float* pz = streams[POS_Z].data();
+		const float* age = streams[LIFETIME].data();
+		const float* length = streams[LIFE_LENGTH].data();
+		const int last = std::min(count, (chunk + 1) * PARTICLE_CHUNK_SIZE);
+		for (int v = chunk * PARTICLE_CHUNK_SIZE; v < last; v++)
+		{
+			const int i = order != nullptr ? int(order[v]) : v;
+			const float x = px[i], y = py[i], z = pz[i];
+			vertices[v] = glm::vec4(viewMat[0][0] * x + viewMat[1][0] * y + viewMat[2][0] * z + viewMat[3][0],
+				viewMat[0][1] * x + viewMat[1][1] * y + viewMat[2][1] * z + viewMat[3][1],
+				viewMat[0][2] * x + viewMat[1][2] * y + viewMat[2][2] * z + viewMat[3][2], age[i] / length[i]);
+		}
+	});
+}
 
-void ParticleSystem::kill(int id) {};
\ No newline at end of file
+void ParticleSystem::for_each_chunk(const std::function<void(int chunk)>& fn) const
+{
+	const int chunks = (count + PARTICLE_CHUNK_SIZE - 1) / PARTICLE_CHUNK_SIZE;
+	if (pool != nullptr)
+	{
+		pool->parallelFor(chunks, [&](int chunk, int) { fn(chunk); }, deterministic);
+	}
+	else
+	{
+		for (int chunk = 0; chunk < chunks; chunk++)
+		{
+			fn(chunk);
+		}
+	}
+}
+
+void ParticleSystem::spawn(Particle particle)
+{
+	if (count >= max_size)
+	{
+		return;
+	}
+	sorted = false;
+	streams[POS_X][count] = particle.pos.x;
+	streams[POS_Y][count] = particle.pos.y;
+	streams[POS_Z][count] = particle.pos.z;
+	streams[VEL_X][count] = particle.velocity.x;
+	streams[VEL_Y][count] = particle.velocity.y;
+	streams[VEL_Z][count] = particle.velocity.z;
+	streams[LIFETIME][count] = particle.lifetime;
+	streams[LIFE_LENGTH][count] = particle.life_length;
+	count++;
+}
+
+void ParticleSystem::emit(int thread, const Particle& particle)
+{
+	emission_buffers[thread].push_back(particle);
+}
+
+void ParticleSystem::spawn_emitted()
+{
+	for (auto& buffer : emission_buffers)
+	{
+		for (const auto& particle : buffer)
+		{
+			spawn(particle);
+		}
+		buffer.clear();
+	}
+}
+
+Particle ParticleSystem::get(int id) const
+{
+	Particle particle;
+	particle.pos = glm::vec3(streams[POS_X][id], streams[POS_Y][id], streams[POS_Z][id]);
+	particle.velocity = glm::vec3(streams[VEL_X][id], streams[VEL_Y][id], streams[VEL_Z][id]);
+	particle.lifetime = streams[LIFETIME][id];
+	particle.life_length = streams[LIFE_LENGTH][id];
+	return particle;
+}
+
+void ParticleSystem::kill(int id)
+{
+	streams[LIFETIME][id] = std::max(streams[LIFETIME][id], streams[LIFE_LENGTH][id]);
+}
+
+void ParticleSystem::move(int from, int to)
+{
+	for (auto& stream : streams)
+	{
+		stream[to] = stream[from];
+	}
+}
@@ -1,10 +1,16 @@
 #pragma once
 
-#include <GL/glew.h>
+#include <cstdint>
+#include <functional>
 #include <vector>
 #include <glm/detail/type_vec3.hpp>
 #include <glm/mat4x4.hpp>
 
+namespace labhelper
+{
+	class WorkerPool;
+}
+
 struct Particle
 {
 	glm::vec3 pos;
@@ -13,38 +19,127 @@ struct Particle
 	float life_length;
 };
 
+/// The particles are stored as a structure of arrays, so that
+/// process_particles() can update 8 (AVX) or 4 (SSE) of them with each
+/// instruction. Build with PARTICLES_AVX to get the 8 wide version.
+///
+/// With a worker pool, the update is split into chunks of
+/// PARTICLE_CHUNK_SIZE particles that run in parallel, and particles can be
+/// emitted from the pool's threads through per-thread emission buffers.
+///
+/// There is no GL code here: the vertices are written to memory given by
+/// the caller, normally a ParticleBuffer, so the simulation can be run and
+/// tested without a GL context.
 class ParticleSystem
 {
 public:
-	/// Allocates the gpu buffer to hold up to `capacity` particles and the corresponding vao
-	explicit ParticleSystem(int capacity);
-
-	/// Clean up the gpu structures created in the constructor
-	~ParticleSystem();
+	/// Allocates room for up to `capacity` particles
+	explicit ParticleSystem(int capacity, labhelper::WorkerPool* pool = nullptr);
 
-	void init_gpu_data();
+	ParticleSystem(const ParticleSystem&) = delete;
+	ParticleSystem& operator=(const ParticleSystem&) = delete;
 
 	/// Creates a new particle if there less than `max_size` elements in the particles array buffer
 	void spawn(Particle particle);
 
+	/// Queues a particle in the emission buffer of a pool thread. Threads
+	/// may emit at the same time as long as each uses its own index.
+	void emit(int thread, const Particle& particle);
+
+	/// Spawns the particles in the emission buffers, in thread order. This
+	/// is done at the start of process_particles(), but should be called
+	/// after each parallel emission when several are done per frame, or
+	/// later batches get mixed into earlier ones.
+	void spawn_emitted();
+
 	/// Updates all the particles' positions depending on their speed, their lifetimes, and kills any
-	/// that are past their life_length
+	/// that are past their life_length. Surviving particles keep their order.
 	void process_particles(float dt);
 
-	/// Updates the vertex buffer with the current particle properties, and renders them
-	void submit_to_gpu(const glm::mat4& viewMat);
+	/// Sorts the particles back to front for blending, by their view space
+	/// depth quantized to SORT_KEY_BITS bits, with a parallel LSD radix
+	/// sort. The particles are not moved: the order is used by the next
+	/// write_vertices(), unless particles are spawned or processed before.
+	void sort_by_depth(const glm::mat4& viewMat);
 
-private:
-	/// Deletes a particle at position `id` by swapping it with the last
-	/// particle in the array and reducing the size by 1.
-	/// (Care with indexes, as this can change the particle an index refers to)
+	/// Writes one vertex per particle to `vertices`: the view space
+	/// position, and the age divided by the life length in w, in the order
+	/// of sort_by_depth() if it is up to date. Runs on the pool, and writes
+	/// each vertex once and in order, so `vertices` can point into
+	/// write-combined mapped memory.
+	void write_vertices(const glm::mat4& viewMat, glm::vec4* vertices) const;
+
+	int size() const
+	{
+		return count;
+	}
+	Particle get(int id) const;
+
+	/// Marks the particle at position `id` as dead. It is removed by the
+	/// stream compaction in the next process_particles(), so indices stay
+	/// valid until then.
 	void kill(int id);
 
-	// Members
-	std::vector<Particle> particles;
+	/// Use the scalar loop in process_particles(), to compare with the
+	/// vectorized one
+	bool force_scalar = false;
+
+	/// Run the pool jobs with a static schedule, so that particles emitted
+	/// from pool jobs end up in the same order every run, whatever the
+	/// number of threads. The simulation itself is always deterministic.
+	bool deterministic = false;
+
+	static const int PARTICLE_CHUNK_SIZE = 16384;
+	static const int SORT_KEY_BITS = 16;
+	static const int SORT_RADIX_BITS = 8;
+
+private:
+	enum Stream
+	{
+		POS_X,
+		POS_Y,
+		POS_Z,
+		VEL_X,
+		VEL_Y,
+		VEL_Z,
+		LIFETIME,
+		LIFE_LENGTH,
+		NUM_STREAMS
+	};
+
+	/// Integrates the particles in [first, last) and moves the survivors
+	/// to the front of the range. Returns the number of survivors.
+	int integrate_and_compact(int first, int last, float dt);
+
+	/// Copies particle `from` over particle `to`
+	void move(int from, int to);
+
+	/// Calls fn(chunk) for each PARTICLE_CHUNK_SIZE chunk of the particles,
+	/// on the pool if there is one
+	void for_each_chunk(const std::function<void(int chunk)>& fn) const;
+
+	// Members, one array per particle attribute
+	std::vector<float> streams[NUM_STREAMS];
+	int count = 0;
 	int max_size;
 
-	GLuint gl_vao = 0;
-	GLuint gl_buffer = 0;
-	std::vector<glm::vec4> gl_data_temp_buffer;
+	// Parallel update: the pool, the survivors of each chunk and where they
+	// go, the arrays the survivors are gathered into, and one emission
+	// buffer per pool thread.
+	labhelper::WorkerPool* pool;
+	std::vector<int> chunk_survivors;
+	std::vector<int> chunk_offsets;
+	std::vector<float> gathered_streams[NUM_STREAMS];
+	std::vector<std::vector<Particle>> emission_buffers;
+
+	// Depth sort: view space depths, keys and particle indices ping-ponged
+	// between the two copies by the radix passes, and per chunk bucket
+	// counts and depth ranges.
+	bool sorted = false;
+	std::vector<float> sort_depths;
+	std::vector<uint16_t> sort_keys[2];
+	std::vector<uint32_t> sort_indices[2];
+	std::vector<uint32_t> sort_histograms;
+	std::vector<glm::vec2> chunk_depth_ranges;
+	int sorted_copy = 0;
 };
@@ -1,14 +1,24 @@
 #include "heightfield.h"
 
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
 #include <iostream>
 #include <stdint.h>
 #include <vector>
 #include <glm/glm.hpp>
 #include <stb_image.h>
+#include <Culling.h>
+#include <labhelper.h>
 
 using namespace glm;
 using std::string;
 
+const int HeightField::STRIP_BAND_WIDTH;
+const GLuint HeightField::RESTART_INDEX;
+const int HeightField::MIN_MAX_FIRST_LEVEL;
+const uint32_t HeightField::MAX_PAGE_UPLOADS_PER_FRAME;
+
 HeightField::HeightField(void)
 	: m_meshResolution(0)
 	, m_vao(UINT32_MAX)
@@ -16,10 +26,21 @@ HeightField::HeightField(void)
 	, m_uvBuffer(UINT32_MAX)
 	, m_indexBuffer(UINT32_MAX)
 	, m_numIndices(0)
+	, m_numTriangles(0)
+	, m_generationMs(0.0f)
+	, m_gpuMemoryBytes(0)
 	, m_texid_hf(UINT32_MAX)
 	, m_texid_diffuse(UINT32_MAX)
 	, m_heightFieldPath("")
 	, m_diffuseTexturePath("")
+	, m_width(0)
+	, m_height(0)
+	, m_chunkResolution(0)
+	, m_chunkVao(UINT32_MAX)
+	, m_chunkPositionBuffer(UINT32_MAX)
+	, m_chunkIndexBuffer(UINT32_MAX)
+	, m_chunkNumIndices(0)
+	, m_chunkNumTriangles(0)
 {
 }
 
@@ -42,10 +63,52 @@ void HeightField::loadHeightField(const std::string& heigtFieldPath)
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	// Mipmaps are sampled by the coarser chunks
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, width, height, 0, GL_RED, GL_FLOAT,
 		data); // just one component (float)
+	glGenerateMipmap(GL_TEXTURE_2D);
+
+	m_width = width;
+	m_height = height;
+	m_heights.assign(data, data + size_t(width) * height);
+	stbi_image_free(data);
+
+	// Min/max pyramid, the first level from the heights, the following
+	// ones from 2x2 cells of the previous
+	m_minMax.clear();
+	int cellsX = (width + (1 << MIN_MAX_FIRST_LEVEL) - 1) >> MIN_MAX_FIRST_LEVEL;
+	int cellsY = (height + (1 << MIN_MAX_FIRST_LEVEL) - 1) >> MIN_MAX_FIRST_LEVEL;
+	m_minMax.emplace_back(size_t(cellsX) * cellsY, vec2(FLT_MAX, -FLT_MAX));
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			vec2& cell = m_minMax[0][(y >> MIN_MAX_FIRST_LEVEL) * cellsX + (x >> MIN_MAX_FIRST_LEVEL)];
+			const float h = m_heights[size_t(y) * width + x];
+			cell = vec2(min(cell.x, h), max(cell.y, h));
+		}
+	}
+	while (cellsX > 1 || cellsY > 1)
+	{
+		const std::vector<vec2>& previous = m_minMax.back();
+		const int nextX = (cellsX + 1) / 2;
+		const int nextY = (cellsY + 1) / 2;
+		std::vector<vec2> next(size_t(nextX) * nextY, vec2(FLT_MAX, -FLT_MAX));
+		for (int y = 0; y < cellsY; y++)
+		{
+			for (int x = 0; x < cellsX; x++)
+			{
+				vec2& cell = next[(y / 2) * nextX + x / 2];
+				const vec2& child = previous[y * cellsX + x];
+				cell = vec2(min(cell.x, child.x), max(cell.y, child.y));
+			}
+		}
+		m_minMax.push_back(std::move(next));
+		cellsX = nextX;
+		cellsY = nextY;
+	}
 
 	m_heightFieldPath = heigtFieldPath;
 	std::cout << "Successfully loaded heigh field texture: " << heigtFieldPath << ".\n";
@@ -79,10 +142,87 @@ void HeightField::loadDiffuseTexture(const std::string& diffusePath)
 	std::cout << "Successfully loaded diffuse texture: " << diffusePath << ".\n";
 }
 
+///////////////////////////////////////////////////////////////////////////////
+/// Appends the strips of a grid of quads x quads, where vertex (i, j) is at
+/// index first + j * stride + i
+///////////////////////////////////////////////////////////////////////////////
+static void appendGridStrips(std::vector<uint32_t>& indices, int quads, uint32_t first, uint32_t stride)
+{
+	const int bands = (quads + HeightField::STRIP_BAND_WIDTH - 1) / HeightField::STRIP_BAND_WIDTH;
+	indices.reserve(indices.size() + size_t(bands) * quads * (2 * (HeightField::STRIP_BAND_WIDTH + 1) + 1));
+	for (int band = 0; band < bands; band++)
+	{
+		const int firstColumn = band * HeightField::STRIP_BAND_WIDTH;
+		const int lastColumn = std::min(firstColumn + HeightField::STRIP_BAND_WIDTH, quads);
+		for (int j = 0; j < quads; j++)
+		{
+			for (int i = firstColumn; i <= lastColumn; i++)
+			{
+				indices.push_back(first + j * stride + i);
+				indices.push_back(first + (j + 1) * stride + i);
+			}
+			indices.push_back(HeightField::RESTART_INDEX);
+		}
+	}
+}
+
 void HeightField::generateMesh(int tesselation)
 {
+	auto startTime = std::chrono::high_resolution_clock::now();
+	tesselation = std::max(1, std::min(tesselation, 8192));
+	m_meshResolution = tesselation;
+	const int verticesPerSide = tesselation + 1;
+
 	// generate a mesh in range -1 to 1 in x and z
 	// (y is 0 but will be altered in height field vertex shader)
+	// The grid is shared by all strips, vertex (i, j) is at index j * (n + 1) + i
+	std::vector<vec3> positions(size_t(verticesPerSide) * verticesPerSide);
+	std::vector<vec2> uvs(positions.size());
+	for (int j = 0; j < verticesPerSide; j++)
+	{
+		const float v = float(j) / float(tesselation);
+		for (int i = 0; i < verticesPerSide; i++)
+		{
+			const float u = float(i) / float(tesselation);
+			positions[j * verticesPerSide + i] = vec3(u * 2.0f - 1.0f, 0.0f, v * 2.0f - 1.0f);
+			// The image is flipped on load, so its top row is at v = 1 (z = -1)
+			uvs[j * verticesPerSide + i] = vec2(u, 1.0f - v);
+		}
+	}
+
+	// One strip per row of each band, counter clockwise seen from above
+	std::vector<uint32_t> indices;
+	appendGridStrips(indices, tesselation, 0, verticesPerSide);
+	m_numIndices = GLuint(indices.size());
+	m_numTriangles = GLuint(2 * size_t(tesselation) * tesselation);
+
+	if (m_vao == UINT32_MAX)
+	{
+		glGenVertexArrays(1, &m_vao);
+		glGenBuffers(1, &m_positionBuffer);
+		glGenBuffers(1, &m_uvBuffer);
+		glGenBuffers(1, &m_indexBuffer);
+	}
+	glBindVertexArray(m_vao);
+	glBindBuffer(GL_ARRAY_BUFFER, m_positionBuffer);
+	glBufferData(GL_ARRAY_BUFFER, positions.size() * sizeof(vec3), positions.data(), GL_STATIC_DRAW);
+	glVertexAttribPointer(0, 3, GL_FLOAT, false, 0, 0);
+	glEnableVertexAttribArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, m_uvBuffer);
+	glBufferData(GL_ARRAY_BUFFER, uvs.size() * sizeof(vec2), uvs.data(), GL_STATIC_DRAW);
+	glVertexAttribPointer(2, 2, GL_FLOAT, false, 0, 0);
+	glEnableVertexAttribArray(2);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(uint32_t), indices.data(), GL_STATIC_DRAW);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	m_gpuMemoryBytes = positions.size() * (sizeof(vec3) + sizeof(vec2)) + indices.size() * sizeof(uint32_t);
+	m_generationMs = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - startTime)
+		.count();
+	std::cout << "Generated height field mesh: " << m_numTriangles << " triangles, " << positions.size()
+		<< " vertices, " << m_numIndices << " indices, " << m_gpuMemoryBytes / 1024 << " kB in "
+		<< m_generationMs << " ms.\n";
 }
 
 void HeightField::submitTriangles(void)
@@ -92,4 +232,254 @@ void HeightField::submitTriangles(void)
 		std::cout << "No vertex array is generated, cannot draw anything.\n";
 		return;
 	}
-}
\ No newline at end of file
+	glBindVertexArray(m_vao);
+	glEnable(GL_PRIMITIVE_RESTART);
+	glPrimitiveRestartIndex(RESTART_INDEX);
+	glDrawElements(GL_TRIANGLE_STRIP, m_numIndices, GL_UNSIGNED_INT, 0);
+	glDisable(GL_PRIMITIVE_RESTART);
+	glBindVertexArray(0);
+}
+void HeightField::generateChunkMesh(int resolution)
+{
+	m_chunkResolution = resolution;
+	const int verticesPerSide = resolution + 1;
+
+	// The grid spans 0 to 1 in x and z. The skirt repeats the border
+	// vertices with y = -1, which the vertex shader moves down.
+	std::vector<vec3> positions;
+	for (int j = 0; j < verticesPerSide; j++)
+	{
+		for (int i = 0; i < verticesPerSide; i++)
+		{
+			positions.push_back(vec3(float(i) / resolution, 0.0f, float(j) / resolution));
+		}
+	}
+	std::vector<uint32_t> border;
+	for (int i = 0; i < resolution; i++)
+		border.push_back(i);
+	for (int j = 0; j < resolution; j++)
+		border.push_back(j * verticesPerSide + resolution);
+	for (int i = resolution; i > 0; i--)
+		border.push_back(resolution * verticesPerSide + i);
+	for (int j = resolution; j > 0; j--)
+		border.push_back(j * verticesPerSide);
+	const uint32_t firstSkirtVertex = uint32_t(positions.size());
+	for (uint32_t b : border)
+	{
+		positions.push_back(vec3(positions[b].x, -1.0f, positions[b].z));
+	}
+
+	std::vector<uint32_t> indices;
+	appendGridStrips(indices, resolution, 0, verticesPerSide);
+	// One closed strip around the chunk
+	for (size_t k = 0; k <= border.size(); k++)
+	{
+		indices.push_back(border[k % border.size()]);
+		indices.push_back(firstSkirtVertex + uint32_t(k % border.size()));
+	}
+	indices.push_back(RESTART_INDEX);
+	m_chunkNumIndices = GLuint(indices.size());
+	m_chunkNumTriangles = GLuint(2 * resolution * resolution + 2 * border.size());
+
+	if (m_chunkVao == UINT32_MAX)
+	{
+		glGenVertexArrays(1, &m_chunkVao);
+		glGenBuffers(1, &m_chunkPositionBuffer);
+		glGenBuffers(1, &m_chunkIndexBuffer);
+	}
+	glBindVertexArray(m_chunkVao);
+	glBindBuffer(GL_ARRAY_BUFFER, m_chunkPositionBuffer);
+	glBufferData(GL_ARRAY_BUFFER, positions.size() * sizeof(vec3), positions.data(), GL_STATIC_DRAW);
+	glVertexAttribPointer(0, 3, GL_FLOAT, false, 0, 0);
+	glEnableVertexAttribArray(0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_chunkIndexBuffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(uint32_t), indices.data(), GL_STATIC_DRAW);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+vec2 HeightField::getHeightRange(float x0, float z0, float x1, float z1) const
+{
+	if (m_minMax.empty())
+	{
+		return vec2(0.0f, 1.0f);
+	}
+	// Texels covered, with v = 0.5 - z / 2 as in generateMesh()
+	int c0 = int(std::floor((x0 * 0.5f + 0.5f) * m_width));
+	int c1 = int(std::ceil((x1 * 0.5f + 0.5f) * m_width)) - 1;
+	int r0 = int(std::floor((0.5f - z1 * 0.5f) * m_height));
+	int r1 = int(std::ceil((0.5f - z0 * 0.5f) * m_height)) - 1;
+	c0 = clamp(c0, 0, m_width - 1) >> MIN_MAX_FIRST_LEVEL;
+	c1 = clamp(c1, 0, m_width - 1) >> MIN_MAX_FIRST_LEVEL;
+	r0 = clamp(r0, 0, m_height - 1) >> MIN_MAX_FIRST_LEVEL;
+	r1 = clamp(r1, 0, m_height - 1) >> MIN_MAX_FIRST_LEVEL;
+	// Go up the pyramid until a few cells cover the rectangle
+	size_t level = 0;
+	while (level + 1 < m_minMax.size() && (c1 - c0 > 2 || r1 - r0 > 2))
+	{
+		level++;
+		c0 >>= 1;
+		c1 >>= 1;
+		r0 >>= 1;
+		r1 >>= 1;
+	}
+	int cellsX = (m_width + (1 << MIN_MAX_FIRST_LEVEL) - 1) >> MIN_MAX_FIRST_LEVEL;
+	for (size_t l = 0; l < level; l++)
+	{
+		cellsX = (cellsX + 1) / 2;
+	}
+	vec2 range(FLT_MAX, -FLT_MAX);
+	for (int r = r0; r <= r1; r++)
+	{
+		for (int c = c0; c <= c1; c++)
+		{
+			const vec2& cell = m_minMax[level][r * cellsX + c];
+			range = vec2(min(range.x, cell.x), max(range.y, cell.y));
+		}
+	}
+	return range;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Quadtree traversal of submitChunks()
+///////////////////////////////////////////////////////////////////////////////
+struct ChunkContext
+{
+	// Draw from the streamed pages instead of the height field texture
+	bool paged;
+	labhelper::Frustum frustum;
+	vec3 camera;
+	float heightScale;
+	float lodFactor;
+	int maxDepth;
+	GLint transformLocation;
+	GLint lodLocation;
+	GLint layerLocation;
+};
+
+static void submitChunk(HeightField* hf, const ChunkContext& context, float x0, float z0, float size, int depth,
+	uint32_t tileX, uint32_t tileY)
+{
+	vec2 range;
+	if (context.paged)
+	{
+		const TileEntry& entry = hf->m_pages.getEntry(depth, tileX, tileY);
+		range = vec2(entry.minHeight, entry.maxHeight) * context.heightScale;
+	}
+	else
+	{
+		range = hf->getHeightRange(x0, z0, x0 + size, z0 + size) * context.heightScale;
+	}
+	const float spacing = size / hf->m_chunkResolution;
+	const float skirtDepth = range.y - range.x + spacing;
+	const vec3 boxMin(x0, range.x - skirtDepth, z0);
+	const vec3 boxMax(x0 + size, range.y, z0 + size);
+
+	const glm::vec4 sphere(0.5f * (boxMin + boxMax), 0.5f * length(boxMax - boxMin));
+	uint8_t visible;
+	labhelper::cullSpheres(context.frustum, &sphere, sizeof(sphere), 1, &visible);
+	if (!visible)
+	{
+		return;
+	}
+
+	const float distance = length(max(max(boxMin - context.camera, context.camera - boxMax), vec3(0.0f)));
+	bool split = depth < context.maxDepth && distance < context.lodFactor * size;
+	if (split && context.paged)
+	{
+		// Children are drawn once all four are resident, until then this
+		// node stands in for them. All are requested so they load together.
+		int resident = 0;
+		for (uint32_t child = 0; child < 4; child++)
+		{
+			const int layer = hf->m_pages.request(depth + 1, 2 * tileX + (child & 1), 2 * tileY + (child >> 1));
+			resident += layer >= 0 ? 1 : 0;
+		}
+		split = resident == 4;
+	}
+	if (split)
+	{
+		const float half = 0.5f * size;
+		submitChunk(hf, context, x0, z0, half, depth + 1, 2 * tileX, 2 * tileY);
+		submitChunk(hf, context, x0 + half, z0, half, depth + 1, 2 * tileX + 1, 2 * tileY);
+		submitChunk(hf, context, x0, z0 + half, half, depth + 1, 2 * tileX, 2 * tileY + 1);
+		submitChunk(hf, context, x0 + half, z0 + half, half, depth + 1, 2 * tileX + 1, 2 * tileY + 1);
+		return;
+	}
+
+	glUniform4f(context.transformLocation, x0, z0, size, skirtDepth);
+	if (context.paged)
+	{
+		const int layer = hf->m_pages.request(depth, tileX, tileY);
+		if (layer < 0)
+		{
+			return;
+		}
+		glUniform1f(context.layerLocation, float(layer));
+	}
+	else
+	{
+		// Sample the mip level whose texels are as large as the vertex spacing
+		const float texelsPerVertex = spacing * 0.5f * hf->m_width;
+		glUniform1f(context.lodLocation, std::max(0.0f, std::log2(texelsPerVertex)));
+	}
+	glDrawElements(GL_TRIANGLE_STRIP, hf->m_chunkNumIndices, GL_UNSIGNED_INT, 0);
+	hf->m_chunkStats.chunks++;
+	hf->m_chunkStats.triangles += hf->m_chunkNumTriangles;
+	hf->m_chunkStats.depth = std::max(hf->m_chunkStats.depth, depth);
+}
+
+void HeightField::submitChunks(const mat4& modelMatrix, const mat4& viewProjectionMatrix,
+	const vec3& cameraPosition, float heightScale, float lodFactor, bool paged)
+{
+	if (m_chunkVao == UINT32_MAX)
+	{
+		std::cout << "No chunk mesh is generated, cannot draw anything.\n";
+		return;
+	}
+	auto startTime = std::chrono::high_resolution_clock::now();
+	m_chunkStats = ChunkStats();
+
+	GLint program = 0;
+	glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+	paged = paged && m_pages.isOpen();
+	if (paged)
+	{
+		m_pages.update(MAX_PAGE_UPLOADS_PER_FRAME);
+		glActiveTexture(GL_TEXTURE2);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, m_pages.m_texture);
+		glActiveTexture(GL_TEXTURE0);
+	}
+	ChunkContext context;
+	context.paged = paged;
+	context.frustum = labhelper::extractFrustum(viewProjectionMatrix * modelMatrix);
+	context.camera = vec3(inverse(modelMatrix) * vec4(cameraPosition, 1.0f));
+	context.heightScale = heightScale;
+	context.lodFactor = lodFactor;
+	// The finest chunks have one vertex per texel, or use the finest tiles
+	context.maxDepth = paged ? int(m_pages.m_header.levels) - 1
+		: std::max(0, int(std::floor(std::log2(float(m_width) / m_chunkResolution))));
+	context.transformLocation = labhelper::getUniformLocation(program, "chunkTransform");
+	context.lodLocation = labhelper::getUniformLocation(program, "chunkLod");
+	context.layerLocation = labhelper::getUniformLocation(program, "pageLayer");
+
+	// Skirts are seen from both sides
+	const GLboolean cullFace = glIsEnabled(GL_CULL_FACE);
+	glDisable(GL_CULL_FACE);
+	glUniform1i(labhelper::getUniformLocation(program, "chunked"), 1);
+	glUniform1i(labhelper::getUniformLocation(program, "paged"), paged ? 1 : 0);
+	glBindVertexArray(m_chunkVao);
+	glEnable(GL_PRIMITIVE_RESTART);
+	glPrimitiveRestartIndex(RESTART_INDEX);
+	submitChunk(this, context, -1.0f, -1.0f, 2.0f, 0, 0, 0);
+	glDisable(GL_PRIMITIVE_RESTART);
+	glBindVertexArray(0);
+	glUniform1i(labhelper::getUniformLocation(program, "chunked"), 0);
+	glUniform1i(labhelper::getUniformLocation(program, "paged"), 0);
+	if (cullFace)
+	{
+		glEnable(GL_CULL_FACE);
+	}
+	m_chunkStats.selectMs = std::chrono::duration<float, std::milli>(
+		std::chrono::high_resolution_clock::now() - startTime).count();
+}
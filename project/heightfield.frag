@@ -5,13 +5,19 @@ precision highp float;
 
 
 in vec2 texCoord;
+in vec3 viewSpacePosition;
+in vec3 viewSpaceNormal;
 layout(location = 0) out vec4 fragmentColor;
 
+uniform vec3 viewSpaceLightDir;
+
 // This simple fragment shader is meant to be used for debug purposes
 // When the geometry is ok, we will migrate to use shading.frag instead.
 
 void main()
 {
 	//fragmentColor = vec4(texCoord.xy, 0.0, 1.0);
-	fragmentColor = vec4(1, 1, 1, 1);
+	vec3 n = normalize(viewSpaceNormal);
+	float diffuse = max(dot(n, -normalize(viewSpaceLightDir)), 0.0);
+	fragmentColor = vec4(vec3(0.45, 0.5, 0.4) * (0.3 + 0.7 * diffuse), 1.0);
 }
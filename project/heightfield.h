@@ -1,20 +1,59 @@
+#include <cstdint>
 #include <string>
+#include <vector>
 #include <GL/glew.h>
+#include <glm/glm.hpp>
+#include "heightfieldpages.h"
 
 class HeightField
 {
 public:
 	int m_meshResolution; // triangles edges per quad side
-	GLuint m_texid_hf;
-	GLuint m_texid_diffuse;
 	GLuint m_vao;
 	GLuint m_positionBuffer;
 	GLuint m_uvBuffer;
 	GLuint m_indexBuffer;
 	GLuint m_numIndices;
+	GLuint m_numTriangles;
+	// Statistics of the last generateMesh()
+	float m_generationMs;
+	size_t m_gpuMemoryBytes;
+	GLuint m_texid_hf;
+	GLuint m_texid_diffuse;
 	std::string m_heightFieldPath;
 	std::string m_diffuseTexturePath;
 
+	// The heights on the CPU, row 0 at v = 0, and their minimum and maximum
+	// over blocks of 2^(MIN_MAX_FIRST_LEVEL + level) texels per side
+	static const int MIN_MAX_FIRST_LEVEL = 4;
+	int m_width;
+	int m_height;
+	std::vector<float> m_heights;
+	std::vector<std::vector<glm::vec2>> m_minMax;
+
+	// Chunked LOD: a quadtree over the height field where every node is
+	// drawn with the same grid of m_chunkResolution quads per side, skirted
+	// to hide the cracks between nodes of different levels.
+	int m_chunkResolution;
+	GLuint m_chunkVao;
+	GLuint m_chunkPositionBuffer;
+	GLuint m_chunkIndexBuffer;
+	GLuint m_chunkNumIndices;
+	GLuint m_chunkNumTriangles;
+	struct ChunkStats
+	{
+		uint32_t chunks = 0;
+		uint32_t triangles = 0;
+		int depth = 0;
+		float selectMs = 0.0f;
+	};
+	ChunkStats m_chunkStats;
+
+	// Streamed tiles of a height field too large for one texture, drawn
+	// by the chunked LOD in place of m_texid_hf
+	HeightFieldPages m_pages;
+	static const uint32_t MAX_PAGE_UPLOADS_PER_FRAME = 8;
+
 	HeightField(void);
 
 	/// Load height field
@@ -23,9 +62,32 @@ public:
 	/// Load diffuse map
 	void loadDiffuseTexture(const std::string& diffusePath);
 
-	/// Generate mesh
+	/// Generate mesh: a grid of tesselation x tesselation quads drawn as
+	/// triangle strips, restarted at the end of every row of a band of
+	/// STRIP_BAND_WIDTH quads so that the vertices shared with the next row
+	/// are still in the post-transform cache.
+	static const int STRIP_BAND_WIDTH = 16;
+	static const GLuint RESTART_INDEX = UINT32_MAX;
 	void generateMesh(int tesselation);
 
 	/// Render height map
 	void submitTriangles(void);
+
+	/// Generate the grid shared by all chunks
+	void generateChunkMesh(int resolution);
+
+	/// Render the chunks needed from the camera. A node is split while the
+	/// camera is closer than lodFactor times its size, down to the level
+	/// where the vertex spacing is one texel. Nodes outside the frustum are
+	/// skipped. Expects a program with the chunked path of heightfield.vert.
+	///
+	/// If paged is set and a tile file is open in m_pages, each node is
+	/// drawn from its tile instead, and is only split once the tiles of
+	/// its children are resident.
+	void submitChunks(const glm::mat4& modelMatrix, const glm::mat4& viewProjectionMatrix,
+		const glm::vec3& cameraPosition, float heightScale, float lodFactor, bool paged = false);
+
+	/// Minimum and maximum height in a rectangle of the grid (-1 to 1 in x
+	/// and z), conservatively
+	glm::vec2 getHeightRange(float x0, float z0, float x1, float z1) const;
 };
@@ -13,6 +13,21 @@ uniform mat4 normalMatrix;
 uniform mat4 modelViewMatrix;
 uniform mat4 modelViewProjectionMatrix;
 
+layout(binding = 1) uniform sampler2D heightField;
+uniform float heightScale = 1.0;
+
+// Chunked LOD: position.xz is in 0 to 1 within the chunk, and the skirt
+// vertices have position.y = -1.
+uniform bool chunked = false;
+uniform vec4 chunkTransform; // xz of the chunk corner, chunk size, skirt depth
+uniform float chunkLod;      // height field mip level to sample
+
+// Streamed pages: each chunk is one tile, a layer of heightPages whose edge
+// samples are at the chunk edges.
+uniform bool paged = false;
+layout(binding = 2) uniform sampler2DArray heightPages;
+uniform float pageLayer;
+
 ///////////////////////////////////////////////////////////////////////////////
 // Output to fragment shader
 ///////////////////////////////////////////////////////////////////////////////
@@ -22,6 +37,54 @@ out vec3 viewSpaceNormal;
 
 void main()
 {
-	gl_Position = modelViewProjectionMatrix * vec4(position, 1.0);
-	texCoord = texCoordIn;
+	vec2 xz = position.xz;
+	vec2 uv = texCoordIn;
+	float lod = 0.0;
+	float skirt = 0.0;
+	if(chunked)
+	{
+		xz = chunkTransform.xy + position.xz * chunkTransform.z;
+		uv = vec2(xz.x * 0.5 + 0.5, 0.5 - xz.y * 0.5);
+		lod = chunkLod;
+		skirt = position.y < 0.0 ? chunkTransform.w : 0.0;
+	}
+
+	// Heights at the vertex and one sample away in -x, +x, -z and +z, and
+	// the distance between samples in x and z
+	float center, left, right, back, front;
+	vec2 spacing;
+	if(paged)
+	{
+		float tileSize = float(textureSize(heightPages, 0).x - 1);
+		vec2 st = (0.5 + position.xz * tileSize) / (tileSize + 1.0);
+		float texel = 1.0 / (tileSize + 1.0);
+		center = textureLod(heightPages, vec3(st, pageLayer), 0.0).r;
+		left = textureLod(heightPages, vec3(st - vec2(texel, 0.0), pageLayer), 0.0).r;
+		right = textureLod(heightPages, vec3(st + vec2(texel, 0.0), pageLayer), 0.0).r;
+		back = textureLod(heightPages, vec3(st - vec2(0.0, texel), pageLayer), 0.0).r;
+		front = textureLod(heightPages, vec3(st + vec2(0.0, texel), pageLayer), 0.0).r;
+		spacing = vec2(chunkTransform.z / tileSize);
+	}
+	else
+	{
+		// The grid spans -1 to 1 in x and z, that is 2 units per texture
+		// width, and v decreases with z
+		vec2 texel = exp2(lod) / vec2(textureSize(heightField, 0));
+		center = textureLod(heightField, uv, lod).r;
+		left = textureLod(heightField, uv - vec2(texel.x, 0.0), lod).r;
+		right = textureLod(heightField, uv + vec2(texel.x, 0.0), lod).r;
+		back = textureLod(heightField, uv + vec2(0.0, texel.y), lod).r;
+		front = textureLod(heightField, uv - vec2(0.0, texel.y), lod).r;
+		spacing = 2.0 * texel;
+	}
+	float height = center * heightScale - skirt;
+	float dhdx = (right - left) * heightScale / (2.0 * spacing.x);
+	float dhdz = (front - back) * heightScale / (2.0 * spacing.y);
+	vec3 normal = normalize(vec3(-dhdx, 1.0, -dhdz));
+
+	vec4 displaced = vec4(xz.x, height, xz.y, 1.0);
+	gl_Position = modelViewProjectionMatrix * displaced;
+	viewSpacePosition = (modelViewMatrix * displaced).xyz;
+	viewSpaceNormal = normalize((normalMatrix * vec4(normal, 0.0)).xyz);
+	texCoord = uv;
 }
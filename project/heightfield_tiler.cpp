@@ -0,0 +1,35 @@
+///////////////////////////////////////////////////////////////////////////////
+// heightfield-tiler: splits a height map into the tiled format streamed by
+// HeightFieldPages.
+//
+// usage: heightfield-tiler <height map> [<tile file>] [<tile size>]
+//
+// The tile file defaults to the height map path with the extension replaced
+// by .tiles, and the tile size to 256.
+///////////////////////////////////////////////////////////////////////////////
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include "heightfieldpages.h"
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2)
+	{
+		std::cout << "usage: " << argv[0] << " <height map> [<tile file>] [<tile size>]\n";
+		return 1;
+	}
+	const std::string sourcePath = argv[1];
+	std::string tilePath = sourcePath.substr(0, sourcePath.find_last_of('.')) + ".tiles";
+	if (argc > 2)
+	{
+		tilePath = argv[2];
+	}
+	const int tileSize = argc > 3 ? atoi(argv[3]) : 256;
+	if (tileSize < 2 || (tileSize & (tileSize - 1)) != 0)
+	{
+		std::cout << "The tile size must be a power of two.\n";
+		return 1;
+	}
+	return writeTiledHeightField(sourcePath, tilePath, uint32_t(tileSize)) ? 0 : 1;
+}
@@ -0,0 +1,399 @@
+#include "heightfieldpages.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <glm/glm.hpp>
+#include <stb_image.h>
+
+using namespace glm;
+
+static int seekFile(FILE* file, uint64_t offset)
+{
+#ifdef _WIN32
+	return _fseeki64(file, int64_t(offset), SEEK_SET);
+#else
+	return fseeko(file, off_t(offset), SEEK_SET);
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Preprocessing
+///////////////////////////////////////////////////////////////////////////////
+struct SourceLevel
+{
+	int width;
+	int height;
+	std::vector<float> heights;
+
+	// Bilinear sample at x and z in 0 to 1, texel centers at (i + 0.5) / width
+	float sample(float x, float z) const
+	{
+		const float px = clamp(x * width - 0.5f, 0.0f, float(width - 1));
+		const float pz = clamp(z * height - 0.5f, 0.0f, float(height - 1));
+		const int x0 = int(px);
+		const int z0 = int(pz);
+		const int x1 = std::min(x0 + 1, width - 1);
+		const int z1 = std::min(z0 + 1, height - 1);
+		const float fx = px - x0;
+		const float fz = pz - z0;
+		const float top = mix(heights[z0 * width + x0], heights[z0 * width + x1], fx);
+		const float bottom = mix(heights[z1 * width + x0], heights[z1 * width + x1], fx);
+		return mix(top, bottom, fz);
+	}
+};
+
+bool writeTiledHeightField(const std::string& sourcePath, const std::string& tilePath, uint32_t tileSize)
+{
+	auto startTime = std::chrono::high_resolution_clock::now();
+	// Loaded as in HeightField::loadHeightField(), but with the first row
+	// at z = -1 as in the grid
+	int width, height, components;
+	stbi_set_flip_vertically_on_load(false);
+	float* data = stbi_loadf(sourcePath.c_str(), &width, &height, &components, 1);
+	if (data == nullptr)
+	{
+		std::cout << "Failed to load image: " << sourcePath << ".\n";
+		return false;
+	}
+
+	// Box filtered mipmaps of the source, for the coarser levels
+	std::vector<SourceLevel> mips(1);
+	mips[0].width = width;
+	mips[0].height = height;
+	mips[0].heights.assign(data, data + size_t(width) * height);
+	stbi_image_free(data);
+	while (mips.back().width > 1 || mips.back().height > 1)
+	{
+		const SourceLevel& previous = mips.back();
+		SourceLevel next;
+		next.width = std::max(1, previous.width / 2);
+		next.height = std::max(1, previous.height / 2);
+		next.heights.resize(size_t(next.width) * next.height);
+		for (int z = 0; z < next.height; z++)
+		{
+			for (int x = 0; x < next.width; x++)
+			{
+				const int x0 = std::min(2 * x, previous.width - 1), x1 = std::min(2 * x + 1, previous.width - 1);
+				const int z0 = std::min(2 * z, previous.height - 1), z1 = std::min(2 * z + 1, previous.height - 1);
+				next.heights[z * next.width + x] =
+					0.25f * (previous.heights[z0 * previous.width + x0] + previous.heights[z0 * previous.width + x1]
+						+ previous.heights[z1 * previous.width + x0] + previous.heights[z1 * previous.width + x1]);
+			}
+		}
+		mips.push_back(std::move(next));
+	}
+
+	// The finest level has at least one sample per source texel
+	const float largestSide = float(std::max(width, height));
+	const uint32_t levels = 1 + uint32_t(std::max(0.0f, std::ceil(std::log2(largestSide / tileSize))));
+	const uint32_t numTiles = tileIndex(levels, 0, 0);
+	const uint32_t side = tileSize + 1;
+
+	FILE* file = fopen(tilePath.c_str(), "wb");
+	if (file == nullptr)
+	{
+		std::cout << "Failed to open " << tilePath << " for writing.\n";
+		return false;
+	}
+	TileFileHeader header;
+	memcpy(header.magic, "HFTL", 4);
+	header.version = TILE_FILE_VERSION;
+	header.sourceWidth = width;
+	header.sourceHeight = height;
+	header.tileSize = tileSize;
+	header.levels = levels;
+	std::vector<TileEntry> entries(numTiles);
+	fwrite(&header, sizeof(header), 1, file);
+	fwrite(entries.data(), sizeof(TileEntry), entries.size(), file);
+
+	std::vector<uint16_t> samples(side * side);
+	uint64_t offset = sizeof(header) + entries.size() * sizeof(TileEntry);
+	for (uint32_t level = 0; level < levels; level++)
+	{
+		const uint32_t tilesPerSide = 1u << level;
+		// Source texels between samples, and the mipmap closest to that
+		const float spacing = largestSide / float(tilesPerSide * tileSize);
+		const int mip = std::min(int(mips.size()) - 1, int(std::floor(std::log2(std::max(spacing, 1.0f)))));
+		for (uint32_t ty = 0; ty < tilesPerSide; ty++)
+		{
+			for (uint32_t tx = 0; tx < tilesPerSide; tx++)
+			{
+				TileEntry& entry = entries[tileIndex(level, tx, ty)];
+				entry.offset = offset;
+				entry.minHeight = FLT_MAX;
+				entry.maxHeight = -FLT_MAX;
+				for (uint32_t j = 0; j < side; j++)
+				{
+					for (uint32_t i = 0; i < side; i++)
+					{
+						const float x = (tx + float(i) / tileSize) / tilesPerSide;
+						const float z = (ty + float(j) / tileSize) / tilesPerSide;
+						const float h = clamp(mips[mip].sample(x, z), 0.0f, 1.0f);
+						samples[j * side + i] = uint16_t(std::round(h * 65535.0f));
+						entry.minHeight = std::min(entry.minHeight, samples[j * side + i] / 65535.0f);
+						entry.maxHeight = std::max(entry.maxHeight, samples[j * side + i] / 65535.0f);
+					}
+				}
+				fwrite(samples.data(), sizeof(uint16_t), samples.size(), file);
+				offset += samples.size() * sizeof(uint16_t);
+			}
+		}
+	}
+	fseek(file, sizeof(header), SEEK_SET);
+	fwrite(entries.data(), sizeof(TileEntry), entries.size(), file);
+	const bool ok = ferror(file) == 0;
+	fclose(file);
+
+	const float ms =
+		std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count();
+	std::cout << "Wrote " << numTiles << " tiles of " << side << "x" << side << " in " << levels << " levels to "
+		<< tilePath << " (" << offset / (1024 * 1024) << " MB) in " << ms << " ms.\n";
+	return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Page cache
+///////////////////////////////////////////////////////////////////////////////
+HeightFieldPages::HeightFieldPages()
+	: m_texture(0)
+	, m_capacity(0)
+	, m_file(nullptr)
+	, m_frame(0)
+	, m_quit(false)
+{
+}
+
+HeightFieldPages::~HeightFieldPages()
+{
+	close();
+}
+
+bool HeightFieldPages::open(const std::string& tilePath, uint32_t capacity)
+{
+	close();
+	m_file = fopen(tilePath.c_str(), "rb");
+	if (m_file == nullptr)
+	{
+		std::cout << "Failed to open tiled height field: " << tilePath << ".\n";
+		return false;
+	}
+	if (fread(&m_header, sizeof(m_header), 1, m_file) != 1 || memcmp(m_header.magic, "HFTL", 4) != 0
+		|| m_header.version != TILE_FILE_VERSION)
+	{
+		std::cout << "Not a tiled height field: " << tilePath << ".\n";
+		fclose(m_file);
+		m_file = nullptr;
+		return false;
+	}
+	m_entries.resize(tileIndex(m_header.levels, 0, 0));
+	if (fread(m_entries.data(), sizeof(TileEntry), m_entries.size(), m_file) != m_entries.size())
+	{
+		std::cout << "Truncated tile index in tiled height field: " << tilePath << ".\n";
+		close();
+		return false;
+	}
+
+	const GLsizei side = m_header.tileSize + 1;
+	m_capacity = std::max(capacity, 1u);
+	glGenTextures(1, &m_texture);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, m_texture);
+	glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R16, side, side, m_capacity, 0, GL_RED, GL_UNSIGNED_SHORT, nullptr);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+	for (uint32_t layer = m_capacity; layer > 0; layer--)
+	{
+		m_freeLayers.push_back(layer - 1);
+	}
+
+	// The root tile is never evicted
+	LoadedTile root;
+	root.index = 0;
+	if (!readTile(0, root.samples))
+	{
+		close();
+		return false;
+	}
+	upload(root);
+
+	m_quit = false;
+	m_loader = std::thread(&HeightFieldPages::loaderMain, this);
+	std::cout << "Opened tiled height field " << tilePath << ": " << m_header.levels << " levels of "
+		<< m_header.tileSize << "x" << m_header.tileSize << " tiles, " << m_capacity << " pages resident.\n";
+	return true;
+}
+
+void HeightFieldPages::close()
+{
+	if (m_loader.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_quit = true;
+		}
+		m_wake.notify_all();
+		m_loader.join();
+	}
+	if (m_file != nullptr)
+	{
+		fclose(m_file);
+		m_file = nullptr;
+	}
+	if (m_texture != 0)
+	{
+		glDeleteTextures(1, &m_texture);
+		m_texture = 0;
+	}
+	m_entries.clear();
+	m_lru.clear();
+	m_resident.clear();
+	m_freeLayers.clear();
+	m_pending.clear();
+	m_requests.clear();
+	m_loaded.clear();
+	m_stats = Stats();
+}
+
+bool HeightFieldPages::readTile(uint32_t index, std::vector<uint16_t>& samples)
+{
+	const size_t side = m_header.tileSize + 1;
+	samples.resize(side * side);
+	if (seekFile(m_file, m_entries[index].offset) != 0
+		|| fread(samples.data(), sizeof(uint16_t), samples.size(), m_file) != samples.size())
+	{
+		std::cout << "Failed to read height field tile " << index << ".\n";
+		return false;
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Loader thread. The newest request is served first, since it is most
+// likely still needed when the camera moves.
+///////////////////////////////////////////////////////////////////////////////
+void HeightFieldPages::loaderMain()
+{
+	for (;;)
+	{
+		uint32_t index;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_wake.wait(lock, [this] { return m_quit || !m_requests.empty(); });
+			if (m_quit)
+			{
+				return;
+			}
+			index = m_requests.back();
+			m_requests.pop_back();
+		}
+		LoadedTile tile;
+		tile.index = index;
+		const bool ok = readTile(index, tile.samples);
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!ok)
+		{
+			tile.samples.clear();
+		}
+		m_loaded.push_back(std::move(tile));
+	}
+}
+
+int HeightFieldPages::request(uint32_t level, uint32_t x, uint32_t y)
+{
+	const uint32_t index = tileIndex(level, x, y);
+	auto it = m_resident.find(index);
+	if (it != m_resident.end())
+	{
+		m_lru.splice(m_lru.begin(), m_lru, it->second);
+		it->second->lastUsedFrame = m_frame;
+		return int(it->second->layer);
+	}
+	if (m_pending.insert(index).second)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_requests.push_back(index);
+		}
+		m_wake.notify_one();
+	}
+	return -1;
+}
+
+void HeightFieldPages::upload(LoadedTile& tile)
+{
+	m_pending.erase(tile.index);
+	if (tile.samples.empty() || m_resident.count(tile.index) != 0)
+	{
+		return;
+	}
+	uint32_t layer;
+	if (!m_freeLayers.empty())
+	{
+		layer = m_freeLayers.back();
+		m_freeLayers.pop_back();
+	}
+	else
+	{
+		// Replace the least recently used page that was not drawn last frame
+		auto victim = m_lru.end();
+		for (auto it = m_lru.rbegin(); it != m_lru.rend(); ++it)
+		{
+			if (it->tile != 0 && it->lastUsedFrame + 1 < m_frame)
+			{
+				victim = std::prev(it.base());
+				break;
+			}
+		}
+		if (victim == m_lru.end())
+		{
+			// Every page is in use, the tile is requested again next frame
+			return;
+		}
+		layer = victim->layer;
+		m_resident.erase(victim->tile);
+		m_lru.erase(victim);
+		m_stats.evictions++;
+	}
+
+	const GLsizei side = m_header.tileSize + 1;
+	glBindTexture(GL_TEXTURE_2D_ARRAY, m_texture);
+	// Rows of 16-bit samples are not 4-byte aligned for even tile sizes
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+	glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, side, side, 1, GL_RED, GL_UNSIGNED_SHORT,
+		tile.samples.data());
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+	m_lru.push_front({ tile.index, layer, m_frame });
+	m_resident[tile.index] = m_lru.begin();
+	m_stats.loads++;
+	m_stats.bytesRead += tile.samples.size() * sizeof(uint16_t);
+}
+
+void HeightFieldPages::update(uint32_t maxUploads)
+{
+	auto startTime = std::chrono::high_resolution_clock::now();
+	std::vector<LoadedTile> loaded;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		const size_t count = std::min(size_t(maxUploads), m_loaded.size());
+		loaded.insert(loaded.end(), std::make_move_iterator(m_loaded.begin()),
+			std::make_move_iterator(m_loaded.begin() + count));
+		m_loaded.erase(m_loaded.begin(), m_loaded.begin() + count);
+	}
+	m_frame++;
+	for (LoadedTile& tile : loaded)
+	{
+		upload(tile);
+	}
+	m_stats.resident = uint32_t(m_resident.size());
+	m_stats.pending = uint32_t(m_pending.size());
+	m_stats.uploadMs = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - startTime)
+		.count();
+}
@@ -0,0 +1,140 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <GL/glew.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Tiled height field file, written by heightfield-tiler.
+//
+// The tiles form a quadtree over the whole height field: level l has
+// 2^l x 2^l tiles. Every tile has (tileSize + 1)^2 16-bit heights, so that
+// neighbouring tiles share their edge samples, with sample (i, j) at x
+// increasing with i and z increasing with j. Coarser levels are resampled
+// from box filtered mipmaps of the source. The finest level has about one
+// sample per source texel.
+//
+// Layout: TileFileHeader, then one TileEntry per tile (level by level, row
+// by row), then the tile data.
+///////////////////////////////////////////////////////////////////////////////
+struct TileFileHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t sourceWidth;
+	uint32_t sourceHeight;
+	uint32_t tileSize;
+	uint32_t levels;
+};
+
+struct TileEntry
+{
+	uint64_t offset;
+	// Height range of the tile, normalized like the samples
+	float minHeight;
+	float maxHeight;
+};
+
+const uint32_t TILE_FILE_VERSION = 1;
+
+/// Index of tile (x, y) of a level in the entry table
+inline uint32_t tileIndex(uint32_t level, uint32_t x, uint32_t y)
+{
+	// 4^0 + 4^1 + ... + 4^(level - 1) tiles come before this level
+	return ((1u << (2 * level)) - 1) / 3 + (y << level) + x;
+}
+
+/// Splits a height map into a tiled height field file
+bool writeTiledHeightField(const std::string& sourcePath, const std::string& tilePath, uint32_t tileSize);
+
+///////////////////////////////////////////////////////////////////////////////
+// Streams the tiles of a tiled height field into a texture array. Tiles are
+// requested by the render thread, read from disk by a background thread,
+// and uploaded by update(). When the array is full, the least recently
+// requested tile that was not requested in the last frame is replaced.
+///////////////////////////////////////////////////////////////////////////////
+class HeightFieldPages
+{
+public:
+	HeightFieldPages();
+	~HeightFieldPages();
+
+	/// Open a tile file and start the loader. The root tile is loaded
+	/// right away, so there is always something to draw.
+	bool open(const std::string& tilePath, uint32_t capacity);
+	void close();
+	bool isOpen() const
+	{
+		return m_file != nullptr;
+	}
+
+	/// Texture array layer of a tile, or -1 if it is not resident yet, in
+	/// which case it is queued for loading. Marks the tile as used in the
+	/// current frame.
+	int request(uint32_t level, uint32_t x, uint32_t y);
+
+	/// Upload at most maxUploads loaded tiles and start a new frame
+	void update(uint32_t maxUploads);
+
+	const TileEntry& getEntry(uint32_t level, uint32_t x, uint32_t y) const
+	{
+		return m_entries[tileIndex(level, x, y)];
+	}
+
+	TileFileHeader m_header;
+	std::vector<TileEntry> m_entries;
+	GLuint m_texture; // GL_TEXTURE_2D_ARRAY of GL_R16 pages
+	uint32_t m_capacity;
+
+	struct Stats
+	{
+		uint32_t resident = 0;
+		uint32_t pending = 0;
+		uint64_t loads = 0;
+		uint64_t evictions = 0;
+		uint64_t bytesRead = 0;
+		float uploadMs = 0.0f;
+	};
+	Stats m_stats;
+
+private:
+	struct LoadedTile
+	{
+		uint32_t index;
+		std::vector<uint16_t> samples;
+	};
+	struct Page
+	{
+		uint32_t tile;
+		uint32_t layer;
+		uint64_t lastUsedFrame;
+	};
+
+	bool readTile(uint32_t index, std::vector<uint16_t>& samples);
+	void loaderMain();
+	void upload(LoadedTile& tile);
+
+	FILE* m_file;
+	uint64_t m_frame;
+	// Resident pages, most recently used first
+	std::list<Page> m_lru;
+	std::unordered_map<uint32_t, std::list<Page>::iterator> m_resident;
+	std::vector<uint32_t> m_freeLayers;
+	std::unordered_set<uint32_t> m_pending;
+
+	// Shared with the loader thread
+	std::thread m_loader;
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	std::deque<uint32_t> m_requests;
+	std::vector<LoadedTile> m_loaded;
+	bool m_quit;
+};
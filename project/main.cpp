@@ -4,21 +4,35 @@ extern "C" _declspec(dllexport) unsigned int NvOptimusEnablement = 0x00000001;
 
 #include <GL/glew.h>
 #include <cmath>
+#include <cfloat>
 #include <cstdlib>
 #include <algorithm>
 #include <chrono>
+#include <iostream>
+#include <map>
+#include <random>
 
 #include <labhelper.h>
+#include <Profiler.h>
+#include <GpuProfiler.h>
+#include <ShaderReloader.h>
 #include <imgui.h>
 #include <imgui_impl_sdl_gl3.h>
 
 #include <glm/glm.hpp>
 #include <glm/gtx/transform.hpp>
+#include <stb_image.h>
 using namespace glm;
 
 #include <Model.h>
+#include <SceneBatch.h>
+#include <Culling.h>
+#include <WorkerPool.h>
 #include "hdr.h"
 #include "fbo.h"
+#include "heightfield.h"
+#include "ParticleSystem.h"
+#include "ParticleBuffer.h"
 
 using std::min;
 using std::max;
@@ -45,6 +59,9 @@ GLuint simpleShaderProgram; // Shader used to draw the shadow map
 GLuint backgroundProgram;   // Shader used to draw the background
 GLuint ssaoInputProgram;    // Shader used for the ssaoInput
 GLuint ssaoOutputProgram;   // Shader used for the ssaoOutput
+GLuint shaderProgramBatched = 0; // shaderProgram variant that draws a SceneBatch
+GLuint terrainProgram;      // Shader used to draw the height field
+GLuint particleProgram;     // Shader used to draw the particles
 
 ///////////////////////////////////////////////////////////////////////////////
 // Environment
@@ -82,43 +99,239 @@ mat4 fighterModelMatrix;
 
 float shipSpeed = 50;
 
+// The landing pad and fighter packed into one buffer, drawn with multi draw
+// indirect when the context supports it.
+labhelper::SceneBatch* sceneBatch = nullptr;
+bool useSceneBatch = true;
+
+// Level of detail selection. The scene batch only draws the full meshes, so
+// it is not used when LODs or culling are enabled.
+bool useLods = true;
+float lodPixelError = 1.0f;
+int forceLod = -1;
+
+// Culling of meshes against the camera frustum, and against the depth of the
+// coarsest LODs rasterized on the CPU each frame.
+bool useFrustumCulling = true;
+bool useOcclusionCulling = false;
+labhelper::OcclusionBuffer occlusionBuffer;
+float occlusionRasterMs = 0.0f;
+struct LodBenchmarkResult
+{
+	uint32_t triangles;
+	float ms;
+};
+LodBenchmarkResult lodBenchmark[labhelper::MAX_LOD_LEVELS] = {};
+
+labhelper::VertexFormat vertexFormat = labhelper::VertexFormat::Float;
+
+///////////////////////////////////////////////////////////////////////////////
+// Terrain
+///////////////////////////////////////////////////////////////////////////////
+HeightField terrain;
+bool drawTerrainMesh = true;
+int terrainTesselation = 1024;
+float terrainHeightScale = 1.0f;
+// Chunked LOD draws a quadtree of fixed grids instead of the full mesh
+bool terrainChunked = true;
+int terrainChunkResolution = 64;
+float terrainLodFactor = 2.0f;
+// Streamed tiles written by heightfield-tiler, used by the chunked LOD.
+// When they are there, the whole image is never loaded.
+const std::string terrainTilePath = "../scenes/nlsFinland/L3123F.tiles";
+int terrainPageCapacity = 128;
+mat4 terrainModelMatrix = translate(vec3(0.0f, -10.0f, 0.0f)) * scale(vec3(500.0f));
+
+///////////////////////////////////////////////////////////////////////////////
+// Particles, emitted from the exhaust of the fighter
+///////////////////////////////////////////////////////////////////////////////
+labhelper::WorkerPool* workerPool = nullptr;
+ParticleSystem* particleSystem = nullptr;
+ParticleBuffer* particleBuffer = nullptr;
+GLuint particleTexture = 0;
+bool drawParticles = true;
+const int particleCapacity = 1 << 20;
+int particlesPerSecond = 2000;
+float particleLifeLength = 5.0f;
+bool particleDeterministic = false;
+float particleSimMs = 0.0f;
+float particleWriteMs = 0.0f;
+// Back to front sorting, needed for the alpha blending
+bool sortParticles = true;
+float particleSortMs = 0.0f;
+struct ParticleSortBenchmarkResult
+{
+	float radixMs;
+	float radixThreadedMs;
+	float stdSortMs;
+	bool ordered;
+};
+ParticleSortBenchmarkResult particleSortBenchmark = {};
+struct ParticleBenchmarkResult
+{
+	float scalarMs;
+	float simdMs;
+	// Milliseconds per frame with 1, 2, 4, ... threads
+	std::vector<std::pair<int, float>> threadMs;
+	bool deterministic;
+};
+ParticleBenchmarkResult particleBenchmark = {};
+
 ///////////////////////////////////////////////////////////////////////////////
 // SSAO
 ///////////////////////////////////////////////////////////////////////////////
 FboInfo ssaoInputFbo;
+// GPU time of the SSAO input pass
+labhelper::GpuProfiler* gpuProfiler = nullptr;
 
-void loadShaders(bool is_reload)
+///////////////////////////////////////////////////////////////////////////////
+// Uniforms set by drawScene(). One set of handles per program that drawScene
+// is used with, created on first use and dropped when shaders are reloaded.
+///////////////////////////////////////////////////////////////////////////////
+struct SceneUniforms
+{
+	labhelper::Uniform<vec3> point_light_color;
+	labhelper::Uniform<float> point_light_intensity_multiplier;
+	labhelper::Uniform<vec3> viewSpaceLightPosition;
+	labhelper::Uniform<vec3> viewSpaceLightDir;
+	labhelper::Uniform<float> environment_multiplier;
+	labhelper::Uniform<mat4> viewInverse;
+	labhelper::Uniform<mat4> modelViewProjectionMatrix;
+	labhelper::Uniform<mat4> modelViewMatrix;
+	labhelper::Uniform<mat4> normalMatrix;
+	labhelper::Uniform<mat4> viewMatrix;
+	labhelper::Uniform<mat4> projectionMatrix;
+
+	SceneUniforms() = default;
+	explicit SceneUniforms(GLuint program)
+		: point_light_color(program, "point_light_color")
+		, point_light_intensity_multiplier(program, "point_light_intensity_multiplier")
+		, viewSpaceLightPosition(program, "viewSpaceLightPosition")
+		, viewSpaceLightDir(program, "viewSpaceLightDir")
+		, environment_multiplier(program, "environment_multiplier")
+		, viewInverse(program, "viewInverse")
+		, modelViewProjectionMatrix(program, "modelViewProjectionMatrix")
+		, modelViewMatrix(program, "modelViewMatrix")
+		, normalMatrix(program, "normalMatrix")
+		, viewMatrix(program, "viewMatrix")
+		, projectionMatrix(program, "projectionMatrix")
+	{
+	}
+};
+std::map<GLuint, SceneUniforms> sceneUniforms;
+
+const SceneUniforms& getSceneUniforms(GLuint program)
 {
-	GLuint shader = labhelper::loadShaderProgram("../project/simple.vert", "../project/simple.frag",
-		is_reload);
-	if (shader != 0)
+	auto it = sceneUniforms.find(program);
+	if (it == sceneUniforms.end())
 	{
-		simpleShaderProgram = shader;
+		it = sceneUniforms.insert({ program, SceneUniforms(program) }).first;
 	}
+	return it->second;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Result of the last uniform benchmark, in ms per frame
+///////////////////////////////////////////////////////////////////////////////
+float uniformBenchmarkSlowMs = 0.0f;
+float uniformBenchmarkHandlesMs = 0.0f;
 
-	shader = labhelper::loadShaderProgram("../project/fullscreenQuad.vert", "../project/background.frag",
-		is_reload);
-	if (shader != 0)
+// Shader loads of the last reload from the GUI, to compare cold and warm
+labhelper::ShaderCacheStats lastShaderLoad;
+// Recompiles the programs whose files are edited, in the background
+labhelper::ShaderReloader* shaderReloader = nullptr;
+bool hotReloadShaders = true;
+
+///////////////////////////////////////////////////////////////////////////////
+/// Replaces `program` with a newly loaded `shader`, unless loading failed
+///////////////////////////////////////////////////////////////////////////////
+void replaceShaderProgram(GLuint& program, GLuint shader)
+{
+	if (shader == 0)
+	{
+		return;
+	}
+	if (program != 0)
 	{
-		backgroundProgram = shader;
+		labhelper::deleteShaderProgram(program);
 	}
+	program = shader;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// The programs and the files they are built from, used both to load them
+/// and to watch them for hot reload
+///////////////////////////////////////////////////////////////////////////////
+struct ShaderProgramFiles
+{
+	GLuint* program;
+	const char* vertexShader;
+	const char* fragmentShader;
+	std::vector<std::string> defines;
+};
 
-	shader = labhelper::loadShaderProgram("../project/shading.vert", "../project/shading.frag", is_reload);
-	if (shader != 0)
+std::vector<ShaderProgramFiles> shaderProgramFiles()
+{
+	std::vector<ShaderProgramFiles> files = {
+		{ &simpleShaderProgram, "../project/simple.vert", "../project/simple.frag", {} },
+		{ &backgroundProgram, "../project/fullscreenQuad.vert", "../project/background.frag", {} },
+		{ &shaderProgram, "../project/shading.vert", "../project/shading.frag", {} },
+		{ &ssaoInputProgram, "../project/ssaoInput.vert", "../project/ssaoInput.frag", {} },
+		{ &ssaoOutputProgram, "../project/ssaoOutput.vert", "../project/ssaoOutput.frag", {} },
+		{ &terrainProgram, "../project/heightfield.vert", "../project/heightfield.frag", {} },
+		{ &particleProgram, "../project/particle.vert", "../project/particle.frag", {} },
+	};
+	if (labhelper::isSceneBatchSupported())
 	{
-		shaderProgram = shader;
+		files.push_back({ &shaderProgramBatched, "../project/shading.vert", "../project/shading.frag", { "BATCHED" } });
 	}
+	return files;
+}
 
-	shader = labhelper::loadShaderProgram("../project/ssaoInput.vert", "../project/ssaoInput.frag", is_reload);
-	if (shader != 0)
+void loadShaders(bool is_reload)
+{
+	for (const ShaderProgramFiles& files : shaderProgramFiles())
 	{
-		ssaoInputProgram = shader;
+		replaceShaderProgram(*files.program, labhelper::loadShaderProgram(files.vertexShader,
+			files.fragmentShader, is_reload, files.defines));
 	}
 
-	shader = labhelper::loadShaderProgram("../project/ssaoOutput.vert", "../project/ssaoOutput.frag", is_reload);
-	if (shader != 0)
+	// Uniform handles refer to the old programs
+	sceneUniforms.clear();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Prints and resets the shader load times since the last call. The first
+/// launch, or one after clearing the cache, shows the cold compile time;
+/// the next ones the warm load time from program binaries.
+///////////////////////////////////////////////////////////////////////////////
+void printShaderCacheStats()
+{
+	const labhelper::ShaderCacheStats& stats = labhelper::getShaderCacheStats();
+	printf("Shaders: %u from cache in %.1f ms, %u compiled in %.1f ms (%u stale, %u rejected)\n",
+		stats.cache_hits, stats.cache_ms, stats.compiled, stats.compile_ms, stats.stale, stats.rejected);
+	labhelper::resetShaderCacheStats();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// (Re)loads the models with the current vertex format
+///////////////////////////////////////////////////////////////////////////////
+void loadModels()
+{
+	labhelper::freeSceneBatch(sceneBatch);
+	labhelper::freeModel(fighterModel);
+	labhelper::freeModel(landingpadModel);
+	sceneBatch = nullptr;
+
+	fighterModel = labhelper::loadModelFromOBJ("../scenes/space-ship.obj", vertexFormat);
+	landingpadModel = labhelper::loadModelFromOBJ("../scenes/landingpad.obj", vertexFormat);
+	labhelper::generateLods(fighterModel);
+	labhelper::generateLods(landingpadModel);
+
+	if (labhelper::isSceneBatchSupported())
 	{
-		ssaoOutputProgram = shader;
+		sceneBatch = labhelper::createSceneBatch({ landingpadModel, fighterModel },
+			{ landingPadModelMatrix, fighterModelMatrix });
 	}
 }
 
@@ -129,20 +342,26 @@ void initialize()
 {
 	ENSURE_INITIALIZE_ONLY_ONCE();
 
+	gpuProfiler = new labhelper::GpuProfiler();
+
 	///////////////////////////////////////////////////////////////////////
 	//		Load Shaders
 	///////////////////////////////////////////////////////////////////////
 	loadShaders(false);
+	printShaderCacheStats();
+	shaderReloader = new labhelper::ShaderReloader(g_window);
+	for (const ShaderProgramFiles& files : shaderProgramFiles())
+	{
+		shaderReloader->watch(files.program, files.vertexShader, files.fragmentShader, files.defines);
+	}
 
 	///////////////////////////////////////////////////////////////////////
 	// Load models and set up model matrices
 	///////////////////////////////////////////////////////////////////////
-	fighterModel = labhelper::loadModelFromOBJ("../scenes/space-ship.obj");
-	landingpadModel = labhelper::loadModelFromOBJ("../scenes/landingpad.obj");
-
 	roomModelMatrix = mat4(1.0f);
 	fighterModelMatrix = translate(15.0f * worldUp);
 	landingPadModelMatrix = mat4(1.0f);
+	loadModels();
 
 	///////////////////////////////////////////////////////////////////////
 	// Load environment map
@@ -156,12 +375,53 @@ void initialize()
 	irradianceMap = labhelper::loadHdrTexture("../scenes/envmaps/" + envmap_base_name + "_irradiance.hdr");
 	reflectionMap = labhelper::loadHdrMipmapTexture(filenames);
 
+	///////////////////////////////////////////////////////////////////////
+	// Load the terrain
+	///////////////////////////////////////////////////////////////////////
+	terrain.generateChunkMesh(terrainChunkResolution);
+	if (!terrain.m_pages.open(terrainTilePath, terrainPageCapacity))
+	{
+		std::cout << "Run heightfield-tiler to stream the terrain from " << terrainTilePath << ".\n";
+		terrain.loadHeightField("../scenes/nlsFinland/L3123F.png");
+		terrain.generateMesh(terrainTesselation);
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Particles
+	///////////////////////////////////////////////////////////////////////
+	workerPool = new labhelper::WorkerPool();
+	particleSystem = new ParticleSystem(particleCapacity, workerPool);
+	particleBuffer = new ParticleBuffer(particleCapacity);
+	particleBuffer->init_gpu_data();
+	{
+		int width, height, components;
+		stbi_set_flip_vertically_on_load(true);
+		uint8_t* data = stbi_load("../scenes/textures/explosion.png", &width, &height, &components, 4);
+		if (data == nullptr)
+		{
+			std::cout << "Failed to load image: ../scenes/textures/explosion.png.\n";
+		}
+		else
+		{
+			glGenTextures(1, &particleTexture);
+			glBindTexture(GL_TEXTURE_2D, particleTexture);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			stbi_image_free(data);
+		}
+	}
+
 	glEnable(GL_DEPTH_TEST); // enable Z-buffering
 	glEnable(GL_CULL_FACE);  // enables backface culling
 
 	// Setup SSAO FBO
 	SDL_GetWindowSize(g_window, &windowWidth, &windowHeight);
 	ssaoInputFbo.resize(windowWidth, windowHeight);
+
+	occlusionBuffer.resize(256, 128);
 }
 
 void debugDrawLight(const glm::mat4& viewMatrix,
@@ -178,6 +438,7 @@ void debugDrawLight(const glm::mat4& viewMatrix,
 
 void drawBackground(const mat4& viewMatrix, const mat4& projectionMatrix)
 {
+	PROFILE_GPU_ZONE("background");
 	glUseProgram(backgroundProgram);
 	labhelper::setUniformSlow(backgroundProgram, "environment_multiplier", environment_multiplier);
 	labhelper::setUniformSlow(backgroundProgram, "inv_PV", inverse(projectionMatrix * viewMatrix));
@@ -185,6 +446,130 @@ void drawBackground(const mat4& viewMatrix, const mat4& projectionMatrix)
 	labhelper::drawFullScreenQuad();
 }
 
+///////////////////////////////////////////////////////////////////////////////
+/// Draws the height field, displaced in heightfield.vert
+///////////////////////////////////////////////////////////////////////////////
+void drawTerrain(const mat4& viewMatrix, const mat4& projectionMatrix)
+{
+	PROFILE_CPU_ZONE("terrain");
+	PROFILE_GPU_ZONE("terrain");
+	glUseProgram(terrainProgram);
+	labhelper::setUniformSlow(terrainProgram, "modelViewProjectionMatrix",
+		projectionMatrix * viewMatrix * terrainModelMatrix);
+	labhelper::setUniformSlow(terrainProgram, "modelViewMatrix", viewMatrix * terrainModelMatrix);
+	labhelper::setUniformSlow(terrainProgram, "normalMatrix", inverse(transpose(viewMatrix * terrainModelMatrix)));
+	labhelper::setUniformSlow(terrainProgram, "heightScale", terrainHeightScale);
+	labhelper::setUniformSlow(terrainProgram, "viewSpaceLightDir",
+		normalize(vec3(viewMatrix * vec4(-lightPosition, 0.0f))));
+	// A streamed terrain has no whole image, only its tiles
+	const bool paged = terrain.m_pages.isOpen();
+	if (!paged)
+	{
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, terrain.m_texid_hf);
+		glActiveTexture(GL_TEXTURE0);
+	}
+	if (terrainChunked || paged)
+	{
+		terrain.submitChunks(terrainModelMatrix, projectionMatrix * viewMatrix, cameraPosition, terrainHeightScale,
+			terrainLodFactor, paged);
+	}
+	else
+	{
+		terrain.submitTriangles();
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Emits `count` particles at `position`, spread around `direction`, on the
+/// worker pool. Every job draws from its own random sequence seeded with
+/// `seed` and the job index, so in deterministic mode the same particles
+/// are emitted in the same order whatever the number of threads.
+///////////////////////////////////////////////////////////////////////////////
+void emitParticles(ParticleSystem& particles, labhelper::WorkerPool& pool, int count, uint32_t seed,
+	const vec3& position, const vec3& direction, float lifeLength, bool deterministic)
+{
+	const int particlesPerJob = 4096;
+	const int jobs = (count + particlesPerJob - 1) / particlesPerJob;
+	pool.parallelFor(jobs,
+		[&](int job, int thread) {
+			std::minstd_rand random(seed * 7919u + uint32_t(job) + 1u);
+			std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+			const int last = std::min(count, (job + 1) * particlesPerJob);
+			for (int i = job * particlesPerJob; i < last; i++)
+			{
+				const vec3 spread(uniform(random) - 0.5f, uniform(random) - 0.5f, uniform(random) - 0.5f);
+				Particle particle;
+				particle.pos = position;
+				particle.velocity = 10.0f * normalize(direction + 0.4f * spread);
+				particle.lifetime = 0.0f;
+				particle.life_length = lifeLength * (0.25f + 0.75f * uniform(random));
+				particles.emit(thread, particle);
+			}
+		},
+		deterministic);
+	particles.spawn_emitted();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Spawns the particles for this frame at the exhaust of the fighter, and
+/// moves and kills the old ones
+///////////////////////////////////////////////////////////////////////////////
+void updateParticles(float dt)
+{
+	PROFILE_CPU_ZONE("simulation");
+	auto startTime = std::chrono::high_resolution_clock::now();
+	// Carry the fraction of a particle over to the next frame
+	static float toSpawn = 0.0f;
+	static uint32_t frame = 0;
+	toSpawn += particlesPerSecond * dt;
+	const vec3 exhaust = vec3(fighterModelMatrix * vec4(17.0f, 3.0f, 0.0f, 1.0f));
+	const vec3 backwards = normalize(vec3(fighterModelMatrix * vec4(1.0f, 0.0f, 0.0f, 0.0f)));
+	const int count = int(toSpawn);
+	toSpawn -= count;
+	emitParticles(*particleSystem, *workerPool, count, frame++, exhaust, backwards, particleLifeLength,
+		particleDeterministic);
+	particleSystem->deterministic = particleDeterministic;
+	particleSystem->process_particles(dt);
+	particleSimMs = std::chrono::duration<float, std::milli>(
+		std::chrono::high_resolution_clock::now() - startTime).count();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Draws the particles as point sprites, blended over the scene
+///////////////////////////////////////////////////////////////////////////////
+void drawParticleSystem(const mat4& viewMatrix, const mat4& projectionMatrix)
+{
+	PROFILE_CPU_ZONE("particles");
+	PROFILE_GPU_ZONE("particles");
+	glUseProgram(particleProgram);
+	labhelper::setUniformSlow(particleProgram, "P", projectionMatrix);
+	labhelper::setUniformSlow(particleProgram, "screen_x", float(windowWidth));
+	labhelper::setUniformSlow(particleProgram, "screen_y", float(windowHeight));
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, particleTexture);
+	glEnable(GL_PROGRAM_POINT_SIZE);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glDepthMask(GL_FALSE);
+	auto startTime = std::chrono::high_resolution_clock::now();
+	if (sortParticles)
+	{
+		particleSystem->sort_by_depth(viewMatrix);
+	}
+	auto sortedTime = std::chrono::high_resolution_clock::now();
+	glm::vec4* vertices = particleBuffer->map_frame();
+	auto mappedTime = std::chrono::high_resolution_clock::now();
+	particleSystem->write_vertices(viewMatrix, vertices);
+	particleSortMs = std::chrono::duration<float, std::milli>(sortedTime - startTime).count();
+	particleWriteMs = std::chrono::duration<float, std::milli>(
+		std::chrono::high_resolution_clock::now() - mappedTime).count();
+	particleBuffer->draw(particleSystem->size());
+	glDepthMask(GL_TRUE);
+	glDisable(GL_BLEND);
+	glDisable(GL_PROGRAM_POINT_SIZE);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 /// This function is used to draw the main objects on the scene
 ///////////////////////////////////////////////////////////////////////////////
@@ -194,39 +579,328 @@ void drawScene(GLuint currentShaderProgram,
 	const mat4& lightViewMatrix,
 	const mat4& lightProjectionMatrix)
 {
+	const bool batched = sceneBatch != nullptr && useSceneBatch && !useLods && !useFrustumCulling
+		&& !useOcclusionCulling && shaderProgramBatched != 0 && currentShaderProgram == shaderProgram;
+	if (batched)
+	{
+		currentShaderProgram = shaderProgramBatched;
+	}
 	glUseProgram(currentShaderProgram);
+	const SceneUniforms& u = getSceneUniforms(currentShaderProgram);
 	// Light source
 	vec4 viewSpaceLightPosition = viewMatrix * vec4(lightPosition, 1.0f);
-	labhelper::setUniformSlow(currentShaderProgram, "point_light_color", point_light_color);
-	labhelper::setUniformSlow(currentShaderProgram, "point_light_intensity_multiplier",
-		point_light_intensity_multiplier);
-	labhelper::setUniformSlow(currentShaderProgram, "viewSpaceLightPosition", vec3(viewSpaceLightPosition));
-	labhelper::setUniformSlow(currentShaderProgram, "viewSpaceLightDir",
-		normalize(vec3(viewMatrix * vec4(-lightPosition, 0.0f))));
+	u.point_light_color.set(point_light_color);
+	u.point_light_intensity_multiplier.set(point_light_intensity_multiplier);
+	u.viewSpaceLightPosition.set(vec3(viewSpaceLightPosition));
+	u.viewSpaceLightDir.set(normalize(vec3(viewMatrix * vec4(-lightPosition, 0.0f))));
 
 	// Environment
-	labhelper::setUniformSlow(currentShaderProgram, "environment_multiplier", environment_multiplier);
+	u.environment_multiplier.set(environment_multiplier);
 
 	// camera
-	labhelper::setUniformSlow(currentShaderProgram, "viewInverse", inverse(viewMatrix));
+	u.viewInverse.set(inverse(viewMatrix));
 
-	// landing pad
-	labhelper::setUniformSlow(currentShaderProgram, "modelViewProjectionMatrix",
-		projectionMatrix * viewMatrix * landingPadModelMatrix);
-	labhelper::setUniformSlow(currentShaderProgram, "modelViewMatrix", viewMatrix * landingPadModelMatrix);
-	labhelper::setUniformSlow(currentShaderProgram, "normalMatrix",
-		inverse(transpose(viewMatrix * landingPadModelMatrix)));
+	if (batched)
+	{
+		u.viewMatrix.set(viewMatrix);
+		u.projectionMatrix.set(projectionMatrix);
+		labhelper::render(sceneBatch);
+		return;
+	}
 
-	labhelper::render(landingpadModel);
+	// landing pad
+	u.modelViewProjectionMatrix.set(projectionMatrix * viewMatrix * landingPadModelMatrix);
+	u.modelViewMatrix.set(viewMatrix * landingPadModelMatrix);
+	u.normalMatrix.set(inverse(transpose(viewMatrix * landingPadModelMatrix)));
+
+	labhelper::RenderView view;
+	view.projection_matrix = projectionMatrix;
+	view.viewport_height = float(windowHeight);
+	view.max_pixel_error = lodPixelError;
+	view.force_lod = useLods ? forceLod : 0;
+	view.frustum_cull = useFrustumCulling;
+	// Every pass of this program is drawn from the camera, like the occlusion buffer
+	view.occlusion = useOcclusionCulling ? &occlusionBuffer : nullptr;
+
+	view.model_view_matrix = viewMatrix * landingPadModelMatrix;
+	labhelper::render(landingpadModel, view);
 
 	// Fighter
-	labhelper::setUniformSlow(currentShaderProgram, "modelViewProjectionMatrix",
-		projectionMatrix * viewMatrix * fighterModelMatrix);
-	labhelper::setUniformSlow(currentShaderProgram, "modelViewMatrix", viewMatrix * fighterModelMatrix);
-	labhelper::setUniformSlow(currentShaderProgram, "normalMatrix",
-		inverse(transpose(viewMatrix * fighterModelMatrix)));
+	u.modelViewProjectionMatrix.set(projectionMatrix * viewMatrix * fighterModelMatrix);
+	u.modelViewMatrix.set(viewMatrix * fighterModelMatrix);
+	u.normalMatrix.set(inverse(transpose(viewMatrix * fighterModelMatrix)));
 
-	labhelper::render(fighterModel);
+	view.model_view_matrix = viewMatrix * fighterModelMatrix;
+	labhelper::render(fighterModel, view);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Draws the scene from the current camera a number of times with each level
+/// of detail forced, and measures the triangles and time per frame.
+///////////////////////////////////////////////////////////////////////////////
+void benchmarkLods()
+{
+	const int frames = 50;
+	mat4 projMatrix = perspective(radians(45.0f), float(windowWidth) / float(windowHeight), 5.0f, 2000.0f);
+	mat4 viewMatrix = lookAt(cameraPosition, cameraPosition + cameraDirection, worldUp);
+	const int savedForceLod = forceLod;
+	const bool savedUseLods = useLods;
+	useLods = true;
+	for (int lod = 0; lod < int(labhelper::MAX_LOD_LEVELS); lod++)
+	{
+		forceLod = lod;
+		glFinish();
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int frame = 0; frame < frames; frame++)
+		{
+			labhelper::resetRenderStats();
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			drawScene(shaderProgram, viewMatrix, projMatrix, mat4(1.0f), mat4(1.0f));
+		}
+		glFinish();
+		auto end = std::chrono::high_resolution_clock::now();
+		lodBenchmark[lod].triangles = labhelper::getRenderStats().triangles;
+		lodBenchmark[lod].ms = std::chrono::duration<float, std::milli>(end - start).count() / frames;
+		printf("LOD %d: %u triangles, %.3f ms/frame\n", lod, lodBenchmark[lod].triangles, lodBenchmark[lod].ms);
+	}
+	forceLod = savedForceLod;
+	useLods = savedUseLods;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Measures the CPU cost of the uniform updates in drawScene(), for a number
+/// of frames with many objects, once with setUniformSlow and once with
+/// Uniform handles.
+///////////////////////////////////////////////////////////////////////////////
+void benchmarkUniforms()
+{
+	const int frames = 100;
+	const int objects_per_frame = 100;
+	const mat4 matrices[] = { landingPadModelMatrix, fighterModelMatrix };
+	const GLuint program = shaderProgram;
+
+	glUseProgram(program);
+	glFinish();
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int frame = 0; frame < frames; frame++)
+	{
+		labhelper::setUniformSlow(program, "point_light_color", point_light_color);
+		labhelper::setUniformSlow(program, "point_light_intensity_multiplier", point_light_intensity_multiplier);
+		labhelper::setUniformSlow(program, "viewSpaceLightPosition", lightPosition);
+		labhelper::setUniformSlow(program, "viewSpaceLightDir", normalize(-lightPosition));
+		labhelper::setUniformSlow(program, "environment_multiplier", environment_multiplier);
+		labhelper::setUniformSlow(program, "viewInverse", mat4(1.0f));
+		for (int i = 0; i < objects_per_frame; i++)
+		{
+			const mat4& m = matrices[i % 2];
+			labhelper::setUniformSlow(program, "modelViewProjectionMatrix", m);
+			labhelper::setUniformSlow(program, "modelViewMatrix", m);
+			labhelper::setUniformSlow(program, "normalMatrix", m);
+		}
+	}
+	glFinish();
+	auto middle = std::chrono::high_resolution_clock::now();
+	const SceneUniforms& u = getSceneUniforms(program);
+	for (int frame = 0; frame < frames; frame++)
+	{
+		u.point_light_color.set(point_light_color);
+		u.point_light_intensity_multiplier.set(point_light_intensity_multiplier);
+		u.viewSpaceLightPosition.set(lightPosition);
+		u.viewSpaceLightDir.set(normalize(-lightPosition));
+		u.environment_multiplier.set(environment_multiplier);
+		u.viewInverse.set(mat4(1.0f));
+		for (int i = 0; i < objects_per_frame; i++)
+		{
+			const mat4& m = matrices[i % 2];
+			u.modelViewProjectionMatrix.set(m);
+			u.modelViewMatrix.set(m);
+			u.normalMatrix.set(m);
+		}
+	}
+	glFinish();
+	auto end = std::chrono::high_resolution_clock::now();
+	uniformBenchmarkSlowMs = std::chrono::duration<float, std::milli>(middle - start).count() / frames;
+	uniformBenchmarkHandlesMs = std::chrono::duration<float, std::milli>(end - middle).count() / frames;
+	printf("Uniform benchmark (%d objects/frame): setUniformSlow %.3f ms/frame, handles %.3f ms/frame\n",
+		objects_per_frame, uniformBenchmarkSlowMs, uniformBenchmarkHandlesMs);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Measures the particle simulation on a million particles, once with the
+/// scalar loop and once vectorized. Half of the particles die during the
+/// run, so the compaction is measured as well. Then measures how emitting
+/// and simulating four million particles scales with the number of
+/// threads, and checks that deterministic mode gives the same particles
+/// with every thread count.
+///////////////////////////////////////////////////////////////////////////////
+void benchmarkParticles()
+{
+	const int count = 1 << 20;
+	const int frames = 100;
+	const float dt = 1.0f / 60.0f;
+	float* results[] = { &particleBenchmark.scalarMs, &particleBenchmark.simdMs };
+	for (int simd = 0; simd < 2; simd++)
+	{
+		ParticleSystem particles(count);
+		particles.force_scalar = simd == 0;
+		srand(1);
+		for (int i = 0; i < count; i++)
+		{
+			Particle particle;
+			particle.pos = vec3(rand(), rand(), rand()) / float(RAND_MAX);
+			particle.velocity = vec3(rand(), rand(), rand()) / float(RAND_MAX) - 0.5f;
+			particle.lifetime = 0.0f;
+			particle.life_length = 2.0f * frames * dt * rand() / float(RAND_MAX);
+			particles.spawn(particle);
+		}
+		uint64_t processed = 0;
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int frame = 0; frame < frames; frame++)
+		{
+			processed += particles.size();
+			particles.process_particles(dt);
+		}
+		auto end = std::chrono::high_resolution_clock::now();
+		const float ms = std::chrono::duration<float, std::milli>(end - start).count();
+		*results[simd] = ms / frames;
+		printf("Particles (%s): %.3f ms/frame, %.1f M particles/s, %d left\n", simd ? "SIMD" : "scalar",
+			ms / frames, processed / (ms * 1000.0f), particles.size());
+	}
+
+	const int threadedCount = 1 << 22;
+	// 1, 2, 4, ... threads, and all of them
+	std::vector<int> threadCounts;
+	const int maxThreads = std::max(1, int(std::thread::hardware_concurrency()));
+	for (int threads = 1; threads < maxThreads; threads *= 2)
+	{
+		threadCounts.push_back(threads);
+	}
+	threadCounts.push_back(maxThreads);
+
+	std::vector<Particle> reference;
+	particleBenchmark.threadMs.clear();
+	particleBenchmark.deterministic = true;
+	for (int threads : threadCounts)
+	{
+		labhelper::WorkerPool pool(threads);
+		ParticleSystem particles(threadedCount, &pool);
+		particles.deterministic = true;
+		emitParticles(particles, pool, threadedCount / 2, 0, vec3(0.0f), worldUp, 2.0f * frames * dt, true);
+		uint64_t processed = 0;
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int frame = 0; frame < frames; frame++)
+		{
+			emitParticles(particles, pool, threadedCount / 200, frame + 1, vec3(0.0f), worldUp,
+				2.0f * frames * dt, true);
+			processed += particles.size();
+			particles.process_particles(dt);
+		}
+		auto end = std::chrono::high_resolution_clock::now();
+		const float ms = std::chrono::duration<float, std::milli>(end - start).count();
+		particleBenchmark.threadMs.push_back({ threads, ms / frames });
+
+		// Compare the final particles with the single threaded run
+		bool identical = true;
+		if (threads == 1)
+		{
+			for (int i = 0; i < particles.size(); i++)
+			{
+				reference.push_back(particles.get(i));
+			}
+		}
+		else
+		{
+			identical = particles.size() == int(reference.size());
+			for (int i = 0; identical && i < particles.size(); i++)
+			{
+				const Particle p = particles.get(i);
+				identical = p.pos == reference[i].pos && p.velocity == reference[i].velocity
+					&& p.lifetime == reference[i].lifetime && p.life_length == reference[i].life_length;
+			}
+			particleBenchmark.deterministic = particleBenchmark.deterministic && identical;
+		}
+		printf("Particles (%d threads): %.3f ms/frame, %.1f M particles/s, %d left, %s\n", threads, ms / frames,
+			processed / (ms * 1000.0f), particles.size(), identical ? "identical" : "DIFFERENT");
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Measures the depth sort of a million particles, with the radix sort on
+/// one thread and on the pool, and with std::sort on the depths. Checks
+/// that the sorted vertices are back to front, within the quantization of
+/// the keys, and that they are the same vertices as unsorted. The order is
+/// checked on known depths, outside the UI, by particles-check.
+///////////////////////////////////////////////////////////////////////////////
+void benchmarkParticleSort()
+{
+	const int count = 1 << 20;
+	const int runs = 10;
+	const mat4 viewMatrix = lookAt(cameraPosition, cameraPosition + cameraDirection, worldUp);
+	labhelper::WorkerPool serialPool(1);
+	float* results[] = { &particleSortBenchmark.radixMs, &particleSortBenchmark.radixThreadedMs };
+	labhelper::WorkerPool* pools[] = { &serialPool, workerPool };
+	std::vector<vec4> sortedVertices(count), unsortedVertices(count);
+	for (int p = 0; p < 2; p++)
+	{
+		ParticleSystem particles(count, pools[p]);
+		emitParticles(particles, *pools[p], count, 0, vec3(0.0f), worldUp, 10.0f, true);
+		particles.process_particles(1.0f);
+		if (p == 1)
+		{
+			// In the order they are stored, before any sort
+			particles.write_vertices(viewMatrix, unsortedVertices.data());
+		}
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int run = 0; run < runs; run++)
+		{
+			particles.sort_by_depth(viewMatrix);
+		}
+		auto end = std::chrono::high_resolution_clock::now();
+		*results[p] = std::chrono::duration<float, std::milli>(end - start).count() / runs;
+		if (p == 1)
+		{
+			particles.write_vertices(viewMatrix, sortedVertices.data());
+		}
+	}
+
+	// std::sort of the (unquantized) depths, with the particle indices
+	std::vector<std::pair<float, uint32_t>> depths(count);
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int run = 0; run < runs; run++)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			depths[i] = { unsortedVertices[i].z, uint32_t(i) };
+		}
+		std::sort(depths.begin(), depths.end());
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+	particleSortBenchmark.stdSortMs = std::chrono::duration<float, std::milli>(end - start).count() / runs;
+
+	// Back to front is increasing view space z. Neighbours may be out of
+	// order by up to one quantization step.
+	float minZ = FLT_MAX, maxZ = -FLT_MAX;
+	for (const auto& v : unsortedVertices)
+	{
+		minZ = std::min(minZ, v.z);
+		maxZ = std::max(maxZ, v.z);
+	}
+	const float step = (maxZ - minZ) / float((1 << ParticleSystem::SORT_KEY_BITS) - 1);
+	bool ordered = true;
+	for (int i = 1; i < count && ordered; i++)
+	{
+		ordered = sortedVertices[i].z >= sortedVertices[i - 1].z - step;
+	}
+	auto lexicographic = [](const vec4& a, const vec4& b) {
+		return a.x != b.x ? a.x < b.x : a.y != b.y ? a.y < b.y : a.z != b.z ? a.z < b.z : a.w < b.w;
+	};
+	std::sort(sortedVertices.begin(), sortedVertices.end(), lexicographic);
+	std::sort(unsortedVertices.begin(), unsortedVertices.end(), lexicographic);
+	ordered = ordered && sortedVertices == unsortedVertices;
+	particleSortBenchmark.ordered = ordered;
+	printf("Particle sort (%d particles): radix %.3f ms, radix on %d threads %.3f ms, std::sort %.3f ms, %s\n",
+		count, particleSortBenchmark.radixMs, workerPool->size(), particleSortBenchmark.radixThreadedMs,
+		particleSortBenchmark.stdSortMs, ordered ? "back to front" : "NOT SORTED");
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -235,6 +909,10 @@ void drawScene(GLuint currentShaderProgram,
 ///////////////////////////////////////////////////////////////////////////////
 void display(void)
 {
+	PROFILE_CPU_ZONE("display");
+	gpuProfiler->beginFrame();
+	labhelper::resetRenderStats();
+
 	///////////////////////////////////////////////////////////////////////////
 	// Check if window size has changed and resize buffers as needed
 	///////////////////////////////////////////////////////////////////////////
@@ -270,14 +948,33 @@ void display(void)
 	glBindTexture(GL_TEXTURE_2D, reflectionMap);
 	glActiveTexture(GL_TEXTURE0);
 
+	///////////////////////////////////////////////////////////////////////////
+	// Rasterize the occluders for occlusion culling
+	///////////////////////////////////////////////////////////////////////////
+	if (useOcclusionCulling)
+	{
+		PROFILE_CPU_ZONE("occlusion raster");
+		auto startTime = std::chrono::high_resolution_clock::now();
+		occlusionBuffer.clear();
+		occlusionBuffer.addOccluder(landingpadModel, projMatrix * viewMatrix * landingPadModelMatrix);
+		occlusionBuffer.addOccluder(fighterModel, projMatrix * viewMatrix * fighterModelMatrix);
+		occlusionRasterMs = std::chrono::duration<float, std::milli>(
+			std::chrono::high_resolution_clock::now() - startTime).count();
+	}
+
 	// FBOs
 	if (ssaoInputFbo.width != windowWidth || ssaoInputFbo.height != windowHeight) {
 		ssaoInputFbo.resize(windowWidth, windowHeight);
 	}
-	glBindFramebuffer(GL_FRAMEBUFFER, ssaoInputFbo.framebufferId);
-	glViewport(0, 0, windowWidth, windowHeight);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	drawScene(ssaoInputProgram, viewMatrix, projMatrix, lightViewMatrix, lightProjMatrix);
+	{
+		PROFILE_GPU_ZONE("SSAO input");
+		gpuProfiler->begin("SSAO input");
+		glBindFramebuffer(GL_FRAMEBUFFER, ssaoInputFbo.framebufferId);
+		glViewport(0, 0, windowWidth, windowHeight);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		drawScene(ssaoInputProgram, viewMatrix, projMatrix, lightViewMatrix, lightProjMatrix);
+		gpuProfiler->end();
+	}
 
 	// Unbind the framebuffer
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
@@ -291,8 +988,21 @@ void display(void)
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 	drawBackground(viewMatrix, projMatrix);
-	drawScene(shaderProgram, viewMatrix, projMatrix, lightViewMatrix, lightProjMatrix);
+	{
+		PROFILE_GPU_ZONE("main");
+		drawScene(shaderProgram, viewMatrix, projMatrix, lightViewMatrix, lightProjMatrix);
+	}
+	if (drawTerrainMesh)
+	{
+		drawTerrain(viewMatrix, projMatrix);
+	}
 	debugDrawLight(viewMatrix, projMatrix, vec3(lightPosition));
+
+	updateParticles(deltaTime);
+	if (drawParticles)
+	{
+		drawParticleSystem(viewMatrix, projMatrix);
+	}
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -300,6 +1010,7 @@ void display(void)
 ///////////////////////////////////////////////////////////////////////////////
 bool handleEvents(void)
 {
+	PROFILE_CPU_ZONE("events");
 	// Allow ImGui to capture events.
 	ImGuiIO& io = ImGui::GetIO();
 
@@ -322,6 +1033,10 @@ bool handleEvents(void)
 		{
 			labhelper::saveScreenshot();
 		}
+		else if (event.type == SDL_KEYUP && event.key.keysym.sym == SDLK_F9)
+		{
+			labhelper::profiler::toggleCapture();
+		}
 		if (event.type == SDL_MOUSEBUTTONDOWN && event.button.button == SDL_BUTTON_LEFT
 			&& (!showUI || !io.WantCaptureMouse))
 		{
@@ -401,9 +1116,176 @@ bool handleEvents(void)
 ///////////////////////////////////////////////////////////////////////////////
 void gui()
 {
+	PROFILE_CPU_ZONE("gui");
 	// ----------------- Set variables --------------------------
 	ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate,
 		ImGui::GetIO().Framerate);
+	const labhelper::RenderStats& stats = labhelper::getRenderStats();
+	ImGui::Text("Draw calls: %u, material changes: %u", stats.draw_calls, stats.material_changes);
+	ImGui::Text("Texture binds: %u, uniform updates: %u, buffer binds: %u", stats.texture_binds,
+		stats.uniform_updates, stats.buffer_binds);
+	if (ImGui::CollapsingHeader("GPU passes"))
+	{
+		gpuProfiler->gui();
+	}
+	if (ImGui::CollapsingHeader("Shader cache"))
+	{
+		bool shaderCache = labhelper::isShaderCacheEnabled();
+		if (ImGui::Checkbox("Program binary cache", &shaderCache))
+		{
+			labhelper::setShaderCacheEnabled(shaderCache);
+		}
+		// Reload from the cache (warm), or compile everything again (cold)
+		const bool warmReload = ImGui::Button("Reload shaders");
+		ImGui::SameLine();
+		const bool coldReload = ImGui::Button("Clear cache and reload");
+		if (warmReload || coldReload)
+		{
+			if (coldReload)
+			{
+				labhelper::clearShaderCache();
+			}
+			labhelper::resetShaderCacheStats();
+			loadShaders(true);
+			lastShaderLoad = labhelper::getShaderCacheStats();
+			printShaderCacheStats();
+		}
+		ImGui::Text("Last reload: %u from cache in %.1f ms, %u compiled in %.1f ms", lastShaderLoad.cache_hits,
+			lastShaderLoad.cache_ms, lastShaderLoad.compiled, lastShaderLoad.compile_ms);
+		ImGui::Checkbox("Hot reload edited shaders", &hotReloadShaders);
+		const char* compileMode = "the main thread, blocking the frame";
+		if (shaderReloader->usesParallelCompile())
+		{
+			compileMode = "KHR_parallel_shader_compile";
+		}
+		else if (shaderReloader->usesCompileThread())
+		{
+			compileMode = "a shared context thread";
+		}
+		ImGui::Text("Compiling with %s: %d pending, last took %.1f ms", compileMode,
+			shaderReloader->getPendingCount(), shaderReloader->getLastReloadMs());
+	}
+	if (sceneBatch != nullptr)
+	{
+		ImGui::Checkbox("Multi draw indirect", &useSceneBatch);
+		ImGui::Text("Indirect draws: %u", stats.indirect_draws);
+	}
+	else
+	{
+		ImGui::Text("Multi draw indirect not supported");
+	}
+	ImGui::Checkbox("Mesh LOD", &useLods);
+	if (useLods)
+	{
+		ImGui::SliderFloat("LOD pixel error", &lodPixelError, 0.1f, 20.0f, "%.1f", 2.0f);
+		ImGui::SliderInt("Force LOD", &forceLod, -1, labhelper::MAX_LOD_LEVELS - 1);
+	}
+	ImGui::Checkbox("Frustum culling", &useFrustumCulling);
+	ImGui::Checkbox("Occlusion culling", &useOcclusionCulling);
+	ImGui::Text("Culled meshes: %u, occluded meshes: %u", stats.culled_meshes, stats.occluded_meshes);
+	if (useOcclusionCulling)
+	{
+		ImGui::Text("Occluders: %u triangles rasterized in %.3f ms", occlusionBuffer.m_triangles_rasterized,
+			occlusionRasterMs);
+	}
+	ImGui::Text("Triangles: %u", stats.triangles);
+	for (uint32_t lod = 0; lod < labhelper::MAX_LOD_LEVELS; lod++)
+	{
+		ImGui::Text("  LOD %u: %u meshes, %u triangles", lod, stats.lod_meshes[lod], stats.lod_triangles[lod]);
+	}
+	if (ImGui::Button("Benchmark LODs"))
+	{
+		benchmarkLods();
+	}
+	for (uint32_t lod = 0; lod < labhelper::MAX_LOD_LEVELS; lod++)
+	{
+		ImGui::Text("  LOD %u: %u triangles, %.3f ms/frame", lod, lodBenchmark[lod].triangles, lodBenchmark[lod].ms);
+	}
+	ImGui::Checkbox("Terrain", &drawTerrainMesh);
+	ImGui::SliderFloat("Terrain height scale", &terrainHeightScale, 0.0f, 10.0f);
+	if (!terrain.m_pages.isOpen())
+	{
+		ImGui::Checkbox("Chunked terrain LOD", &terrainChunked);
+	}
+	if (terrainChunked || terrain.m_pages.isOpen())
+	{
+		ImGui::SliderFloat("Terrain LOD factor", &terrainLodFactor, 0.5f, 8.0f);
+		if (ImGui::SliderInt("Chunk resolution", &terrainChunkResolution, 8, 256))
+		{
+			terrain.generateChunkMesh(terrainChunkResolution);
+		}
+		const HeightField::ChunkStats& chunkStats = terrain.m_chunkStats;
+		ImGui::Text("Terrain: %u chunks, %u triangles, depth %d, %.3f ms CPU", chunkStats.chunks,
+			chunkStats.triangles, chunkStats.depth, chunkStats.selectMs);
+		if (terrain.m_pages.isOpen())
+		{
+			const HeightFieldPages::Stats& pageStats = terrain.m_pages.m_stats;
+			ImGui::Text("Pages: %u/%u resident, %u pending, %.3f ms upload", pageStats.resident,
+				terrain.m_pages.m_capacity, pageStats.pending, pageStats.uploadMs);
+			ImGui::Text("Loaded %llu, evicted %llu, %.1f MB read", (unsigned long long)pageStats.loads,
+				(unsigned long long)pageStats.evictions, pageStats.bytesRead / (1024.0 * 1024.0));
+		}
+	}
+	else
+	{
+		ImGui::SliderInt("Terrain tesselation", &terrainTesselation, 16, 4096);
+		if (ImGui::Button("Generate terrain mesh"))
+		{
+			terrain.generateMesh(terrainTesselation);
+		}
+		ImGui::Text("Terrain: %u triangles, %zu kB, generated in %.1f ms", terrain.m_numTriangles,
+			terrain.m_gpuMemoryBytes / 1024, terrain.m_generationMs);
+	}
+	int format = int(vertexFormat);
+	if (ImGui::Combo("Vertex format", &format, "Float\0Packed\0Packed, quantized positions\0"))
+	{
+		vertexFormat = labhelper::VertexFormat(format);
+		loadModels();
+	}
+	ImGui::Text("Vertex memory: %zu kB on GPU, %zu kB on CPU",
+		(labhelper::getGpuVertexMemory(fighterModel) + labhelper::getGpuVertexMemory(landingpadModel)) / 1024,
+		(labhelper::getCpuVertexMemory(fighterModel) + labhelper::getCpuVertexMemory(landingpadModel)) / 1024);
+	if (ImGui::Button("Benchmark uniforms"))
+	{
+		benchmarkUniforms();
+	}
+	ImGui::Text("setUniformSlow: %.3f ms/frame, handles: %.3f ms/frame", uniformBenchmarkSlowMs,
+		uniformBenchmarkHandlesMs);
+	ImGui::Checkbox("Particles", &drawParticles);
+	ImGui::SliderInt("Particles per second", &particlesPerSecond, 0, 200000);
+	ImGui::SliderFloat("Particle life length", &particleLifeLength, 0.5f, 20.0f);
+	ImGui::Checkbox("Deterministic particles", &particleDeterministic);
+	ImGui::Text("Particles: %d/%d, simulated in %.3f ms on %d threads", particleSystem->size(), particleCapacity,
+		particleSimMs, workerPool->size());
+	ImGui::Checkbox("Sort particles", &sortParticles);
+	if (sortParticles)
+	{
+		ImGui::Text("Particles sorted in %.3f ms", particleSortMs);
+	}
+	if (ImGui::Button("Benchmark particle sort"))
+	{
+		benchmarkParticleSort();
+	}
+	ImGui::Text("Radix: %.3f ms, %.3f ms threaded, std::sort: %.3f ms (1M particles)%s",
+		particleSortBenchmark.radixMs, particleSortBenchmark.radixThreadedMs, particleSortBenchmark.stdSortMs,
+		particleSortBenchmark.stdSortMs > 0.0f && !particleSortBenchmark.ordered ? ", NOT SORTED" : "");
+	ImGui::Text("Particle vertices: %s, written in %.3f ms, %.3f ms waiting for the GPU",
+		particleBuffer->is_persistent() ? "persistently mapped" : "glBufferSubData", particleWriteMs,
+		particleBuffer->wait_ms);
+	if (ImGui::Button("Benchmark particles"))
+	{
+		benchmarkParticles();
+	}
+	ImGui::Text("Scalar: %.3f ms/frame, SIMD: %.3f ms/frame (1M particles)", particleBenchmark.scalarMs,
+		particleBenchmark.simdMs);
+	for (const auto& result : particleBenchmark.threadMs)
+	{
+		ImGui::Text("  %d threads: %.3f ms/frame (4M particles)", result.first, result.second);
+	}
+	if (!particleBenchmark.threadMs.empty())
+	{
+		ImGui::Text("  Deterministic: %s", particleBenchmark.deterministic ? "yes" : "NO");
+	}
 	// ----------------------------------------------------------
 }
 
@@ -418,6 +1300,14 @@ int main(int argc, char* argv[])
 
 	while (!stopRendering)
 	{
+		labhelper::profiler::beginFrame();
+
+		// Swap in the shaders edited since the last frame
+		if (hotReloadShaders && shaderReloader->update() > 0)
+		{
+			sceneUniforms.clear();
+		}
+
 		//update currentTime
 		std::chrono::duration<float> timeSinceStart = std::chrono::system_clock::now() - startTime;
 		previousTime = currentTime;
@@ -447,9 +1337,16 @@ int main(int argc, char* argv[])
 	}
 	// Free Models
 	labhelper::freeModel(fighterModel);
+	labhelper::freeSceneBatch(sceneBatch);
 	labhelper::freeModel(landingpadModel);
+	terrain.m_pages.close();
+	delete particleSystem;
+	delete particleBuffer;
+	delete workerPool;
 
 	// Shut down everything. This includes the window and all other subsystems.
+	delete gpuProfiler;
+	delete shaderReloader;
 	labhelper::shutDown(g_window);
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,129 @@
+///////////////////////////////////////////////////////////////////////////////
+// particles-check: runs the particle simulation without a GL context and
+// checks what it writes, the way it writes the persistently mapped
+// ParticleBuffer regions. Prints each failure and returns non-zero if any.
+//
+// usage: particles-check
+///////////////////////////////////////////////////////////////////////////////
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+#include <glm/glm.hpp>
+#include <glm/gtx/transform.hpp>
+#include <WorkerPool.h>
+#include "ParticleSystem.h"
+
+using namespace glm;
+
+static int failures = 0;
+
+static void check(bool condition, const char* what, int pool_size)
+{
+	if (!condition)
+	{
+		printf("FAILED (%d threads): %s\n", pool_size, what);
+		failures++;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Particles over several chunks are written to a frame region in the ring,
+/// each to its own vertex, and nothing past the last one
+///////////////////////////////////////////////////////////////////////////////
+static void checkWriteVertices(labhelper::WorkerPool& pool)
+{
+	const int count = 3 * ParticleSystem::PARTICLE_CHUNK_SIZE + 123;
+	ParticleSystem particles(count, &pool);
+	for (int i = 0; i < count; i++)
+	{
+		Particle particle;
+		particle.pos = vec3(float(i), 0.5f * float(i % 97), -float(i % 1013));
+		particle.velocity = vec3(0.0f);
+		particle.life_length = 4.0f;
+		particle.lifetime = float(i % 8) * 0.5f;
+		particles.spawn(particle);
+	}
+
+	// Three frames in flight, the middle one written
+	const mat4 viewMatrix = rotate(0.3f, vec3(0.0f, 1.0f, 0.0f)) * translate(vec3(1.0f, -2.0f, -30.0f));
+	const vec4 untouched(-1.0f);
+	std::vector<vec4> ring(3 * count, untouched);
+	particles.write_vertices(viewMatrix, &ring[count]);
+
+	bool written = true;
+	for (int i = 0; i < count && written; i++)
+	{
+		const Particle particle = particles.get(i);
+		const vec3 expected = vec3(viewMatrix * vec4(particle.pos, 1.0f));
+		const vec4& vertex = ring[count + i];
+		written = length(vec3(vertex) - expected) <= 1e-4f * (1.0f + length(expected))
+		          && vertex.w == particle.lifetime / particle.life_length;
+	}
+	check(written, "write_vertices() writes the view space position and age of every particle", pool.size());
+	bool outside = true;
+	for (int i = 0; i < count; i++)
+	{
+		outside = outside && ring[i] == untouched && ring[2 * count + i] == untouched;
+	}
+	check(outside, "write_vertices() only writes its own region", pool.size());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+/// Particles at known, shuffled depths over several chunks, one per
+/// quantized key, come out back to front: in decreasing depth, that is
+/// increasing view space z, each exactly once
+///////////////////////////////////////////////////////////////////////////////
+static void checkSortByDepth(labhelper::WorkerPool& pool)
+{
+	const int count = 3 * ParticleSystem::PARTICLE_CHUNK_SIZE + 123;
+	static_assert(3 * ParticleSystem::PARTICLE_CHUNK_SIZE + 123 < (1 << ParticleSystem::SORT_KEY_BITS),
+		"the depths must quantize to distinct keys");
+	std::vector<int> depths(count);
+	for (int i = 0; i < count; i++)
+	{
+		depths[i] = i;
+	}
+	std::shuffle(depths.begin(), depths.end(), std::minstd_rand(1));
+
+	ParticleSystem particles(count, &pool);
+	for (int i = 0; i < count; i++)
+	{
+		Particle particle;
+		particle.pos = vec3(float(i % 101), 0.0f, -float(depths[i]));
+		particle.velocity = vec3(0.0f);
+		particle.lifetime = 0.0f;
+		particle.life_length = 1.0f;
+		particles.spawn(particle);
+	}
+	const mat4 viewMatrix(1.0f);
+	particles.sort_by_depth(viewMatrix);
+	std::vector<vec4> vertices(count);
+	particles.write_vertices(viewMatrix, vertices.data());
+
+	bool ordered = true;
+	for (int i = 0; i < count && ordered; i++)
+	{
+		ordered = -vertices[i].z == float(count - 1 - i);
+	}
+	check(ordered, "sort_by_depth() orders the vertices back to front", pool.size());
+}
+
+int main()
+{
+	labhelper::WorkerPool serialPool(1);
+	labhelper::WorkerPool pool(4);
+	for (labhelper::WorkerPool* p : { &serialPool, &pool })
+	{
+		checkWriteVertices(*p);
+		checkSortByDepth(*p);
+	}
+	if (failures > 0)
+	{
+		printf("%d particle checks failed\n", failures);
+		return 1;
+	}
+	printf("All particle checks passed\n");
+	return 0;
+}
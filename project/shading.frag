@@ -1,4 +1,7 @@
 #version 420
+#ifdef BATCHED
+#extension GL_ARB_shader_storage_buffer_object : require
+#endif
 
 // required by GLSL spec Sect 4.5.3 (though nvidia does not, amd does)
 precision highp float;
@@ -6,15 +9,44 @@ precision highp float;
 ///////////////////////////////////////////////////////////////////////////////
 // Material
 ///////////////////////////////////////////////////////////////////////////////
-uniform vec3 material_color = vec3(1, 1, 1);
-uniform float material_metalness = 0;
-uniform float material_fresnel = 0;
-uniform float material_shininess = 0;
-uniform vec3 material_emission = vec3(0);
+// Layout must match labhelper::MaterialBlock
+#ifdef BATCHED
+struct Material
+{
+	vec3 color;
+	float metalness;
+	vec3 emission;
+	float fresnel;
+	float shininess;
+	int has_color_texture;
+	int has_emission_texture;
+};
+layout(std430, binding = 1) readonly buffer MaterialBuffer
+{
+	Material materials[];
+};
+flat in uint materialIndex;
+#define material_color materials[materialIndex].color
+#define material_metalness materials[materialIndex].metalness
+#define material_emission materials[materialIndex].emission
+#define material_fresnel materials[materialIndex].fresnel
+#define material_shininess materials[materialIndex].shininess
+#define has_color_texture materials[materialIndex].has_color_texture
+#define has_emission_texture materials[materialIndex].has_emission_texture
+#else
+layout(std140, binding = 0) uniform MaterialBlock
+{
+	vec3 material_color;
+	float material_metalness;
+	vec3 material_emission;
+	float material_fresnel;
+	float material_shininess;
+	int has_color_texture;
+	int has_emission_texture;
+};
+#endif
 
-uniform int has_color_texture = 0;
 layout(binding = 0) uniform sampler2D colorMap;
-uniform int has_emission_texture = 0;
 layout(binding = 5) uniform sampler2D emissiveMap;
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -52,7 +84,7 @@ uniform vec3 viewSpaceLightPosition;
 ///////////////////////////////////////////////////////////////////////////////
 // Output color
 ///////////////////////////////////////////////////////////////////////////////
-layout(location = 0) out vec4 fragmentColor;a
+layout(location = 0) out vec4 fragmentColor;
 
 vec3 calculateDirectIllumiunation(vec3 wo, vec3 n, vec3 base_color)
 {
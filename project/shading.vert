@@ -1,4 +1,7 @@
 #version 420
+#ifdef BATCHED
+#extension GL_ARB_shader_storage_buffer_object : require
+#endif
 ///////////////////////////////////////////////////////////////////////////////
 // Input vertex attributes
 ///////////////////////////////////////////////////////////////////////////////
@@ -6,12 +9,53 @@ layout(location = 0) in vec3 position;
 layout(location = 1) in vec3 normalIn;
 layout(location = 2) in vec2 texCoordIn;
 
+#ifdef BATCHED
+///////////////////////////////////////////////////////////////////////////////
+// Per-draw data of a labhelper::SceneBatch, selected by the draw id
+///////////////////////////////////////////////////////////////////////////////
+layout(location = 3) in uint drawId;
+
+// Layout must match labhelper::BatchDrawData
+struct DrawData
+{
+	mat4 modelMatrix;
+	mat4 normalMatrix;
+	uint materialIndex;
+};
+layout(std430, binding = 0) readonly buffer DrawBuffer
+{
+	DrawData draws[];
+};
+
+uniform mat4 viewMatrix;
+uniform mat4 projectionMatrix;
+
+flat out uint materialIndex;
+#else
 ///////////////////////////////////////////////////////////////////////////////
 // Input uniform variables
 ///////////////////////////////////////////////////////////////////////////////
 uniform mat4 normalMatrix;
 uniform mat4 modelViewMatrix;
 uniform mat4 modelViewProjectionMatrix;
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// Vertex decoding, set by labhelper::render() for the packed vertex formats
+///////////////////////////////////////////////////////////////////////////////
+uniform bool octahedral_normals = false;
+uniform vec3 position_offset = vec3(0.0);
+uniform vec3 position_scale = vec3(1.0);
+
+vec3 decodeOctahedral(vec2 p)
+{
+	vec3 n = vec3(p, 1.0 - abs(p.x) - abs(p.y));
+	if(n.z < 0.0)
+	{
+		n.xy = (1.0 - abs(p.yx)) * vec2(p.x >= 0.0 ? 1.0 : -1.0, p.y >= 0.0 ? 1.0 : -1.0);
+	}
+	return normalize(n);
+}
 
 ///////////////////////////////////////////////////////////////////////////////
 // Output to fragment shader
@@ -23,9 +67,18 @@ out vec3 viewSpacePosition;
 
 void main()
 {
-	gl_Position = modelViewProjectionMatrix * vec4(position, 1.0);
+#ifdef BATCHED
+	mat4 modelViewMatrix = viewMatrix * draws[drawId].modelMatrix;
+	mat4 modelViewProjectionMatrix = projectionMatrix * modelViewMatrix;
+	// Only the rotation of the view, its translation must not move normals
+	mat4 normalMatrix = mat4(mat3(viewMatrix) * mat3(draws[drawId].normalMatrix));
+	materialIndex = draws[drawId].materialIndex;
+#endif
+	vec3 p = position_offset + position_scale * position;
+	vec3 n = octahedral_normals ? decodeOctahedral(normalIn.xy) : normalIn;
+	gl_Position = modelViewProjectionMatrix * vec4(p, 1.0);
 	texCoord = texCoordIn;
-	viewSpaceNormal = (normalMatrix * vec4(normalIn, 0.0)).xyz;
-	viewSpacePosition = (modelViewMatrix * vec4(position, 1.0)).xyz;
+	viewSpaceNormal = (normalMatrix * vec4(n, 0.0)).xyz;
+	viewSpacePosition = (modelViewMatrix * vec4(p, 1.0)).xyz;
 
 }